@@ -16,12 +16,13 @@
 #include "tcg/tcg.h"
 #include "exec/cpu-common.h"
 #include "exec/exec-all.h"
+#include "exec/tb-cache.h"
 
 void tb_flush(CPUState *cpu)
 {
 }
 
-void tb_unlock(void)
+void tb_cache_init(const char *dir, const char *cpu_model, Error **errp)
 {
 }
 
@@ -0,0 +1,260 @@
+/*
+ * Linux perf perf-<pid>.map and jit-<pid>.dump integration.
+ *
+ * The perf map is a text file that "perf report" reads to symbolize
+ * samples in anonymous executable memory.  The jitdump is the binary
+ * format described in tools/perf/Documentation/jitdump-specification.txt
+ * of the Linux tree; "perf inject --jit" turns it into one ELF image per
+ * code load, so that "perf annotate" can also show the host code.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "disas/disas.h"
+#include "elf.h"
+#include "exec/exec-all.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "perf.h"
+
+#define JITHEADER_MAGIC     0x4A695444
+#define JITHEADER_VERSION   1
+#define JIT_CODE_LOAD       0
+
+#if defined(__x86_64__)
+#define JIT_ELF_MACH EM_X86_64
+#elif defined(__i386__)
+#define JIT_ELF_MACH EM_386
+#elif defined(__aarch64__)
+#define JIT_ELF_MACH EM_AARCH64
+#elif defined(__arm__)
+#define JIT_ELF_MACH EM_ARM
+#elif defined(__powerpc64__)
+#define JIT_ELF_MACH EM_PPC64
+#elif defined(__powerpc__)
+#define JIT_ELF_MACH EM_PPC
+#elif defined(__s390x__)
+#define JIT_ELF_MACH EM_S390
+#elif defined(__mips__)
+#define JIT_ELF_MACH EM_MIPS
+#elif defined(__sparc__)
+#define JIT_ELF_MACH EM_SPARCV9
+#else
+#define JIT_ELF_MACH EM_NONE
+#endif
+
+struct jitheader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct jr_prefix {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+};
+
+/* followed by the NUL-terminated name and the code bytes */
+struct jr_code_load {
+    struct jr_prefix p;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+};
+
+static QemuMutex perf_lock;
+static bool perf_initialized;
+static FILE *perfmap;
+static FILE *jitdump;
+static uint64_t jitdump_code_index;
+
+/* the prologue may be generated before the outputs are enabled */
+static const void *prologue_start;
+static size_t prologue_size;
+
+static void perfmap_write(const void *start, size_t size, const char *name)
+{
+    fprintf(perfmap, "%" PRIxPTR " %zx %s\n", (uintptr_t)start, size, name);
+}
+
+static void jitdump_write(const void *start, size_t size, const char *name)
+{
+    struct jr_code_load rec;
+    size_t name_len = strlen(name) + 1;
+
+    rec.p.id = JIT_CODE_LOAD;
+    rec.p.total_size = sizeof(rec) + name_len + size;
+    rec.p.timestamp = get_clock();
+    rec.pid = getpid();
+    rec.tid = qemu_get_thread_id();
+    rec.vma = (uintptr_t)start;
+    rec.code_addr = (uintptr_t)start;
+    rec.code_size = size;
+    rec.code_index = jitdump_code_index++;
+
+    fwrite(&rec, sizeof(rec), 1, jitdump);
+    fwrite(name, name_len, 1, jitdump);
+    fwrite(start, size, 1, jitdump);
+}
+
+static void perf_exit(void)
+{
+    qemu_mutex_lock(&perf_lock);
+    if (perfmap) {
+        fclose(perfmap);
+        perfmap = NULL;
+    }
+    if (jitdump) {
+        fclose(jitdump);
+        jitdump = NULL;
+    }
+    qemu_mutex_unlock(&perf_lock);
+}
+
+/* Called at startup, before any vCPU thread is created */
+static void perf_init(void)
+{
+    if (!perf_initialized) {
+        qemu_mutex_init(&perf_lock);
+        atexit(perf_exit);
+        perf_initialized = true;
+    }
+}
+
+bool perf_enabled(void)
+{
+    return perfmap || jitdump;
+}
+
+void perf_enable_perfmap(void)
+{
+    char *path;
+
+    perf_init();
+    if (perfmap) {
+        return;
+    }
+    path = g_strdup_printf("/tmp/perf-%d.map", getpid());
+    perfmap = fopen(path, "w");
+    if (perfmap == NULL) {
+        warn_report("could not open %s: %s, proceeding without perfmap",
+                    path, strerror(errno));
+    } else if (prologue_start) {
+        perfmap_write(prologue_start, prologue_size, "tcg-prologue");
+    }
+    g_free(path);
+}
+
+void perf_enable_jitdump(void)
+{
+    struct jitheader header = {
+        .magic = JITHEADER_MAGIC,
+        .version = JITHEADER_VERSION,
+        .total_size = sizeof(header),
+        .elf_mach = JIT_ELF_MACH,
+        .pid = getpid(),
+    };
+    char *path;
+    int fd;
+
+    perf_init();
+    if (jitdump) {
+        return;
+    }
+    path = g_strdup_printf("./jit-%d.dump", getpid());
+    fd = qemu_open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        warn_report("could not open %s: %s, proceeding without jitdump",
+                    path, strerror(errno));
+        goto out;
+    }
+
+#ifdef CONFIG_LINUX
+    {
+        /*
+         * perf only notices the jitdump if an executable mapping of it
+         * shows up among the process's mmap events.  The mapping is
+         * never accessed and is kept for the lifetime of the process.
+         */
+        void *marker = mmap(NULL, qemu_real_host_page_size,
+                            PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+
+        if (marker == MAP_FAILED) {
+            warn_report("could not map %s: %s, proceeding without jitdump",
+                        path, strerror(errno));
+            close(fd);
+            goto out;
+        }
+    }
+#endif
+
+    jitdump = fdopen(fd, "w+");
+    if (jitdump == NULL) {
+        warn_report("could not open %s: %s, proceeding without jitdump",
+                    path, strerror(errno));
+        close(fd);
+        goto out;
+    }
+    header.timestamp = get_clock();
+    fwrite(&header, sizeof(header), 1, jitdump);
+    if (prologue_start) {
+        jitdump_write(prologue_start, prologue_size, "tcg-prologue");
+    }
+
+out:
+    g_free(path);
+}
+
+void perf_report_prologue(const void *start, size_t size)
+{
+    prologue_start = start;
+    prologue_size = size;
+
+    if (perfmap) {
+        perfmap_write(start, size, "tcg-prologue");
+    }
+    if (jitdump) {
+        jitdump_write(start, size, "tcg-prologue");
+    }
+}
+
+void perf_report_code(const TranslationBlock *tb)
+{
+    const char *symbol;
+    char *name;
+
+    if (likely(!perfmap && !jitdump)) {
+        return;
+    }
+
+    symbol = lookup_symbol(tb->pc);
+    if (symbol[0]) {
+        name = g_strdup_printf("%s@0x" TARGET_FMT_lx, symbol, tb->pc);
+    } else {
+        name = g_strdup_printf("guest-0x" TARGET_FMT_lx, tb->pc);
+    }
+
+    qemu_mutex_lock(&perf_lock);
+    if (perfmap) {
+        perfmap_write(tb->tc.ptr, tb->tc.size, name);
+    }
+    if (jitdump) {
+        jitdump_write(tb->tc.ptr, tb->tc.size, name);
+    }
+    qemu_mutex_unlock(&perf_lock);
+    g_free(name);
+}
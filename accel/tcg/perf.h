@@ -0,0 +1,35 @@
+/*
+ * Linux perf perf-<pid>.map and jit-<pid>.dump integration.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef ACCEL_TCG_PERF_H
+#define ACCEL_TCG_PERF_H
+
+#include "exec/exec-all.h"
+
+/* Start writing perf-<pid>.map in /tmp.  */
+void perf_enable_perfmap(void);
+
+/* Start writing jit-<pid>.dump in the current directory.  */
+void perf_enable_jitdump(void);
+
+/* Return whether any output is enabled.  */
+bool perf_enabled(void);
+
+/* Add the TCG prologue to the enabled outputs.  */
+void perf_report_prologue(const void *start, size_t size);
+
+/*
+ * Add the host code of @tb to the enabled outputs, named after the guest
+ * symbol containing its PC when one is known.  There is no removal: the
+ * jitdump orders records by time, so perf attributes samples taken after
+ * a flush or eviction to whatever code was generated at that address
+ * next.  The perf map has no such ordering and is only accurate until
+ * the first flush or eviction.
+ */
+void perf_report_code(const TranslationBlock *tb);
+
+#endif
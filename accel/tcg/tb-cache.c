@@ -0,0 +1,414 @@
+/*
+ * Persistent translation cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The cache keeps the TCG ops generated by the guest front-end, not host
+ * code: host code embeds absolute addresses (helpers, the TB itself, the
+ * epilogue) that change from one run to the next, while the ops can be
+ * relocated with tcg_ops_serialize/tcg_ops_deserialize().  A hit thus
+ * skips decoding and translation of the guest instructions; register
+ * allocation and code emission still run as usual.
+ *
+ * All the runs of a given QEMU binary with a given CPU model share one
+ * file, named after a hash of those parameters.  The file starts with a
+ * TBCacheHeader and is followed by TBCacheRecords.  Each process maps
+ * the file read-only at startup, indexes the records it finds, and
+ * appends the records for the TBs it translates with O_APPEND writes,
+ * so that concurrent processes do not need to coordinate.  A record is
+ * only used if the guest code it was translated from is found unchanged
+ * at the same address.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "exec/tb-cache.h"
+#include "qemu/crc32c.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "tcg.h"
+
+#ifdef CONFIG_POSIX
+#include <sys/mman.h>
+
+#define TB_CACHE_MAGIC      "QEMUTBC"
+#define TB_CACHE_VERSION    1
+#define TB_CACHE_KEY_LEN    256
+/* Stop appending once the file reaches this size */
+#define TB_CACHE_MAX_SIZE   (512 * 1024 * 1024)
+/* Maximum number of translations kept for a given guest address */
+#define TB_CACHE_MAX_CANDIDATES 16
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    char key[TB_CACHE_KEY_LEN];
+} TBCacheHeader;
+
+typedef struct TBCacheRecord {
+    uint32_t len;       /* of the whole record, padded to 8 bytes */
+    uint32_t crc;       /* crc32c of the record, starting at @pc */
+    uint64_t pc;
+    uint64_t cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t trace_vcpu_dstate;
+    uint16_t size;      /* number of guest code bytes */
+    uint16_t icount;
+    uint32_t ops_len;
+    uint32_t reserved;
+    /* followed by @size bytes of guest code and @ops_len bytes of ops */
+} TBCacheRecord;
+
+typedef struct TBCache {
+    int fd;
+    void *map;
+    size_t map_size;
+    size_t file_size;
+    GHashTable *index;  /* TBCacheRecord -> GPtrArray of TBCacheRecord */
+    QemuMutex lock;     /* serializes appends */
+    GByteArray *buf;
+} TBCache;
+
+static TBCache *tb_cache;
+
+static uint32_t tb_cache_record_crc(const TBCacheRecord *rec)
+{
+    const uint8_t *start = (const uint8_t *)&rec->pc;
+    size_t len = sizeof(*rec) - offsetof(TBCacheRecord, pc)
+                 + rec->size + rec->ops_len;
+
+    return crc32c(0xffffffff, start, len);
+}
+
+static guint tb_cache_key_hash(gconstpointer p)
+{
+    const TBCacheRecord *rec = p;
+
+    return rec->pc ^ (rec->pc >> 32) ^ rec->flags ^ rec->cflags;
+}
+
+static gboolean tb_cache_key_equal(gconstpointer a, gconstpointer b)
+{
+    const TBCacheRecord *ra = a;
+    const TBCacheRecord *rb = b;
+
+    return ra->pc == rb->pc && ra->cs_base == rb->cs_base &&
+           ra->flags == rb->flags && ra->cflags == rb->cflags &&
+           ra->trace_vcpu_dstate == rb->trace_vcpu_dstate;
+}
+
+static const uint8_t *tb_cache_record_code(const TBCacheRecord *rec)
+{
+    return (const uint8_t *)(rec + 1);
+}
+
+static void tb_cache_index_add(TBCache *c, const TBCacheRecord *rec)
+{
+    GPtrArray *candidates = g_hash_table_lookup(c->index, rec);
+    guint i;
+
+    if (!candidates) {
+        candidates = g_ptr_array_new();
+        g_hash_table_insert(c->index, (gpointer)rec, candidates);
+    }
+    for (i = 0; i < candidates->len; i++) {
+        const TBCacheRecord *old = g_ptr_array_index(candidates, i);
+
+        if (old->size == rec->size &&
+            !memcmp(tb_cache_record_code(old), tb_cache_record_code(rec),
+                    rec->size)) {
+            /* Same guest code, possibly appended by a concurrent run */
+            return;
+        }
+    }
+    if (candidates->len == TB_CACHE_MAX_CANDIDATES) {
+        g_ptr_array_remove_index(candidates, 0);
+    }
+    g_ptr_array_add(candidates, (gpointer)rec);
+}
+
+static void tb_cache_index_file(TBCache *c)
+{
+    size_t ofs = sizeof(TBCacheHeader);
+
+    while (ofs + sizeof(TBCacheRecord) <= c->map_size) {
+        const TBCacheRecord *rec = c->map + ofs;
+
+        if (rec->len < sizeof(*rec) || rec->len & 7 ||
+            rec->len > c->map_size - ofs ||
+            sizeof(*rec) + rec->size + rec->ops_len > rec->len) {
+            /* Torn write at the end of the file: ignore the rest */
+            break;
+        }
+        tb_cache_index_add(c, rec);
+        ofs += rec->len;
+    }
+}
+
+/* Create the file with its header, unless another process did it first */
+static bool tb_cache_create(const char *path, const TBCacheHeader *hdr,
+                            Error **errp)
+{
+    char *tmp = g_strdup_printf("%s.%d", path, getpid());
+    bool ok = false;
+    int fd;
+
+    fd = qemu_open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "cannot create '%s'", tmp);
+        goto out;
+    }
+    if (qemu_write_full(fd, hdr, sizeof(*hdr)) != sizeof(*hdr)) {
+        error_setg_errno(errp, errno, "cannot write '%s'", tmp);
+        close(fd);
+        unlink(tmp);
+        goto out;
+    }
+    close(fd);
+    if (link(tmp, path) < 0 && errno != EEXIST) {
+        error_setg_errno(errp, errno, "cannot create '%s'", path);
+    } else {
+        ok = true;
+    }
+    unlink(tmp);
+ out:
+    g_free(tmp);
+    return ok;
+}
+
+static char *tb_cache_build_key(const char *cpu_model)
+{
+    struct stat st;
+
+    /*
+     * The ops depend on the exact front-end and helper set of this
+     * binary, so identify the build by the executable itself.
+     */
+    if (stat("/proc/self/exe", &st) < 0) {
+        return NULL;
+    }
+    return g_strdup_printf("%s %s %s exe=%" PRIu64 ":%" PRId64
+                           " tcg=%zu hot=%u cpu=%s",
+                           QEMU_VERSION, TARGET_NAME,
+#ifdef CONFIG_USER_ONLY
+                           "user",
+#else
+                           "softmmu",
+#endif
+                           (uint64_t)st.st_size, (int64_t)st.st_mtime,
+                           sizeof(TCGArg), tb_hot_threshold,
+                           cpu_model ? cpu_model : "default");
+}
+
+void tb_cache_init(const char *dir, const char *cpu_model, Error **errp)
+{
+    TBCacheHeader hdr = {
+        .magic = TB_CACHE_MAGIC,
+        .version = TB_CACHE_VERSION,
+        .header_size = sizeof(TBCacheHeader),
+    };
+    const TBCacheHeader *file_hdr;
+    char *key, *hash, *path;
+    struct stat st;
+    TBCache *c;
+    int fd;
+
+    key = tb_cache_build_key(cpu_model);
+    if (!key) {
+        error_setg_errno(errp, errno, "cannot identify the QEMU executable");
+        return;
+    }
+    if (strlen(key) >= TB_CACHE_KEY_LEN) {
+        error_setg(errp, "CPU model string too long for the TB cache");
+        g_free(key);
+        return;
+    }
+    pstrcpy(hdr.key, sizeof(hdr.key), key);
+    hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+    path = g_strdup_printf("%s/%s-%s.tbc", dir, TARGET_NAME, hash);
+    g_free(hash);
+    g_free(key);
+
+    if (!tb_cache_create(path, &hdr, errp)) {
+        g_free(path);
+        return;
+    }
+    fd = qemu_open(path, O_RDWR | O_APPEND);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "cannot open '%s'", path);
+        goto fail;
+    }
+
+    c = g_new0(TBCache, 1);
+    c->fd = fd;
+    c->map_size = st.st_size;
+    c->file_size = st.st_size;
+    c->map = mmap(NULL, c->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (c->map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "cannot map '%s'", path);
+        g_free(c);
+        goto fail;
+    }
+    file_hdr = c->map;
+    if (c->map_size < sizeof(*file_hdr) ||
+        memcmp(file_hdr->magic, TB_CACHE_MAGIC, sizeof(file_hdr->magic)) ||
+        file_hdr->version != TB_CACHE_VERSION ||
+        file_hdr->header_size != sizeof(*file_hdr) ||
+        memcmp(file_hdr->key, hdr.key, sizeof(hdr.key))) {
+        error_setg(errp, "'%s' is not a compatible TB cache file", path);
+        munmap(c->map, c->map_size);
+        g_free(c);
+        goto fail;
+    }
+
+    c->index = g_hash_table_new_full(tb_cache_key_hash, tb_cache_key_equal,
+                                     NULL, (GDestroyNotify)g_ptr_array_unref);
+    tb_cache_index_file(c);
+    qemu_mutex_init(&c->lock);
+    c->buf = g_byte_array_new();
+    tb_cache = c;
+    g_free(path);
+    return;
+
+ fail:
+    if (fd >= 0) {
+        close(fd);
+    }
+    g_free(path);
+}
+
+/*
+ * Translations are only valid for the CPU state captured in the key;
+ * debugging changes the code generated for a given guest address.
+ */
+static bool tb_cache_usable(CPUState *cpu, TranslationBlock *tb)
+{
+    return tb_cache && !(tb->cflags & CF_NOCACHE) &&
+           !singlestep && !cpu->singlestep_enabled &&
+           QTAILQ_EMPTY(&cpu->breakpoints);
+}
+
+static bool tb_cache_code_matches(CPUState *cpu, const TBCacheRecord *rec,
+                                  uint8_t *buf)
+{
+    return cpu_memory_rw_debug(cpu, rec->pc, buf, rec->size, 0) == 0 &&
+           !memcmp(buf, tb_cache_record_code(rec), rec->size);
+}
+
+bool tb_cache_load(CPUState *cpu, TranslationBlock *tb)
+{
+    TBCacheRecord key;
+    GPtrArray *candidates;
+    uint8_t *buf;
+    guint i;
+
+    if (!tb_cache_usable(cpu, tb)) {
+        return false;
+    }
+
+    key.pc = tb->pc;
+    key.cs_base = tb->cs_base;
+    key.flags = tb->flags;
+    key.cflags = tb->cflags;
+    key.trace_vcpu_dstate = tb->trace_vcpu_dstate;
+    candidates = g_hash_table_lookup(tb_cache->index, &key);
+    if (!candidates) {
+        return false;
+    }
+
+    buf = g_malloc(TARGET_PAGE_SIZE * 2);
+    for (i = candidates->len; i-- > 0; ) {
+        const TBCacheRecord *rec = g_ptr_array_index(candidates, i);
+
+        if (rec->size > TARGET_PAGE_SIZE * 2 ||
+            !tb_cache_code_matches(cpu, rec, buf)) {
+            continue;
+        }
+        if (tb_cache_record_crc(rec) != rec->crc) {
+            continue;
+        }
+        if (tcg_ops_deserialize(tcg_ctx, tb,
+                                tb_cache_record_code(rec) + rec->size,
+                                rec->ops_len)) {
+            tb->size = rec->size;
+            tb->icount = rec->icount;
+            g_free(buf);
+            return true;
+        }
+        tcg_func_start(tcg_ctx);
+    }
+    g_free(buf);
+    return false;
+}
+
+void tb_cache_save(CPUState *cpu, TranslationBlock *tb)
+{
+    TBCache *c = tb_cache;
+    TBCacheRecord *rec;
+    guint len, ops_len;
+
+    if (!tb_cache_usable(cpu, tb) || tb->size == 0 ||
+        atomic_read(&c->file_size) >= TB_CACHE_MAX_SIZE) {
+        return;
+    }
+
+    qemu_mutex_lock(&c->lock);
+    g_byte_array_set_size(c->buf, sizeof(*rec) + tb->size);
+    if (cpu_memory_rw_debug(cpu, tb->pc, c->buf->data + sizeof(*rec),
+                            tb->size, 0) < 0 ||
+        !tcg_ops_serialize(tcg_ctx, tb, c->buf)) {
+        goto out;
+    }
+    ops_len = c->buf->len - sizeof(*rec) - tb->size;
+    len = ROUND_UP(c->buf->len, 8);
+    g_byte_array_set_size(c->buf, len);
+    memset(c->buf->data + sizeof(*rec) + tb->size + ops_len, 0,
+           len - (sizeof(*rec) + tb->size + ops_len));
+
+    rec = (TBCacheRecord *)c->buf->data;
+    memset(rec, 0, sizeof(*rec));
+    rec->len = len;
+    rec->pc = tb->pc;
+    rec->cs_base = tb->cs_base;
+    rec->flags = tb->flags;
+    rec->cflags = tb->cflags;
+    rec->trace_vcpu_dstate = tb->trace_vcpu_dstate;
+    rec->size = tb->size;
+    rec->icount = tb->icount;
+    rec->ops_len = ops_len;
+    rec->crc = tb_cache_record_crc(rec);
+
+    /* A single O_APPEND write, so that concurrent writers do not mix */
+    if (write(c->fd, rec, len) != (ssize_t)len) {
+        warn_report("TB cache: write failed, disabling further updates");
+        atomic_set(&c->file_size, TB_CACHE_MAX_SIZE);
+    } else {
+        atomic_set(&c->file_size, c->file_size + len);
+    }
+ out:
+    qemu_mutex_unlock(&c->lock);
+}
+#else /* !CONFIG_POSIX */
+void tb_cache_init(const char *dir, const char *cpu_model, Error **errp)
+{
+    error_setg(errp, "the TB cache is not supported on this host");
+}
+
+bool tb_cache_load(CPUState *cpu, TranslationBlock *tb)
+{
+    return false;
+}
+
+void tb_cache_save(CPUState *cpu, TranslationBlock *tb)
+{
+}
+#endif
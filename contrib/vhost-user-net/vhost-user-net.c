@@ -0,0 +1,987 @@
+/*
+ * vhost-user-net sample application
+ *
+ * Each queue pair of the device is served by its own thread, which moves
+ * packets between the virtqueues and one queue of the uplink: a tap
+ * interface (one IFF_MULTI_QUEUE file descriptor per queue pair) or a host
+ * interface accessed through AF_PACKET sockets in a fanout group.  When
+ * busy polling is enabled, a thread that runs out of work keeps polling the
+ * rings and the uplink for a while, with guest notifications disabled,
+ * before going to sleep.
+ *
+ * The vhost-user socket is served by the main thread.  Messages from the
+ * master can remap guest memory or replace the ring eventfds, so they are
+ * processed with the queue threads excluded by a read-write lock; the
+ * threads only take it around each round of ring processing.
+ *
+ * Dirty pages are logged by libvhost-user when the master enables
+ * VHOST_F_LOG_ALL, so live migration works without further help.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "standard-headers/linux/virtio_net.h"
+#include "contrib/libvhost-user/libvhost-user.h"
+
+#include <glib.h>
+
+#define VUN_MAX_QUEUE_PAIRS (VHOST_MAX_NR_VIRTQUEUE / 2)
+
+/* Packets moved in each direction before checking for control messages */
+#define VUN_BATCH 64
+
+/* Largest frame read from the uplink; no segmentation offloads are used */
+#define VUN_MAX_FRAME 65536
+
+/* Largest number of mergeable rx buffers used for a single frame */
+#define VUN_MAX_RX_BUFS 64
+
+#define VUN_RXQ(pair) ((pair) * 2)
+#define VUN_TXQ(pair) ((pair) * 2 + 1)
+
+typedef struct VunStats {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t rx_dropped;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_dropped;
+    uint64_t sleeps;
+} VunStats;
+
+typedef struct VunDev VunDev;
+
+typedef struct VunQueue {
+    VunDev *vdev;
+    int index;
+    int uplink_fd;
+    int wake_fd;
+    bool running;
+    bool stop;
+    pthread_t thread;
+    VunStats stats;
+    uint8_t *buf;
+} VunQueue;
+
+/* vhost user network device */
+struct VunDev {
+    VuDev parent;
+    pthread_rwlock_t lock;
+    int nr_pairs;
+    bool packet;
+    int64_t busy_poll_ns;
+    size_t hdrlen;
+    bool mrg_rxbuf;
+    bool version_1;
+    bool quit;
+    int quit_fd;
+    VunQueue queues[VUN_MAX_QUEUE_PAIRS];
+};
+
+static volatile sig_atomic_t vun_dump_stats;
+
+/* refer util/iov.c */
+static size_t vun_iov_size(const struct iovec *iov,
+                           const unsigned int iov_cnt)
+{
+    size_t len;
+    unsigned int i;
+
+    len = 0;
+    for (i = 0; i < iov_cnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+static size_t vun_iov_from_buf(const struct iovec *iov, unsigned int iov_cnt,
+                               size_t offset, const void *buf, size_t bytes)
+{
+    size_t done;
+    unsigned int i;
+
+    for (i = 0, done = 0; (offset || done < bytes) && i < iov_cnt; i++) {
+        if (offset < iov[i].iov_len) {
+            size_t len = MIN(iov[i].iov_len - offset, bytes - done);
+            memcpy(iov[i].iov_base + offset, buf + done, len);
+            done += len;
+            offset = 0;
+        } else {
+            offset -= iov[i].iov_len;
+        }
+    }
+    return done;
+}
+
+/* Make @dst describe the bytes of @src that follow the first @skip ones */
+static unsigned int vun_iov_skip(struct iovec *dst, unsigned int dst_cnt,
+                                 const struct iovec *src, unsigned int src_cnt,
+                                 size_t skip)
+{
+    unsigned int i, n;
+
+    for (i = 0, n = 0; i < src_cnt && n < dst_cnt; i++) {
+        if (skip >= src[i].iov_len) {
+            skip -= src[i].iov_len;
+            continue;
+        }
+        dst[n].iov_base = src[i].iov_base + skip;
+        dst[n].iov_len = src[i].iov_len - skip;
+        skip = 0;
+        n++;
+    }
+    return n;
+}
+
+static void vun_stat_add(uint64_t *stat, uint64_t n)
+{
+    /* Only the queue thread writes, the main thread reads */
+    atomic_set__nocheck(stat, *stat + n);
+}
+
+static bool vun_queue_ready(VuDev *dev, VuVirtq *vq)
+{
+    return vu_queue_started(dev, vq) && vu_queue_enabled(dev, vq);
+}
+
+static int vun_uplink_recv(VunQueue *q)
+{
+    struct sockaddr_ll sll;
+    socklen_t sll_len;
+    ssize_t ret;
+
+    for (;;) {
+        if (!q->vdev->packet) {
+            ret = read(q->uplink_fd, q->buf, VUN_MAX_FRAME);
+        } else {
+            sll_len = sizeof(sll);
+            ret = recvfrom(q->uplink_fd, q->buf, VUN_MAX_FRAME, MSG_TRUNC,
+                           (struct sockaddr *)&sll, &sll_len);
+            /* Packet sockets also see what the other queues transmit */
+            if (ret >= 0 && sll.sll_pkttype == PACKET_OUTGOING) {
+                continue;
+            }
+        }
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        break;
+    }
+
+    if (ret > VUN_MAX_FRAME) {
+        vun_stat_add(&q->stats.rx_dropped, 1);
+        return 0;
+    }
+    return ret;
+}
+
+/*
+ * Copy the frame in q->buf to the rx queue, using as many buffers as
+ * needed when mergeable rx buffers were negotiated.  Returns the number of
+ * used ring entries filled starting at @idx, or 0 if the frame was dropped
+ * because the ring had no room for it.
+ */
+static unsigned int vun_rx_frame(VunQueue *q, VuVirtq *vq, size_t len,
+                                 unsigned int idx)
+{
+    VunDev *vdev = q->vdev;
+    VuDev *dev = &vdev->parent;
+    VuVirtqElement *elems[VUN_MAX_RX_BUFS];
+    unsigned int lens[VUN_MAX_RX_BUFS];
+    struct virtio_net_hdr_mrg_rxbuf hdr = {
+        .hdr.flags = 0,
+        .hdr.gso_type = VIRTIO_NET_HDR_GSO_NONE,
+    };
+    unsigned int n = 0, i;
+    size_t done = 0;
+
+    while (done < len) {
+        VuVirtqElement *elem;
+        size_t size, head = n ? 0 : vdev->hdrlen;
+
+        if (n == (vdev->mrg_rxbuf ? VUN_MAX_RX_BUFS : 1)) {
+            goto drop;
+        }
+        elem = vu_queue_pop(dev, vq, sizeof(VuVirtqElement));
+        if (!elem) {
+            goto drop;
+        }
+        elems[n++] = elem;
+
+        size = vun_iov_size(elem->in_sg, elem->in_num);
+        if (size <= head) {
+            goto drop;
+        }
+        lens[n - 1] = head + vun_iov_from_buf(elem->in_sg, elem->in_num, head,
+                                              q->buf + done, len - done);
+        done += lens[n - 1] - head;
+    }
+
+    if (vdev->mrg_rxbuf) {
+        hdr.num_buffers = vdev->version_1 ? cpu_to_le16(n) : n;
+    }
+    vun_iov_from_buf(elems[0]->in_sg, elems[0]->in_num, 0, &hdr, vdev->hdrlen);
+
+    for (i = 0; i < n; i++) {
+        vu_queue_fill(dev, vq, elems[i], lens[i], idx + i);
+        free(elems[i]);
+    }
+    return n;
+
+drop:
+    vu_queue_rewind(dev, vq, n);
+    for (i = 0; i < n; i++) {
+        free(elems[i]);
+    }
+    vun_stat_add(&q->stats.rx_dropped, 1);
+    return 0;
+}
+
+static int vun_process_rx(VunQueue *q)
+{
+    VuDev *dev = &q->vdev->parent;
+    VuVirtq *vq = vu_get_queue(dev, VUN_RXQ(q->index));
+    unsigned int idx = 0, n;
+    int i;
+
+    if (!vun_queue_ready(dev, vq)) {
+        return 0;
+    }
+
+    for (i = 0; i < VUN_BATCH && !vu_queue_empty(dev, vq); i++) {
+        int len = vun_uplink_recv(q);
+
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "queue %d: uplink receive error: %s\n",
+                        q->index, strerror(errno));
+            }
+            break;
+        }
+        if (len > 0) {
+            n = vun_rx_frame(q, vq, len, idx);
+            if (n) {
+                idx += n;
+                vun_stat_add(&q->stats.rx_packets, 1);
+                vun_stat_add(&q->stats.rx_bytes, len);
+            }
+        }
+    }
+
+    if (idx) {
+        vu_queue_flush(dev, vq, idx);
+        vu_queue_notify(dev, vq);
+    }
+    return i;
+}
+
+static int vun_process_tx(VunQueue *q)
+{
+    VunDev *vdev = q->vdev;
+    VuDev *dev = &vdev->parent;
+    VuVirtq *vq = vu_get_queue(dev, VUN_TXQ(q->index));
+    int i;
+
+    if (!vun_queue_ready(dev, vq)) {
+        return 0;
+    }
+
+    for (i = 0; i < VUN_BATCH; i++) {
+        struct iovec iov[VIRTQUEUE_MAX_SIZE];
+        VuVirtqElement *elem;
+        unsigned int cnt;
+        size_t len;
+        ssize_t ret;
+
+        elem = vu_queue_pop(dev, vq, sizeof(VuVirtqElement));
+        if (!elem) {
+            break;
+        }
+
+        cnt = vun_iov_skip(iov, ARRAY_SIZE(iov), elem->out_sg, elem->out_num,
+                           vdev->hdrlen);
+        len = vun_iov_size(iov, cnt);
+        do {
+            ret = writev(q->uplink_fd, iov, cnt);
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret < 0) {
+            vun_stat_add(&q->stats.tx_dropped, 1);
+        } else {
+            vun_stat_add(&q->stats.tx_packets, 1);
+            vun_stat_add(&q->stats.tx_bytes, len);
+        }
+
+        vu_queue_push(dev, vq, elem, 0);
+        free(elem);
+    }
+
+    if (i) {
+        vu_queue_notify(dev, vq);
+    }
+    return i;
+}
+
+static void vun_set_notification(VunQueue *q, bool enable)
+{
+    VuDev *dev = &q->vdev->parent;
+    int i;
+
+    for (i = VUN_RXQ(q->index); i <= VUN_TXQ(q->index); i++) {
+        VuVirtq *vq = vu_get_queue(dev, i);
+
+        if (vun_queue_ready(dev, vq)) {
+            vu_queue_set_notification(dev, vq, enable);
+        }
+    }
+}
+
+/*
+ * Re-enable guest notifications and fill @pfd with what to wait for.
+ * Returns false if there is work to do already, so that the caller does
+ * not miss a buffer that was made available before notifications were on.
+ */
+static bool vun_prepare_sleep(VunQueue *q, struct pollfd *pfd)
+{
+    VuDev *dev = &q->vdev->parent;
+    VuVirtq *rxq = vu_get_queue(dev, VUN_RXQ(q->index));
+    VuVirtq *txq = vu_get_queue(dev, VUN_TXQ(q->index));
+    bool rx_room;
+
+    vun_set_notification(q, true);
+    /* Publish the notification flags before looking at the rings */
+    smp_mb();
+
+    if (vun_queue_ready(dev, txq) && !vu_queue_empty(dev, txq)) {
+        return false;
+    }
+    rx_room = vun_queue_ready(dev, rxq) && !vu_queue_empty(dev, rxq);
+
+    pfd[0].fd = q->wake_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = vun_queue_ready(dev, rxq) ? rxq->kick_fd : -1;
+    pfd[1].events = POLLIN;
+    pfd[2].fd = vun_queue_ready(dev, txq) ? txq->kick_fd : -1;
+    pfd[2].events = POLLIN;
+    /* Without rx buffers, wait for the guest to add some */
+    pfd[3].fd = rx_room ? q->uplink_fd : -1;
+    pfd[3].events = POLLIN;
+    return true;
+}
+
+/* Consume the kicks that woke the thread, if the eventfds are still ours */
+static void vun_clear_kicks(VunQueue *q, const struct pollfd *pfd)
+{
+    VuDev *dev = &q->vdev->parent;
+    eventfd_t val;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        VuVirtq *vq = vu_get_queue(dev, VUN_RXQ(q->index) + i);
+
+        if ((pfd[i + 1].revents & POLLIN) && pfd[i + 1].fd == vq->kick_fd) {
+            eventfd_read(vq->kick_fd, &val);
+        }
+    }
+}
+
+static void *vun_queue_thread(void *opaque)
+{
+    VunQueue *q = opaque;
+    VunDev *vdev = q->vdev;
+    struct pollfd pfd[4];
+    int64_t idle_since = 0;
+    eventfd_t val;
+    sigset_t set;
+    bool sleeping;
+    int work;
+
+    /* Statistics requests are for the main thread */
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_rwlock_rdlock(&vdev->lock);
+    vun_set_notification(q, false);
+    pthread_rwlock_unlock(&vdev->lock);
+
+    for (;;) {
+        pthread_rwlock_rdlock(&vdev->lock);
+        if (atomic_read(&q->stop)) {
+            pthread_rwlock_unlock(&vdev->lock);
+            break;
+        }
+        work = vun_process_tx(q) + vun_process_rx(q);
+        pthread_rwlock_unlock(&vdev->lock);
+
+        if (work) {
+            idle_since = 0;
+            continue;
+        }
+        if (vdev->busy_poll_ns) {
+            int64_t now = g_get_monotonic_time() * 1000;
+
+            if (!idle_since) {
+                idle_since = now;
+            }
+            if (now - idle_since < vdev->busy_poll_ns) {
+                continue;
+            }
+        }
+        idle_since = 0;
+
+        pthread_rwlock_rdlock(&vdev->lock);
+        sleeping = vun_prepare_sleep(q, pfd);
+        pthread_rwlock_unlock(&vdev->lock);
+
+        if (sleeping) {
+            vun_stat_add(&q->stats.sleeps, 1);
+            if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0 && errno != EINTR) {
+                fprintf(stderr, "queue %d: poll error: %s\n",
+                        q->index, strerror(errno));
+            }
+            if (pfd[0].revents & POLLIN) {
+                eventfd_read(q->wake_fd, &val);
+            }
+        }
+
+        pthread_rwlock_rdlock(&vdev->lock);
+        if (sleeping) {
+            vun_clear_kicks(q, pfd);
+        }
+        vun_set_notification(q, false);
+        pthread_rwlock_unlock(&vdev->lock);
+    }
+
+    return NULL;
+}
+
+static void vun_panic_cb(VuDev *dev, const char *buf)
+{
+    VunDev *vdev = container_of(dev, VunDev, parent);
+
+    if (buf) {
+        fprintf(stderr, "vu_panic: %s\n", buf);
+    }
+
+    atomic_set(&vdev->quit, true);
+    eventfd_write(vdev->quit_fd, 1);
+}
+
+static void vun_wake(VunQueue *q)
+{
+    eventfd_write(q->wake_fd, 1);
+}
+
+/* Called with the lock held for writing */
+static void vun_queue_set_started(VuDev *dev, int qidx, bool started)
+{
+    VunDev *vdev = container_of(dev, VunDev, parent);
+    VunQueue *q;
+    bool active;
+
+    if (qidx / 2 >= vdev->nr_pairs) {
+        fprintf(stderr, "Queue %d out of range\n", qidx);
+        return;
+    }
+
+    q = &vdev->queues[qidx / 2];
+
+    active = vu_queue_started(dev, vu_get_queue(dev, VUN_RXQ(q->index))) ||
+             vu_queue_started(dev, vu_get_queue(dev, VUN_TXQ(q->index)));
+
+    if (active && !q->running) {
+        atomic_set(&q->stop, false);
+        if (pthread_create(&q->thread, NULL, vun_queue_thread, q)) {
+            vun_panic_cb(dev, "Cannot create queue thread");
+            return;
+        }
+        q->running = true;
+    } else if (!active && q->running) {
+        /* The thread exits once it gets the lock, and is joined then */
+        atomic_set(&q->stop, true);
+    }
+}
+
+static void vun_reap_queues(VunDev *vdev)
+{
+    int i;
+
+    for (i = 0; i < vdev->nr_pairs; i++) {
+        VunQueue *q = &vdev->queues[i];
+
+        if (!q->running) {
+            continue;
+        }
+        if (atomic_read(&q->stop)) {
+            vun_wake(q);
+            pthread_join(q->thread, NULL);
+            q->running = false;
+        } else {
+            /* The ring eventfds or state may have changed */
+            vun_wake(q);
+        }
+    }
+}
+
+static bool vun_dispatch(VunDev *vdev)
+{
+    bool ok;
+
+    pthread_rwlock_wrlock(&vdev->lock);
+    ok = vu_dispatch(&vdev->parent);
+    pthread_rwlock_unlock(&vdev->lock);
+
+    vun_reap_queues(vdev);
+    return ok;
+}
+
+static void vun_stop_queues(VunDev *vdev)
+{
+    int i;
+
+    for (i = 0; i < vdev->nr_pairs; i++) {
+        atomic_set(&vdev->queues[i].stop, true);
+    }
+    vun_reap_queues(vdev);
+}
+
+static void vun_print_stats(VunDev *vdev)
+{
+    int i;
+
+    for (i = 0; i < vdev->nr_pairs; i++) {
+        VunStats *s = &vdev->queues[i].stats;
+
+        printf("queue %d: rx %" PRIu64 " packets %" PRIu64 " bytes %" PRIu64
+               " dropped, tx %" PRIu64 " packets %" PRIu64 " bytes %" PRIu64
+               " dropped, %" PRIu64 " sleeps\n", i,
+               atomic_read__nocheck(&s->rx_packets),
+               atomic_read__nocheck(&s->rx_bytes),
+               atomic_read__nocheck(&s->rx_dropped),
+               atomic_read__nocheck(&s->tx_packets),
+               atomic_read__nocheck(&s->tx_bytes),
+               atomic_read__nocheck(&s->tx_dropped),
+               atomic_read__nocheck(&s->sleeps));
+    }
+    fflush(stdout);
+}
+
+/*
+ * The queue threads poll the kick eventfds themselves, and no queue
+ * handler is ever installed, so libvhost-user has nothing to watch.
+ */
+static void vun_set_watch(VuDev *dev, int fd, int condition,
+                          vu_watch_cb cb, void *data)
+{
+}
+
+static void vun_remove_watch(VuDev *dev, int fd)
+{
+}
+
+static uint64_t
+vun_get_features(VuDev *dev)
+{
+    return 1ull << VIRTIO_NET_F_MRG_RXBUF |
+           1ull << VIRTIO_NET_F_MQ |
+           1ull << VIRTIO_RING_F_EVENT_IDX |
+           1ull << VIRTIO_RING_F_INDIRECT_DESC |
+           1ull << VIRTIO_F_ANY_LAYOUT |
+           1ull << VIRTIO_F_VERSION_1 |
+           1ull << VHOST_F_LOG_ALL |
+           1ull << VHOST_USER_F_PROTOCOL_FEATURES;
+}
+
+static void
+vun_set_features(VuDev *dev, uint64_t features)
+{
+    VunDev *vdev = container_of(dev, VunDev, parent);
+
+    vdev->mrg_rxbuf = features & (1ull << VIRTIO_NET_F_MRG_RXBUF);
+    vdev->version_1 = features & (1ull << VIRTIO_F_VERSION_1);
+    if (vdev->mrg_rxbuf || vdev->version_1) {
+        vdev->hdrlen = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    } else {
+        vdev->hdrlen = sizeof(struct virtio_net_hdr);
+    }
+}
+
+static uint64_t
+vun_get_protocol_features(VuDev *dev)
+{
+    return 1ull << VHOST_USER_PROTOCOL_F_MQ;
+}
+
+static int
+vun_process_msg(VuDev *dev, VhostUserMsg *vmsg, int *do_reply)
+{
+    VunDev *vdev = container_of(dev, VunDev, parent);
+
+    /* libvhost-user does not know how many queues the device has */
+    if (vmsg->request == VHOST_USER_GET_QUEUE_NUM) {
+        vmsg->payload.u64 = vdev->nr_pairs;
+        vmsg->size = sizeof(vmsg->payload.u64);
+        vmsg->fd_num = 0;
+        *do_reply = true;
+        return 1;
+    }
+
+    return 0;
+}
+
+static const VuDevIface vun_iface = {
+    .get_features = vun_get_features,
+    .set_features = vun_set_features,
+    .get_protocol_features = vun_get_protocol_features,
+    .process_msg = vun_process_msg,
+    .queue_set_started = vun_queue_set_started,
+};
+
+static int vun_tap_open(const char *ifname, bool multiqueue)
+{
+    struct ifreq ifr;
+    int fd;
+
+    fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open /dev/net/tun: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    if (multiqueue) {
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        fprintf(stderr, "Cannot attach to tap %s: %s\n",
+                ifname, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int vun_packet_open(const char *ifname, bool fanout)
+{
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_ALL),
+    };
+    int fd, arg;
+
+    sll.sll_ifindex = if_nametoindex(ifname);
+    if (!sll.sll_ifindex) {
+        fprintf(stderr, "Unknown interface %s\n", ifname);
+        return -1;
+    }
+
+    fd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK, htons(ETH_P_ALL));
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create packet socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        fprintf(stderr, "Cannot bind to %s: %s\n", ifname, strerror(errno));
+        goto fail;
+    }
+
+    /* Spread the flows of the interface over the queue pairs */
+    if (fanout) {
+        arg = (getpid() & 0xffff) | (PACKET_FANOUT_HASH << 16);
+        if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+            fprintf(stderr, "Cannot join fanout group: %s\n", strerror(errno));
+            goto fail;
+        }
+    }
+
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+static int unix_sock_new(char *unix_fn)
+{
+    int sock;
+    struct sockaddr_un un;
+    size_t len;
+
+    assert(unix_fn);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock <= 0) {
+        perror("socket");
+        return -1;
+    }
+
+    un.sun_family = AF_UNIX;
+    (void)snprintf(un.sun_path, sizeof(un.sun_path), "%s", unix_fn);
+    len = sizeof(un.sun_family) + strlen(un.sun_path);
+
+    (void)unlink(unix_fn);
+    if (bind(sock, (struct sockaddr *)&un, len) < 0) {
+        perror("bind");
+        goto fail;
+    }
+
+    if (listen(sock, 1) < 0) {
+        perror("listen");
+        goto fail;
+    }
+
+    return sock;
+
+fail:
+    (void)close(sock);
+
+    return -1;
+}
+
+static void vun_free(VunDev *vdev)
+{
+    int i;
+
+    if (!vdev) {
+        return;
+    }
+
+    for (i = 0; i < vdev->nr_pairs; i++) {
+        VunQueue *q = &vdev->queues[i];
+
+        if (q->uplink_fd >= 0) {
+            close(q->uplink_fd);
+        }
+        if (q->wake_fd >= 0) {
+            close(q->wake_fd);
+        }
+        g_free(q->buf);
+    }
+    if (vdev->quit_fd >= 0) {
+        close(vdev->quit_fd);
+    }
+    pthread_rwlock_destroy(&vdev->lock);
+    g_free(vdev);
+}
+
+static VunDev *
+vun_new(const char *ifname, bool packet, int nr_pairs, int64_t busy_poll_us)
+{
+    pthread_rwlockattr_t attr;
+    VunDev *vdev;
+    int i;
+
+    vdev = g_new0(VunDev, 1);
+    vdev->nr_pairs = nr_pairs;
+    vdev->packet = packet;
+    vdev->busy_poll_ns = busy_poll_us * 1000;
+    vdev->hdrlen = sizeof(struct virtio_net_hdr);
+    vdev->quit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    /*
+     * Busy polling threads take the lock for reading all the time, so
+     * make sure that a pending control message gets it.
+     */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&vdev->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    for (i = 0; i < nr_pairs; i++) {
+        VunQueue *q = &vdev->queues[i];
+
+        q->vdev = vdev;
+        q->index = i;
+        q->buf = g_malloc(VUN_MAX_FRAME);
+        q->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (packet) {
+            q->uplink_fd = vun_packet_open(ifname, nr_pairs > 1);
+        } else {
+            q->uplink_fd = vun_tap_open(ifname, nr_pairs > 1);
+        }
+        if (q->uplink_fd < 0 || q->wake_fd < 0) {
+            vdev->nr_pairs = i + 1;
+            vun_free(vdev);
+            return NULL;
+        }
+    }
+    if (vdev->quit_fd < 0) {
+        vun_free(vdev);
+        return NULL;
+    }
+
+    return vdev;
+}
+
+static void vun_sigusr1(int sig)
+{
+    vun_dump_stats = 1;
+}
+
+static void vun_usage(const char *name)
+{
+    printf("Usage: %s -s UNIX domain socket"
+           " -t tap interface | -i host interface\n"
+           "       [-q queue pairs] [-p busy poll usecs]"
+           " [-S stats interval secs] | [ -h ]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    char *unix_socket = NULL;
+    char *ifname = NULL;
+    bool packet = false;
+    int nr_pairs = 1;
+    int64_t busy_poll_us = 0;
+    int stats_interval = 0;
+    int64_t next_stats = 0;
+    int lsock = -1, csock = -1;
+    struct sigaction sa;
+    VunDev *vdev = NULL;
+
+    while ((opt = getopt(argc, argv, "s:t:i:q:p:S:h")) != -1) {
+        switch (opt) {
+        case 's':
+            unix_socket = g_strdup(optarg);
+            break;
+        case 't':
+        case 'i':
+            ifname = g_strdup(optarg);
+            packet = opt == 'i';
+            break;
+        case 'q':
+            nr_pairs = atoi(optarg);
+            break;
+        case 'p':
+            busy_poll_us = atoll(optarg);
+            break;
+        case 'S':
+            stats_interval = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            vun_usage(argv[0]);
+            return 0;
+        }
+    }
+
+    if (!unix_socket || !ifname) {
+        vun_usage(argv[0]);
+        return -1;
+    }
+    if (nr_pairs < 1 || nr_pairs > VUN_MAX_QUEUE_PAIRS) {
+        fprintf(stderr, "The number of queue pairs must be between 1 and %d\n",
+                VUN_MAX_QUEUE_PAIRS);
+        return -1;
+    }
+    if (busy_poll_us < 0 || stats_interval < 0) {
+        vun_usage(argv[0]);
+        return -1;
+    }
+
+    vdev = vun_new(ifname, packet, nr_pairs, busy_poll_us);
+    if (!vdev) {
+        goto err;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = vun_sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    lsock = unix_sock_new(unix_socket);
+    if (lsock < 0) {
+        goto err;
+    }
+
+    csock = accept(lsock, (void *)0, (void *)0);
+    if (csock < 0) {
+        fprintf(stderr, "Accept error %s\n", strerror(errno));
+        goto err;
+    }
+
+    vu_init(&vdev->parent, csock, vun_panic_cb, vun_set_watch,
+            vun_remove_watch, &vun_iface);
+
+    if (stats_interval) {
+        next_stats = g_get_monotonic_time() + stats_interval * 1000000LL;
+    }
+
+    while (!atomic_read(&vdev->quit)) {
+        struct pollfd pfd[2] = {
+            { .fd = csock, .events = POLLIN },
+            { .fd = vdev->quit_fd, .events = POLLIN },
+        };
+        int timeout = -1;
+        int ret;
+
+        if (stats_interval) {
+            int64_t now = g_get_monotonic_time();
+
+            if (now >= next_stats) {
+                vun_dump_stats = 1;
+                next_stats = now + stats_interval * 1000000LL;
+            }
+            timeout = (next_stats - now + 999) / 1000;
+        }
+        if (vun_dump_stats) {
+            vun_dump_stats = 0;
+            vun_print_stats(vdev);
+        }
+
+        ret = poll(pfd, ARRAY_SIZE(pfd), timeout);
+        if (ret < 0 && errno != EINTR) {
+            fprintf(stderr, "poll error %s\n", strerror(errno));
+            break;
+        }
+        if (ret > 0 && (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            if (!vun_dispatch(vdev)) {
+                fprintf(stderr, "vhost-user connection closed\n");
+                break;
+            }
+        }
+    }
+
+    vun_stop_queues(vdev);
+    vun_print_stats(vdev);
+    vu_deinit(&vdev->parent);
+
+    close(csock);
+    close(lsock);
+    g_free(unix_socket);
+    g_free(ifname);
+    vun_free(vdev);
+
+    return 0;
+
+err:
+    vun_free(vdev);
+    if (csock >= 0) {
+        close(csock);
+    }
+    if (lsock >= 0) {
+        close(lsock);
+    }
+    g_free(unix_socket);
+    g_free(ifname);
+
+    return -1;
+}
@@ -50,6 +50,7 @@
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
 #include "tcg.h"
+#include "perf.h"
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
 #include "hw/boards.h"
@@ -224,6 +225,24 @@ void qemu_tcg_configure(QemuOpts *opts, Error **errp)
     } else {
         mttcg_enabled = default_mttcg_enabled();
     }
+#ifdef CONFIG_TCG
+    {
+        uint64_t hot = qemu_opt_get_number(opts, "hot-threshold", 0);
+
+        if (hot > INT32_MAX) {
+            error_setg(errp, "Invalid 'hot-threshold' setting %" PRIu64, hot);
+        } else {
+            tb_hot_threshold = hot;
+        }
+    }
+    if (qemu_opt_get_bool(opts, "perfmap", false)) {
+        perf_enable_perfmap();
+    }
+    if (qemu_opt_get_bool(opts, "jitdump", false)) {
+        perf_enable_jitdump();
+    }
+    tcg_reg_prefs = qemu_opt_get_bool(opts, "reg-prefs", true);
+#endif
 }
 
 /* The current number of executed instructions is based on what we
@@ -710,19 +729,31 @@ static const VMStateDescription vmstate_timers = {
     }
 };
 
+/* Length of one throttle period, so that the most throttled vcpu still
+ * gets CPU_THROTTLE_TIMESLICE_NS of run time per period.
+ */
+static int64_t cpu_throttle_period_ns(void)
+{
+    double pct = (double)cpu_throttle_get_percentage() / 100;
+
+    return CPU_THROTTLE_TIMESLICE_NS / (1 - pct);
+}
+
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
     double pct;
-    double throttle_ratio;
     long sleeptime_ns;
 
-    if (!cpu_throttle_get_percentage()) {
+    pct = (double)cpu_throttle_get_vcpu_percentage(cpu) / 100;
+    if (!pct) {
+        atomic_set(&cpu->throttle_thread_scheduled, 0);
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
-    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+    /* Sleep for pct of the period; for the most throttled vcpu this is
+     * pct / (1 - pct) times the timeslice.
+     */
+    sleeptime_ns = (long)(pct * cpu_throttle_period_ns());
 
     qemu_mutex_unlock_iothread();
     g_usleep(sleeptime_ns / 1000); /* Convert ns to us for usleep call */
@@ -733,31 +764,44 @@ static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 static void cpu_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
-    double pct;
 
     /* Stop the timer if needed */
-    if (!cpu_throttle_get_percentage()) {
+    if (!cpu_throttle_active()) {
         return;
     }
     CPU_FOREACH(cpu) {
+        if (!cpu_throttle_get_vcpu_percentage(cpu)) {
+            continue;
+        }
         if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread,
                              RUN_ON_CPU_NULL);
         }
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
-                                   CPU_THROTTLE_TIMESLICE_NS / (1-pct));
+                                   cpu_throttle_period_ns());
 }
 
-void cpu_throttle_set(int new_throttle_pct)
+static int cpu_throttle_clamp(int new_throttle_pct)
 {
     /* Ensure throttle percentage is within valid range */
     new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
-    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+    return MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    atomic_set(&throttle_percentage, cpu_throttle_clamp(new_throttle_pct));
 
-    atomic_set(&throttle_percentage, new_throttle_pct);
+    timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                       CPU_THROTTLE_TIMESLICE_NS);
+}
+
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct)
+{
+    atomic_set(&cpu->throttle_percentage,
+               cpu_throttle_clamp(new_throttle_pct));
 
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
                                        CPU_THROTTLE_TIMESLICE_NS);
@@ -765,7 +809,12 @@ void cpu_throttle_set(int new_throttle_pct)
 
 void cpu_throttle_stop(void)
 {
+    CPUState *cpu;
+
     atomic_set(&throttle_percentage, 0);
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, 0);
+    }
 }
 
 bool cpu_throttle_active(void)
@@ -775,7 +824,19 @@ bool cpu_throttle_active(void)
 
 int cpu_throttle_get_percentage(void)
 {
-    return atomic_read(&throttle_percentage);
+    CPUState *cpu;
+    int pct = atomic_read(&throttle_percentage);
+
+    CPU_FOREACH(cpu) {
+        pct = MAX(pct, atomic_read(&cpu->throttle_percentage));
+    }
+    return pct;
+}
+
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu)
+{
+    return MAX(atomic_read(&cpu->throttle_percentage),
+               atomic_read(&throttle_percentage));
 }
 
 void cpu_ticks_init(void)
@@ -766,6 +766,9 @@ void cpu_exec_unrealizefn(CPUState *cpu)
 
     cpu_list_remove(cpu);
 
+    if (tcg_enabled()) {
+        tlb_destroy(cpu);
+    }
     if (cc->vmsd != NULL) {
         vmstate_unregister(NULL, cc->vmsd, cpu);
     }
@@ -811,6 +814,9 @@ void cpu_exec_realizefn(CPUState *cpu, Error **errp)
         tcg_target_initialized = true;
         cc->tcg_initialize();
     }
+    if (tcg_enabled()) {
+        tlb_init(cpu);
+    }
 
 #ifndef CONFIG_USER_ONLY
     if (qdev_get_vmsd(DEVICE(cpu)) == NULL) {
@@ -849,9 +855,7 @@ const char *parse_cpu_model(const char *cpu_model)
 static void breakpoint_invalidate(CPUState *cpu, target_ulong pc)
 {
     mmap_lock();
-    tb_lock();
     tb_invalidate_phys_page_range(pc, pc + 1, 0);
-    tb_unlock();
     mmap_unlock();
 }
 #else
@@ -2263,6 +2267,70 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
 }
 #endif /* !_WIN32 */
 
+#ifdef __linux__
+/*
+ * Replace the memory of a shared, file backed RAMBlock with the file
+ * @fd, e.g. the same memory backend passed over by a migration source
+ * on this host.  The block keeps its host address, and takes ownership
+ * of @fd on success.
+ */
+int qemu_ram_adopt_fd(RAMBlock *block, int fd, Error **errp)
+{
+    struct stat st;
+    void *area;
+
+    if (block->fd < 0 || !(block->flags & RAM_SHARED) ||
+        (block->flags & RAM_PREALLOC)) {
+        error_setg(errp, "RAM block %s is not backed by a shared file",
+                   block->idstr);
+        return -1;
+    }
+
+    if (qemu_fd_getpagesize(fd) != block->page_size) {
+        error_setg(errp, "RAM block %s page size 0x%zx does not match the"
+                   " passed file", block->idstr, block->page_size);
+        return -1;
+    }
+
+    if (fstat(fd, &st)) {
+        error_setg_errno(errp, errno, "failed to query passed file for RAM"
+                         " block %s", block->idstr);
+        return -1;
+    }
+
+    /*
+     * The whole block is remapped: touching a page past the end of the
+     * file would raise SIGBUS.
+     */
+    if (st.st_size < block->max_length) {
+        error_setg(errp, "passed file for RAM block %s is smaller than 0x"
+                   RAM_ADDR_FMT, block->idstr, block->max_length);
+        return -1;
+    }
+
+    area = mmap(block->host, block->max_length, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0);
+    if (area != block->host) {
+        error_setg_errno(errp, errno, "failed to map passed file for RAM"
+                         " block %s", block->idstr);
+        return -1;
+    }
+    memory_try_enable_merging(area, block->max_length);
+    qemu_ram_setup_dump(area, block->max_length);
+
+    close(block->fd);
+    block->fd = fd;
+    return 0;
+}
+#else
+int qemu_ram_adopt_fd(RAMBlock *block, int fd, Error **errp)
+{
+    error_setg(errp, "passing RAM between processes is not supported"
+               " on this host");
+    return -1;
+}
+#endif
+
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
  * This should not be used for general purpose DMA.  Use address_space_map
  * or address_space_rw instead. For local memory (e.g. video ram) that the
@@ -2446,25 +2514,40 @@ void memory_notdirty_write_prepare(NotDirtyInfo *ndi,
     ndi->ram_addr = ram_addr;
     ndi->mem_vaddr = mem_vaddr;
     ndi->size = size;
-    ndi->locked = false;
+    ndi->pages = NULL;
 
     assert(tcg_enabled());
     if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
-        ndi->locked = true;
-        tb_lock();
-        tb_invalidate_phys_page_fast(ram_addr, size);
+        ndi->pages = page_collection_lock(ram_addr, ram_addr + size);
+        tb_invalidate_phys_page_fast(ndi->pages, ram_addr, size);
     }
 }
 
 /* Called within RCU critical section. */
 void memory_notdirty_write_complete(NotDirtyInfo *ndi)
 {
-    if (ndi->locked) {
-        tb_unlock();
+    if (ndi->pages) {
+        page_collection_unlock(ndi->pages);
+        ndi->pages = NULL;
+    }
+
+    /* Account the page to the vcpu that dirtied it, separately for
+     * auto-converge and for dirty rate measurement, which clear their
+     * own dirty bitmaps.
+     */
+    if (ndi->cpu) {
+        if (!cpu_physical_memory_get_dirty_flag(ndi->ram_addr,
+                                                DIRTY_MEMORY_MIGRATION)) {
+            atomic_inc(&ndi->cpu->dirty_pages);
+        }
+        if (!cpu_physical_memory_get_dirty_flag(ndi->ram_addr,
+                                                DIRTY_MEMORY_DIRTYRATE)) {
+            atomic_inc(&ndi->cpu->dirtyrate_pages);
+        }
     }
 
-    /* Set both VGA and migration bits for simplicity and to remove
-     * the notdirty callback faster.
+    /* Set the VGA, migration and dirty rate bits for simplicity and to
+     * remove the notdirty callback faster.
      */
     cpu_physical_memory_set_dirty_range(ndi->ram_addr, ndi->size,
                                         DIRTY_CLIENTS_NOCODE);
@@ -2561,11 +2644,7 @@ static void check_watchpoint(int offset, int len, MemTxAttrs attrs, int flags)
                 }
                 cpu->watchpoint_hit = wp;
 
-                /* Both tb_lock and iothread_mutex will be reset when
-                 * cpu_loop_exit or cpu_loop_exit_noexc longjmp
-                 * back into the cpu_exec main loop.
-                 */
-                tb_lock();
+                /* This call also restores vCPU state */
                 tb_check_watchpoint(cpu);
                 if (wp->flags & BP_STOP_BEFORE_ACCESS) {
                     cpu->exception_index = EXCP_DEBUG;
@@ -2989,9 +3068,7 @@ static void invalidate_and_set_dirty(MemoryRegion *mr, hwaddr addr,
     }
     if (dirty_log_mask & (1 << DIRTY_MEMORY_CODE)) {
         assert(tcg_enabled());
-        tb_lock();
         tb_invalidate_phys_range(addr, addr + length);
-        tb_unlock();
         dirty_log_mask &= ~(1 << DIRTY_MEMORY_CODE);
     }
     cpu_physical_memory_set_dirty_range(addr, length, dirty_log_mask);
@@ -85,6 +85,8 @@ this code that are retained.
 #include "qemu/osdep.h"
 #include "qemu/bitops.h"
 #include "fpu/softfloat.h"
+#include <math.h>
+#include <float.h>
 
 /* We only need stdlib for abort() */
 
@@ -105,6 +107,254 @@ this code that are retained.
 *----------------------------------------------------------------------------*/
 #include "softfloat-specialize.h"
 
+/*
+ * Hardfloat
+ *
+ * When the rounding mode is nearest-even, the inputs are zero or normal
+ * and the inexact flag is already raised, the host FPU computes the same
+ * result as softfloat, and the only flags left to work out are overflow
+ * and underflow.  Overflow is recognised by an infinite result; results
+ * that may be tiny are recomputed in software, which also gets underflow
+ * and flush-to-zero right.  Anything else goes through softfloat.
+ *
+ * Requiring inexact to be set already is what makes this cheap: most
+ * operations on such inputs are inexact anyway and guests rarely clear
+ * the sticky flag, so the host never has to tell whether a result was
+ * exact.
+ *
+ * Hosts that evaluate float and double in extended precision would round
+ * twice, so they always use softfloat.
+ */
+#if defined(__FAST_MATH__) || (defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD != 0)
+# define QEMU_NO_HARDFLOAT 1
+#else
+# define QEMU_NO_HARDFLOAT 0
+#endif
+
+typedef union {
+    float32 s;
+    float h;
+} union_float32;
+
+typedef union {
+    float64 s;
+    double h;
+} union_float64;
+
+static inline bool can_use_fpu(const float_status *s)
+{
+    if (QEMU_NO_HARDFLOAT) {
+        return false;
+    }
+    return likely(s->float_exception_flags & float_flag_inexact &&
+                  s->float_rounding_mode == float_round_nearest_even);
+}
+
+/*
+ * The *_fast functions below return false if softfloat must compute the
+ * result; otherwise they store it in *r and raise overflow if needed.
+ */
+static inline bool f32_addsub_fast(float32 a, float32 b, bool subtract,
+                                   float32 *r, float_status *s)
+{
+    union_float32 ua = { .s = a }, ub = { .s = b }, ur;
+
+    if (!can_use_fpu(s) ||
+        !float32_is_zero_or_normal(a) || !float32_is_zero_or_normal(b)) {
+        return false;
+    }
+    ur.h = subtract ? ua.h - ub.h : ua.h + ub.h;
+    if (unlikely(isinf(ur.h))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN) &&
+               !(float32_is_zero(a) && float32_is_zero(b))) {
+        return false;
+    }
+    *r = ur.s;
+    return true;
+}
+
+static inline bool f64_addsub_fast(float64 a, float64 b, bool subtract,
+                                   float64 *r, float_status *s)
+{
+    union_float64 ua = { .s = a }, ub = { .s = b }, ur;
+
+    if (!can_use_fpu(s) ||
+        !float64_is_zero_or_normal(a) || !float64_is_zero_or_normal(b)) {
+        return false;
+    }
+    ur.h = subtract ? ua.h - ub.h : ua.h + ub.h;
+    if (unlikely(isinf(ur.h))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN) &&
+               !(float64_is_zero(a) && float64_is_zero(b))) {
+        return false;
+    }
+    *r = ur.s;
+    return true;
+}
+
+static inline bool f32_mul_fast(float32 a, float32 b, float32 *r,
+                                float_status *s)
+{
+    union_float32 ua = { .s = a }, ub = { .s = b }, ur;
+
+    if (!can_use_fpu(s) ||
+        !float32_is_zero_or_normal(a) || !float32_is_zero_or_normal(b)) {
+        return false;
+    }
+    ur.h = ua.h * ub.h;
+    if (unlikely(isinf(ur.h))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN) &&
+               !float32_is_zero(a) && !float32_is_zero(b)) {
+        return false;
+    }
+    *r = ur.s;
+    return true;
+}
+
+static inline bool f64_mul_fast(float64 a, float64 b, float64 *r,
+                                float_status *s)
+{
+    union_float64 ua = { .s = a }, ub = { .s = b }, ur;
+
+    if (!can_use_fpu(s) ||
+        !float64_is_zero_or_normal(a) || !float64_is_zero_or_normal(b)) {
+        return false;
+    }
+    ur.h = ua.h * ub.h;
+    if (unlikely(isinf(ur.h))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN) &&
+               !float64_is_zero(a) && !float64_is_zero(b)) {
+        return false;
+    }
+    *r = ur.s;
+    return true;
+}
+
+static inline bool f32_div_fast(float32 a, float32 b, float32 *r,
+                                float_status *s)
+{
+    union_float32 ua = { .s = a }, ub = { .s = b }, ur;
+
+    if (!can_use_fpu(s) ||
+        !float32_is_zero_or_normal(a) || !float32_is_normal(b)) {
+        return false;
+    }
+    ur.h = ua.h / ub.h;
+    if (unlikely(isinf(ur.h))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN) && !float32_is_zero(a)) {
+        return false;
+    }
+    *r = ur.s;
+    return true;
+}
+
+static inline bool f64_div_fast(float64 a, float64 b, float64 *r,
+                                float_status *s)
+{
+    union_float64 ua = { .s = a }, ub = { .s = b }, ur;
+
+    if (!can_use_fpu(s) ||
+        !float64_is_zero_or_normal(a) || !float64_is_normal(b)) {
+        return false;
+    }
+    ur.h = ua.h / ub.h;
+    if (unlikely(isinf(ur.h))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN) && !float64_is_zero(a)) {
+        return false;
+    }
+    *r = ur.s;
+    return true;
+}
+
+/* The result of a square root can neither overflow nor be tiny */
+static inline bool f32_sqrt_fast(float32 a, float32 *r, float_status *s)
+{
+    union_float32 ua = { .s = a }, ur;
+
+    if (!can_use_fpu(s) || !float32_is_normal(a) || float32_is_neg(a)) {
+        return false;
+    }
+    ur.h = sqrtf(ua.h);
+    *r = ur.s;
+    return true;
+}
+
+static inline bool f64_sqrt_fast(float64 a, float64 *r, float_status *s)
+{
+    union_float64 ua = { .s = a }, ur;
+
+    if (!can_use_fpu(s) || !float64_is_normal(a) || float64_is_neg(a)) {
+        return false;
+    }
+    ur.h = sqrt(ua.h);
+    *r = ur.s;
+    return true;
+}
+
+static inline bool f32_muladd_fast(float32 a, float32 b, float32 c, int flags,
+                                   float32 *r, float_status *s)
+{
+    union_float32 ua = { .s = a }, ub = { .s = b }, uc = { .s = c }, ur;
+
+    if (!can_use_fpu(s) || (flags & float_muladd_halve_result) ||
+        !float32_is_zero_or_normal(a) || !float32_is_zero_or_normal(b) ||
+        !float32_is_zero_or_normal(c)) {
+        return false;
+    }
+    if (flags & float_muladd_negate_product) {
+        ua.h = -ua.h;
+    }
+    if (flags & float_muladd_negate_c) {
+        uc.h = -uc.h;
+    }
+    ur.h = fmaf(ua.h, ub.h, uc.h);
+    if (unlikely(isinf(ur.h))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN)) {
+        return false;
+    }
+    if (flags & float_muladd_negate_result) {
+        ur.h = -ur.h;
+    }
+    *r = ur.s;
+    return true;
+}
+
+static inline bool f64_muladd_fast(float64 a, float64 b, float64 c, int flags,
+                                   float64 *r, float_status *s)
+{
+    union_float64 ua = { .s = a }, ub = { .s = b }, uc = { .s = c }, ur;
+
+    if (!can_use_fpu(s) || (flags & float_muladd_halve_result) ||
+        !float64_is_zero_or_normal(a) || !float64_is_zero_or_normal(b) ||
+        !float64_is_zero_or_normal(c)) {
+        return false;
+    }
+    if (flags & float_muladd_negate_product) {
+        ua.h = -ua.h;
+    }
+    if (flags & float_muladd_negate_c) {
+        uc.h = -uc.h;
+    }
+    ur.h = fma(ua.h, ub.h, uc.h);
+    if (unlikely(isinf(ur.h))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN)) {
+        return false;
+    }
+    if (flags & float_muladd_negate_result) {
+        ur.h = -ur.h;
+    }
+    *r = ur.s;
+    return true;
+}
+
 /*----------------------------------------------------------------------------
 | Returns the fraction bits of the half-precision floating-point value `a'.
 *----------------------------------------------------------------------------*/
@@ -323,8 +573,8 @@ static inline float64 float64_pack_raw(FloatParts p)
 }
 
 /* Canonicalize EXP and FRAC, setting CLS.  */
-static FloatParts canonicalize(FloatParts part, const FloatFmt *parm,
-                               float_status *status)
+static FloatParts sf_canonicalize(FloatParts part, const FloatFmt *parm,
+                                  float_status *status)
 {
     if (part.exp == parm->exp_max) {
         if (part.frac == 0) {
@@ -494,7 +744,7 @@ static FloatParts round_canonical(FloatParts p, float_status *s,
 
 static FloatParts float16_unpack_canonical(float16 f, float_status *s)
 {
-    return canonicalize(float16_unpack_raw(f), &float16_params, s);
+    return sf_canonicalize(float16_unpack_raw(f), &float16_params, s);
 }
 
 static float16 float16_round_pack_canonical(FloatParts p, float_status *s)
@@ -512,7 +762,7 @@ static float16 float16_round_pack_canonical(FloatParts p, float_status *s)
 
 static FloatParts float32_unpack_canonical(float32 f, float_status *s)
 {
-    return canonicalize(float32_unpack_raw(f), &float32_params, s);
+    return sf_canonicalize(float32_unpack_raw(f), &float32_params, s);
 }
 
 static float32 float32_round_pack_canonical(FloatParts p, float_status *s)
@@ -530,7 +780,7 @@ static float32 float32_round_pack_canonical(FloatParts p, float_status *s)
 
 static FloatParts float64_unpack_canonical(float64 f, float_status *s)
 {
-    return canonicalize(float64_unpack_raw(f), &float64_params, s);
+    return sf_canonicalize(float64_unpack_raw(f), &float64_params, s);
 }
 
 static float64 float64_round_pack_canonical(FloatParts p, float_status *s)
@@ -741,9 +991,15 @@ float16  __attribute__((flatten)) float16_add(float16 a, float16 b,
 float32 __attribute__((flatten)) float32_add(float32 a, float32 b,
                                              float_status *status)
 {
-    FloatParts pa = float32_unpack_canonical(a, status);
-    FloatParts pb = float32_unpack_canonical(b, status);
-    FloatParts pr = addsub_floats(pa, pb, false, status);
+    FloatParts pa, pb, pr;
+    float32 r;
+
+    if (f32_addsub_fast(a, b, false, &r, status)) {
+        return r;
+    }
+    pa = float32_unpack_canonical(a, status);
+    pb = float32_unpack_canonical(b, status);
+    pr = addsub_floats(pa, pb, false, status);
 
     return float32_round_pack_canonical(pr, status);
 }
@@ -751,9 +1007,15 @@ float32 __attribute__((flatten)) float32_add(float32 a, float32 b,
 float64 __attribute__((flatten)) float64_add(float64 a, float64 b,
                                              float_status *status)
 {
-    FloatParts pa = float64_unpack_canonical(a, status);
-    FloatParts pb = float64_unpack_canonical(b, status);
-    FloatParts pr = addsub_floats(pa, pb, false, status);
+    FloatParts pa, pb, pr;
+    float64 r;
+
+    if (f64_addsub_fast(a, b, false, &r, status)) {
+        return r;
+    }
+    pa = float64_unpack_canonical(a, status);
+    pb = float64_unpack_canonical(b, status);
+    pr = addsub_floats(pa, pb, false, status);
 
     return float64_round_pack_canonical(pr, status);
 }
@@ -771,9 +1033,15 @@ float16 __attribute__((flatten)) float16_sub(float16 a, float16 b,
 float32 __attribute__((flatten)) float32_sub(float32 a, float32 b,
                                              float_status *status)
 {
-    FloatParts pa = float32_unpack_canonical(a, status);
-    FloatParts pb = float32_unpack_canonical(b, status);
-    FloatParts pr = addsub_floats(pa, pb, true, status);
+    FloatParts pa, pb, pr;
+    float32 r;
+
+    if (f32_addsub_fast(a, b, true, &r, status)) {
+        return r;
+    }
+    pa = float32_unpack_canonical(a, status);
+    pb = float32_unpack_canonical(b, status);
+    pr = addsub_floats(pa, pb, true, status);
 
     return float32_round_pack_canonical(pr, status);
 }
@@ -781,9 +1049,15 @@ float32 __attribute__((flatten)) float32_sub(float32 a, float32 b,
 float64 __attribute__((flatten)) float64_sub(float64 a, float64 b,
                                              float_status *status)
 {
-    FloatParts pa = float64_unpack_canonical(a, status);
-    FloatParts pb = float64_unpack_canonical(b, status);
-    FloatParts pr = addsub_floats(pa, pb, true, status);
+    FloatParts pa, pb, pr;
+    float64 r;
+
+    if (f64_addsub_fast(a, b, true, &r, status)) {
+        return r;
+    }
+    pa = float64_unpack_canonical(a, status);
+    pb = float64_unpack_canonical(b, status);
+    pr = addsub_floats(pa, pb, true, status);
 
     return float64_round_pack_canonical(pr, status);
 }
@@ -852,9 +1126,15 @@ float16 __attribute__((flatten)) float16_mul(float16 a, float16 b,
 float32 __attribute__((flatten)) float32_mul(float32 a, float32 b,
                                              float_status *status)
 {
-    FloatParts pa = float32_unpack_canonical(a, status);
-    FloatParts pb = float32_unpack_canonical(b, status);
-    FloatParts pr = mul_floats(pa, pb, status);
+    FloatParts pa, pb, pr;
+    float32 r;
+
+    if (f32_mul_fast(a, b, &r, status)) {
+        return r;
+    }
+    pa = float32_unpack_canonical(a, status);
+    pb = float32_unpack_canonical(b, status);
+    pr = mul_floats(pa, pb, status);
 
     return float32_round_pack_canonical(pr, status);
 }
@@ -862,9 +1142,15 @@ float32 __attribute__((flatten)) float32_mul(float32 a, float32 b,
 float64 __attribute__((flatten)) float64_mul(float64 a, float64 b,
                                              float_status *status)
 {
-    FloatParts pa = float64_unpack_canonical(a, status);
-    FloatParts pb = float64_unpack_canonical(b, status);
-    FloatParts pr = mul_floats(pa, pb, status);
+    FloatParts pa, pb, pr;
+    float64 r;
+
+    if (f64_mul_fast(a, b, &r, status)) {
+        return r;
+    }
+    pa = float64_unpack_canonical(a, status);
+    pb = float64_unpack_canonical(b, status);
+    pr = mul_floats(pa, pb, status);
 
     return float64_round_pack_canonical(pr, status);
 }
@@ -1087,10 +1373,16 @@ float16 __attribute__((flatten)) float16_muladd(float16 a, float16 b, float16 c,
 float32 __attribute__((flatten)) float32_muladd(float32 a, float32 b, float32 c,
                                                 int flags, float_status *status)
 {
-    FloatParts pa = float32_unpack_canonical(a, status);
-    FloatParts pb = float32_unpack_canonical(b, status);
-    FloatParts pc = float32_unpack_canonical(c, status);
-    FloatParts pr = muladd_floats(pa, pb, pc, flags, status);
+    FloatParts pa, pb, pc, pr;
+    float32 r;
+
+    if (f32_muladd_fast(a, b, c, flags, &r, status)) {
+        return r;
+    }
+    pa = float32_unpack_canonical(a, status);
+    pb = float32_unpack_canonical(b, status);
+    pc = float32_unpack_canonical(c, status);
+    pr = muladd_floats(pa, pb, pc, flags, status);
 
     return float32_round_pack_canonical(pr, status);
 }
@@ -1098,10 +1390,16 @@ float32 __attribute__((flatten)) float32_muladd(float32 a, float32 b, float32 c,
 float64 __attribute__((flatten)) float64_muladd(float64 a, float64 b, float64 c,
                                                 int flags, float_status *status)
 {
-    FloatParts pa = float64_unpack_canonical(a, status);
-    FloatParts pb = float64_unpack_canonical(b, status);
-    FloatParts pc = float64_unpack_canonical(c, status);
-    FloatParts pr = muladd_floats(pa, pb, pc, flags, status);
+    FloatParts pa, pb, pc, pr;
+    float64 r;
+
+    if (f64_muladd_fast(a, b, c, flags, &r, status)) {
+        return r;
+    }
+    pa = float64_unpack_canonical(a, status);
+    pb = float64_unpack_canonical(b, status);
+    pc = float64_unpack_canonical(c, status);
+    pr = muladd_floats(pa, pb, pc, flags, status);
 
     return float64_round_pack_canonical(pr, status);
 }
@@ -1178,18 +1476,30 @@ float16 float16_div(float16 a, float16 b, float_status *status)
 
 float32 float32_div(float32 a, float32 b, float_status *status)
 {
-    FloatParts pa = float32_unpack_canonical(a, status);
-    FloatParts pb = float32_unpack_canonical(b, status);
-    FloatParts pr = div_floats(pa, pb, status);
+    FloatParts pa, pb, pr;
+    float32 r;
+
+    if (f32_div_fast(a, b, &r, status)) {
+        return r;
+    }
+    pa = float32_unpack_canonical(a, status);
+    pb = float32_unpack_canonical(b, status);
+    pr = div_floats(pa, pb, status);
 
     return float32_round_pack_canonical(pr, status);
 }
 
 float64 float64_div(float64 a, float64 b, float_status *status)
 {
-    FloatParts pa = float64_unpack_canonical(a, status);
-    FloatParts pb = float64_unpack_canonical(b, status);
-    FloatParts pr = div_floats(pa, pb, status);
+    FloatParts pa, pb, pr;
+    float64 r;
+
+    if (f64_div_fast(a, b, &r, status)) {
+        return r;
+    }
+    pa = float64_unpack_canonical(a, status);
+    pb = float64_unpack_canonical(b, status);
+    pr = div_floats(pa, pb, status);
 
     return float64_round_pack_canonical(pr, status);
 }
@@ -1993,15 +2303,27 @@ float16 __attribute__((flatten)) float16_sqrt(float16 a, float_status *status)
 
 float32 __attribute__((flatten)) float32_sqrt(float32 a, float_status *status)
 {
-    FloatParts pa = float32_unpack_canonical(a, status);
-    FloatParts pr = sqrt_float(pa, status, &float32_params);
+    FloatParts pa, pr;
+    float32 r;
+
+    if (f32_sqrt_fast(a, &r, status)) {
+        return r;
+    }
+    pa = float32_unpack_canonical(a, status);
+    pr = sqrt_float(pa, status, &float32_params);
     return float32_round_pack_canonical(pr, status);
 }
 
 float64 __attribute__((flatten)) float64_sqrt(float64 a, float_status *status)
 {
-    FloatParts pa = float64_unpack_canonical(a, status);
-    FloatParts pr = sqrt_float(pa, status, &float64_params);
+    FloatParts pa, pr;
+    float64 r;
+
+    if (f64_sqrt_fast(a, &r, status)) {
+        return r;
+    }
+    pa = float64_unpack_canonical(a, status);
+    pr = sqrt_float(pa, status, &float64_params);
     return float64_round_pack_canonical(pr, status);
 }
 
@@ -1053,6 +1053,23 @@ STEXI
 @findex migrate_start_postcopy
 Switch in-progress migration to postcopy mode. Ignored after the end of
 migration (or once already in postcopy).
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "second:l,sample_pages_per_GB:l?",
+        .params     = "second [sample_pages_per_GB]",
+        .help       = "start measuring the guest dirty rate for 'second' "
+                      "seconds, sampling 'sample_pages_per_GB' pages per GiB "
+                      "of guest memory (default 512)",
+        .cmd        = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{second} [@var{sample_pages_per_GB}]
+@findex calc_dirty_rate
+Start measuring the rate at which the guest dirties its memory during
+@var{second} seconds.  Use @code{info dirty_rate} to read the result.
 ETEXI
 
     {
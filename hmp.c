@@ -370,6 +370,9 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %" PRIu64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE),
             params->xbzrle_cache_size);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_X_SCAN_THREADS),
+            params->x_scan_threads);
     }
 
     qapi_free_MigrationParameters(params);
@@ -381,6 +384,32 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info;
+    DirtyRateVcpuList *vcpu;
+
+    info = qmp_query_dirty_rate(NULL);
+
+    monitor_printf(mon, "Status: %s\n",
+                   DirtyRateStatus_str(info->status));
+    monitor_printf(mon, "Start time: %" PRId64 " s\n", info->start_time);
+    monitor_printf(mon, "Calculation time: %" PRId64 " s\n",
+                   info->calc_time);
+    monitor_printf(mon, "Sample pages: %" PRId64 " per GiB\n",
+                   info->sample_pages);
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "Dirty rate: %" PRId64 " MiB/s\n",
+                       info->dirty_rate);
+    }
+    for (vcpu = info->vcpu_dirty_rate; vcpu; vcpu = vcpu->next) {
+        monitor_printf(mon, "  CPU #%" PRId64 ": %" PRId64 " MiB/s\n",
+                       vcpu->value->id, vcpu->value->dirty_rate);
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoFastList *cpu_list, *cpu;
@@ -1533,6 +1562,21 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &err);
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t sec = qdict_get_int(qdict, "second");
+    bool has_sample_pages = qdict_haskey(qdict, "sample_pages_per_GB");
+    int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages_per_GB", 0);
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(sec, has_sample_pages, sample_pages, &err);
+    if (!err) {
+        monitor_printf(mon, "Measuring the dirty rate for %" PRId64 " seconds, "
+                       "use 'info dirty_rate' to get the result\n", sec);
+    }
+    hmp_handle_error(mon, &err);
+}
+
 /* Kept for backwards compatibility */
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
@@ -1657,6 +1701,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         }
         p->xbzrle_cache_size = cache_size;
         break;
+    case MIGRATION_PARAMETER_X_SCAN_THREADS:
+        p->has_x_scan_threads = true;
+        visit_type_uint8(v, param, &p->x_scan_threads, &err);
+        break;
     default:
         assert(0);
     }
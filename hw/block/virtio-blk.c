@@ -42,7 +42,16 @@ static void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
 
 static void virtio_blk_free_request(VirtIOBlockReq *req)
 {
-    g_free(req);
+    virtqueue_free_element(req->vq, req);
+}
+
+static void virtio_blk_notify(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->dataplane_started && !s->dataplane_disabled) {
+        virtio_blk_data_plane_notify(s->dataplane, vq);
+    } else {
+        virtio_notify(VIRTIO_DEVICE(s), vq);
+    }
 }
 
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
@@ -54,11 +63,58 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 
     stb_p(&req->in->status, status);
     virtqueue_push(req->vq, &req->elem, req->in_len);
-    if (s->dataplane_started && !s->dataplane_disabled) {
-        virtio_blk_data_plane_notify(s->dataplane, req->vq);
-    } else {
-        virtio_notify(vdev, req->vq);
+    virtio_blk_notify(s, req->vq);
+}
+
+/* Requests completed together, returned to the guest with one used index
+ * update and one notification.  All of them belong to the same virtqueue.  */
+typedef struct VirtIOBlockCompletions {
+    VirtIOBlockReq *reqs[VIRTQUEUE_BATCH_SIZE];
+    VirtQueueElement *elems[VIRTQUEUE_BATCH_SIZE];
+    unsigned int lens[VIRTQUEUE_BATCH_SIZE];
+    unsigned int num;
+} VirtIOBlockCompletions;
+
+static void virtio_blk_complete_batch(VirtIOBlock *s,
+                                      VirtIOBlockCompletions *c)
+{
+    VirtQueue *vq;
+    unsigned int i;
+
+    if (!c->num) {
+        return;
+    }
+
+    vq = c->reqs[0]->vq;
+    virtqueue_push_batch(vq, c->elems, c->lens, c->num);
+    virtio_blk_notify(s, vq);
+    for (i = 0; i < c->num; i++) {
+        virtio_blk_free_request(c->reqs[i]);
     }
+    c->num = 0;
+}
+
+/* Like virtio_blk_req_complete() followed by virtio_blk_free_request(),
+ * but the request is only returned to the guest by
+ * virtio_blk_complete_batch().  */
+static void virtio_blk_req_complete_deferred(VirtIOBlockReq *req,
+                                             unsigned char status,
+                                             VirtIOBlockCompletions *c)
+{
+    VirtIOBlock *s = req->dev;
+
+    if (c->num == VIRTQUEUE_BATCH_SIZE ||
+        (c->num && c->reqs[0]->vq != req->vq)) {
+        virtio_blk_complete_batch(s, c);
+    }
+
+    trace_virtio_blk_req_complete(VIRTIO_DEVICE(s), req, status);
+
+    stb_p(&req->in->status, status);
+    c->reqs[c->num] = req;
+    c->elems[c->num] = &req->elem;
+    c->lens[c->num] = req->in_len;
+    c->num++;
 }
 
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
@@ -89,6 +145,7 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
     VirtIOBlockReq *next = opaque;
     VirtIOBlock *s = next->dev;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    VirtIOBlockCompletions completions = {};
 
     aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
     while (next) {
@@ -119,10 +176,10 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
             }
         }
 
-        virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
         block_acct_done(blk_get_stats(req->dev->blk), &req->acct);
-        virtio_blk_free_request(req);
+        virtio_blk_req_complete_deferred(req, VIRTIO_BLK_S_OK, &completions);
     }
+    virtio_blk_complete_batch(s, &completions);
     aio_context_release(blk_get_aio_context(s->conf.conf.blk));
 }
 
@@ -199,14 +256,17 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
+static unsigned int virtio_blk_get_requests(VirtIOBlock *s, VirtQueue *vq,
+                                            VirtIOBlockReq **reqs)
 {
-    VirtIOBlockReq *req = virtqueue_pop(vq, sizeof(VirtIOBlockReq));
+    unsigned int i, n;
 
-    if (req) {
-        virtio_blk_init_request(s, vq, req);
+    n = virtqueue_pop_batch(vq, sizeof(VirtIOBlockReq), (void **)reqs,
+                            VIRTQUEUE_BATCH_SIZE);
+    for (i = 0; i < n; i++) {
+        virtio_blk_init_request(s, vq, reqs[i]);
     }
-    return req;
+    return n;
 }
 
 static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
@@ -594,7 +654,8 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req;
+    VirtIOBlockReq *reqs[VIRTQUEUE_BATCH_SIZE];
+    unsigned int i, n;
     MultiReqBuffer mrb = {};
     bool progress = false;
 
@@ -604,11 +665,22 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     do {
         virtio_queue_set_notification(vq, 0);
 
-        while ((req = virtio_blk_get_request(s, vq))) {
+        while ((n = virtio_blk_get_requests(s, vq, reqs))) {
             progress = true;
-            if (virtio_blk_handle_request(req, &mrb)) {
-                virtqueue_detach_element(req->vq, &req->elem, 0);
-                virtio_blk_free_request(req);
+            for (i = 0; i < n; i++) {
+                if (virtio_blk_handle_request(reqs[i], &mrb)) {
+                    break;
+                }
+            }
+            if (i < n) {
+                /* Give back the requests after the failed one, newest
+                 * first, so that they are popped again later.  */
+                while (--n > i) {
+                    virtqueue_unpop(vq, &reqs[n]->elem, 0);
+                    virtio_blk_free_request(reqs[n]);
+                }
+                virtqueue_detach_element(vq, &reqs[i]->elem, 0);
+                virtio_blk_free_request(reqs[i]);
                 break;
             }
         }
@@ -862,7 +934,7 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
             qemu_put_be32(f, virtio_get_queue_index(req->vq));
         }
 
-        qemu_put_virtqueue_element(f, &req->elem);
+        qemu_put_virtqueue_element(vdev, f, &req->elem);
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -964,7 +1036,10 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
     for (i = 0; i < conf->num_queues; i++) {
-        virtio_add_queue(vdev, conf->queue_size, virtio_blk_handle_output);
+        VirtQueue *vq = virtio_add_queue(vdev, conf->queue_size,
+                                         virtio_blk_handle_output);
+
+        virtqueue_init_element_pool(vq, sizeof(VirtIOBlockReq));
     }
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
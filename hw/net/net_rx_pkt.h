@@ -19,6 +19,7 @@
 #define NET_RX_PKT_H
 
 #include "net/eth.h"
+#include "net/checksum.h"
 
 /* defines to enable packet dump functions */
 /*#define NET_RX_PKT_DEBUG*/
@@ -131,9 +132,13 @@ eth_l4_hdr_info *net_rx_pkt_get_l4_info(struct NetRxPkt *pkt);
 typedef enum {
     NetPktRssIpV4,
     NetPktRssIpV4Tcp,
-    NetPktRssIpV6Tcp,
+    NetPktRssIpV6TcpEx,
     NetPktRssIpV6,
-    NetPktRssIpV6Ex
+    NetPktRssIpV6Ex,
+    NetPktRssIpV6Tcp,
+    NetPktRssIpV4Udp,
+    NetPktRssIpV6Udp,
+    NetPktRssIpV6UdpEx,
 } NetRxPktRssType;
 
 /**
@@ -150,6 +155,21 @@ net_rx_pkt_calc_rss_hash(struct NetRxPkt *pkt,
                          NetRxPktRssType type,
                          uint8_t *key);
 
+/**
+* calculates RSS hash for packet with a precomputed Toeplitz table
+*
+* @pkt:            packet
+* @type:           RSS hash type
+* @table:          lookup table built from the RSS key
+*
+* Return:  Toeplitz RSS hash.
+*
+*/
+uint32_t
+net_rx_pkt_calc_rss_hash_table(struct NetRxPkt *pkt,
+                               NetRxPktRssType type,
+                               const NetToeplitzTable *table);
+
 /**
 * fetches IP identification for the packet
 *
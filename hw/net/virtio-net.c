@@ -19,6 +19,9 @@
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
+#include "block/aio-wait.h"
 #include "hw/virtio/virtio-net.h"
 #include "net/vhost_net.h"
 #include "hw/virtio/virtio-bus.h"
@@ -27,6 +30,7 @@
 #include "hw/virtio/virtio-access.h"
 #include "migration/misc.h"
 #include "standard-headers/linux/ethtool.h"
+#include "net_rx_pkt.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -41,6 +45,16 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)
+
 /*
  * Calculate the number of bytes up to and including the given 'field' of
  * 'container'.
@@ -64,6 +78,8 @@ static VirtIOFeature feature_sizes[] = {
      .end = endof(struct virtio_net_config, mtu)},
     {.flags = 1ULL << VIRTIO_NET_F_SPEED_DUPLEX,
      .end = endof(struct virtio_net_config, duplex)},
+    {.flags = (1ULL << VIRTIO_NET_F_RSS) | (1ULL << VIRTIO_NET_F_HASH_REPORT),
+     .end = endof(struct virtio_net_config, supported_hash_types)},
     {}
 };
 
@@ -94,6 +110,11 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
     virtio_stl_p(vdev, &netcfg.speed, n->net_conf.speed);
     netcfg.duplex = n->net_conf.duplex;
+    netcfg.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    virtio_stw_p(vdev, &netcfg.rss_max_indirection_table_length,
+                 VIRTIO_NET_RSS_MAX_TABLE_LEN);
+    virtio_stl_p(vdev, &netcfg.supported_hash_types,
+                 VIRTIO_NET_RSS_SUPPORTED_HASHES);
     memcpy(config, &netcfg, n->config_size);
 }
 
@@ -240,14 +261,84 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
-static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
+/* Called in the IOThread.  While the transport has the vector of @vq
+ * masked, only record the interrupt; virtio_net_guest_notifier_pending
+ * hands it over when the vector is unmasked or polled.  */
+static void virtio_net_notify_irqfd(VirtIONetQueue *q, VirtQueue *vq)
 {
-    unsigned int dropped = virtqueue_drop_all(vq);
-    if (dropped) {
+    int i = virtio_get_queue_index(vq) & 1;
+
+    if (atomic_read(&q->notifier_masked[i])) {
+        atomic_set(&q->notifier_pending[i], true);
+        /* Pairs with smp_mb() in virtio_net_guest_notifier_mask: if the
+         * vector was unmasked meanwhile, whoever clears the pending flag
+         * first delivers the interrupt.  */
+        smp_mb();
+        if (atomic_read(&q->notifier_masked[i]) ||
+            !atomic_xchg(&q->notifier_pending[i], false)) {
+            return;
+        }
+    }
+    virtio_notify_irqfd(VIRTIO_DEVICE(q->n), vq);
+}
+
+static void virtio_net_notify(VirtIONetQueue *q, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
+
+    if (q->ctx) {
+        virtio_net_notify_irqfd(q, vq);
+    } else {
         virtio_notify(vdev, vq);
     }
 }
 
+/* Serialize with the IOThread that runs @q, if any.  The returned
+ * context must be passed to virtio_net_queue_release.  */
+static AioContext *virtio_net_queue_acquire(VirtIONetQueue *q)
+{
+    AioContext *ctx = q->ctx;
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    return ctx;
+}
+
+static void virtio_net_queue_release(AioContext *ctx)
+{
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
+/* Serialize with the IOThreads of all queue pairs.  */
+static void virtio_net_acquire_queues(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->iothread_queues; i++) {
+        virtio_net_queue_acquire(&n->vqs[i]);
+    }
+}
+
+static void virtio_net_release_queues(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->iothread_queues; i++) {
+        virtio_net_queue_release(n->vqs[i].ctx);
+    }
+}
+
+static void virtio_net_drop_tx_queue_data(VirtIONetQueue *q)
+{
+    unsigned int dropped = virtqueue_drop_all(q->tx_vq);
+    if (dropped) {
+        virtio_net_notify(q, q->tx_vq);
+    }
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -260,6 +351,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
+        AioContext *ctx;
         bool queue_started;
         q = &n->vqs[i];
 
@@ -271,11 +363,13 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
         queue_started =
             virtio_net_started(n, queue_status) && !n->vhost_started;
 
+        ctx = virtio_net_queue_acquire(q);
         if (queue_started) {
             qemu_flush_queued_packets(ncs);
         }
 
         if (!q->tx_waiting) {
+            virtio_net_queue_release(ctx);
             continue;
         }
 
@@ -299,9 +393,10 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
                  * and disabled notification */
                 q->tx_waiting = 0;
                 virtio_queue_set_notification(q->tx_vq, 1);
-                virtio_net_drop_tx_queue_data(vdev, q->tx_vq);
+                virtio_net_drop_tx_queue_data(q);
             }
         }
+        virtio_net_queue_release(ctx);
     }
 }
 
@@ -424,6 +519,29 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
     return info;
 }
 
+static void virtio_net_disable_rss(VirtIONet *n)
+{
+    n->rss_data.enabled = false;
+    n->rss_data.redirect = false;
+    n->rss_data.populate_hash = false;
+    g_free(n->rss_data.toeplitz);
+    n->rss_data.toeplitz = NULL;
+}
+
+/* The lookup table is only needed while some hash type is enabled.  */
+static void virtio_net_commit_rss_key(VirtIONet *n)
+{
+    if (!n->rss_data.hash_types) {
+        g_free(n->rss_data.toeplitz);
+        n->rss_data.toeplitz = NULL;
+        return;
+    }
+    if (!n->rss_data.toeplitz) {
+        n->rss_data.toeplitz = g_new(NetToeplitzTable, 1);
+    }
+    net_toeplitz_table_init(n->rss_data.toeplitz, n->rss_data.key);
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -452,6 +570,8 @@ static void virtio_net_reset(VirtIODevice *vdev)
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
 
+    virtio_net_disable_rss(n);
+
     /* Flush any async TX */
     for (i = 0;  i < n->max_queues; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
@@ -489,28 +609,34 @@ static int peer_has_ufo(VirtIONet *n)
 }
 
 static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs,
-                                       int version_1)
+                                       int version_1, int hash_report)
 {
     int i;
     NetClientState *nc;
+    size_t hdr_len;
 
     n->mergeable_rx_bufs = mergeable_rx_bufs;
 
     if (version_1) {
-        n->guest_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+        n->guest_hdr_len = hash_report ?
+            sizeof(struct virtio_net_hdr_v1_hash) :
+            sizeof(struct virtio_net_hdr_mrg_rxbuf);
     } else {
         n->guest_hdr_len = n->mergeable_rx_bufs ?
             sizeof(struct virtio_net_hdr_mrg_rxbuf) :
             sizeof(struct virtio_net_hdr);
     }
 
+    /* The hash is filled in by us, the peer never supplies it */
+    hdr_len = MIN(n->guest_hdr_len, sizeof(struct virtio_net_hdr_mrg_rxbuf));
+
     for (i = 0; i < n->max_queues; i++) {
         nc = qemu_get_subqueue(n->nic, i);
 
         if (peer_has_vnet_hdr(n) &&
-            qemu_has_vnet_hdr_len(nc->peer, n->guest_hdr_len)) {
-            qemu_set_vnet_hdr_len(nc->peer, n->guest_hdr_len);
-            n->host_hdr_len = n->guest_hdr_len;
+            qemu_has_vnet_hdr_len(nc->peer, hdr_len)) {
+            qemu_set_vnet_hdr_len(nc->peer, hdr_len);
+            n->host_hdr_len = hdr_len;
         }
     }
 }
@@ -625,9 +751,18 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_UFO);
     }
 
+    if (!virtio_has_feature(features, VIRTIO_NET_F_CTRL_VQ)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+        virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
+    }
+
     if (!get_vhost_net(nc->peer)) {
         return features;
     }
+
+    /* Steering and hash reporting are done in virtio_net_receive */
+    virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
     features = vhost_net_get_features(get_vhost_net(nc->peer), features);
     vdev->backend_features = features;
 
@@ -699,7 +834,9 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
                                virtio_has_feature(features,
                                                   VIRTIO_NET_F_MRG_RXBUF),
                                virtio_has_feature(features,
-                                                  VIRTIO_F_VERSION_1));
+                                                  VIRTIO_F_VERSION_1),
+                               virtio_has_feature(features,
+                                                  VIRTIO_NET_F_HASH_REPORT));
 
     if (n->has_vnet_hdr) {
         n->curr_guest_offloads =
@@ -937,6 +1074,118 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+/*
+ * Parse a VIRTIO_NET_CTRL_MQ_RSS_CONFIG (@do_rss) or
+ * VIRTIO_NET_CTRL_MQ_HASH_CONFIG command.  The latter has the layout of
+ * the former with a single indirection table entry.  Returns the number
+ * of queue pairs to use, or 0 if the command is invalid.
+ */
+static uint16_t virtio_net_handle_rss(VirtIONet *n, struct iovec *iov,
+                                      unsigned int iov_cnt, bool do_rss)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtioNetRssData *rss = &n->rss_data;
+    struct virtio_net_rss_config cfg;
+    uint16_t table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    struct {
+        uint16_t max_tx_vq;
+        uint8_t hash_key_length;
+    } QEMU_PACKED temp;
+    uint16_t queues, table_len, default_queue, i;
+    uint32_t hash_types;
+    size_t s, offset = 0, size_get;
+
+    if (!virtio_vdev_has_feature(vdev, do_rss ? VIRTIO_NET_F_RSS :
+                                 VIRTIO_NET_F_HASH_REPORT)) {
+        return 0;
+    }
+
+    size_get = offsetof(struct virtio_net_rss_config, indirection_table);
+    s = iov_to_buf(iov, iov_cnt, offset, &cfg, size_get);
+    if (s != size_get) {
+        return 0;
+    }
+    offset += size_get;
+
+    hash_types = virtio_ldl_p(vdev, &cfg.hash_types);
+    if (hash_types & ~VIRTIO_NET_RSS_SUPPORTED_HASHES) {
+        return 0;
+    }
+
+    if (do_rss) {
+        table_len = virtio_lduw_p(vdev, &cfg.indirection_table_mask) + 1;
+        if (table_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+            !is_power_of_2(table_len)) {
+            return 0;
+        }
+        default_queue = virtio_lduw_p(vdev, &cfg.unclassified_queue);
+    } else {
+        table_len = 1;
+        default_queue = 0;
+    }
+
+    size_get = sizeof(uint16_t) * table_len;
+    s = iov_to_buf(iov, iov_cnt, offset, table, size_get);
+    if (s != size_get) {
+        return 0;
+    }
+    offset += size_get;
+    for (i = 0; i < table_len; i++) {
+        table[i] = do_rss ? virtio_lduw_p(vdev, &table[i]) : 0;
+    }
+
+    size_get = sizeof(temp);
+    s = iov_to_buf(iov, iov_cnt, offset, &temp, size_get);
+    if (s != size_get) {
+        return 0;
+    }
+    offset += size_get;
+
+    queues = do_rss ? virtio_lduw_p(vdev, &temp.max_tx_vq) : n->curr_queues;
+    if (queues == 0 || queues > n->max_queues ||
+        (queues > 1 && !n->multiqueue)) {
+        return 0;
+    }
+    if (default_queue >= queues) {
+        return 0;
+    }
+    for (i = 0; i < table_len; i++) {
+        if (table[i] >= queues) {
+            return 0;
+        }
+    }
+
+    if (temp.hash_key_length > VIRTIO_NET_RSS_MAX_KEY_SIZE ||
+        (hash_types && !temp.hash_key_length)) {
+        return 0;
+    }
+    memset(key, 0, sizeof(key));
+    size_get = temp.hash_key_length;
+    s = iov_to_buf(iov, iov_cnt, offset, key, size_get);
+    if (s != size_get) {
+        return 0;
+    }
+
+    if (!do_rss && !hash_types) {
+        virtio_net_disable_rss(n);
+        return queues;
+    }
+
+    rss->enabled = true;
+    rss->redirect = do_rss;
+    rss->populate_hash = hash_types &&
+        virtio_vdev_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT);
+    rss->hash_types = hash_types;
+    rss->indirections_len = table_len;
+    memcpy(rss->indirections_table, table, sizeof(uint16_t) * table_len);
+    rss->default_queue = default_queue;
+    memcpy(rss->key, key, sizeof(key));
+    virtio_net_commit_rss_key(n);
+
+    return queues;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
@@ -945,21 +1194,30 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     size_t s;
     uint16_t queues;
 
-    s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
-    if (s != sizeof(mq)) {
-        return VIRTIO_NET_ERR;
-    }
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG ||
+        cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG) {
+        queues = virtio_net_handle_rss(n, iov, iov_cnt,
+                                       cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG);
+        if (!queues) {
+            return VIRTIO_NET_ERR;
+        }
+    } else if (cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
+        if (s != sizeof(mq)) {
+            return VIRTIO_NET_ERR;
+        }
 
-    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
-        return VIRTIO_NET_ERR;
-    }
+        queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
 
-    queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
+        if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+            queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
+            queues > n->max_queues ||
+            !n->multiqueue) {
+            return VIRTIO_NET_ERR;
+        }
 
-    if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
-        queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
-        queues > n->max_queues ||
-        !n->multiqueue) {
+        virtio_net_disable_rss(n);
+    } else {
         return VIRTIO_NET_ERR;
     }
 
@@ -1001,18 +1259,27 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         iov_discard_front(&iov, &iov_cnt, sizeof(ctrl));
         if (s != sizeof(ctrl)) {
             status = VIRTIO_NET_ERR;
-        } else if (ctrl.class == VIRTIO_NET_CTRL_RX) {
-            status = virtio_net_handle_rx_mode(n, ctrl.cmd, iov, iov_cnt);
-        } else if (ctrl.class == VIRTIO_NET_CTRL_MAC) {
-            status = virtio_net_handle_mac(n, ctrl.cmd, iov, iov_cnt);
-        } else if (ctrl.class == VIRTIO_NET_CTRL_VLAN) {
-            status = virtio_net_handle_vlan_table(n, ctrl.cmd, iov, iov_cnt);
         } else if (ctrl.class == VIRTIO_NET_CTRL_ANNOUNCE) {
             status = virtio_net_handle_announce(n, ctrl.cmd, iov, iov_cnt);
         } else if (ctrl.class == VIRTIO_NET_CTRL_MQ) {
+            /* Restarts the queue pairs, which takes their AioContexts */
             status = virtio_net_handle_mq(n, ctrl.cmd, iov, iov_cnt);
-        } else if (ctrl.class == VIRTIO_NET_CTRL_GUEST_OFFLOADS) {
-            status = virtio_net_handle_offloads(n, ctrl.cmd, iov, iov_cnt);
+        } else {
+            /* The receive path reads the filters and offloads that
+             * these commands change.  */
+            virtio_net_acquire_queues(n);
+            if (ctrl.class == VIRTIO_NET_CTRL_RX) {
+                status = virtio_net_handle_rx_mode(n, ctrl.cmd, iov, iov_cnt);
+            } else if (ctrl.class == VIRTIO_NET_CTRL_MAC) {
+                status = virtio_net_handle_mac(n, ctrl.cmd, iov, iov_cnt);
+            } else if (ctrl.class == VIRTIO_NET_CTRL_VLAN) {
+                status = virtio_net_handle_vlan_table(n, ctrl.cmd,
+                                                      iov, iov_cnt);
+            } else if (ctrl.class == VIRTIO_NET_CTRL_GUEST_OFFLOADS) {
+                status = virtio_net_handle_offloads(n, ctrl.cmd,
+                                                    iov, iov_cnt);
+            }
+            virtio_net_release_queues(n);
         }
 
         s = iov_from_buf(elem->in_sg, elem->in_num, 0, &status, sizeof(status));
@@ -1031,8 +1298,17 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    int i;
 
-    qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+    if (!n->rss_data.redirect) {
+        qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+        return;
+    }
+
+    /* Packets for this queue may be waiting on any of them */
+    for (i = 0; i < n->curr_queues; i++) {
+        qemu_flush_queued_packets(qemu_get_subqueue(n->nic, i));
+    }
 }
 
 static int virtio_net_can_receive(NetClientState *nc)
@@ -1137,6 +1413,20 @@ static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
     }
 }
 
+static void receive_hash(VirtIONet *n, const struct iovec *iov, int iov_cnt,
+                         uint32_t hash_value, uint16_t hash_report)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct virtio_net_hdr_v1_hash hdr;
+    size_t offset = offsetof(struct virtio_net_hdr_v1_hash, hash_value);
+
+    virtio_stl_p(vdev, &hdr.hash_value, hash_value);
+    virtio_stw_p(vdev, &hdr.hash_report, hash_report);
+    hdr.padding = 0;
+    iov_from_buf(iov, iov_cnt, offset, (uint8_t *)&hdr + offset,
+                 sizeof(hdr) - offset);
+}
+
 static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
 {
     static const uint8_t bcast[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
@@ -1188,8 +1478,92 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size)
+static int virtio_net_get_hash_type(bool isip4, bool isip6, bool isudp,
+                                    bool istcp, uint32_t types)
+{
+    if (isip4) {
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) {
+            return NetPktRssIpV4Tcp;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)) {
+            return NetPktRssIpV4Udp;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv4) {
+            return NetPktRssIpV4;
+        }
+    } else if (isip6) {
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCP_EX)) {
+            return NetPktRssIpV6TcpEx;
+        }
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6)) {
+            return NetPktRssIpV6Tcp;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)) {
+            return NetPktRssIpV6UdpEx;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6)) {
+            return NetPktRssIpV6Udp;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IP_EX) {
+            return NetPktRssIpV6Ex;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv6) {
+            return NetPktRssIpV6;
+        }
+    }
+    return -1;
+}
+
+/* Returns the queue @buf is steered to, or -1 to leave it on @nc */
+static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
+                                  size_t size, uint32_t *hash_value,
+                                  uint16_t *hash_report)
+{
+    static const uint16_t reports[] = {
+        [NetPktRssIpV4] = VIRTIO_NET_HASH_REPORT_IPv4,
+        [NetPktRssIpV4Tcp] = VIRTIO_NET_HASH_REPORT_TCPv4,
+        [NetPktRssIpV6TcpEx] = VIRTIO_NET_HASH_REPORT_TCPv6_EX,
+        [NetPktRssIpV6] = VIRTIO_NET_HASH_REPORT_IPv6,
+        [NetPktRssIpV6Ex] = VIRTIO_NET_HASH_REPORT_IPv6_EX,
+        [NetPktRssIpV6Tcp] = VIRTIO_NET_HASH_REPORT_TCPv6,
+        [NetPktRssIpV4Udp] = VIRTIO_NET_HASH_REPORT_UDPv4,
+        [NetPktRssIpV6Udp] = VIRTIO_NET_HASH_REPORT_UDPv6,
+        [NetPktRssIpV6UdpEx] = VIRTIO_NET_HASH_REPORT_UDPv6_EX,
+    };
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtioNetRssData *rss = &n->rss_data;
+    bool isip4, isip6, isudp, istcp;
+    int type, index;
+    uint32_t hash;
+
+    net_rx_pkt_set_protocols(n->rx_pkt, buf + n->host_hdr_len,
+                             size - n->host_hdr_len);
+    net_rx_pkt_get_protocols(n->rx_pkt, &isip4, &isip6, &isudp, &istcp);
+    type = virtio_net_get_hash_type(isip4, isip6, isudp, istcp,
+                                    rss->hash_types);
+    if (type < 0) {
+        index = rss->default_queue;
+    } else {
+        hash = net_rx_pkt_calc_rss_hash_table(n->rx_pkt, type,
+                                              rss->toeplitz);
+        if (rss->populate_hash) {
+            *hash_value = hash;
+            *hash_report = reports[type];
+        }
+        index = rss->indirections_table[hash & (rss->indirections_len - 1)];
+    }
+
+    if (!rss->redirect || index == nc->queue_index) {
+        return -1;
+    }
+    return index;
+}
+
+/* Sets *@pushed if the packet was added to the used ring, in which case
+ * the caller must notify the guest.  */
+static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
+                                     size_t size, uint32_t hash_value,
+                                     uint16_t hash_report, bool *pushed)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1238,7 +1612,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             virtio_error(vdev,
                          "virtio-net receive queue contains no in buffers");
             virtqueue_detach_element(q->rx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_free_element(q->rx_vq, elem);
             return -1;
         }
 
@@ -1253,6 +1627,9 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             }
 
             receive_header(n, sg, elem->in_num, buf, size);
+            if (n->guest_hdr_len == sizeof(struct virtio_net_hdr_v1_hash)) {
+                receive_hash(n, sg, elem->in_num, hash_value, hash_report);
+            }
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1270,13 +1647,13 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
          * Otherwise, drop it. */
         if (!n->mergeable_rx_bufs && offset < size) {
             virtqueue_unpop(q->rx_vq, elem, total);
-            g_free(elem);
+            virtqueue_free_element(q->rx_vq, elem);
             return size;
         }
 
         /* signal other side */
         virtqueue_fill(q->rx_vq, elem, total, i++);
-        g_free(elem);
+        virtqueue_free_element(q->rx_vq, elem);
     }
 
     if (mhdr_cnt) {
@@ -1287,46 +1664,219 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    *pushed = true;
 
     return size;
 }
 
+/* Like virtio_net_do_receive, but apply RSS first.  A packet steered to
+ * another queue notifies that queue here.  */
+static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
+                                      size_t size, bool *pushed)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    uint32_t hash_value = 0;
+    uint16_t hash_report = VIRTIO_NET_HASH_REPORT_NONE;
+    NetClientState *nc2;
+    VirtIONetQueue *q2;
+    bool pushed2 = false;
+    ssize_t r;
+    int index;
+
+    if (!n->rss_data.enabled || !virtio_net_can_receive(nc)) {
+        return virtio_net_do_receive(nc, buf, size, hash_value, hash_report,
+                                     pushed);
+    }
+
+    index = virtio_net_process_rss(nc, buf, size, &hash_value, &hash_report);
+    if (index < 0) {
+        return virtio_net_do_receive(nc, buf, size, hash_value, hash_report,
+                                     pushed);
+    }
+
+    nc2 = qemu_get_subqueue(n->nic, index);
+    q2 = virtio_net_get_subqueue(nc2);
+    r = virtio_net_do_receive(nc2, buf, size, hash_value, hash_report,
+                              &pushed2);
+    if (pushed2) {
+        virtio_net_notify(q2, q2->rx_vq);
+    }
+    return r;
+}
+
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    AioContext *ctx = virtio_net_queue_acquire(q);
+    bool pushed = false;
     ssize_t r;
 
     rcu_read_lock();
-    r = virtio_net_receive_rcu(nc, buf, size);
+    r = virtio_net_receive_rcu(nc, buf, size, &pushed);
+    if (pushed) {
+        virtio_net_notify(q, q->rx_vq);
+    }
     rcu_read_unlock();
+    virtio_net_queue_release(ctx);
     return r;
 }
 
+/* Receive @packets into buffers popped as one batch, and push them with a
+ * single used index update.  Only valid if every packet fits one buffer
+ * and stays on @nc, i.e. without mergeable buffers and RSS.  Returns the
+ * number of packets consumed; the caller handles the rest one by one.  */
+static int virtio_net_receive_batch_simple(NetClientState *nc,
+                                           const struct iovec *packets,
+                                           int count, bool *pushed)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtQueueElement *elems[VIRTQUEUE_BATCH_SIZE];
+    unsigned int lens[VIRTQUEUE_BATCH_SIZE];
+    unsigned int num, used = 0, bad = 0, j;
+    int i;
+
+    num = virtqueue_pop_batch(q->rx_vq, sizeof(VirtQueueElement),
+                              (void **)elems,
+                              MIN(count, VIRTQUEUE_BATCH_SIZE));
+    for (i = 0; i < count && used < num; i++) {
+        const uint8_t *buf = packets[i].iov_base;
+        size_t size = packets[i].iov_len, len;
+        VirtQueueElement *elem = elems[used];
+
+        if (!receive_filter(n, buf, size)) {
+            continue;
+        }
+
+        if (elem->in_num < 1) {
+            virtio_error(vdev,
+                         "virtio-net receive queue contains no in buffers");
+            virtqueue_detach_element(q->rx_vq, elem, 0);
+            virtqueue_free_element(q->rx_vq, elem);
+            bad = 1;
+            i++;
+            break;
+        }
+
+        receive_header(n, elem->in_sg, elem->in_num, buf, size);
+        if (n->guest_hdr_len == sizeof(struct virtio_net_hdr_v1_hash)) {
+            receive_hash(n, elem->in_sg, elem->in_num, 0,
+                         VIRTIO_NET_HASH_REPORT_NONE);
+        }
+        len = iov_from_buf(elem->in_sg, elem->in_num, n->guest_hdr_len,
+                           buf + n->host_hdr_len, size - n->host_hdr_len);
+        if (len < size - n->host_hdr_len) {
+            /* Does not fit: drop the packet, reuse the buffer */
+            continue;
+        }
+        lens[used++] = n->guest_hdr_len + len;
+    }
+
+    if (used) {
+        virtqueue_push_batch(q->rx_vq, elems, lens, used);
+        *pushed = true;
+    }
+    for (j = 0; j < used; j++) {
+        virtqueue_free_element(q->rx_vq, elems[j]);
+    }
+
+    /* Give back the buffers that were not filled, newest first */
+    while (num-- > used + bad) {
+        virtqueue_unpop(q->rx_vq, elems[num], 0);
+        virtqueue_free_element(q->rx_vq, elems[num]);
+    }
+    return i;
+}
+
+/* Like virtio_net_receive, but notify the guest once for all packets.  */
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const struct iovec *packets, int count)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    AioContext *ctx = virtio_net_queue_acquire(q);
+    bool pushed = false;
+    int i = 0;
+
+    rcu_read_lock();
+    if (!n->mergeable_rx_bufs && !n->rss_data.enabled &&
+        virtio_net_can_receive(nc)) {
+        i = virtio_net_receive_batch_simple(nc, packets, count, &pushed);
+    }
+    for (; i < count; i++) {
+        if (virtio_net_receive_rcu(nc, packets[i].iov_base,
+                                   packets[i].iov_len, &pushed) == 0) {
+            break;
+        }
+    }
+    if (pushed) {
+        virtio_net_notify(q, q->rx_vq);
+    }
+    rcu_read_unlock();
+    virtio_net_queue_release(ctx);
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
-    VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    AioContext *ctx = virtio_net_queue_acquire(q);
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(q, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_free_element(q->tx_vq, q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
     virtio_net_flush_tx(q);
+    virtio_net_queue_release(ctx);
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+
+/* Return the packets in @elems to the guest and notify it once.  */
+static void virtio_net_tx_complete_batch(VirtIONetQueue *q,
+                                         VirtQueueElement **elems,
+                                         unsigned int *num)
+{
+    unsigned int i;
+
+    if (!*num) {
+        return;
+    }
+
+    virtqueue_push_batch(q->tx_vq, elems, NULL, *num);
+    virtio_net_notify(q, q->tx_vq);
+    for (i = 0; i < *num; i++) {
+        virtqueue_free_element(q->tx_vq, elems[i]);
+    }
+    *num = 0;
+}
+
+/* Give back the popped but unprocessed packets elems[first..last-1],
+ * newest first, so that they are popped again by the next flush.  */
+static void virtio_net_tx_unpop(VirtIONetQueue *q, VirtQueueElement **elems,
+                                unsigned int first, unsigned int last)
+{
+    while (last-- > first) {
+        virtqueue_unpop(q->tx_vq, elems[last], 0);
+        virtqueue_free_element(q->tx_vq, elems[last]);
+    }
+}
+
+static int32_t virtio_net_do_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtQueueElement *elem;
+    VirtQueueElement *popped[VIRTQUEUE_BATCH_SIZE];
+    VirtQueueElement *sent[VIRTQUEUE_BATCH_SIZE];
+    unsigned int cur = 0, num_popped = 0, num_sent = 0;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -1344,17 +1894,28 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
         struct virtio_net_hdr_mrg_rxbuf mhdr;
 
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
+        if (cur == num_popped) {
+            virtio_net_tx_complete_batch(q, sent, &num_sent);
+            num_popped = virtqueue_pop_batch(q->tx_vq,
+                                             sizeof(VirtQueueElement),
+                                             (void **)popped,
+                                             MIN(VIRTQUEUE_BATCH_SIZE,
+                                                 n->tx_burst - num_packets));
+            cur = 0;
+        }
+        if (cur == num_popped) {
             break;
         }
+        elem = popped[cur++];
 
         out_num = elem->out_num;
         out_sg = elem->out_sg;
         if (out_num < 1) {
             virtio_error(vdev, "virtio-net header not in first element");
             virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_free_element(q->tx_vq, elem);
+            virtio_net_tx_unpop(q, popped, cur, num_popped);
+            virtio_net_tx_complete_batch(q, sent, &num_sent);
             return -EINVAL;
         }
 
@@ -1363,7 +1924,9 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
                 n->guest_hdr_len) {
                 virtio_error(vdev, "virtio-net header incorrect");
                 virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
+                virtqueue_free_element(q->tx_vq, elem);
+                virtio_net_tx_unpop(q, popped, cur, num_popped);
+                virtio_net_tx_complete_batch(q, sent, &num_sent);
                 return -EINVAL;
             }
             if (n->needs_vnet_hdr_swap) {
@@ -1402,28 +1965,42 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
+            virtio_net_tx_unpop(q, popped, cur, num_popped);
+            virtio_net_tx_complete_batch(q, sent, &num_sent);
             return -EBUSY;
         }
 
 drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+        sent[num_sent++] = elem;
 
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+    virtio_net_tx_complete_batch(q, sent, &num_sent);
     return num_packets;
 }
 
+/* Let the peer send the whole burst at once if it can.  */
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+{
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc = qemu_get_subqueue(q->n->nic, queue_index);
+    int32_t ret;
+
+    qemu_net_plug(nc);
+    ret = virtio_net_do_flush_tx(q);
+    qemu_net_unplug(nc);
+    return ret;
+}
+
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
     if (unlikely((n->status & VIRTIO_NET_S_LINK_UP) == 0)) {
-        virtio_net_drop_tx_queue_data(vdev, vq);
+        virtio_net_drop_tx_queue_data(q);
         return;
     }
 
@@ -1454,7 +2031,7 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
     if (unlikely((n->status & VIRTIO_NET_S_LINK_UP) == 0)) {
-        virtio_net_drop_tx_queue_data(vdev, vq);
+        virtio_net_drop_tx_queue_data(q);
         return;
     }
 
@@ -1563,8 +2140,14 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
         n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
     }
 
+    virtqueue_init_element_pool(n->vqs[index].rx_vq, sizeof(VirtQueueElement));
+    virtqueue_init_element_pool(n->vqs[index].tx_vq, sizeof(VirtQueueElement));
+
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
+    if (n->iothreads) {
+        n->vqs[index].iothread = n->iothreads[index % n->net_conf.num_iothreads];
+    }
 }
 
 static void virtio_net_del_queue(VirtIONet *n, int index)
@@ -1633,6 +2216,252 @@ static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
     virtio_net_set_queues(n);
 }
 
+/* IOThread datapath */
+
+static bool virtio_net_handle_rx_aio(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+    AioContext *ctx = virtio_net_queue_acquire(q);
+
+    virtio_net_handle_rx(vdev, vq);
+    virtio_net_queue_release(ctx);
+
+    /* The ring normally stays full of buffers, polling it is useless.  */
+    return false;
+}
+
+static bool virtio_net_handle_tx_aio(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+    AioContext *ctx = virtio_net_queue_acquire(q);
+    bool progress = !q->tx_waiting;
+
+    if (q->tx_timer) {
+        virtio_net_handle_tx_timer(vdev, vq);
+    } else {
+        virtio_net_handle_tx_bh(vdev, vq);
+    }
+    virtio_net_queue_release(ctx);
+    return progress;
+}
+
+static void virtio_net_tx_timer_aio(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    AioContext *ctx = virtio_net_queue_acquire(q);
+
+    virtio_net_tx_timer(q);
+    virtio_net_queue_release(ctx);
+}
+
+static void virtio_net_tx_bh_aio(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    AioContext *ctx = virtio_net_queue_acquire(q);
+
+    virtio_net_tx_bh(q);
+    virtio_net_queue_release(ctx);
+}
+
+/* Recreate the TX timer or bottom half of @q in @ctx, or in the main loop
+ * if @ctx is NULL, keeping a pending flush scheduled.  */
+static void virtio_net_tx_set_aio_context(VirtIONetQueue *q, AioContext *ctx)
+{
+    VirtIONet *n = q->n;
+
+    if (q->tx_timer) {
+        timer_del(q->tx_timer);
+        timer_free(q->tx_timer);
+        if (ctx) {
+            q->tx_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                        virtio_net_tx_timer_aio, q);
+        } else {
+            q->tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                       virtio_net_tx_timer, q);
+        }
+    } else {
+        qemu_bh_delete(q->tx_bh);
+        if (ctx) {
+            q->tx_bh = aio_bh_new(ctx, virtio_net_tx_bh_aio, q);
+        } else {
+            q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        }
+    }
+
+    if (q->tx_waiting && VIRTIO_DEVICE(n)->vm_running) {
+        if (q->tx_timer) {
+            timer_mod(q->tx_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
+        } else {
+            qemu_bh_schedule(q->tx_bh);
+        }
+    }
+}
+
+static void virtio_net_queue_start(VirtIONet *n, VirtIONetQueue *q)
+{
+    NetClientState *nc = qemu_get_subqueue(n->nic, q - n->vqs);
+    AioContext *ctx = iothread_get_aio_context(q->iothread);
+
+    /* Take the host notifiers away from the main loop; they were already
+     * kicked by virtio_device_start_ioeventfd, so the IOThread processes
+     * anything that is in the rings at this point.  */
+    event_notifier_set_handler(virtio_queue_get_host_notifier(q->rx_vq), NULL);
+    event_notifier_set_handler(virtio_queue_get_host_notifier(q->tx_vq), NULL);
+
+    aio_context_acquire(ctx);
+    q->ctx = ctx;
+    qemu_net_set_aio_context(nc->peer, ctx);
+    virtio_net_tx_set_aio_context(q, ctx);
+    virtio_queue_aio_set_host_notifier_handler(q->rx_vq, ctx,
+                                               virtio_net_handle_rx_aio);
+    virtio_queue_aio_set_host_notifier_handler(q->tx_vq, ctx,
+                                               virtio_net_handle_tx_aio);
+    aio_context_release(ctx);
+}
+
+/* Context: BH in IOThread */
+static void virtio_net_queue_stop_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx, NULL);
+    virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx, NULL);
+}
+
+static void virtio_net_queue_stop(VirtIONet *n, VirtIONetQueue *q)
+{
+    NetClientState *nc = qemu_get_subqueue(n->nic, q - n->vqs);
+    AioContext *ctx = q->ctx;
+
+    aio_context_acquire(ctx);
+    aio_wait_bh_oneshot(ctx, virtio_net_queue_stop_bh, q);
+    qemu_net_set_aio_context(nc->peer, NULL);
+    virtio_net_tx_set_aio_context(q, NULL);
+    q->ctx = NULL;
+    aio_context_release(ctx);
+}
+
+static int virtio_net_start_ioeventfd(VirtIODevice *vdev)
+{
+    VirtioDeviceClass *vdc =
+        VIRTIO_DEVICE_CLASS(object_class_by_name(TYPE_VIRTIO_DEVICE));
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i, r;
+
+    r = vdc->start_ioeventfd(vdev);
+    if (r < 0 || !n->iothreads) {
+        return r;
+    }
+
+    /* Set first: assigning the notifiers may already mask them */
+    n->iothread_queues = queues;
+    r = k->set_guest_notifiers(qbus->parent, queues * 2, true);
+    if (r != 0) {
+        error_report("virtio-net: Failed to set guest notifiers (%d), "
+                     "running queues in the main loop", r);
+        n->iothread_queues = 0;
+        return 0;
+    }
+
+    for (i = 0; i < queues; i++) {
+        virtio_net_queue_start(n, &n->vqs[i]);
+    }
+    return 0;
+}
+
+static void virtio_net_stop_ioeventfd(VirtIODevice *vdev)
+{
+    VirtioDeviceClass *vdc =
+        VIRTIO_DEVICE_CLASS(object_class_by_name(TYPE_VIRTIO_DEVICE));
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
+
+    for (i = 0; i < n->iothread_queues; i++) {
+        virtio_net_queue_stop(n, &n->vqs[i]);
+    }
+
+    vdc->stop_ioeventfd(vdev);
+
+    if (n->iothread_queues) {
+        k->set_guest_notifiers(qbus->parent, n->iothread_queues * 2, false);
+        for (i = 0; i < n->iothread_queues; i++) {
+            memset(n->vqs[i].notifier_masked, 0,
+                   sizeof(n->vqs[i].notifier_masked));
+            memset(n->vqs[i].notifier_pending, 0,
+                   sizeof(n->vqs[i].notifier_pending));
+        }
+        n->iothread_queues = 0;
+    }
+}
+
+static void virtio_net_put_iothreads(VirtIONet *n)
+{
+    uint32_t i;
+
+    if (!n->iothreads) {
+        return;
+    }
+    for (i = 0; i < n->net_conf.num_iothreads; i++) {
+        if (n->iothreads[i]) {
+            object_unref(OBJECT(n->iothreads[i]));
+        }
+    }
+    g_free(n->iothreads);
+    n->iothreads = NULL;
+}
+
+static bool virtio_net_get_iothreads(VirtIONet *n, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    uint32_t i;
+
+    if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+        error_setg(errp,
+                   "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return false;
+    }
+    if (!virtio_device_ioeventfd_enabled(vdev)) {
+        error_setg(errp, "ioeventfd is required for iothread");
+        return false;
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (peer && !peer->info->set_aio_context) {
+            error_setg(errp, "netdev '%s' does not support iothreads",
+                       peer->name);
+            return false;
+        }
+    }
+
+    n->iothreads = g_new0(IOThread *, n->net_conf.num_iothreads);
+    for (i = 0; i < n->net_conf.num_iothreads; i++) {
+        IOThread *iothread = iothread_by_id(n->net_conf.iothreads[i]);
+
+        if (!iothread) {
+            error_setg(errp, "iothread '%s' not found",
+                       n->net_conf.iothreads[i] ?: "");
+            virtio_net_put_iothreads(n);
+            return false;
+        }
+        object_ref(OBJECT(iothread));
+        n->iothreads[i] = iothread;
+    }
+    return true;
+}
+
 static int virtio_net_post_load_device(void *opaque, int version_id)
 {
     VirtIONet *n = opaque;
@@ -1641,7 +2470,9 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
 
     virtio_net_set_mrg_rx_bufs(n, n->mergeable_rx_bufs,
                                virtio_vdev_has_feature(vdev,
-                                                       VIRTIO_F_VERSION_1));
+                                                       VIRTIO_F_VERSION_1),
+                               virtio_vdev_has_feature(vdev,
+                                                  VIRTIO_NET_F_HASH_REPORT));
 
     /* MAC_TABLE_ENTRIES may be different from the saved image */
     if (n->mac_table.in_use > MAC_TABLE_ENTRIES) {
@@ -1840,6 +2671,58 @@ static const VMStateDescription vmstate_virtio_net_has_vnet = {
     },
 };
 
+static bool virtio_net_rss_needed(void *opaque)
+{
+    VirtIONet *n = opaque;
+
+    return n->rss_data.enabled;
+}
+
+static int virtio_net_rss_post_load(void *opaque, int version_id)
+{
+    VirtIONet *n = opaque;
+    VirtioNetRssData *rss = &n->rss_data;
+    int i;
+
+    if (rss->indirections_len == 0 ||
+        rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        !is_power_of_2(rss->indirections_len) ||
+        rss->default_queue >= n->max_queues) {
+        error_report("virtio-net: invalid RSS state in saved image");
+        return -EINVAL;
+    }
+    for (i = 0; i < rss->indirections_len; i++) {
+        if (rss->indirections_table[i] >= n->max_queues) {
+            error_report("virtio-net: invalid RSS state in saved image");
+            return -EINVAL;
+        }
+    }
+
+    virtio_net_commit_rss_key(n);
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_net_rss = {
+    .name = "virtio-net-device/rss",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = virtio_net_rss_needed,
+    .post_load = virtio_net_rss_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(rss_data.enabled, VirtIONet),
+        VMSTATE_BOOL(rss_data.redirect, VirtIONet),
+        VMSTATE_BOOL(rss_data.populate_hash, VirtIONet),
+        VMSTATE_UINT32(rss_data.hash_types, VirtIONet),
+        VMSTATE_UINT16(rss_data.indirections_len, VirtIONet),
+        VMSTATE_UINT16(rss_data.default_queue, VirtIONet),
+        VMSTATE_UINT8_ARRAY(rss_data.key, VirtIONet,
+                            VIRTIO_NET_RSS_MAX_KEY_SIZE),
+        VMSTATE_UINT16_ARRAY(rss_data.indirections_table, VirtIONet,
+                             VIRTIO_NET_RSS_MAX_TABLE_LEN),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static const VMStateDescription vmstate_virtio_net_device = {
     .name = "virtio-net-device",
     .version_id = VIRTIO_NET_VM_VERSION,
@@ -1890,6 +2773,10 @@ static const VMStateDescription vmstate_virtio_net_device = {
                             has_ctrl_guest_offloads),
         VMSTATE_END_OF_LIST()
    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_virtio_net_rss,
+        NULL
+    }
 };
 
 static NetClientInfo net_virtio_info = {
@@ -1897,6 +2784,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -1904,17 +2792,40 @@ static NetClientInfo net_virtio_info = {
 static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
-    NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
-    assert(n->vhost_started);
+    NetClientState *nc;
+
+    if (!n->vhost_started) {
+        /* Only the queue pairs of IOThreads have guest notifiers */
+        if (idx >= n->iothread_queues * 2) {
+            return false;
+        }
+        return atomic_xchg(&n->vqs[vq2q(idx)].notifier_pending[idx & 1],
+                           false);
+    }
+
+    nc = qemu_get_subqueue(n->nic, vq2q(idx));
     return vhost_net_virtqueue_pending(get_vhost_net(nc->peer), idx);
 }
 
+/* Without vhost, the IOThreads set the guest notifiers themselves and
+ * check the mask in virtio_net_notify_irqfd.  */
 static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
                                            bool mask)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
-    NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
-    assert(n->vhost_started);
+    NetClientState *nc;
+
+    if (!n->vhost_started) {
+        if (idx < n->iothread_queues * 2) {
+            atomic_set(&n->vqs[vq2q(idx)].notifier_masked[idx & 1], mask);
+            /* Order against the caller's pending check after unmasking,
+             * pairs with smp_mb() in virtio_net_notify_irqfd.  */
+            smp_mb();
+        }
+        return;
+    }
+
+    nc = qemu_get_subqueue(n->nic, vq2q(idx));
     vhost_net_virtqueue_mask(get_vhost_net(nc->peer),
                              vdev, idx, mask);
 }
@@ -1976,6 +2887,14 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         n->host_features |= (1ULL << VIRTIO_NET_F_SPEED_DUPLEX);
     }
 
+    if ((n->host_features & ((1ULL << VIRTIO_NET_F_RSS) |
+                             (1ULL << VIRTIO_NET_F_HASH_REPORT))) &&
+        n->net_conf.num_iothreads) {
+        error_setg(errp, "'rss' and 'hash' are not supported with "
+                   "'iothreads'");
+        return;
+    }
+
     virtio_net_set_config_size(n, n->host_features);
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
@@ -2029,6 +2948,12 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     n->net_conf.tx_queue_size = MIN(virtio_net_max_tx_queue_size(n),
                                     n->net_conf.tx_queue_size);
 
+    if (n->net_conf.num_iothreads && !virtio_net_get_iothreads(n, errp)) {
+        g_free(n->vqs);
+        virtio_cleanup(vdev);
+        return;
+    }
+
     for (i = 0; i < n->max_queues; i++) {
         virtio_net_add_queue(n, i);
     }
@@ -2065,7 +2990,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
-    virtio_net_set_mrg_rx_bufs(n, 0, 0);
+    virtio_net_set_mrg_rx_bufs(n, 0, 0, 0);
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
@@ -2075,6 +3000,8 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     nc = qemu_get_queue(n->nic);
     nc->rxfilter_notify_enabled = 1;
 
+    net_rx_pkt_init(&n->rx_pkt, false);
+
     n->qdev = dev;
 }
 
@@ -2095,6 +3022,9 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     g_free(n->mac_table.macs);
     g_free(n->vlans);
 
+    virtio_net_disable_rss(n);
+    net_rx_pkt_uninit(n->rx_pkt);
+
     max_queues = n->multiqueue ? n->max_queues : 1;
     for (i = 0; i < max_queues; i++) {
         virtio_net_del_queue(n, i);
@@ -2104,6 +3034,7 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     timer_free(n->announce_timer);
     g_free(n->vqs);
     qemu_del_nic(n->nic);
+    virtio_net_put_iothreads(n);
     virtio_cleanup(vdev);
 }
 
@@ -2121,6 +3052,13 @@ static void virtio_net_instance_init(Object *obj)
                                   DEVICE(n), NULL);
 }
 
+static void virtio_net_instance_finalize(Object *obj)
+{
+    VirtIONet *n = VIRTIO_NET(obj);
+
+    g_free(n->net_conf.iothreads);
+}
+
 static int virtio_net_pre_save(void *opaque)
 {
     VirtIONet *n = opaque;
@@ -2184,6 +3122,10 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_BIT64("ctrl_guest_offloads", VirtIONet, host_features,
                     VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
     DEFINE_PROP_BIT64("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("rss", VirtIONet, host_features,
+                    VIRTIO_NET_F_RSS, false),
+    DEFINE_PROP_BIT64("hash", VirtIONet, host_features,
+                    VIRTIO_NET_F_HASH_REPORT, false),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
@@ -2198,6 +3140,8 @@ static Property virtio_net_properties[] = {
                      true),
     DEFINE_PROP_INT32("speed", VirtIONet, net_conf.speed, SPEED_UNKNOWN),
     DEFINE_PROP_STRING("duplex", VirtIONet, net_conf.duplex_str),
+    DEFINE_PROP_ARRAY("iothreads", VirtIONet, net_conf.num_iothreads,
+                      net_conf.iothreads, qdev_prop_string, char *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -2220,6 +3164,8 @@ static void virtio_net_class_init(ObjectClass *klass, void *data)
     vdc->set_status = virtio_net_set_status;
     vdc->guest_notifier_mask = virtio_net_guest_notifier_mask;
     vdc->guest_notifier_pending = virtio_net_guest_notifier_pending;
+    vdc->start_ioeventfd = virtio_net_start_ioeventfd;
+    vdc->stop_ioeventfd = virtio_net_stop_ioeventfd;
     vdc->legacy_features |= (0x1 << VIRTIO_NET_F_GSO);
     vdc->vmsd = &vmstate_virtio_net_device;
 }
@@ -2229,6 +3175,7 @@ static const TypeInfo virtio_net_info = {
     .parent = TYPE_VIRTIO_DEVICE,
     .instance_size = sizeof(VirtIONet),
     .instance_init = virtio_net_instance_init,
+    .instance_finalize = virtio_net_instance_finalize,
     .class_init = virtio_net_class_init,
 };
 
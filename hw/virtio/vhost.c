@@ -953,6 +953,8 @@ static int vhost_virtqueue_start(struct vhost_dev *dev,
         return -errno;
     }
 
+    /* For packed rings this also carries the wrap counters and the used
+     * index, in the layout that vhost uses for VHOST_SET_VRING_BASE.  */
     state.num = virtio_queue_get_last_avail_idx(vdev, idx);
     r = dev->vhost_ops->vhost_set_vring_base(dev, &state);
     if (r) {
@@ -1065,10 +1067,13 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
     if (r < 0) {
         VHOST_OPS_DEBUG("vhost VQ %d ring restore failed: %d", idx, r);
         /* Connection to the backend is broken, so let's sync internal
-         * last avail idx to the device used idx.
+         * last avail idx to the device used idx.  A packed ring has no
+         * used idx in guest memory, and keeps the state it was started
+         * with.
          */
         virtio_queue_restore_last_avail_idx(vdev, idx);
     } else {
+        /* Restores the wrap counters and used idx of packed rings too */
         virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     }
     virtio_queue_invalidate_signalled_used(vdev, idx);
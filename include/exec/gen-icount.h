@@ -7,11 +7,44 @@
 
 static TCGOp *icount_start_insn;
 
+/* Count executions of a first-tier TB.  When the counter reaches
+ * tb_hot_threshold, request an exit so that the main loop can replace
+ * the TB with a CF_HOT translation (see tb_find()).
+ */
+static inline void gen_tb_exec_count(TranslationBlock *tb)
+{
+    TCGv_ptr ptr;
+    TCGv_i32 count;
+    TCGLabel *cold;
+
+    if (!tb_hot_threshold || (tb_cflags(tb) & (CF_HOT | CF_NOCACHE))) {
+        return;
+    }
+
+    /* Relocated to the new TB when loaded from the translation cache */
+    ptr = tcg_const_tb_ptr(&tb->exec_count);
+    count = tcg_temp_new_i32();
+    cold = gen_new_label();
+
+    tcg_gen_ld_i32(count, ptr, 0);
+    tcg_gen_addi_i32(count, count, 1);
+    tcg_gen_st_i32(count, ptr, 0);
+    tcg_gen_brcondi_i32(TCG_COND_NE, count, tb_hot_threshold, cold);
+    tcg_gen_movi_i32(count, -1);
+    tcg_gen_st16_i32(count, cpu_env,
+                     -ENV_OFFSET + offsetof(CPUState, icount_decr.u16.high));
+    gen_set_label(cold);
+
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(ptr);
+}
+
 static inline void gen_tb_start(TranslationBlock *tb)
 {
     TCGv_i32 count, imm;
 
     tcg_ctx->exitreq_label = gen_new_label();
+    gen_tb_exec_count(tb);
     if (tb_cflags(tb) & CF_USE_ICOUNT) {
         count = tcg_temp_local_new_i32();
     } else {
@@ -59,7 +59,7 @@ typedef struct {
     ram_addr_t ram_addr;
     vaddr mem_vaddr;
     unsigned size;
-    bool locked;
+    struct page_collection *pages;
     bool active;
 } NotDirtyInfo;
 
@@ -49,6 +49,11 @@ struct RAMBlock {
     unsigned long *unsentmap;
     /* bitmap of already received pages in postcopy */
     unsigned long *receivedmap;
+    /* bitmap of pages found to be zero by the migration scan threads,
+     * and scan generation of each chunk of the bitmap
+     */
+    unsigned long *zero_bmap;
+    uint32_t *scan_gen;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -188,7 +193,9 @@ static inline bool cpu_physical_memory_is_clean(ram_addr_t addr)
     bool code = cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_CODE);
     bool migration =
         cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_MIGRATION);
-    return !(vga && code && migration);
+    bool dirtyrate =
+        cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_DIRTYRATE);
+    return !(vga && code && migration && dirtyrate);
 }
 
 static inline uint8_t cpu_physical_memory_range_includes_clean(ram_addr_t start,
@@ -209,6 +216,10 @@ static inline uint8_t cpu_physical_memory_range_includes_clean(ram_addr_t start,
         !cpu_physical_memory_all_dirty(start, length, DIRTY_MEMORY_MIGRATION)) {
         ret |= (1 << DIRTY_MEMORY_MIGRATION);
     }
+    if (mask & (1 << DIRTY_MEMORY_DIRTYRATE) &&
+        !cpu_physical_memory_all_dirty(start, length, DIRTY_MEMORY_DIRTYRATE)) {
+        ret |= (1 << DIRTY_MEMORY_DIRTYRATE);
+    }
     return ret;
 }
 
@@ -273,6 +284,10 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
             bitmap_set_atomic(blocks[DIRTY_MEMORY_CODE]->blocks[idx],
                               offset, next - page);
         }
+        if (unlikely(mask & (1 << DIRTY_MEMORY_DIRTYRATE))) {
+            bitmap_set_atomic(blocks[DIRTY_MEMORY_DIRTYRATE]->blocks[idx],
+                              offset, next - page);
+        }
 
         page = next;
         idx++;
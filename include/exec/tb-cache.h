@@ -0,0 +1,48 @@
+/*
+ * Persistent translation cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef EXEC_TB_CACHE_H
+#define EXEC_TB_CACHE_H
+
+#include "exec/exec-all.h"
+
+/**
+ * tb_cache_init:
+ * @dir: directory holding the cache files
+ * @cpu_model: the CPU model string, including any feature flags
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Enable the persistent translation cache.  The TCG ops of translated
+ * blocks are appended to a file in @dir, and reused by later runs of
+ * the same QEMU binary with the same @cpu_model when the guest code
+ * they were generated from is found again at the same address.
+ */
+void tb_cache_init(const char *dir, const char *cpu_model, Error **errp);
+
+/**
+ * tb_cache_load:
+ * @cpu: the CPU the TB is being translated for
+ * @tb: the TB being translated; pc, cs_base, flags, cflags and
+ *      trace_vcpu_dstate must be set
+ *
+ * Try to fill tcg_ctx with the ops of a cached translation of @tb.
+ * On success @tb's size and icount are set and the ops are ready for
+ * tcg_gen_code().  Returns false on a cache miss, in which case the
+ * TCG context is left as it was reset by tcg_func_start().
+ */
+bool tb_cache_load(CPUState *cpu, TranslationBlock *tb);
+
+/**
+ * tb_cache_save:
+ * @cpu: the CPU the TB was translated for
+ * @tb: the TB whose ops have just been generated into tcg_ctx
+ *
+ * Append the ops of @tb to the cache file.
+ */
+void tb_cache_save(CPUState *cpu, TranslationBlock *tb);
+
+#endif
@@ -31,14 +31,14 @@ typedef struct TBContext TBContext;
 
 struct TBContext {
 
-    GTree *tb_tree;
     struct qht htable;
-    /* any access to the tbs or the page table must use this lock */
-    QemuMutex tb_lock;
 
     /* statistics */
     unsigned tb_flush_count;
-    int tb_phys_invalidate_count;
+    unsigned tb_evict_count;
+    unsigned long tb_evicted_count;
+    unsigned long tb_retranslate_count;
+    unsigned long tb_phys_invalidate_count;
 };
 
 extern TBContext tb_ctx;
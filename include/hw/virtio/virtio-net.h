@@ -16,6 +16,8 @@
 
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
+#include "net/checksum.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -41,11 +43,28 @@ typedef struct virtio_net_conf
     int32_t speed;
     char *duplex_str;
     uint8_t duplex;
+    uint32_t num_iothreads;
+    char **iothreads;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 << 10))
 
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
+
+typedef struct VirtioNetRssData {
+    bool enabled;
+    bool redirect;
+    bool populate_hash;
+    uint32_t hash_types;
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    uint16_t indirections_len;
+    uint16_t indirections_table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint16_t default_queue;
+    NetToeplitzTable *toeplitz;     /* built from key while enabled */
+} VirtioNetRssData;
+
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
@@ -56,6 +75,12 @@ typedef struct VirtIONetQueue {
         VirtQueueElement *elem;
     } async_tx;
     struct VirtIONet *n;
+    IOThread *iothread;
+    AioContext *ctx;    /* non-NULL while the queue pair runs in iothread */
+    /* Guest notifier state of rx and tx while the guest notifiers are
+     * owned by the iothread, see virtio_net_guest_notifier_mask.  */
+    bool notifier_masked[2];
+    bool notifier_pending[2];
 } VirtIONetQueue;
 
 typedef struct VirtIONet {
@@ -64,6 +89,8 @@ typedef struct VirtIONet {
     uint16_t status;
     VirtIONetQueue *vqs;
     VirtQueue *ctrl_vq;
+    IOThread **iothreads;
+    uint16_t iothread_queues;   /* queue pairs with guest notifiers set */
     NICState *nic;
     uint32_t tx_timeout;
     int32_t tx_burst;
@@ -102,6 +129,8 @@ typedef struct VirtIONet {
     int announce_counter;
     bool needs_vnet_hdr_swap;
     bool mtu_bypass_backend;
+    VirtioNetRssData rss_data;
+    struct NetRxPkt *rx_pkt;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -103,4 +103,35 @@ void net_toeplitz_add(uint32_t *result,
     *result = accumulator;
 }
 
+/* Longest Toeplitz hash input: IPv6 source and destination plus ports */
+#define NET_TOEPLITZ_MAX_INPUT 36
+
+/* Key length needed to hash NET_TOEPLITZ_MAX_INPUT bytes */
+#define NET_TOEPLITZ_KEY_SIZE (NET_TOEPLITZ_MAX_INPUT + sizeof(uint32_t))
+
+/*
+ * Per-key lookup table for the Toeplitz hash: entry [i][b] is the hash
+ * of byte value b at position i of the input, so that hashing is one
+ * independent load and XOR per input byte.
+ */
+typedef struct NetToeplitzTable {
+    uint32_t t[NET_TOEPLITZ_MAX_INPUT][256];
+} NetToeplitzTable;
+
+/* @key must hold NET_TOEPLITZ_KEY_SIZE bytes */
+void net_toeplitz_table_init(NetToeplitzTable *table, const uint8_t *key);
+
+static inline uint32_t
+net_toeplitz_table_hash(const NetToeplitzTable *table,
+                        const uint8_t *input, size_t len)
+{
+    uint32_t hash = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= table->t[i][input[i]];
+    }
+    return hash;
+}
+
 #endif /* QEMU_NET_CHECKSUM_H */
@@ -0,0 +1,86 @@
+/*
+ * Software segmentation and receive coalescing offloads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_NET_OFFLOAD_H
+#define QEMU_NET_OFFLOAD_H
+
+#include "standard-headers/linux/virtio_net.h"
+
+/* Virtio net headers used by the net layer are in host byte order.  */
+
+typedef struct NetGRO NetGRO;
+
+typedef enum NetGROResult {
+    NET_GRO_MERGED,     /* the frame is now part of the pending frame */
+    NET_GRO_FLUSH,      /* flush the pending frame, then try again */
+    NET_GRO_NONE,       /* the frame cannot be coalesced, send it as is */
+} NetGROResult;
+
+NetGRO *net_gro_new(void);
+void net_gro_free(NetGRO *gro);
+bool net_gro_pending(NetGRO *gro);
+void net_gro_reset(NetGRO *gro);
+
+/**
+ * net_gro_receive:
+ * @gro: the coalescing state of a backend
+ * @frame: an Ethernet frame received by the backend
+ * @size: the size of @frame
+ * @tso4: whether TCPv4 frames may be coalesced
+ * @tso6: whether TCPv6 frames may be coalesced
+ *
+ * Try to append @frame to the pending frame, or to start a new one.  Only
+ * in-order TCP segments of a single stream with valid checksums and the
+ * same MSS are merged.  @frame is copied and can be reused on return.
+ */
+NetGROResult net_gro_receive(NetGRO *gro, const uint8_t *frame, size_t size,
+                             bool tso4, bool tso6);
+
+/**
+ * net_gro_finish:
+ * @gro: the coalescing state of a backend
+ * @vnet_hdr_len: the size of the virtio net header to prepend
+ * @size: returns the size of the packet, header included
+ *
+ * Return the pending frame with a virtio net header describing it and
+ * clear it.  The packet remains valid until the next net_gro_receive().
+ */
+const uint8_t *net_gro_finish(NetGRO *gro, size_t vnet_hdr_len, size_t *size);
+
+typedef struct NetGSO NetGSO;
+
+NetGSO *net_gso_new(void);
+void net_gso_free(NetGSO *gso);
+void net_gso_reset(NetGSO *gso);
+
+/* The maximum number of elements passed to a NetGSOOutput */
+#define NET_GSO_MAX_IOV 64
+
+typedef ssize_t (NetGSOOutput)(void *opaque, const struct iovec *iov,
+                               int iovcnt);
+
+/**
+ * net_gso_segment:
+ * @gso: the segmentation state of a backend
+ * @iov: a packet starting with a virtio net header
+ * @iovcnt: the number of elements in @iov
+ * @vnet_hdr_len: the size of the virtio net header
+ * @output: called for each resulting frame
+ * @opaque: passed to @output
+ *
+ * Strip the virtio net header from a packet, completing its checksum and
+ * cutting it into MSS sized TCP segments as requested by the header.
+ * Returns the size of the packet if it was sent or dropped, or the
+ * return value of @output if a frame could not be sent.  When @output
+ * returns 0, @gso remembers the segments that went out, and passing the
+ * same packet again sends only the remaining ones.
+ */
+ssize_t net_gso_segment(NetGSO *gso, const struct iovec *iov, int iovcnt,
+                        size_t vnet_hdr_len,
+                        NetGSOOutput *output, void *opaque);
+
+#endif /* QEMU_NET_OFFLOAD_H */
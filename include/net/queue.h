@@ -45,7 +45,21 @@ typedef ssize_t (NetQueueDeliverFunc)(NetClientState *sender,
                                       int iovcnt,
                                       void *opaque);
 
+/* Returns the number of packets at the head of @packets that were
+ * consumed, either delivered or discarded.  The others are kept in
+ * the queue for future redelivery.  Each element of @packets holds
+ * a whole packet.
+ */
+typedef int (NetQueueDeliverBatchFunc)(const struct iovec *packets,
+                                       int count,
+                                       void *opaque);
+
+/* Maximum number of packets passed to a NetQueueDeliverBatchFunc */
+#define NET_QUEUE_BATCH_MAX 32
+
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque);
+void qemu_net_queue_set_deliver_batch(NetQueue *queue,
+                                      NetQueueDeliverBatchFunc *deliver_batch);
 
 void qemu_net_queue_append_iov(NetQueue *queue,
                                NetClientState *sender,
@@ -73,4 +87,7 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
+void qemu_net_queue_plug(NetQueue *queue);
+void qemu_net_queue_unplug(NetQueue *queue);
+
 #endif /* QEMU_NET_QUEUE_H */
@@ -406,6 +406,18 @@ struct CPUState {
      */
     bool throttle_thread_scheduled;
 
+    /* Per-vcpu throttle percentage set by cpu_throttle_set_vcpu(); zero
+     * means the vcpu follows the global throttle percentage.
+     */
+    unsigned int throttle_percentage;
+
+    /* Number of guest pages this vcpu has dirtied for migration, and for
+     * dirty rate measurement.  Only maintained by TCG, which sees the first
+     * write to every clean page; updated with atomic_inc().
+     */
+    unsigned long dirty_pages;
+    unsigned long dirtyrate_pages;
+
     bool ignore_memory_transaction_failures;
 
     /* Note that this is accessed at the start of every TB via a negative
@@ -825,11 +837,34 @@ bool cpu_throttle_active(void);
  * cpu_throttle_get_percentage:
  *
  * Returns the vcpu throttle percentage. See cpu_throttle_set for details.
+ * If some vcpus are throttled individually, the highest percentage of any
+ * vcpu is returned.
  *
  * Returns: The throttle percentage in range 1 to 99.
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vcpu to throttle.
+ * @new_throttle_pct: Percent of sleep time. Valid range is 1 to 99.
+ *
+ * Like cpu_throttle_set, but only throttles @cpu.  @cpu runs with the
+ * higher of the per-vcpu percentage and the one given to cpu_throttle_set,
+ * and the per-vcpu percentage remains in effect until cpu_throttle_stop is
+ * called.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
+/**
+ * cpu_throttle_get_vcpu_percentage:
+ * @cpu: The vcpu to query.
+ *
+ * Returns: The throttle percentage that currently applies to @cpu, or 0
+ * if @cpu is not being throttled.
+ */
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu);
+
 #ifndef CONFIG_USER_ONLY
 
 typedef void (*CPUInterruptHandler)(CPUState *, int);
@@ -29,7 +29,9 @@
 #include "qemu/help_option.h"
 #include "cpu.h"
 #include "exec/exec-all.h"
+#include "exec/tb-cache.h"
 #include "tcg.h"
+#include "perf.h"
 #include "qemu/timer.h"
 #include "qemu/envlist.h"
 #include "elf.h"
@@ -131,7 +133,6 @@ void fork_start(void)
 {
     start_exclusive();
     mmap_fork_start();
-    qemu_mutex_lock(&tb_ctx.tb_lock);
     cpu_list_lock();
 }
 
@@ -147,14 +148,12 @@ void fork_end(int child)
                 QTAILQ_REMOVE(&cpus, cpu, node);
             }
         }
-        qemu_mutex_init(&tb_ctx.tb_lock);
         qemu_init_cpu_list();
         gdbserver_fork(thread_cpu);
         /* qemu_init_cpu_list() takes care of reinitializing the
          * exclusive state, so we don't need to end_exclusive() here.
          */
     } else {
-        qemu_mutex_unlock(&tb_ctx.tb_lock);
         cpu_list_unlock();
         end_exclusive();
     }
@@ -4307,6 +4306,35 @@ static void handle_arg_singlestep(const char *arg)
     singlestep = 1;
 }
 
+static void handle_arg_perfmap(const char *arg)
+{
+    perf_enable_perfmap();
+}
+
+static void handle_arg_jitdump(const char *arg)
+{
+    perf_enable_jitdump();
+}
+
+static void handle_arg_reg_prefs(const char *arg)
+{
+    if (!strcmp(arg, "on")) {
+        tcg_reg_prefs = true;
+    } else if (!strcmp(arg, "off")) {
+        tcg_reg_prefs = false;
+    } else {
+        fprintf(stderr, "Invalid reg-prefs setting %s (use on or off)\n",
+                arg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static const char *tb_cache_dir;
+static void handle_arg_tb_cache(const char *arg)
+{
+    tb_cache_dir = arg;
+}
+
 static void handle_arg_strace(const char *arg)
 {
     do_strace = 1;
@@ -4371,6 +4399,14 @@ static const struct qemu_argument arg_table[] = {
      "pagesize",   "set the host page size to 'pagesize'"},
     {"singlestep", "QEMU_SINGLESTEP",  false, handle_arg_singlestep,
      "",           "run in singlestep mode"},
+    {"perfmap",    "QEMU_PERFMAP",     false, handle_arg_perfmap,
+     "",           "Generate a /tmp/perf-${pid}.map file for perf"},
+    {"jitdump",    "QEMU_JITDUMP",     false, handle_arg_jitdump,
+     "",           "Generate a jit-${pid}.dump file for perf"},
+    {"reg-prefs",  "QEMU_REG_PREFS",   true,  handle_arg_reg_prefs,
+     "on|off",     "honour register preferences in TCG (default on)"},
+    {"tb-cache",   "QEMU_TB_CACHE",    true,  handle_arg_tb_cache,
+     "dir",        "keep translated code in directory 'dir' across runs"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
     {"seed",       "QEMU_RAND_SEED",   true,  handle_arg_randseed,
@@ -4613,6 +4649,15 @@ int main(int argc, char **argv, char **envp)
 
     thread_cpu = cpu;
 
+    if (tb_cache_dir) {
+        Error *err = NULL;
+
+        tb_cache_init(tb_cache_dir, cpu_model, &err);
+        if (err) {
+            warn_report_err(err);
+        }
+    }
+
     if (getenv("QEMU_STRACE")) {
         do_strace = 1;
     }
@@ -24,6 +24,12 @@
 
 //#define DEBUG_MMAP
 
+/* Serializes every change of the guest address space (mmap, munmap,
+   mprotect, mremap, shmat, shmdt) with the page flag writes that go with
+   it, and with the translation of new code.  There is no range locking:
+   threads making these calls still all contend on this one mutex.  Only
+   the page flag readers, page_get_flags() and page_check_range(), run
+   without it.  */
 static pthread_mutex_t mmap_mutex = PTHREAD_MUTEX_INITIALIZER;
 static __thread int mmap_lock_count;
 
@@ -0,0 +1,340 @@
+/*
+ * Guest dirty rate measurement
+ *
+ * The dirty rate is estimated by hashing a random sample of the pages in
+ * every RAMBlock, and hashing them again after the measurement period;
+ * the fraction of sampled pages that changed is extrapolated to the whole
+ * block.  With TCG the dirty pages are also attributed to the vcpus that
+ * wrote them, using the per-vcpu counters maintained by the notdirty
+ * write path for the DIRTY_MEMORY_DIRTYRATE bitmap.  Other accelerators
+ * do not go through that path, so they only get the global estimate.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "qemu/crc32c.h"
+#include "qemu/cutils.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "qapi/clone-visitor.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qapi/qapi-visit-migration.h"
+#include "exec/ram_addr.h"
+#include "trace.h"
+
+/* Default number of pages sampled per GiB of guest memory */
+#define DIRTYRATE_DEFAULT_SAMPLE_PAGES    512
+
+/* Bounds for the measurement period, in seconds */
+#define DIRTYRATE_MIN_CALC_TIME           1
+#define DIRTYRATE_MAX_CALC_TIME           60
+
+/* Sampling state of one RAMBlock */
+typedef struct RAMBlockDirtyInfo {
+    char idstr[256];
+    /* Size of the block when it was first sampled */
+    ram_addr_t length;
+    /* Number of sampled pages */
+    uint32_t sample_pages;
+    /* Number of sampled pages that changed during the measurement */
+    uint32_t dirty_pages;
+    /* Target page index and hash of each sampled page */
+    uint64_t *page_index;
+    uint32_t *hash;
+} RAMBlockDirtyInfo;
+
+/* Dirty page counter of one vcpu at the start of the measurement */
+typedef struct VcpuDirtyInfo {
+    int cpu_index;
+    unsigned long dirty_pages;
+} VcpuDirtyInfo;
+
+typedef struct DirtyRateState {
+    /* DirtyRateStatus, written by the measurement thread */
+    int status;
+    int64_t start_time;
+    int64_t calc_time;
+    int64_t sample_pages;
+    /* Results, valid once status is DIRTY_RATE_STATUS_MEASURED */
+    int64_t dirty_rate;
+    DirtyRateVcpuList *vcpu_dirty_rate;
+} DirtyRateState;
+
+static DirtyRateState dirty_rate_state;
+
+static uint32_t dirtyrate_hash_page(RAMBlock *block, uint64_t page_index)
+{
+    return crc32c(0xffffffff,
+                  block->host + (page_index << TARGET_PAGE_BITS),
+                  TARGET_PAGE_SIZE);
+}
+
+static uint64_t dirtyrate_random_page(uint64_t nr_pages)
+{
+    uint64_t r = ((uint64_t)g_random_int() << 32) | g_random_int();
+
+    return r % nr_pages;
+}
+
+/* Called within RCU critical section. */
+static GArray *dirtyrate_sample_blocks(int64_t sample_pages)
+{
+    GArray *infos = g_array_new(false, true, sizeof(RAMBlockDirtyInfo));
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH(block) {
+        RAMBlockDirtyInfo info = { };
+        uint64_t nr_pages = block->used_length >> TARGET_PAGE_BITS;
+        uint32_t i;
+
+        if (!nr_pages) {
+            continue;
+        }
+
+        pstrcpy(info.idstr, sizeof(info.idstr), block->idstr);
+        info.length = block->used_length;
+        info.sample_pages = MIN(nr_pages,
+                                MAX(sample_pages * block->used_length >> 30,
+                                    1));
+        info.page_index = g_new(uint64_t, info.sample_pages);
+        info.hash = g_new(uint32_t, info.sample_pages);
+        for (i = 0; i < info.sample_pages; i++) {
+            info.page_index[i] = dirtyrate_random_page(nr_pages);
+            info.hash[i] = dirtyrate_hash_page(block, info.page_index[i]);
+        }
+        g_array_append_val(infos, info);
+    }
+
+    return infos;
+}
+
+/* Called within RCU critical section. */
+static void dirtyrate_compare_blocks(GArray *infos)
+{
+    RAMBlock *block;
+    guint i;
+
+    for (i = 0; i < infos->len; i++) {
+        RAMBlockDirtyInfo *info = &g_array_index(infos, RAMBlockDirtyInfo, i);
+        uint32_t j;
+
+        RAMBLOCK_FOREACH(block) {
+            if (!strcmp(block->idstr, info->idstr)) {
+                break;
+            }
+        }
+        /* Skip blocks that were unplugged or resized meanwhile */
+        if (!block || block->used_length != info->length) {
+            info->sample_pages = 0;
+            continue;
+        }
+
+        for (j = 0; j < info->sample_pages; j++) {
+            if (dirtyrate_hash_page(block, info->page_index[j]) !=
+                info->hash[j]) {
+                info->dirty_pages++;
+            }
+        }
+    }
+}
+
+static void dirtyrate_free_blocks(GArray *infos)
+{
+    guint i;
+
+    for (i = 0; i < infos->len; i++) {
+        RAMBlockDirtyInfo *info = &g_array_index(infos, RAMBlockDirtyInfo, i);
+
+        g_free(info->page_index);
+        g_free(info->hash);
+    }
+    g_array_free(infos, true);
+}
+
+static int64_t dirtyrate_estimate(GArray *infos, int64_t calc_time)
+{
+    uint64_t dirty_bytes = 0;
+    guint i;
+
+    for (i = 0; i < infos->len; i++) {
+        RAMBlockDirtyInfo *info = &g_array_index(infos, RAMBlockDirtyInfo, i);
+
+        if (info->sample_pages) {
+            dirty_bytes += info->length / info->sample_pages *
+                           info->dirty_pages;
+        }
+    }
+
+    return (dirty_bytes >> 20) / calc_time;
+}
+
+/*
+ * Arm the TCG dirty page counters of the vcpus.  The counters only tick on
+ * the first write to a page that is clean in the DIRTY_MEMORY_DIRTYRATE
+ * bitmap, which is private to the measurement, so clear it to catch the
+ * writes done during the measurement.  The migration bitmap is left
+ * alone.  Called with the iothread lock held.
+ */
+static GArray *dirtyrate_start_vcpus(void)
+{
+    GArray *vcpus = g_array_new(false, false, sizeof(VcpuDirtyInfo));
+    RAMBlock *block;
+    CPUState *cpu;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        cpu_physical_memory_test_and_clear_dirty(block->offset,
+                                                 block->used_length,
+                                                 DIRTY_MEMORY_DIRTYRATE);
+    }
+    rcu_read_unlock();
+
+    CPU_FOREACH(cpu) {
+        VcpuDirtyInfo info = {
+            .cpu_index = cpu->cpu_index,
+            .dirty_pages = atomic_read(&cpu->dirtyrate_pages),
+        };
+
+        g_array_append_val(vcpus, info);
+    }
+
+    return vcpus;
+}
+
+/* Called with the iothread lock held. */
+static DirtyRateVcpuList *dirtyrate_stop_vcpus(GArray *vcpus,
+                                               int64_t calc_time)
+{
+    DirtyRateVcpuList *head = NULL, **tail = &head;
+    CPUState *cpu;
+    guint i;
+
+    CPU_FOREACH(cpu) {
+        for (i = 0; i < vcpus->len; i++) {
+            VcpuDirtyInfo *info = &g_array_index(vcpus, VcpuDirtyInfo, i);
+            DirtyRateVcpuList *entry;
+            unsigned long pages;
+
+            if (info->cpu_index != cpu->cpu_index) {
+                continue;
+            }
+
+            pages = atomic_read(&cpu->dirtyrate_pages) - info->dirty_pages;
+            entry = g_new0(DirtyRateVcpuList, 1);
+            entry->value = g_new0(DirtyRateVcpu, 1);
+            entry->value->id = cpu->cpu_index;
+            entry->value->dirty_rate =
+                (((uint64_t)pages << TARGET_PAGE_BITS) >> 20) / calc_time;
+            *tail = entry;
+            tail = &entry->next;
+            break;
+        }
+    }
+
+    g_array_free(vcpus, true);
+    return head;
+}
+
+static void *dirtyrate_thread(void *opaque)
+{
+    DirtyRateState *s = opaque;
+    GArray *blocks, *vcpus = NULL;
+
+    rcu_register_thread();
+
+    if (tcg_enabled()) {
+        qemu_mutex_lock_iothread();
+        vcpus = dirtyrate_start_vcpus();
+        qemu_mutex_unlock_iothread();
+    }
+
+    rcu_read_lock();
+    blocks = dirtyrate_sample_blocks(s->sample_pages);
+    rcu_read_unlock();
+
+    g_usleep(s->calc_time * G_USEC_PER_SEC);
+
+    rcu_read_lock();
+    dirtyrate_compare_blocks(blocks);
+    rcu_read_unlock();
+
+    s->dirty_rate = dirtyrate_estimate(blocks, s->calc_time);
+    dirtyrate_free_blocks(blocks);
+
+    if (vcpus) {
+        qemu_mutex_lock_iothread();
+        s->vcpu_dirty_rate = dirtyrate_stop_vcpus(vcpus, s->calc_time);
+        qemu_mutex_unlock_iothread();
+    }
+
+    trace_dirtyrate_measured(s->dirty_rate, s->calc_time, s->sample_pages);
+    atomic_mb_set(&s->status, DIRTY_RATE_STATUS_MEASURED);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    DirtyRateState *s = &dirty_rate_state;
+    QemuThread thread;
+
+    if (atomic_mb_read(&s->status) == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "the dirty rate is already being measured");
+        return;
+    }
+
+    if (calc_time < DIRTYRATE_MIN_CALC_TIME ||
+        calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, "calc-time must be between %d and %d seconds",
+                   DIRTYRATE_MIN_CALC_TIME, DIRTYRATE_MAX_CALC_TIME);
+        return;
+    }
+
+    if (!has_sample_pages) {
+        sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < 1 || sample_pages > (1 << 30) / TARGET_PAGE_SIZE) {
+        error_setg(errp, "sample-pages must be between 1 and %d",
+                   (int)((1 << 30) / TARGET_PAGE_SIZE));
+        return;
+    }
+
+    qapi_free_DirtyRateVcpuList(s->vcpu_dirty_rate);
+    s->vcpu_dirty_rate = NULL;
+    s->dirty_rate = 0;
+    s->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
+    s->calc_time = calc_time;
+    s->sample_pages = sample_pages;
+    atomic_mb_set(&s->status, DIRTY_RATE_STATUS_MEASURING);
+
+    qemu_thread_create(&thread, "dirtyrate", dirtyrate_thread, s,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateState *s = &dirty_rate_state;
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+
+    info->status = atomic_mb_read(&s->status);
+    info->start_time = s->start_time;
+    info->calc_time = s->calc_time;
+    info->sample_pages = s->sample_pages;
+    if (info->status == DIRTY_RATE_STATUS_MEASURED) {
+        info->has_dirty_rate = true;
+        info->dirty_rate = s->dirty_rate;
+        if (s->vcpu_dirty_rate) {
+            info->has_vcpu_dirty_rate = true;
+            info->vcpu_dirty_rate =
+                QAPI_CLONE(DirtyRateVcpuList, s->vcpu_dirty_rate);
+        }
+    }
+
+    return info;
+}
@@ -35,6 +35,7 @@
 #include "qapi/qapi-events-migration.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qnull.h"
+#include "qemu/main-loop.h"
 #include "qemu/rcu.h"
 #include "block.h"
 #include "postcopy-ram.h"
@@ -44,6 +45,7 @@
 #include "io/channel-buffer.h"
 #include "migration/colo.h"
 #include "hw/boards.h"
+#include "sysemu/cpus.h"
 #include "monitor/monitor.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
@@ -81,6 +83,8 @@
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY 200
 #define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
 #define DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT 16
+#define DEFAULT_MIGRATE_SCAN_THREADS 1
+#define MAX_MIGRATE_SCAN_THREADS 64
 
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
@@ -167,6 +171,11 @@ MigrationIncomingState *migration_incoming_get_current(void)
     return &mis_current;
 }
 
+static void migration_incoming_listener_cleanup_bh(void *opaque)
+{
+    socket_incoming_cleanup();
+}
+
 void migration_incoming_state_destroy(void)
 {
     struct MigrationIncomingState *mis = migration_incoming_get_current();
@@ -182,6 +191,17 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
+    /*
+     * Stop waiting for a preempt channel that the source never opened.
+     * The listener belongs to the main loop, and we may be called from
+     * the postcopy listen thread.
+     */
+    aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                            migration_incoming_listener_cleanup_bh, NULL);
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -449,8 +469,10 @@ void migration_ioc_process_incoming(QIOChannel *ioc)
     if (!mis->from_src_file) {
         QEMUFile *f = qemu_fopen_channel_input(ioc);
         migration_fd_process_incoming(f);
+    } else if (migrate_postcopy_preempt() && !mis->postcopy_qemufile_dst) {
+        /* The source connects the postcopy preempt channel second */
+        postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
     }
-    /* We still only have a single channel.  Nothing to do here yet */
 }
 
 /**
@@ -461,6 +483,11 @@ void migration_ioc_process_incoming(QIOChannel *ioc)
  */
 bool migration_has_all_channels(void)
 {
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    if (migrate_postcopy_preempt()) {
+        return mis->postcopy_qemufile_dst != NULL;
+    }
     return true;
 }
 
@@ -556,6 +583,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->x_multifd_page_count = s->parameters.x_multifd_page_count;
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
+    params->has_x_scan_threads = true;
+    params->x_scan_threads = s->parameters.x_scan_threads;
 
     return params;
 }
@@ -749,6 +778,54 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT] &&
+        !cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+        error_setg(errp, "Postcopy preempt requires postcopy-ram");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_X_RAM_HANDOFF] &&
+        cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+        error_setg(errp, "RAM handoff is not compatible with postcopy-ram");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
+        static const MigrationCapability incompatible[] = {
+            MIGRATION_CAPABILITY_XBZRLE,
+            MIGRATION_CAPABILITY_RDMA_PIN_ALL,
+            MIGRATION_CAPABILITY_AUTO_CONVERGE,
+            MIGRATION_CAPABILITY_COMPRESS,
+            MIGRATION_CAPABILITY_POSTCOPY_RAM,
+            MIGRATION_CAPABILITY_X_COLO,
+            MIGRATION_CAPABILITY_RELEASE_RAM,
+            MIGRATION_CAPABILITY_BLOCK,
+            MIGRATION_CAPABILITY_RETURN_PATH,
+            MIGRATION_CAPABILITY_PAUSE_BEFORE_SWITCHOVER,
+            MIGRATION_CAPABILITY_X_MULTIFD,
+            MIGRATION_CAPABILITY_DIRTY_BITMAPS,
+            MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME,
+            MIGRATION_CAPABILITY_PER_VCPU_THROTTLE,
+            MIGRATION_CAPABILITY_POSTCOPY_PREEMPT,
+            MIGRATION_CAPABILITY_X_RAM_HANDOFF,
+        };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(incompatible); i++) {
+            if (cap_list[incompatible[i]]) {
+                error_setg(errp, "Background snapshot is not compatible "
+                           "with %s", MigrationCapability_str(incompatible[i]));
+                return false;
+            }
+        }
+
+        if (!ram_write_tracking_available()) {
+            error_setg(errp, "Background snapshot is not supported by the "
+                       "host kernel");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -870,6 +947,16 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
 
     /* x_checkpoint_delay is now always positive */
 
+    if (params->has_x_scan_threads &&
+        (params->x_scan_threads < 1 ||
+         params->x_scan_threads > MAX_MIGRATE_SCAN_THREADS)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_scan_threads",
+                   "is invalid, it should be in the range of 1 to "
+                   stringify(MAX_MIGRATE_SCAN_THREADS));
+        return false;
+    }
+
     if (params->has_x_multifd_channels && (params->x_multifd_channels < 1)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
                    "multifd_channels",
@@ -959,6 +1046,9 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_xbzrle_cache_size) {
         dest->xbzrle_cache_size = params->xbzrle_cache_size;
     }
+    if (params->has_x_scan_threads) {
+        dest->x_scan_threads = params->x_scan_threads;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -1031,6 +1121,9 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
         s->parameters.xbzrle_cache_size = params->xbzrle_cache_size;
         xbzrle_cache_resize(params->xbzrle_cache_size, errp);
     }
+    if (params->has_x_scan_threads) {
+        s->parameters.x_scan_threads = params->x_scan_threads;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
@@ -1163,6 +1256,12 @@ static void migrate_fd_cleanup(void *opaque)
         s->to_dst_file = NULL;
     }
 
+    if (s->postcopy_qemufile_src) {
+        qemu_fclose(s->postcopy_qemufile_src);
+        s->postcopy_qemufile_src = NULL;
+    }
+    socket_send_channel_cleanup();
+
     assert((s->state != MIGRATION_STATUS_ACTIVE) &&
            (s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE));
 
@@ -1230,6 +1329,9 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
     }
+    if (s->state == MIGRATION_STATUS_CANCELLING && s->postcopy_qemufile_src) {
+        qemu_file_shutdown(s->postcopy_qemufile_src);
+    }
     if (s->state == MIGRATION_STATUS_CANCELLING && s->block_inactive) {
         Error *local_err = NULL;
 
@@ -1316,6 +1418,7 @@ void migrate_init(MigrationState *s)
     s->xfer_limit = 0;
     s->cleanup_bh = 0;
     s->to_dst_file = NULL;
+    s->postcopy_qemufile_src = NULL;
     s->state = MIGRATION_STATUS_NONE;
     s->rp_state.from_dst_file = NULL;
     s->rp_state.error = false;
@@ -1552,6 +1655,33 @@ bool migrate_postcopy_ram(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_ram_handoff(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_RAM_HANDOFF];
+}
+
 bool migrate_postcopy(void)
 {
     return migrate_postcopy_ram() || migrate_dirty_bitmaps();
@@ -1566,6 +1696,15 @@ bool migrate_auto_converge(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+bool migrate_per_vcpu_throttle(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_PER_VCPU_THROTTLE];
+}
+
 bool migrate_zero_blocks(void)
 {
     MigrationState *s;
@@ -1675,6 +1814,15 @@ int migrate_multifd_page_count(void)
     return s->parameters.x_multifd_page_count;
 }
 
+int migrate_scan_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_scan_threads;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -1941,6 +2089,19 @@ static int postcopy_start(MigrationState *ms)
     int64_t time_at_stop = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     bool restart_block = false;
     int cur_state = MIGRATION_STATUS_ACTIVE;
+
+    /* Connect before the guest stops, it isn't part of the downtime */
+    if (migrate_postcopy_preempt()) {
+        Error *local_err = NULL;
+
+        if (postcopy_preempt_setup(ms, &local_err)) {
+            error_report_err(local_err);
+            migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
+                              MIGRATION_STATUS_FAILED);
+            return -1;
+        }
+    }
+
     if (!migrate_pause_before_switchover()) {
         migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
                           MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -1988,6 +2149,14 @@ static int postcopy_start(MigrationState *ms)
         }
     }
 
+    /*
+     * From now on, pages requested by the destination go out on the
+     * preempt channel.
+     */
+    if (ms->postcopy_qemufile_src) {
+        ram_postcopy_preempt_start(ms->postcopy_qemufile_src);
+    }
+
     /*
      * send rest of state - note things that are doing postcopy
      * will notice we're in POSTCOPY_ACTIVE and not actually
@@ -2178,6 +2347,9 @@ static void migration_completion(MigrationState *s)
         trace_migration_completion_postcopy_end();
 
         qemu_savevm_state_complete_postcopy(s->to_dst_file);
+        if (s->postcopy_qemufile_src) {
+            ram_postcopy_preempt_finish(s->postcopy_qemufile_src);
+        }
         trace_migration_completion_postcopy_end_after_complete();
     }
 
@@ -2469,6 +2641,166 @@ static void *migration_thread(void *opaque)
     return NULL;
 }
 
+/*
+ * Save the device state of a background snapshot into @fb: stops the VM
+ * for the time it takes, and write protects guest RAM before resuming
+ * it, so that RAM is saved as it was at this point.
+ *
+ * Returns 0 on success, negative otherwise
+ */
+static int bg_migration_start(MigrationState *s, QEMUFile *fb)
+{
+    int ret;
+
+    /* Keep the walk over all of guest RAM out of the downtime */
+    ram_write_tracking_prepare();
+
+    qemu_mutex_lock_iothread();
+    s->downtime_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    s->vm_was_running = runstate_is_running();
+    ret = global_state_store();
+    if (!ret) {
+        ret = vm_stop_force_state(RUN_STATE_PAUSED);
+    }
+    if (!ret) {
+        cpu_synchronize_all_states();
+        ret = qemu_savevm_state_complete_precopy_non_iterable(fb, false,
+                                                              false);
+    }
+    if (!ret) {
+        qemu_fflush(fb);
+        ret = ram_write_tracking_start(s);
+    }
+    if (s->vm_was_running) {
+        vm_start();
+    }
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - s->downtime_start;
+    qemu_mutex_unlock_iothread();
+
+    trace_bg_migration_start(ret, s->downtime);
+    return ret;
+}
+
+/*
+ * Finish a background snapshot: complete RAM and append the device
+ * state saved by bg_migration_start.  The VM keeps running.
+ */
+static void bg_migration_completion(MigrationState *s, QIOChannelBuffer *bioc)
+{
+    if (s->state == MIGRATION_STATUS_ACTIVE) {
+        qemu_file_set_rate_limit(s->to_dst_file, INT64_MAX);
+        qemu_savevm_state_complete_precopy_iterable(s->to_dst_file, false);
+        qemu_put_buffer(s->to_dst_file, bioc->data, bioc->usage);
+        qemu_fflush(s->to_dst_file);
+    }
+
+    if (qemu_file_get_error(s->to_dst_file)) {
+        trace_migration_completion_file_err();
+        migrate_set_state(&s->state, s->state, MIGRATION_STATUS_FAILED);
+        return;
+    }
+
+    migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                      MIGRATION_STATUS_COMPLETED);
+}
+
+static void bg_migration_iteration_finish(MigrationState *s)
+{
+    qemu_mutex_lock_iothread();
+    switch (s->state) {
+    case MIGRATION_STATUS_COMPLETED:
+        migration_calculate_complete(s);
+        break;
+
+    case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_FAILED:
+    case MIGRATION_STATUS_CANCELLED:
+    case MIGRATION_STATUS_CANCELLING:
+        break;
+
+    default:
+        /* Should not reach here, but if so, forgive the VM. */
+        error_report("%s: Unknown ending state %d", __func__, s->state);
+        break;
+    }
+    qemu_bh_schedule(s->cleanup_bh);
+    qemu_mutex_unlock_iothread();
+}
+
+/*
+ * Migration thread of a background snapshot: the guest keeps running
+ * while its RAM, write protected at the start, is saved.  There is only
+ * one pass over RAM, since pages can't change until they are saved.
+ */
+static void *bg_migration_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    int64_t setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+
+    rcu_register_thread();
+
+    s->iteration_start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    qemu_savevm_state_header(s->to_dst_file);
+    qemu_savevm_state_setup(s->to_dst_file);
+
+    /* The device state goes last in the stream, after RAM */
+    bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "vmstate-buffer");
+    fb = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
+    migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                      MIGRATION_STATUS_ACTIVE);
+
+    trace_migration_thread_setup_complete();
+
+    if (bg_migration_start(s, fb)) {
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+    }
+
+    while (s->state == MIGRATION_STATUS_ACTIVE) {
+        int64_t current_time;
+
+        if (!qemu_file_rate_limit(s->to_dst_file)) {
+            if (qemu_savevm_state_iterate(s->to_dst_file, false) > 0) {
+                bg_migration_completion(s, bioc);
+                break;
+            }
+        }
+
+        if (qemu_file_get_error(s->to_dst_file)) {
+            if (migration_is_setup_or_active(s->state)) {
+                migrate_set_state(&s->state, s->state,
+                                  MIGRATION_STATUS_FAILED);
+            }
+            trace_migration_thread_file_err();
+            break;
+        }
+
+        current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+        migration_update_counters(s, current_time);
+
+        if (qemu_file_rate_limit(s->to_dst_file)) {
+            /* usleep expects microseconds */
+            g_usleep((s->iteration_start_time + BUFFER_DELAY -
+                      current_time) * 1000);
+        }
+    }
+
+    trace_migration_thread_after_loop();
+    bg_migration_iteration_finish(s);
+    qemu_fclose(fb);
+    rcu_unregister_thread();
+    return NULL;
+}
+
 void migrate_fd_connect(MigrationState *s, Error *error_in)
 {
     s->expected_downtime = s->parameters.downtime_limit;
@@ -2507,8 +2839,13 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         migrate_fd_cleanup(s);
         return;
     }
-    qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
-                       QEMU_THREAD_JOINABLE);
+    if (migrate_background_snapshot()) {
+        qemu_thread_create(&s->thread, "bg_snapshot", bg_migration_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    } else {
+        qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    }
     s->migration_thread_running = true;
 }
 
@@ -2572,6 +2909,9 @@ static Property migration_properties[] = {
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
                       DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE),
+    DEFINE_PROP_UINT8("x-scan-threads", MigrationState,
+                      parameters.x_scan_threads,
+                      DEFAULT_MIGRATE_SCAN_THREADS),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -2636,6 +2976,7 @@ static void migration_instance_init(Object *obj)
     params->has_x_multifd_channels = true;
     params->has_x_multifd_page_count = true;
     params->has_xbzrle_cache_size = true;
+    params->has_x_scan_threads = true;
 }
 
 /*
@@ -24,6 +24,15 @@
 
 struct PostcopyBlocktimeContext;
 
+/* Streams that carry RAM pages into an incoming postcopy migration */
+enum {
+    /* The main migration stream */
+    RAM_CHANNEL_PRECOPY = 0,
+    /* The postcopy preempt channel, for requested pages */
+    RAM_CHANNEL_POSTCOPY,
+    RAM_CHANNEL_MAX,
+};
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -53,11 +62,19 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    /* One per RAM_CHANNEL_*, as the channels load in different threads */
+    void     *postcopy_tmp_pages[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
 
+    /* The postcopy preempt channel, if postcopy-preempt is enabled */
+    QEMUFile *postcopy_qemufile_dst;
+    /* Set once the destination listens for postcopy pages */
+    bool           postcopy_preempt_listening;
+    bool           have_preempt_thread;
+    QemuThread     preempt_thread;
+
     QEMUBH *bh;
 
     int state;
@@ -131,6 +148,16 @@ struct MigrationState
         bool          error;
     } rp_state;
 
+    /* Channel for requested pages during postcopy (postcopy-preempt) */
+    QEMUFile *postcopy_qemufile_src;
+
+    /* Write protection of guest RAM (background-snapshot) */
+    bool have_wp_fault_thread;
+    int wp_userfault_fd;
+    /* Wakes the fault thread to quit */
+    int wp_userfault_event_fd;
+    QemuThread wp_fault_thread;
+
     double mbps;
     /* Timestamp when recent migration starts (ms) */
     int64_t start_time;
@@ -224,10 +251,12 @@ bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
 
 bool migrate_auto_converge(void);
+bool migrate_per_vcpu_throttle(void);
 bool migrate_use_multifd(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
 int migrate_multifd_page_count(void);
+int migrate_scan_threads(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -243,6 +272,9 @@ int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_ram_handoff(void);
+bool migrate_background_snapshot(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_shut(MigrationIncomingState *mis,
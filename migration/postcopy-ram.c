@@ -23,11 +23,15 @@
 #include "savevm.h"
 #include "postcopy-ram.h"
 #include "ram.h"
+#include "ram-scan.h"
 #include "qapi/error.h"
 #include "qemu/notify.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/rcu.h"
+#include "qemu-file-channel.h"
+#include "socket.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -509,13 +513,99 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis, size_t ram_pages)
     return 0;
 }
 
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret;
+
+    rcu_register_thread();
+
+    trace_postcopy_preempt_thread_entry();
+    ret = ram_load_postcopy_preempt(mis->postcopy_qemufile_dst);
+    trace_postcopy_preempt_thread_exit(ret);
+    if (ret) {
+        error_report("%s: loading the postcopy preempt channel failed: %s",
+                     __func__, strerror(-ret));
+        /*
+         * The requested pages are lost; take the main stream down,
+         * so that the listen thread fails the migration.
+         */
+        qemu_file_shutdown(mis->from_src_file);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * The preempt channel is loaded once it is connected and the destination
+ * listens for postcopy pages, in whichever order the two happen; both are
+ * done in the main thread.  Nothing waits for the channel: a source that
+ * does not open it sends the requested pages on the main stream.
+ */
+static void postcopy_preempt_maybe_start(MigrationIncomingState *mis)
+{
+    if (mis->have_preempt_thread || !mis->postcopy_preempt_listening ||
+        !mis->postcopy_qemufile_dst) {
+        return;
+    }
+
+    mis->have_preempt_thread = true;
+    qemu_thread_create(&mis->preempt_thread, "postcopy/preempt",
+                       postcopy_preempt_thread, mis, QEMU_THREAD_JOINABLE);
+}
+
+/*
+ * The postcopy preempt channel is the second connection of the source;
+ * the pages the destination requests during postcopy arrive on it.
+ */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    /* It is only read from the preempt thread, never from a coroutine */
+    qemu_file_set_blocking(file, true);
+    mis->postcopy_qemufile_dst = file;
+    trace_postcopy_preempt_new_channel();
+    postcopy_preempt_maybe_start(mis);
+}
+
+/*
+ * The destination listens for postcopy pages: start loading the preempt
+ * channel if it is already there.
+ */
+void postcopy_preempt_listen(MigrationIncomingState *mis)
+{
+    mis->postcopy_preempt_listening = true;
+    postcopy_preempt_maybe_start(mis);
+}
+
+static void postcopy_preempt_thread_join(MigrationIncomingState *mis)
+{
+    mis->postcopy_preempt_listening = false;
+    if (!mis->have_preempt_thread) {
+        return;
+    }
+
+    if (mis->state == MIGRATION_STATUS_FAILED) {
+        /* The source won't terminate the channel, kick the thread out */
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+    }
+
+    qemu_thread_join(&mis->preempt_thread);
+    mis->have_preempt_thread = false;
+}
+
 /*
  * At the end of a migration where postcopy_ram_incoming_init was called.
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    /* Pages may still be in flight on the preempt channel */
+    postcopy_preempt_thread_join(mis);
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -553,9 +643,11 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 
     postcopy_state_set(POSTCOPY_INCOMING_END);
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (mis->postcopy_tmp_pages[i]) {
+            munmap(mis->postcopy_tmp_pages[i], mis->largest_page_size);
+            mis->postcopy_tmp_pages[i] = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -817,14 +909,17 @@ static void mark_postcopy_blocktime_end(uintptr_t addr)
             atomic_fetch_add(&dc->smp_cpus_down, 0) == smp_cpus) {
             vcpu_total_blocktime = true;
         }
-        /* continue cycle, due to one page could affect several vCPUs */
-        dc->vcpu_blocktime[i] += vcpu_blocktime;
+        /*
+         * continue cycle, due to one page could affect several vCPUs;
+         * with postcopy-preempt pages are placed from two threads
+         */
+        atomic_add(&dc->vcpu_blocktime[i], vcpu_blocktime);
     }
 
     atomic_sub(&dc->smp_cpus_down, affected_cpu);
     if (vcpu_total_blocktime) {
-        dc->total_blocktime += low_time_offset - atomic_fetch_add(
-                &dc->last_begin, 0);
+        atomic_add(&dc->total_blocktime, low_time_offset - atomic_fetch_add(
+                   &dc->last_begin, 0));
     }
     trace_mark_postcopy_blocktime_end(addr, dc, dc->total_blocktime,
                                       affected_cpu);
@@ -1164,19 +1259,22 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
                                                                       host));
     } else {
         /* The kernel can't use UFFDIO_ZEROPAGE for hugepages */
-        if (!mis->postcopy_tmp_zero_page) {
-            mis->postcopy_tmp_zero_page = mmap(NULL, mis->largest_page_size,
-                                               PROT_READ | PROT_WRITE,
-                                               MAP_PRIVATE | MAP_ANONYMOUS,
-                                               -1, 0);
-            if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
+        if (!atomic_read(&mis->postcopy_tmp_zero_page)) {
+            void *zero_page = mmap(NULL, mis->largest_page_size,
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (zero_page == MAP_FAILED) {
                 int e = errno;
-                mis->postcopy_tmp_zero_page = NULL;
                 error_report("%s: %s mapping large zero page",
                              __func__, strerror(e));
                 return -e;
             }
-            memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
+            memset(zero_page, '\0', mis->largest_page_size);
+            /* The preempt thread may be placing a zero page too */
+            if (atomic_cmpxchg(&mis->postcopy_tmp_zero_page, NULL,
+                               zero_page)) {
+                munmap(zero_page, mis->largest_page_size);
+            }
         }
         return postcopy_place_page(mis, host, mis->postcopy_tmp_zero_page,
                                    rb);
@@ -1188,23 +1286,321 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
  * using postcopy_place_page
  * The same address is used repeatedly, postcopy_place_page just takes the
  * backing page away.
+ * Each RAM_CHANNEL_* has its own page, since they are loaded concurrently.
  * Returns: Pointer to allocated page
  *
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
-{
-    if (!mis->postcopy_tmp_page) {
-        mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                             PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                             MAP_ANONYMOUS, -1, 0);
-        if (mis->postcopy_tmp_page == MAP_FAILED) {
-            mis->postcopy_tmp_page = NULL;
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel)
+{
+    if (!mis->postcopy_tmp_pages[channel]) {
+        void *tmp_page = mmap(NULL, mis->largest_page_size,
+                              PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                              MAP_ANONYMOUS, -1, 0);
+        if (tmp_page == MAP_FAILED) {
             error_report("%s: %s", __func__, strerror(errno));
             return NULL;
         }
+        mis->postcopy_tmp_pages[channel] = tmp_page;
+    }
+
+    return mis->postcopy_tmp_pages[channel];
+}
+
+/* ------------------------------------------------------------------------- */
+/*
+ * Write tracking for background snapshots: guest RAM is write protected
+ * with userfaultfd, and a write to a page that hasn't been saved yet
+ * blocks the vCPU until the migration thread has saved it.
+ */
+
+/* Return true if the host kernel can write protect with userfaultfd */
+bool ram_write_tracking_available(void)
+{
+    uint64_t features;
+
+    if (!receive_ufd_features(&features)) {
+        return false;
+    }
+    return features & UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+}
+
+static int ram_write_protect(int ufd, void *host, uint64_t len, bool wp)
+{
+    struct uffdio_writeprotect uffd_wp;
+
+    uffd_wp.range.start = (uintptr_t)host;
+    uffd_wp.range.len = len;
+    uffd_wp.mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+    if (ioctl(ufd, UFFDIO_WRITEPROTECT, &uffd_wp)) {
+        return -errno;
+    }
+    return 0;
+}
+
+/*
+ * Write protection only works on present pages: read every page of the
+ * block, so that untouched ones get mapped to the zero page.
+ */
+static void ram_block_populate_read(void *host_addr, ram_addr_t length)
+{
+    ram_addr_t offset;
+    char tmp = 0;
+
+    for (offset = 0; offset < length; offset += qemu_real_host_page_size) {
+        tmp += *((volatile char *)host_addr + offset);
+    }
+    (void)tmp;
+}
+
+/*
+ * Forward the write faults on protected pages to the migration thread,
+ * through the same queue the postcopy page requests use.
+ */
+static void *ram_write_fault_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    struct uffd_msg msg;
+    struct pollfd pfd[2];
+    RAMBlock *rb;
+    ram_addr_t offset;
+    size_t pagesize;
+    int ret;
+
+    rcu_register_thread();
+    trace_ram_write_fault_thread_entry();
+
+    pfd[0].fd = s->wp_userfault_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = s->wp_userfault_event_fd;
+    pfd[1].events = POLLIN;
+
+    while (true) {
+        pfd[0].revents = 0;
+        pfd[1].revents = 0;
+        if (poll(pfd, 2, -1 /* Wait forever */) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: userfault poll: %s", __func__, strerror(errno));
+            break;
+        }
+
+        if (pfd[1].revents) {
+            trace_ram_write_fault_thread_quit();
+            break;
+        }
+
+        ret = read(s->wp_userfault_fd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (errno == EAGAIN) {
+                /* Another fault may already have woken us */
+                continue;
+            }
+            error_report("%s: Failed to read full userfault message: %s",
+                         __func__, strerror(errno));
+            break;
+        }
+
+        if (msg.event != UFFD_EVENT_PAGEFAULT ||
+            !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+            continue;
+        }
+
+        rcu_read_lock();
+        rb = qemu_ram_block_from_host(
+                 (void *)(uintptr_t)msg.arg.pagefault.address,
+                 true, &offset);
+        if (!rb) {
+            rcu_read_unlock();
+            error_report("%s: Fault on unknown address %" PRIx64, __func__,
+                         (uint64_t)msg.arg.pagefault.address);
+            break;
+        }
+        /* Host pages are saved and unprotected as a whole */
+        pagesize = qemu_ram_pagesize(rb);
+        offset &= ~(ram_addr_t)(pagesize - 1);
+        trace_ram_write_fault_thread_request(msg.arg.pagefault.address,
+                                             qemu_ram_get_idstr(rb), offset);
+        ret = ram_save_queue_pages(qemu_ram_get_idstr(rb), offset, pagesize);
+        rcu_read_unlock();
+        if (ret) {
+            break;
+        }
+    }
+
+    trace_ram_write_fault_thread_exit();
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Callback from ram_write_tracking_start via qemu_ram_foreach_block */
+static int ram_block_write_protect(const char *block_name, void *host_addr,
+                                   ram_addr_t offset, ram_addr_t length,
+                                   void *opaque)
+{
+    MigrationState *s = opaque;
+    struct uffdio_register reg_struct;
+
+    reg_struct.range.start = (uintptr_t)host_addr;
+    reg_struct.range.len = length;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(s->wp_userfault_fd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("%s: Failed to register RAM block %s: %s", __func__,
+                     block_name, strerror(errno));
+        return -1;
+    }
+    if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_WRITEPROTECT))) {
+        error_report("%s: RAM block %s can't be write protected",
+                     __func__, block_name);
+        return -1;
+    }
+    if (ram_write_protect(s->wp_userfault_fd, host_addr, length, true)) {
+        error_report("%s: Failed to write protect RAM block %s", __func__,
+                     block_name);
+        return -1;
+    }
+    trace_ram_block_write_protect(block_name, host_addr, length);
+
+    return 0;
+}
+
+/* Callback from ram_write_tracking_stop via qemu_ram_foreach_block */
+static int ram_block_write_unprotect(const char *block_name, void *host_addr,
+                                     ram_addr_t offset, ram_addr_t length,
+                                     void *opaque)
+{
+    MigrationState *s = opaque;
+    struct uffdio_range range_struct;
+
+    /* Also wakes any vCPU still waiting on the block */
+    ram_write_protect(s->wp_userfault_fd, host_addr, length, false);
+
+    range_struct.start = (uintptr_t)host_addr;
+    range_struct.len = length;
+    if (ioctl(s->wp_userfault_fd, UFFDIO_UNREGISTER, &range_struct)) {
+        error_report("%s: Failed to unregister RAM block %s: %s",
+                     __func__, block_name, strerror(errno));
     }
+    trace_ram_block_write_unprotect(block_name);
 
-    return mis->postcopy_tmp_page;
+    return 0;
+}
+
+/* Callback from ram_write_tracking_prepare via qemu_ram_foreach_block */
+static int ram_block_populate(const char *block_name, void *host_addr,
+                              ram_addr_t offset, ram_addr_t length,
+                              void *opaque)
+{
+    ram_block_populate_read(host_addr, length);
+    return 0;
+}
+
+/**
+ * ram_write_tracking_prepare: map every page of guest RAM
+ *
+ * Reading all of guest RAM takes time proportional to its size, so this
+ * is done while the VM still runs, before ram_write_tracking_start.
+ */
+void ram_write_tracking_prepare(void)
+{
+    qemu_ram_foreach_block(ram_block_populate, NULL);
+}
+
+/**
+ * ram_write_tracking_start: write protect all of guest RAM
+ *
+ * Called with the iothread lock, with the VM stopped, after
+ * ram_write_tracking_prepare.
+ *
+ * Returns 0 on success, -1 otherwise
+ *
+ * @s: current migration state
+ */
+int ram_write_tracking_start(MigrationState *s)
+{
+    struct uffdio_api api_struct = { 0 };
+
+    s->wp_userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (s->wp_userfault_fd == -1) {
+        error_report("%s: Failed to open userfault fd: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+    if (ioctl(s->wp_userfault_fd, UFFDIO_API, &api_struct)) {
+        error_report("%s: UFFDIO_API failed: %s", __func__, strerror(errno));
+        goto fail;
+    }
+
+    if (qemu_ram_foreach_block(ram_block_write_protect, s)) {
+        goto fail;
+    }
+
+    s->wp_userfault_event_fd = eventfd(0, EFD_CLOEXEC);
+    if (s->wp_userfault_event_fd == -1) {
+        error_report("%s: Opening userfault_event_fd: %s", __func__,
+                     strerror(errno));
+        goto fail;
+    }
+
+    qemu_thread_create(&s->wp_fault_thread, "wp_fault",
+                       ram_write_fault_thread, s, QEMU_THREAD_JOINABLE);
+    s->have_wp_fault_thread = true;
+
+    /* Pages scanned before this may have changed since */
+    ram_scan_sync(NULL, 0);
+
+    return 0;
+
+fail:
+    /* Closing the userfault fd drops its registrations and protection */
+    close(s->wp_userfault_fd);
+    return -1;
+}
+
+/**
+ * ram_write_tracking_stop: remove the write protection of guest RAM
+ *
+ * @s: current migration state
+ */
+void ram_write_tracking_stop(MigrationState *s)
+{
+    uint64_t tmp64 = 1;
+
+    if (!s->have_wp_fault_thread) {
+        return;
+    }
+
+    if (write(s->wp_userfault_event_fd, &tmp64, 8) != 8) {
+        error_report("%s: incrementing failed: %s", __func__,
+                     strerror(errno));
+    }
+    qemu_thread_join(&s->wp_fault_thread);
+
+    qemu_ram_foreach_block(ram_block_write_unprotect, s);
+
+    close(s->wp_userfault_fd);
+    close(s->wp_userfault_event_fd);
+    s->have_wp_fault_thread = false;
+}
+
+/**
+ * ram_write_tracking_unprotect: remove the write protection of a range
+ *
+ * Called once the range has been saved; wakes the vCPUs that wrote to it.
+ *
+ * Returns 0 on success, -errno otherwise
+ *
+ * @host: start of the range
+ * @len: length of the range
+ */
+int ram_write_tracking_unprotect(void *host, ram_addr_t len)
+{
+    MigrationState *s = migrate_get_current();
+
+    return ram_write_protect(s->wp_userfault_fd, host, len, false);
 }
 
 #else
@@ -1264,12 +1660,22 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     return -1;
 }
 
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel)
 {
     assert(0);
     return NULL;
 }
 
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    assert(0);
+}
+
+void postcopy_preempt_listen(MigrationIncomingState *mis)
+{
+    assert(0);
+}
+
 int postcopy_wake_shared(struct PostCopyFD *pcfd,
                          uint64_t client_addr,
                          RAMBlock *rb)
@@ -1277,10 +1683,69 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
     assert(0);
     return -1;
 }
+
+bool ram_write_tracking_available(void)
+{
+    return false;
+}
+
+void ram_write_tracking_prepare(void)
+{
+}
+
+int ram_write_tracking_start(MigrationState *s)
+{
+    error_report("%s: No OS support", __func__);
+    return -1;
+}
+
+void ram_write_tracking_stop(MigrationState *s)
+{
+}
+
+int ram_write_tracking_unprotect(void *host, ram_addr_t len)
+{
+    assert(0);
+    return -1;
+}
 #endif
 
 /* ------------------------------------------------------------------------- */
 
+/**
+ * postcopy_preempt_setup: connect the postcopy preempt channel
+ *
+ * Opens a second connection to the destination, on which the pages it
+ * requests during postcopy are sent.
+ *
+ * Returns 0 on success, -1 with @errp set otherwise
+ *
+ * @s: current migration state
+ * @errp: error set on failure
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    QIOChannel *ioc;
+
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        error_setg(errp, "Postcopy preemption does not support TLS");
+        return -1;
+    }
+
+    ioc = socket_send_channel_create_sync(errp);
+    if (!ioc) {
+        error_prepend(errp, "Postcopy preempt channel: ");
+        return -1;
+    }
+
+    qio_channel_set_name(ioc, "migration-postcopy-preempt");
+    s->postcopy_qemufile_src = qemu_fopen_channel_output(ioc);
+    object_unref(OBJECT(ioc));
+    trace_postcopy_preempt_setup();
+
+    return 0;
+}
+
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
     uint64_t tmp64 = 1;
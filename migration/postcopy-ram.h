@@ -105,10 +105,29 @@ typedef enum {
 
 /*
  * Allocate a page of memory that can be mapped at a later point in time
- * using postcopy_place_page
+ * using postcopy_place_page, for the RAM_CHANNEL_* @channel
  * Returns: Pointer to allocated page
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis);
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel);
+
+/*
+ * Postcopy preemption: pages requested by the destination are sent on
+ * a separate channel, opened by postcopy_preempt_setup on the source and
+ * loaded by a thread of its own on the destination.
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+void postcopy_preempt_listen(MigrationIncomingState *mis);
+
+/*
+ * Write protection of guest RAM for background snapshots; see
+ * ram_write_tracking_start.
+ */
+bool ram_write_tracking_available(void);
+void ram_write_tracking_prepare(void);
+int ram_write_tracking_start(MigrationState *s);
+void ram_write_tracking_stop(MigrationState *s);
+int ram_write_tracking_unprotect(void *host, ram_addr_t len);
 
 PostcopyState postcopy_state_get(void);
 /* Set the state and return the old state */
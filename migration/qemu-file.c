@@ -51,6 +51,10 @@ struct QEMUFile {
     struct iovec iov[MAX_IOV_SIZE];
     unsigned int iovcnt;
 
+    /* File descriptors received and not yet taken by qemu_file_recv_fd */
+    int *fds;
+    size_t nfds;
+
     int last_error;
 };
 
@@ -290,8 +294,22 @@ static ssize_t qemu_fill_buffer(QEMUFile *f)
     f->buf_index = 0;
     f->buf_size = pending;
 
-    len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
-                        IO_BUF_SIZE - pending);
+    if (f->ops->get_buffer_fds) {
+        int *fds = NULL;
+        size_t nfds = 0;
+
+        len = f->ops->get_buffer_fds(f->opaque, f->buf + pending, f->pos,
+                                     IO_BUF_SIZE - pending, &fds, &nfds);
+        if (nfds) {
+            f->fds = g_renew(int, f->fds, f->nfds + nfds);
+            memcpy(f->fds + f->nfds, fds, nfds * sizeof(int));
+            f->nfds += nfds;
+        }
+        g_free(fds);
+    } else {
+        len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
+                            IO_BUF_SIZE - pending);
+    }
     if (len > 0) {
         f->buf_size += len;
         f->pos += len;
@@ -335,11 +353,73 @@ int qemu_fclose(QEMUFile *f)
     if (f->last_error) {
         ret = f->last_error;
     }
+    while (f->nfds) {
+        close(f->fds[--f->nfds]);
+    }
+    g_free(f->fds);
     g_free(f);
     trace_qemu_file_fclose();
     return ret;
 }
 
+/* Marks the position of a passed file descriptor in the stream */
+#define QEMU_FILE_FD_MARKER 0xfd
+
+/*
+ * Pass @fd to the other side, which gets it from qemu_file_recv_fd at
+ * the same position in the stream; the caller keeps its @fd.
+ *
+ * Returns 0 on success or -errno if the file can't pass descriptors
+ */
+int qemu_file_send_fd(QEMUFile *f, int fd)
+{
+    int ret;
+
+    if (!f->ops->send_fd) {
+        ret = -ENOTSUP;
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+
+    /* The data before it must not end up after it */
+    qemu_fflush(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    ret = f->ops->send_fd(f->opaque, QEMU_FILE_FD_MARKER, fd);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    f->pos++;
+    f->bytes_xfer++;
+
+    return 0;
+}
+
+/*
+ * Get the file descriptor sent by qemu_file_send_fd at this position
+ * of the stream.
+ *
+ * Returns the file descriptor, owned by the caller, or -1 on error
+ */
+int qemu_file_recv_fd(QEMUFile *f)
+{
+    int fd;
+
+    /* Reading the marker also receives the descriptor passed with it */
+    if (qemu_get_byte(f) != QEMU_FILE_FD_MARKER || !f->nfds) {
+        qemu_file_set_error(f, -EINVAL);
+        return -1;
+    }
+
+    fd = f->fds[0];
+    memmove(f->fds, f->fds + 1, --f->nfds * sizeof(int));
+    return fd;
+}
+
 static void add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size,
                          bool may_free)
 {
@@ -34,6 +34,13 @@
 typedef ssize_t (QEMUFileGetBufferFunc)(void *opaque, uint8_t *buf,
                                         int64_t pos, size_t size);
 
+/* Read like QEMUFileGetBufferFunc, and return the file descriptors
+ * that were passed along with the data in *fds (g_free'd by the caller)
+ */
+typedef ssize_t (QEMUFileGetBufferFdsFunc)(void *opaque, uint8_t *buf,
+                                           int64_t pos, size_t size,
+                                           int **fds, size_t *nfds);
+
 /* Close a file
  *
  * Return negative error number on error, 0 or positive value on success.
@@ -99,13 +106,22 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+/*
+ * Pass a file descriptor to the other side, along with one byte of data
+ * with the value @data.
+ * Returns 0 on success, -err on error
+ */
+typedef int (QEMUFileSendFdFunc)(void *opaque, uint8_t data, int fd);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
+    QEMUFileGetBufferFdsFunc *get_buffer_fds;
     QEMUFileCloseFunc *close;
     QEMUFileSetBlocking *set_blocking;
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFileSendFdFunc *send_fd;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -155,6 +171,8 @@ int qemu_file_shutdown(QEMUFile *f);
 QEMUFile *qemu_file_get_return_path(QEMUFile *f);
 void qemu_fflush(QEMUFile *f);
 void qemu_file_set_blocking(QEMUFile *f, bool block);
+int qemu_file_send_fd(QEMUFile *f, int fd);
+int qemu_file_recv_fd(QEMUFile *f);
 
 size_t qemu_get_counted_string(QEMUFile *f, char buf[256]);
 
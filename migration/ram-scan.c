@@ -0,0 +1,454 @@
+/*
+ * Parallel zero page scanning for RAM migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/thread.h"
+#include "exec/ram_addr.h"
+#include "sysemu/hostmem.h"
+#include "ram.h"
+#include "ram-scan.h"
+#include "trace.h"
+
+#ifdef CONFIG_LINUX
+#include <sched.h>
+#endif
+
+/*
+ * Target pages per scan chunk.  This is a multiple of BITS_PER_LONG, so
+ * that two scan threads never write to the same word of a zero bitmap.
+ */
+#define RAM_SCAN_CHUNK_PAGES 256
+
+typedef struct RAMScanChunk {
+    RAMBlock *rb;
+    /* First page of the chunk within the block */
+    unsigned long page;
+    unsigned long pages;
+} RAMScanChunk;
+
+typedef struct RAMScanBlock {
+    RAMBlock *rb;
+    /* Index of the first chunk of the block in the chunk table */
+    guint first_chunk;
+} RAMScanBlock;
+
+/* Chunks whose memory lives on one host NUMA node */
+typedef struct RAMScanQueue {
+    /* Host NUMA node, or -1 if unknown */
+    int node;
+    /* Indices into the chunk table, in ascending order */
+    GArray *chunks;
+    /* Next element of @chunks to scan */
+    guint next;
+} RAMScanQueue;
+
+typedef struct RAMScanThread {
+    QemuThread thread;
+    /* Queue the thread takes chunks from first */
+    int queue;
+} RAMScanThread;
+
+typedef struct RAMScanState {
+    /* The chunk table, in the order the migration thread walks RAM */
+    GArray *chunks;
+    GArray *blocks;
+    GArray *queues;
+    RAMScanThread *threads;
+    int nr_threads;
+    /* ram_list.version when the chunk table was built */
+    uint32_t version;
+
+    /* Protects the fields below and the queue cursors */
+    QemuMutex mutex;
+    QemuCond cond;
+    /* Dirty bitmap generation; results of older generations are stale */
+    uint32_t generation;
+    bool active;
+    bool quit;
+} RAMScanState;
+
+static RAMScanState *ram_scan_state;
+
+/*
+ * Return the host NUMA node of @rb if its memory backend binds it to
+ * a single node, or -1 otherwise.
+ */
+static int ram_scan_block_node(RAMBlock *rb)
+{
+    Object *owner = rb->mr ? rb->mr->owner : NULL;
+    HostMemoryBackend *backend;
+    unsigned long node;
+
+    if (!owner || !object_dynamic_cast(owner, TYPE_MEMORY_BACKEND)) {
+        return -1;
+    }
+
+    backend = MEMORY_BACKEND(owner);
+    if (backend->policy != HOST_MEM_POLICY_BIND &&
+        backend->policy != HOST_MEM_POLICY_PREFERRED) {
+        return -1;
+    }
+
+    node = find_first_bit(backend->host_nodes, MAX_NODES);
+    if (node >= MAX_NODES ||
+        find_next_bit(backend->host_nodes, MAX_NODES, node + 1) < MAX_NODES) {
+        return -1;
+    }
+    return node;
+}
+
+/* Run the calling thread on the host CPUs of NUMA node @node. */
+static void ram_scan_bind_node(int node)
+{
+#ifdef CONFIG_LINUX
+    gchar *path, *cpulist;
+    gchar **ranges;
+    cpu_set_t set;
+    int i;
+
+    if (node < 0) {
+        return;
+    }
+
+    path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist", node);
+    if (!g_file_get_contents(path, &cpulist, NULL, NULL)) {
+        g_free(path);
+        return;
+    }
+
+    CPU_ZERO(&set);
+    ranges = g_strsplit(g_strstrip(cpulist), ",", -1);
+    for (i = 0; ranges[i]; i++) {
+        const char *end;
+        unsigned long first, last;
+
+        if (qemu_strtoul(ranges[i], &end, 10, &first) < 0) {
+            continue;
+        }
+        last = first;
+        if (*end == '-' && qemu_strtoul(end + 1, NULL, 10, &last) < 0) {
+            continue;
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, &set);
+        }
+    }
+
+    if (CPU_COUNT(&set)) {
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    trace_ram_scan_bind_node(node, CPU_COUNT(&set));
+
+    g_strfreev(ranges);
+    g_free(cpulist);
+    g_free(path);
+#endif
+}
+
+/* Called with the mutex held. */
+static RAMScanChunk *ram_scan_next_chunk(RAMScanState *s, int queue)
+{
+    guint i;
+
+    /* Prefer local memory, but help the other nodes when done */
+    for (i = 0; i < s->queues->len; i++) {
+        RAMScanQueue *q = &g_array_index(s->queues, RAMScanQueue,
+                                         (queue + i) % s->queues->len);
+
+        if (q->next < q->chunks->len) {
+            guint chunk = g_array_index(q->chunks, guint, q->next++);
+
+            return &g_array_index(s->chunks, RAMScanChunk, chunk);
+        }
+    }
+    return NULL;
+}
+
+static void ram_scan_chunk(RAMScanState *s, RAMScanChunk *chunk,
+                           uint32_t generation)
+{
+    RAMBlock *rb = chunk->rb;
+    unsigned long page;
+
+    rcu_read_lock();
+
+    /* The chunk table is stale if blocks were added or removed */
+    if (atomic_read(&ram_list.version) != s->version) {
+        rcu_read_unlock();
+        return;
+    }
+    smp_rmb();
+
+    for (page = chunk->page; page < chunk->page + chunk->pages; page++) {
+        if (buffer_is_zero(rb->host + (page << TARGET_PAGE_BITS),
+                           TARGET_PAGE_SIZE)) {
+            set_bit(page, rb->zero_bmap);
+        } else {
+            clear_bit(page, rb->zero_bmap);
+        }
+    }
+
+    /* Publish the bitmap before the generation that validates it */
+    smp_wmb();
+    atomic_set(&rb->scan_gen[chunk->page / RAM_SCAN_CHUNK_PAGES],
+               generation);
+
+    rcu_read_unlock();
+}
+
+static void *ram_scan_thread(void *opaque)
+{
+    RAMScanThread *thread = opaque;
+    RAMScanState *s = ram_scan_state;
+    RAMScanQueue *q = &g_array_index(s->queues, RAMScanQueue, thread->queue);
+    RAMScanChunk *chunk;
+    uint32_t generation;
+
+    rcu_register_thread();
+    ram_scan_bind_node(q->node);
+
+    qemu_mutex_lock(&s->mutex);
+    while (!s->quit) {
+        chunk = s->active ? ram_scan_next_chunk(s, thread->queue) : NULL;
+        if (!chunk) {
+            qemu_cond_wait(&s->cond, &s->mutex);
+            continue;
+        }
+
+        /*
+         * The generation is bumped under the mutex after the dirty bitmap
+         * sync, so any write after this point is caught by the next sync.
+         */
+        generation = s->generation;
+        qemu_mutex_unlock(&s->mutex);
+
+        ram_scan_chunk(s, chunk, generation);
+
+        qemu_mutex_lock(&s->mutex);
+    }
+    qemu_mutex_unlock(&s->mutex);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static RAMScanQueue *ram_scan_get_queue(RAMScanState *s, int node)
+{
+    RAMScanQueue q = { .node = node };
+    guint i;
+
+    for (i = 0; i < s->queues->len; i++) {
+        if (g_array_index(s->queues, RAMScanQueue, i).node == node) {
+            return &g_array_index(s->queues, RAMScanQueue, i);
+        }
+    }
+
+    q.chunks = g_array_new(false, false, sizeof(guint));
+    g_array_append_val(s->queues, q);
+    return &g_array_index(s->queues, RAMScanQueue, s->queues->len - 1);
+}
+
+void ram_scan_setup(int threads)
+{
+    RAMScanState *s;
+    RAMBlock *block;
+    int i;
+
+    if (!threads) {
+        return;
+    }
+
+    s = g_new0(RAMScanState, 1);
+    s->chunks = g_array_new(false, false, sizeof(RAMScanChunk));
+    s->blocks = g_array_new(false, false, sizeof(RAMScanBlock));
+    s->queues = g_array_new(false, false, sizeof(RAMScanQueue));
+
+    RAMBLOCK_FOREACH(block) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        unsigned long max_pages = block->max_length >> TARGET_PAGE_BITS;
+        RAMScanQueue *q = ram_scan_get_queue(s, ram_scan_block_node(block));
+        RAMScanBlock b = { .rb = block, .first_chunk = s->chunks->len };
+        RAMScanChunk chunk = { .rb = block };
+
+        /* Nothing to scan in memory the destination maps directly */
+        if (ramblock_is_handed_off(block)) {
+            pages = 0;
+        }
+
+        block->zero_bmap = bitmap_new(max_pages);
+        block->scan_gen = g_new0(uint32_t,
+                                 DIV_ROUND_UP(max_pages,
+                                              RAM_SCAN_CHUNK_PAGES));
+        g_array_append_val(s->blocks, b);
+
+        for (chunk.page = 0; chunk.page < pages;
+             chunk.page += RAM_SCAN_CHUNK_PAGES) {
+            guint idx = s->chunks->len;
+
+            chunk.pages = MIN(pages - chunk.page, RAM_SCAN_CHUNK_PAGES);
+            g_array_append_val(s->chunks, chunk);
+            g_array_append_val(q->chunks, idx);
+        }
+    }
+
+    s->version = ram_list.version;
+    s->generation = 1;
+    s->active = true;
+    qemu_mutex_init(&s->mutex);
+    qemu_cond_init(&s->cond);
+    ram_scan_state = s;
+
+    trace_ram_scan_setup(threads, s->chunks->len, s->queues->len);
+
+    s->nr_threads = threads;
+    s->threads = g_new0(RAMScanThread, threads);
+    for (i = 0; i < threads; i++) {
+        s->threads[i].queue = i % s->queues->len;
+        qemu_thread_create(&s->threads[i].thread, "ramscan",
+                           ram_scan_thread, &s->threads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void ram_scan_cleanup(void)
+{
+    RAMScanState *s = ram_scan_state;
+    RAMBlock *block;
+    guint i;
+
+    if (!s) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->mutex);
+    s->quit = true;
+    qemu_cond_broadcast(&s->cond);
+    qemu_mutex_unlock(&s->mutex);
+
+    for (i = 0; i < s->nr_threads; i++) {
+        qemu_thread_join(&s->threads[i].thread);
+    }
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_free(block->zero_bmap);
+        block->zero_bmap = NULL;
+        g_free(block->scan_gen);
+        block->scan_gen = NULL;
+    }
+
+    for (i = 0; i < s->queues->len; i++) {
+        g_array_free(g_array_index(s->queues, RAMScanQueue, i).chunks, true);
+    }
+    g_array_free(s->queues, true);
+    g_array_free(s->blocks, true);
+    g_array_free(s->chunks, true);
+    g_free(s->threads);
+    qemu_mutex_destroy(&s->mutex);
+    qemu_cond_destroy(&s->cond);
+    g_free(s);
+    ram_scan_state = NULL;
+}
+
+/* Return the index in the chunk table of @page of @rb. */
+static guint ram_scan_chunk_index(RAMScanState *s, RAMBlock *rb,
+                                  unsigned long page)
+{
+    guint i;
+
+    for (i = 0; rb && i < s->blocks->len; i++) {
+        RAMScanBlock *b = &g_array_index(s->blocks, RAMScanBlock, i);
+
+        if (b->rb == rb) {
+            return b->first_chunk + page / RAM_SCAN_CHUNK_PAGES;
+        }
+    }
+    return 0;
+}
+
+/* Return the first element of @q not before chunk @chunk. */
+static guint ram_scan_queue_search(RAMScanQueue *q, guint chunk)
+{
+    guint lo = 0, hi = q->chunks->len;
+
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+
+        if (g_array_index(q->chunks, guint, mid) < chunk) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void ram_scan_sync(RAMBlock *rb, unsigned long page)
+{
+    RAMScanState *s = ram_scan_state;
+    guint i, chunk;
+
+    if (!s) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->mutex);
+    /* Generation 0 means "never scanned" */
+    if (!++s->generation) {
+        s->generation++;
+    }
+    trace_ram_scan_sync(s->generation);
+
+    if (s->active) {
+        /*
+         * The migration thread has already sent everything before its
+         * current position, so only rescan what is ahead of it.
+         */
+        chunk = ram_scan_chunk_index(s, rb, page);
+        for (i = 0; i < s->queues->len; i++) {
+            RAMScanQueue *q = &g_array_index(s->queues, RAMScanQueue, i);
+
+            q->next = ram_scan_queue_search(q, chunk);
+        }
+        qemu_cond_broadcast(&s->cond);
+    }
+    qemu_mutex_unlock(&s->mutex);
+}
+
+void ram_scan_stop(void)
+{
+    RAMScanState *s = ram_scan_state;
+
+    if (!s) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->mutex);
+    s->active = false;
+    qemu_mutex_unlock(&s->mutex);
+}
+
+bool ram_scan_lookup(RAMBlock *rb, unsigned long page, bool *zero)
+{
+    RAMScanState *s = ram_scan_state;
+
+    if (!s || !rb->scan_gen || !atomic_read(&s->active)) {
+        return false;
+    }
+
+    if (atomic_read(&rb->scan_gen[page / RAM_SCAN_CHUNK_PAGES]) !=
+        atomic_read(&s->generation)) {
+        return false;
+    }
+    smp_rmb();
+
+    *zero = test_bit(page, rb->zero_bmap);
+    return true;
+}
@@ -0,0 +1,45 @@
+/*
+ * Parallel zero page scanning for RAM migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_RAM_SCAN_H
+#define QEMU_MIGRATION_RAM_SCAN_H
+
+#include "exec/cpu-common.h"
+
+/*
+ * During the bulk stage of RAM migration every page of guest memory is
+ * sent once, and checking each of them for zeroes is what limits the
+ * migration thread.  The scan threads walk RAM ahead of the migration
+ * thread, one chunk at a time, and record which pages are zero.
+ *
+ * A scan result is tied to the generation of the dirty bitmap it was
+ * taken in: a page the guest writes after being scanned is caught by the
+ * next bitmap sync, and the sync invalidates all results taken before it.
+ */
+
+/* Create @threads scan threads.  Called under RCU with the ramlist lock. */
+void ram_scan_setup(int threads);
+
+/* Stop and destroy the scan threads.  Called with the iothread lock. */
+void ram_scan_cleanup(void);
+
+/*
+ * The dirty bitmap was synchronized: drop all scan results, and restart
+ * scanning from @page of @rb, where the migration thread currently is.
+ */
+void ram_scan_sync(RAMBlock *rb, unsigned long page);
+
+/* The bulk stage is over; the scan threads go idle. */
+void ram_scan_stop(void);
+
+/*
+ * Look up the scan result of @page of @rb.  Returns true and sets @zero
+ * if the page was scanned in the current generation.
+ */
+bool ram_scan_lookup(RAMBlock *rb, unsigned long page, bool *zero);
+
+#endif
@@ -35,6 +35,7 @@
 #include "qemu/main-loop.h"
 #include "xbzrle.h"
 #include "ram.h"
+#include "ram-scan.h"
 #include "migration.h"
 #include "migration/register.h"
 #include "migration/misc.h"
@@ -222,6 +223,12 @@ struct RAMState {
     uint64_t bytes_xfer_prev;
     /* number of dirty pages since start_time */
     uint64_t num_dirty_pages_period;
+    /* per-vcpu dirty page counters at start_time, indexed by cpu_index */
+    unsigned long *vcpu_dirty_pages_prev;
+    /* per-vcpu dirty pages in the last period, indexed by cpu_index */
+    unsigned long *vcpu_dirty_pages_period;
+    /* number of entries in the two arrays above */
+    int vcpu_dirty_pages_len;
     /* xbzrle misses since the beginning of the period */
     uint64_t xbzrle_cache_miss_prev;
     /* number of iterations at the beginning of period */
@@ -237,6 +244,13 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(src_page_requests, RAMSrcPageRequest) src_page_requests;
+    /* Channel for requested pages during postcopy, NULL if not preempting */
+    QEMUFile *preempt_f;
+    /* Thread that serves the page requests on preempt_f */
+    QemuThread preempt_thread;
+    /* Posted for each queued request, and to make preempt_thread quit */
+    QemuSemaphore preempt_sem;
+    bool preempt_quit;
 };
 typedef struct RAMState RAMState;
 
@@ -250,6 +264,25 @@ uint64_t ram_bytes_remaining(void)
 
 MigrationStats ram_counters;
 
+#ifndef CONFIG_ATOMIC64
+static QemuSpin ram_counters_lock;
+#endif
+
+/*
+ * With postcopy preemption the migration thread and the preempt thread
+ * both send pages, so the page and byte counters are updated atomically.
+ */
+static inline void ram_counters_add(int64_t *counter, int64_t n)
+{
+#ifdef CONFIG_ATOMIC64
+    atomic_add(counter, n);
+#else
+    qemu_spin_lock(&ram_counters_lock);
+    *counter += n;
+    qemu_spin_unlock(&ram_counters_lock);
+#endif
+}
+
 /* used by the search for pages to send */
 struct PageSearchStatus {
     /* Current block being searched */
@@ -258,6 +291,8 @@ struct PageSearchStatus {
     unsigned long page;
     /* Set once we wrap around */
     bool         complete_round;
+    /* Stream the pages found are sent on */
+    QEMUFile    *f;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -639,6 +674,7 @@ int multifd_load_setup(void)
  *
  * Returns the number of bytes written
  *
+ * @rs: current RAM state
  * @f: QEMUFile where to send the data
  * @block: block that contains the page we want to send
  * @offset: offset inside the block for the page
@@ -649,7 +685,11 @@ static size_t save_page_header(RAMState *rs, QEMUFile *f,  RAMBlock *block,
 {
     size_t size, len;
 
-    if (block == rs->last_sent_block) {
+    /*
+     * The postcopy preempt channel carries isolated pages, so the block
+     * is named on every one of them there.
+     */
+    if (f == rs->f && block == rs->last_sent_block) {
         offset |= RAM_SAVE_FLAG_CONTINUE;
     }
     qemu_put_be64(f, offset);
@@ -660,11 +700,106 @@ static size_t save_page_header(RAMState *rs, QEMUFile *f,  RAMBlock *block,
         qemu_put_byte(f, len);
         qemu_put_buffer(f, (uint8_t *)block->idstr, len);
         size += 1 + len;
-        rs->last_sent_block = block;
+        if (f == rs->f) {
+            rs->last_sent_block = block;
+        }
     }
     return size;
 }
 
+/**
+ * mig_update_vcpu_dirty_pages: account the pages dirtied by each vcpu
+ *
+ * Computes how many pages each vcpu dirtied since the last call, for
+ * accelerators that attribute dirty pages to vcpus.
+ *
+ * @rs: current RAM state
+ */
+static void mig_update_vcpu_dirty_pages(RAMState *rs)
+{
+    CPUState *cpu;
+    int len = 0;
+
+    if (!tcg_enabled()) {
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        len = MAX(len, cpu->cpu_index + 1);
+    }
+    if (len > rs->vcpu_dirty_pages_len) {
+        rs->vcpu_dirty_pages_prev = g_renew(unsigned long,
+                                            rs->vcpu_dirty_pages_prev, len);
+        rs->vcpu_dirty_pages_period = g_renew(unsigned long,
+                                              rs->vcpu_dirty_pages_period,
+                                              len);
+        memset(rs->vcpu_dirty_pages_prev + rs->vcpu_dirty_pages_len, 0,
+               (len - rs->vcpu_dirty_pages_len) * sizeof(unsigned long));
+        rs->vcpu_dirty_pages_len = len;
+    }
+    memset(rs->vcpu_dirty_pages_period, 0,
+           rs->vcpu_dirty_pages_len * sizeof(unsigned long));
+
+    CPU_FOREACH(cpu) {
+        unsigned long pages = atomic_read(&cpu->dirty_pages);
+
+        rs->vcpu_dirty_pages_period[cpu->cpu_index] =
+            pages - rs->vcpu_dirty_pages_prev[cpu->cpu_index];
+        rs->vcpu_dirty_pages_prev[cpu->cpu_index] = pages;
+    }
+}
+
+/**
+ * mig_throttle_vcpus_down: throttle down the vcpus dirtying the most memory
+ *
+ * Throttle the vcpus that dirtied more pages than the average in the last
+ * period; the step applied to each of them is proportional to its share
+ * of the highest per-vcpu dirty rate.  Vcpus dirtying less memory keep
+ * running at their current speed.
+ *
+ * Returns false if the dirty pages could not be attributed to vcpus.
+ *
+ * @rs: current RAM state
+ */
+static bool mig_throttle_vcpus_down(RAMState *rs)
+{
+    MigrationState *s = migrate_get_current();
+    uint64_t pct_initial = s->parameters.cpu_throttle_initial;
+    uint64_t pct_icrement = s->parameters.cpu_throttle_increment;
+    unsigned long total = 0, max = 0;
+    int nr_vcpus = 0;
+    CPUState *cpu;
+
+    if (!rs->vcpu_dirty_pages_len) {
+        return false;
+    }
+
+    CPU_FOREACH(cpu) {
+        unsigned long pages = rs->vcpu_dirty_pages_period[cpu->cpu_index];
+
+        total += pages;
+        max = MAX(max, pages);
+        nr_vcpus++;
+    }
+    if (!total) {
+        return false;
+    }
+
+    CPU_FOREACH(cpu) {
+        unsigned long pages = rs->vcpu_dirty_pages_period[cpu->cpu_index];
+        int pct = cpu_throttle_get_vcpu_percentage(cpu);
+        uint64_t step = pct ? pct_icrement : pct_initial;
+
+        if (pages * nr_vcpus < total) {
+            continue;
+        }
+        pct += MAX(step * pages / max, 1);
+        trace_migration_throttle_vcpu(cpu->cpu_index, pages, pct);
+        cpu_throttle_set_vcpu(cpu, pct);
+    }
+    return true;
+}
+
 /**
  * mig_throttle_guest_down: throotle down the guest
  *
@@ -673,13 +808,19 @@ static size_t save_page_header(RAMState *rs, QEMUFile *f,  RAMBlock *block,
  * which we can transfer pages to the destination then we should be
  * able to complete migration. Some workloads dirty memory way too
  * fast and will not effectively converge, even with auto-converge.
+ *
+ * @rs: current RAM state
  */
-static void mig_throttle_guest_down(void)
+static void mig_throttle_guest_down(RAMState *rs)
 {
     MigrationState *s = migrate_get_current();
     uint64_t pct_initial = s->parameters.cpu_throttle_initial;
     uint64_t pct_icrement = s->parameters.cpu_throttle_increment;
 
+    if (migrate_per_vcpu_throttle() && mig_throttle_vcpus_down(rs)) {
+        return;
+    }
+
     /* We have not started throttling yet. Let's start it. */
     if (!cpu_throttle_active()) {
         cpu_throttle_set(pct_initial);
@@ -789,7 +930,7 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
     bytes_xbzrle += encoded_len + 1 + 2;
     xbzrle_counters.pages++;
     xbzrle_counters.bytes += bytes_xbzrle;
-    ram_counters.transferred += bytes_xbzrle;
+    ram_counters_add(&ram_counters.transferred, bytes_xbzrle);
 
     return 1;
 }
@@ -813,6 +954,10 @@ unsigned long migration_bitmap_find_dirty(RAMState *rs, RAMBlock *rb,
     unsigned long *bitmap = rb->bmap;
     unsigned long next;
 
+    if (ramblock_is_handed_off(rb)) {
+        return size;
+    }
+
     if (rs->ram_bulk_stage && start > 0) {
         next = start + 1;
     } else {
@@ -836,6 +981,19 @@ static inline bool migration_bitmap_clear_dirty(RAMState *rs,
     return ret;
 }
 
+/**
+ * ramblock_is_handed_off: check if a RAMBlock is passed by file descriptor
+ *
+ * With the x-ram-handoff capability, shared file backed blocks are not
+ * copied; the destination maps the same file instead.
+ *
+ * @rb: RAMBlock to check
+ */
+bool ramblock_is_handed_off(RAMBlock *rb)
+{
+    return migrate_ram_handoff() && qemu_ram_is_shared(rb) && rb->fd >= 0;
+}
+
 static void migration_bitmap_sync_range(RAMState *rs, RAMBlock *rb,
                                         ram_addr_t start, ram_addr_t length)
 {
@@ -883,6 +1041,9 @@ static void migration_bitmap_sync(RAMState *rs)
     qemu_mutex_lock(&rs->bitmap_mutex);
     rcu_read_lock();
     RAMBLOCK_FOREACH(block) {
+        if (ramblock_is_handed_off(block)) {
+            continue;
+        }
         migration_bitmap_sync_range(rs, block, 0, block->used_length);
     }
     rcu_read_unlock();
@@ -890,6 +1051,9 @@ static void migration_bitmap_sync(RAMState *rs)
 
     trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
 
+    /* Zero page scan results taken before the sync are stale now */
+    ram_scan_sync(rs->last_seen_block, rs->last_page);
+
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     /* more than 1 second = 1000 millisecons */
@@ -898,6 +1062,7 @@ static void migration_bitmap_sync(RAMState *rs)
         ram_counters.dirty_pages_rate = rs->num_dirty_pages_period * 1000
             / (end_time - rs->time_last_bitmap_sync);
         bytes_xfer_now = ram_counters.transferred;
+        mig_update_vcpu_dirty_pages(rs);
 
         /* During block migration the auto-converge logic incorrectly detects
          * that ram migration makes no progress. Avoid this by disabling the
@@ -914,7 +1079,7 @@ static void migration_bitmap_sync(RAMState *rs)
                 (++rs->dirty_rate_high_cnt >= 2)) {
                     trace_migration_throttle();
                     rs->dirty_rate_high_cnt = 0;
-                    mig_throttle_guest_down();
+                    mig_throttle_guest_down(rs);
             }
         }
 
@@ -945,20 +1110,28 @@ static void migration_bitmap_sync(RAMState *rs)
  * Returns the number of pages written.
  *
  * @rs: current RAM state
+ * @f: QEMUFile where to send the data
  * @block: block that contains the page we want to send
  * @offset: offset inside the block for the page
  */
-static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
+static int save_zero_page(RAMState *rs, QEMUFile *f, RAMBlock *block,
+                          ram_addr_t offset)
 {
     uint8_t *p = block->host + offset;
     int pages = -1;
+    bool zero;
+
+    if (!ram_scan_lookup(block, offset >> TARGET_PAGE_BITS, &zero)) {
+        zero = is_zero_range(p, TARGET_PAGE_SIZE);
+    }
 
-    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
-        ram_counters.duplicate++;
-        ram_counters.transferred +=
-            save_page_header(rs, rs->f, block, offset | RAM_SAVE_FLAG_ZERO);
-        qemu_put_byte(rs->f, 0);
-        ram_counters.transferred += 1;
+    if (zero) {
+        ram_counters_add(&ram_counters.duplicate, 1);
+        ram_counters_add(&ram_counters.transferred,
+                         save_page_header(rs, f, block,
+                                          offset | RAM_SAVE_FLAG_ZERO));
+        qemu_put_byte(f, 0);
+        ram_counters_add(&ram_counters.transferred, 1);
         pages = 1;
     }
 
@@ -981,21 +1154,21 @@ static void ram_release_pages(const char *rbname, uint64_t offset, int pages)
  *
  * Return true if the pages has been saved, otherwise false is returned.
  */
-static bool control_save_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
-                              int *pages)
+static bool control_save_page(RAMState *rs, QEMUFile *f, RAMBlock *block,
+                              ram_addr_t offset, int *pages)
 {
     uint64_t bytes_xmit = 0;
     int ret;
 
     *pages = -1;
-    ret = ram_control_save_page(rs->f, block->offset, offset, TARGET_PAGE_SIZE,
+    ret = ram_control_save_page(f, block->offset, offset, TARGET_PAGE_SIZE,
                                 &bytes_xmit);
     if (ret == RAM_SAVE_CONTROL_NOT_SUPP) {
         return false;
     }
 
     if (bytes_xmit) {
-        ram_counters.transferred += bytes_xmit;
+        ram_counters_add(&ram_counters.transferred, bytes_xmit);
         *pages = 1;
     }
 
@@ -1004,9 +1177,9 @@ static bool control_save_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
     }
 
     if (bytes_xmit > 0) {
-        ram_counters.normal++;
+        ram_counters_add(&ram_counters.normal, 1);
     } else if (bytes_xmit == 0) {
-        ram_counters.duplicate++;
+        ram_counters_add(&ram_counters.duplicate, 1);
     }
 
     return true;
@@ -1018,25 +1191,27 @@ static bool control_save_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
  * Returns the number of pages written.
  *
  * @rs: current RAM state
+ * @f: QEMUFile where to send the data
  * @block: block that contains the page we want to send
  * @offset: offset inside the block for the page
  * @buf: the page to be sent
  * @async: send to page asyncly
  */
-static int save_normal_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
-                            uint8_t *buf, bool async)
+static int save_normal_page(RAMState *rs, QEMUFile *f, RAMBlock *block,
+                            ram_addr_t offset, uint8_t *buf, bool async)
 {
-    ram_counters.transferred += save_page_header(rs, rs->f, block,
-                                                 offset | RAM_SAVE_FLAG_PAGE);
+    ram_counters_add(&ram_counters.transferred,
+                     save_page_header(rs, f, block,
+                                      offset | RAM_SAVE_FLAG_PAGE));
     if (async) {
-        qemu_put_buffer_async(rs->f, buf, TARGET_PAGE_SIZE,
+        qemu_put_buffer_async(f, buf, TARGET_PAGE_SIZE,
                               migrate_release_ram() &
                               migration_in_postcopy());
     } else {
-        qemu_put_buffer(rs->f, buf, TARGET_PAGE_SIZE);
+        qemu_put_buffer(f, buf, TARGET_PAGE_SIZE);
     }
-    ram_counters.transferred += TARGET_PAGE_SIZE;
-    ram_counters.normal++;
+    ram_counters_add(&ram_counters.transferred, TARGET_PAGE_SIZE);
+    ram_counters_add(&ram_counters.normal, 1);
     return 1;
 }
 
@@ -1057,7 +1232,11 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 {
     int pages = -1;
     uint8_t *p;
-    bool send_async = true;
+    /*
+     * A background snapshot unprotects the page once it is saved, so it
+     * must be copied out before that
+     */
+    bool send_async = !migrate_background_snapshot();
     RAMBlock *block = pss->block;
     ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
     ram_addr_t current_addr = block->offset + offset;
@@ -1080,7 +1259,7 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 
     /* XBZRLE overflow or normal page */
     if (pages == -1) {
-        pages = save_normal_page(rs, block, offset, p, send_async);
+        pages = save_normal_page(rs, pss->f, block, offset, p, send_async);
     }
 
     XBZRLE_cache_unlock();
@@ -1138,7 +1317,7 @@ static void flush_compressed_data(RAMState *rs)
         qemu_mutex_lock(&comp_param[idx].mutex);
         if (!comp_param[idx].quit) {
             len = qemu_put_qemu_file(rs->f, comp_param[idx].file);
-            ram_counters.transferred += len;
+            ram_counters_add(&ram_counters.transferred, len);
         }
         qemu_mutex_unlock(&comp_param[idx].mutex);
     }
@@ -1168,8 +1347,8 @@ static int compress_page_with_multi_thread(RAMState *rs, RAMBlock *block,
                 qemu_cond_signal(&comp_param[idx].cond);
                 qemu_mutex_unlock(&comp_param[idx].mutex);
                 pages = 1;
-                ram_counters.normal++;
-                ram_counters.transferred += bytes_xmit;
+                ram_counters_add(&ram_counters.normal, 1);
+                ram_counters_add(&ram_counters.transferred, bytes_xmit);
                 break;
             }
         }
@@ -1216,6 +1395,7 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
             /* Flag that we've looped */
             pss->complete_round = true;
             rs->ram_bulk_stage = false;
+            ram_scan_stop();
             if (migrate_use_xbzrle()) {
                 /* If xbzrle is on, stop using the data compression at this
                  * point. In theory, xbzrle can do better than compression.
@@ -1369,7 +1549,7 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
     RAMBlock *ramblock;
     RAMState *rs = ram_state;
 
-    ram_counters.postcopy_requests++;
+    ram_counters_add(&ram_counters.postcopy_requests, 1);
     rcu_read_lock();
     if (!rbname) {
         /* Reuse last RAMBlock */
@@ -1410,6 +1590,9 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
     memory_region_ref(ramblock->mr);
     qemu_mutex_lock(&rs->src_page_req_mutex);
     QSIMPLEQ_INSERT_TAIL(&rs->src_page_requests, new_entry, next_req);
+    if (rs->preempt_f) {
+        qemu_sem_post(&rs->preempt_sem);
+    }
     qemu_mutex_unlock(&rs->src_page_req_mutex);
     rcu_read_unlock();
 
@@ -1454,7 +1637,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
     ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
     int res;
 
-    if (control_save_page(rs, block, offset, &res)) {
+    if (control_save_page(rs, pss->f, block, offset, &res)) {
         return res;
     }
 
@@ -1469,7 +1652,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
             flush_compressed_data(rs);
     }
 
-    res = save_zero_page(rs, block, offset);
+    res = save_zero_page(rs, pss->f, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
          * page would be stale
@@ -1520,6 +1703,7 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     int tmppages, pages = 0;
     size_t pagesize_bits =
         qemu_ram_pagesize(pss->block) >> TARGET_PAGE_BITS;
+    unsigned long start_page = pss->page & ~(pagesize_bits - 1);
 
     do {
         /* Check the pages is dirty and if it is send it */
@@ -1542,6 +1726,20 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     } while ((pss->page & (pagesize_bits - 1)) &&
              offset_in_ramblock(pss->block, pss->page << TARGET_PAGE_BITS));
 
+    /* A background snapshot lets the guest write to it again */
+    if (pages && migrate_background_snapshot()) {
+        int ret = ram_write_tracking_unprotect(
+                      pss->block->host + (start_page << TARGET_PAGE_BITS),
+                      (pss->page - start_page) << TARGET_PAGE_BITS);
+
+        if (ret) {
+            error_report("%s: Failed to unprotect %s page 0x%lx: %s",
+                         __func__, pss->block->idstr, start_page,
+                         strerror(-ret));
+            return ret;
+        }
+    }
+
     /* The offset we leave with is the last one we looked at */
     pss->page--;
     return pages;
@@ -1565,7 +1763,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 {
     PageSearchStatus pss;
     int pages = 0;
-    bool again, found;
+    bool again, found, preempt;
 
     /* No dirty page as there is zero RAM */
     if (!ram_bytes_total()) {
@@ -1575,21 +1773,37 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     pss.block = rs->last_seen_block;
     pss.page = rs->last_page;
     pss.complete_round = false;
+    pss.f = rs->f;
 
     if (!pss.block) {
         pss.block = QLIST_FIRST_RCU(&ram_list.blocks);
     }
 
+    /*
+     * preempt_f is only set and cleared by the migration thread, so it
+     * can't change under us.
+     */
+    preempt = rs->preempt_f != NULL;
+
     do {
         again = true;
-        found = get_queued_page(rs, &pss);
+        /* With postcopy preemption the requests are served elsewhere */
+        found = !preempt && get_queued_page(rs, &pss);
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
             found = find_dirty_block(rs, &pss, &again);
         }
 
-        if (found) {
+        if (found && preempt) {
+            /*
+             * Keep the host page whole against the preempt thread: each
+             * of its target pages must go out on the same stream.
+             */
+            qemu_mutex_lock(&rs->bitmap_mutex);
+            pages = ram_save_host_page(rs, &pss, last_stage);
+            qemu_mutex_unlock(&rs->bitmap_mutex);
+        } else if (found) {
             pages = ram_save_host_page(rs, &pss, last_stage);
         }
     } while (!pages && again);
@@ -1600,15 +1814,127 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     return pages;
 }
 
+/**
+ * ram_preempt_thread: serve postcopy page requests on the preempt channel
+ *
+ * Requested pages are sent on a stream of their own, so that they do
+ * not wait behind the background pages already queued on the main one.
+ *
+ * @opaque: RAMState pointer
+ */
+static void *ram_preempt_thread(void *opaque)
+{
+    RAMState *rs = opaque;
+    PageSearchStatus pss;
+    int pages, ret = 0;
+
+    rcu_register_thread();
+
+    pss.complete_round = false;
+    pss.f = rs->preempt_f;
+
+    while (!ret) {
+        qemu_sem_wait(&rs->preempt_sem);
+        if (atomic_read(&rs->preempt_quit)) {
+            break;
+        }
+
+        rcu_read_lock();
+        while (get_queued_page(rs, &pss)) {
+            qemu_mutex_lock(&rs->bitmap_mutex);
+            pages = ram_save_host_page(rs, &pss, false);
+            qemu_mutex_unlock(&rs->bitmap_mutex);
+            if (pages < 0) {
+                qemu_file_set_error(pss.f, pages);
+                break;
+            }
+            /* The destination is blocked on this page: don't buffer it */
+            qemu_fflush(pss.f);
+            trace_ram_preempt_thread_sent(pss.block->idstr,
+                                          (uint64_t)pss.page, pages);
+        }
+        rcu_read_unlock();
+
+        ret = qemu_file_get_error(pss.f);
+    }
+
+    if (ret) {
+        error_report("%s: postcopy preempt channel failed: %s", __func__,
+                     strerror(-ret));
+        /* Fail the migration from the migration thread */
+        qemu_file_set_error(rs->f, ret);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/**
+ * ram_postcopy_preempt_start: start sending requested pages on @f
+ *
+ * @f: the postcopy preempt channel
+ */
+void ram_postcopy_preempt_start(QEMUFile *f)
+{
+    RAMState *rs = ram_state;
+
+    rs->preempt_quit = false;
+    qemu_sem_init(&rs->preempt_sem, 0);
+    /* Pick up anything that was queued before the thread was there */
+    qemu_mutex_lock(&rs->src_page_req_mutex);
+    atomic_set(&rs->preempt_f, f);
+    if (!QSIMPLEQ_EMPTY(&rs->src_page_requests)) {
+        qemu_sem_post(&rs->preempt_sem);
+    }
+    qemu_mutex_unlock(&rs->src_page_req_mutex);
+
+    qemu_thread_create(&rs->preempt_thread, "postcopy/preempt",
+                       ram_preempt_thread, rs, QEMU_THREAD_JOINABLE);
+    trace_ram_postcopy_preempt_start();
+}
+
+static void ram_postcopy_preempt_stop(RAMState *rs)
+{
+    if (!rs->preempt_f) {
+        return;
+    }
+
+    atomic_set(&rs->preempt_quit, true);
+    qemu_sem_post(&rs->preempt_sem);
+    qemu_thread_join(&rs->preempt_thread);
+
+    qemu_mutex_lock(&rs->src_page_req_mutex);
+    atomic_set(&rs->preempt_f, NULL);
+    qemu_mutex_unlock(&rs->src_page_req_mutex);
+    qemu_sem_destroy(&rs->preempt_sem);
+}
+
+/**
+ * ram_postcopy_preempt_finish: stop serving requests on the preempt channel
+ *
+ * Called once all RAM has been sent; terminates the channel so that the
+ * destination can wait for the pages still in flight on it.
+ *
+ * @f: the postcopy preempt channel
+ */
+void ram_postcopy_preempt_finish(QEMUFile *f)
+{
+    ram_postcopy_preempt_stop(ram_state);
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    qemu_fflush(f);
+    trace_ram_postcopy_preempt_finish();
+}
+
 void acct_update_position(QEMUFile *f, size_t size, bool zero)
 {
     uint64_t pages = size / TARGET_PAGE_SIZE;
 
     if (zero) {
-        ram_counters.duplicate += pages;
+        ram_counters_add(&ram_counters.duplicate, pages);
     } else {
-        ram_counters.normal += pages;
-        ram_counters.transferred += size;
+        ram_counters_add(&ram_counters.normal, pages);
+        ram_counters_add(&ram_counters.transferred, size);
         qemu_update_position(f, size);
     }
 }
@@ -1643,6 +1969,8 @@ static void ram_state_cleanup(RAMState **rsp)
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
+        g_free((*rsp)->vcpu_dirty_pages_prev);
+        g_free((*rsp)->vcpu_dirty_pages_period);
         g_free(*rsp);
         *rsp = NULL;
     }
@@ -1669,10 +1997,19 @@ static void ram_save_cleanup(void *opaque)
     RAMState **rsp = opaque;
     RAMBlock *block;
 
+    if (*rsp) {
+        ram_postcopy_preempt_stop(*rsp);
+    }
+
     /* caller have hold iothread lock or is in a bh, so there is
      * no writing race against this migration_bitmap
      */
-    memory_global_dirty_log_stop();
+    if (migrate_background_snapshot()) {
+        ram_write_tracking_stop(migrate_get_current());
+    } else {
+        memory_global_dirty_log_stop();
+    }
+    ram_scan_cleanup();
 
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         g_free(block->bmap);
@@ -2153,6 +2490,8 @@ err_out:
 
 static int ram_state_init(RAMState **rsp)
 {
+    RAMBlock *block;
+
     *rsp = g_try_new0(RAMState, 1);
 
     if (!*rsp) {
@@ -2170,6 +2509,16 @@ static int ram_state_init(RAMState **rsp)
      */
     (*rsp)->migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
+    /* Blocks handed off to the destination never have dirty pages */
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        if (ramblock_is_handed_off(block)) {
+            (*rsp)->migration_dirty_pages -=
+                block->used_length >> TARGET_PAGE_BITS;
+        }
+    }
+    rcu_read_unlock();
+
     ram_state_reset(*rsp);
 
     return 0;
@@ -2185,7 +2534,9 @@ static void ram_list_init_bitmaps(void)
         QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
             pages = block->max_length >> TARGET_PAGE_BITS;
             block->bmap = bitmap_new(pages);
-            bitmap_set(block->bmap, 0, pages);
+            if (!ramblock_is_handed_off(block)) {
+                bitmap_set(block->bmap, 0, pages);
+            }
             if (migrate_postcopy_ram()) {
                 block->unsentmap = bitmap_new(pages);
                 bitmap_set(block->unsentmap, 0, pages);
@@ -2202,8 +2553,18 @@ static void ram_init_bitmaps(RAMState *rs)
     rcu_read_lock();
 
     ram_list_init_bitmaps();
-    memory_global_dirty_log_start();
-    migration_bitmap_sync(rs);
+    /*
+     * A background snapshot sends each page once, and catches writes
+     * with write protection instead of the dirty log
+     */
+    if (!migrate_background_snapshot()) {
+        memory_global_dirty_log_start();
+        migration_bitmap_sync(rs);
+    }
+    if (ram_bytes_total()) {
+        /* The migration thread is one of the scanners */
+        ram_scan_setup(migrate_scan_threads() - 1);
+    }
 
     rcu_read_unlock();
     qemu_mutex_unlock_ramlist();
@@ -2270,6 +2631,21 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         if (migrate_postcopy_ram() && block->page_size != qemu_host_page_size) {
             qemu_put_be64(f, block->page_size);
         }
+        if (migrate_ram_handoff()) {
+            bool handoff = ramblock_is_handed_off(block);
+
+            qemu_put_byte(f, handoff);
+            if (handoff) {
+                trace_ram_save_handoff(block->idstr, block->fd);
+                if (qemu_file_send_fd(f, block->fd)) {
+                    error_report("Failed to pass RAM block %s, RAM handoff "
+                                 "needs a unix socket migration",
+                                 block->idstr);
+                    rcu_read_unlock();
+                    return -1;
+                }
+            }
+        }
     }
 
     rcu_read_unlock();
@@ -2354,7 +2730,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
 out:
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-    ram_counters.transferred += 8;
+    ram_counters_add(&ram_counters.transferred, 8);
 
     ret = qemu_file_get_error(f);
     if (ret < 0) {
@@ -2381,7 +2757,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     rcu_read_lock();
 
-    if (!migration_in_postcopy()) {
+    if (!migration_in_postcopy() && !migrate_background_snapshot()) {
         migration_bitmap_sync(rs);
     }
 
@@ -2421,7 +2797,7 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
 
     remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
 
-    if (!migration_in_postcopy() &&
+    if (!migration_in_postcopy() && !migrate_background_snapshot() &&
         remaining_size < max_size) {
         qemu_mutex_lock_iothread();
         rcu_read_lock();
@@ -2482,19 +2858,23 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: RAM_CHANNEL_* the stream belongs to
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block = NULL;
+    /* Each channel continues from the last block named on it */
+    static RAMBlock *blocks[RAM_CHANNEL_MAX];
+    RAMBlock *block;
     char id[256];
     uint8_t len;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
+        if (!blocks[channel]) {
             error_report("Ack, bad migration stream!");
             return NULL;
         }
-        return block;
+        return blocks[channel];
     }
 
     len = qemu_get_byte(f);
@@ -2507,6 +2887,7 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
         return NULL;
     }
 
+    blocks[channel] = block;
     return block;
 }
 
@@ -2779,19 +3160,21 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the preempt thread for
+ * the postcopy preempt channel.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: RAM_CHANNEL_* @f belongs to
  */
-static int ram_load_postcopy(QEMUFile *f)
+static int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matching_page_sizes = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = postcopy_get_tmp_page(mis);
+    void *postcopy_host_page = postcopy_get_tmp_page(mis, channel);
     void *last_host = NULL;
     bool all_zero = false;
 
@@ -2820,7 +3203,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         place_needed = false;
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, channel);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -2919,6 +3302,24 @@ static int ram_load_postcopy(QEMUFile *f)
     return ret;
 }
 
+/**
+ * ram_load_postcopy_preempt: load the pages of the postcopy preempt channel
+ *
+ * Returns 0 once the source terminated the channel, or -errno
+ *
+ * @f: the postcopy preempt channel
+ */
+int ram_load_postcopy_preempt(QEMUFile *f)
+{
+    int ret;
+
+    rcu_read_lock();
+    ret = ram_load_postcopy(f, RAM_CHANNEL_POSTCOPY);
+    rcu_read_unlock();
+
+    return ret;
+}
+
 static bool postcopy_is_advised(void)
 {
     PostcopyState ps = postcopy_state_get();
@@ -2961,7 +3362,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     rcu_read_lock();
 
     if (postcopy_running) {
-        ret = ram_load_postcopy(f);
+        ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
     }
 
     while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
@@ -2984,7 +3385,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -3033,6 +3435,21 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                             ret = -EINVAL;
                         }
                     }
+                    if (migrate_ram_handoff() && qemu_get_byte(f)) {
+                        Error *local_err = NULL;
+                        int fd = qemu_file_recv_fd(f);
+
+                        trace_ram_load_handoff(id, fd);
+                        if (fd < 0) {
+                            error_report("Failed to receive RAM block %s",
+                                         id);
+                            ret = -EINVAL;
+                        } else if (qemu_ram_adopt_fd(block, fd, &local_err)) {
+                            error_report_err(local_err);
+                            close(fd);
+                            ret = -EINVAL;
+                        }
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -53,12 +53,17 @@ void ram_debug_dump_bitmap(unsigned long *todump, bool expected,
 void ram_postcopy_migrated_memory_release(MigrationState *ms);
 /* For outgoing discard bitmap */
 int ram_postcopy_send_discard_bitmap(MigrationState *ms);
+/* For sending requested pages on the postcopy preempt channel */
+void ram_postcopy_preempt_start(QEMUFile *f);
+void ram_postcopy_preempt_finish(QEMUFile *f);
 /* For incoming postcopy discard */
 int ram_discard_range(const char *block_name, uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
+int ram_load_postcopy_preempt(QEMUFile *f);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
+bool ramblock_is_handed_off(RAMBlock *rb);
 int ramblock_recv_bitmap_test(RAMBlock *rb, void *host_addr);
 bool ramblock_recv_bitmap_test_byte_offset(RAMBlock *rb, uint64_t byte_offset);
 void ramblock_recv_bitmap_set(RAMBlock *rb, void *host_addr);
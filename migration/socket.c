@@ -56,6 +56,49 @@ static SocketAddress *unix_build_address(const char *path)
 }
 
 
+/*
+ * Address of the current outgoing migration, kept so that further
+ * channels can be opened to the same destination.
+ */
+static SocketAddress *outgoing_saddr;
+
+/**
+ * socket_send_channel_create_sync: open another channel to the destination
+ *
+ * Returns the connected channel, or NULL with @errp set
+ *
+ * @errp: set if the connection fails, or if the current migration does
+ *        not use a socket
+ */
+QIOChannel *socket_send_channel_create_sync(Error **errp)
+{
+    QIOChannelSocket *sioc;
+
+    if (!outgoing_saddr) {
+        error_setg(errp, "Migration is not using a socket");
+        return NULL;
+    }
+
+    sioc = qio_channel_socket_new();
+    if (qio_channel_socket_connect_sync(sioc, outgoing_saddr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+
+    return QIO_CHANNEL(sioc);
+}
+
+/**
+ * socket_send_channel_cleanup: forget the address of the destination
+ *
+ * Called when the outgoing migration is torn down.
+ */
+void socket_send_channel_cleanup(void)
+{
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = NULL;
+}
+
 struct SocketConnectData {
     MigrationState *s;
     char *hostname;
@@ -106,7 +149,8 @@ static void socket_start_outgoing_migration(MigrationState *s,
                                      data,
                                      socket_connect_data_free,
                                      NULL);
-    qapi_free_SocketAddress(saddr);
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = saddr;
 }
 
 void tcp_start_outgoing_migration(MigrationState *s,
@@ -130,6 +174,25 @@ void unix_start_outgoing_migration(MigrationState *s,
 }
 
 
+/* Listener of the current incoming migration, until it has all channels */
+static QIONetListener *incoming_listener;
+
+/**
+ * socket_incoming_cleanup: stop accepting channels for the incoming migration
+ *
+ * Called when the incoming migration ends, in case some optional channel
+ * was never connected.
+ */
+void socket_incoming_cleanup(void)
+{
+    if (incoming_listener) {
+        /* Close listening socket as its no longer needed */
+        qio_net_listener_disconnect(incoming_listener);
+        object_unref(OBJECT(incoming_listener));
+        incoming_listener = NULL;
+    }
+}
+
 static void socket_accept_incoming_migration(QIONetListener *listener,
                                              QIOChannelSocket *cioc,
                                              gpointer opaque)
@@ -140,10 +203,7 @@ static void socket_accept_incoming_migration(QIONetListener *listener,
     migration_channel_process_incoming(QIO_CHANNEL(cioc));
 
     if (migration_has_all_channels()) {
-        /* Close listening socket as its no longer needed */
-        qio_net_listener_disconnect(listener);
-
-        object_unref(OBJECT(listener));
+        socket_incoming_cleanup();
     }
 }
 
@@ -160,6 +220,7 @@ static void socket_start_incoming_migration(SocketAddress *saddr,
         return;
     }
 
+    incoming_listener = listener;
     qio_net_listener_set_client_func(listener,
                                      socket_accept_incoming_migration,
                                      NULL, NULL);
@@ -16,6 +16,9 @@
 
 #ifndef QEMU_MIGRATION_SOCKET_H
 #define QEMU_MIGRATION_SOCKET_H
+
+#include "io/channel.h"
+
 void tcp_start_incoming_migration(const char *host_port, Error **errp);
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port,
@@ -25,4 +28,8 @@ void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path,
                                    Error **errp);
+
+QIOChannel *socket_send_channel_create_sync(Error **errp);
+void socket_send_channel_cleanup(void);
+void socket_incoming_cleanup(void);
 #endif
@@ -0,0 +1,756 @@
+/*
+ * AF_XDP network backend
+ *
+ * Each queue of the netdev owns an AF_XDP socket bound to one queue of the
+ * host interface, with its own UMEM.  A small XDP program attached to the
+ * interface redirects the packets of the bound queues to the sockets
+ * through an XSKMAP, and passes everything else to the host stack.
+ *
+ * The program is loaded and attached with the bpf() system call and an
+ * rtnetlink request, so that no BPF library is needed.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "qemu/iov.h"
+#include "qemu/cutils.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/* Size of each of the four rings of a socket */
+#define AF_XDP_RING_SIZE    2048
+#define AF_XDP_FRAME_SIZE   4096
+
+/*
+ * The first AF_XDP_RING_SIZE frames of the UMEM are for receive and are
+ * always either in the fill ring or in the RX ring; the others are for
+ * transmit.
+ */
+#define AF_XDP_NUM_FRAMES   (2 * AF_XDP_RING_SIZE)
+#define AF_XDP_UMEM_SIZE    (AF_XDP_NUM_FRAMES * AF_XDP_FRAME_SIZE)
+
+typedef struct AFXDPRing {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;        /* NULL if the kernel has no ring flags */
+    void *desc;
+    void *map;
+    size_t map_size;
+} AFXDPRing;
+
+/* The XDP program and map, shared by all queues of a netdev */
+typedef struct AFXDPProg {
+    int ifindex;
+    uint32_t mode_flags;
+    int prog_fd;
+    int map_fd;
+    unsigned refcnt;
+} AFXDPProg;
+
+typedef struct AFXDPState {
+    NetClientState nc;
+    AFXDPProg *prog;
+    int fd;
+    uint32_t queue;
+    uint8_t *umem;
+    AFXDPRing rx;
+    AFXDPRing tx;
+    AFXDPRing fill;
+    AFXDPRing comp;
+    uint64_t tx_free[AF_XDP_RING_SIZE];
+    unsigned n_tx_free;
+    bool read_poll;
+    bool write_poll;
+    bool need_wakeup;       /* the kernel says when it needs a kick */
+} AFXDPState;
+
+static void af_xdp_send(void *opaque);
+static void af_xdp_writable(void *opaque);
+
+static void af_xdp_update_fd_handler(AFXDPState *s)
+{
+    qemu_set_fd_handler(s->fd,
+                        s->read_poll ? af_xdp_send : NULL,
+                        s->write_poll ? af_xdp_writable : NULL,
+                        s);
+}
+
+static void af_xdp_read_poll(AFXDPState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_write_poll(AFXDPState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_poll(NetClientState *nc, bool enable)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    if (s->read_poll != enable || s->write_poll != enable) {
+        s->read_poll = enable;
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+/* Move the frames that the kernel has transmitted back to the free list. */
+static void af_xdp_complete_tx(AFXDPState *s)
+{
+    uint64_t *addrs = s->comp.desc;
+    uint32_t prod = atomic_load_acquire(s->comp.producer);
+    uint32_t cons = *s->comp.consumer;
+
+    while (cons != prod) {
+        s->tx_free[s->n_tx_free++] = addrs[cons++ & (AF_XDP_RING_SIZE - 1)];
+    }
+    atomic_store_release(s->comp.consumer, cons);
+}
+
+/*
+ * With XDP_USE_NEED_WAKEUP, the kernel sets XDP_RING_NEED_WAKEUP in the
+ * flags of a ring when it stopped looking at it, and only then does it
+ * need a system call.  Without it, it always does.
+ */
+static bool af_xdp_ring_needs_wakeup(AFXDPState *s, AFXDPRing *ring)
+{
+#ifdef XDP_RING_NEED_WAKEUP
+    if (s->need_wakeup) {
+        /* Order the update of the producer index before the flags check */
+        smp_mb();
+        return atomic_read(ring->flags) & XDP_RING_NEED_WAKEUP;
+    }
+#endif
+    return true;
+}
+
+/* Make the kernel look at the TX ring.  */
+static void af_xdp_kick_tx(AFXDPState *s)
+{
+    int ret;
+
+    if (!af_xdp_ring_needs_wakeup(s, &s->tx)) {
+        return;
+    }
+
+    do {
+        ret = sendto(s->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0 && (errno == EAGAIN || errno == EBUSY || errno == ENOBUFS)) {
+        /* Some descriptors were not consumed, try again later.  */
+        af_xdp_write_poll(s, true);
+    }
+}
+
+/* Make the kernel look at the fill ring, when it waits for frames.  */
+static void af_xdp_kick_fill(AFXDPState *s)
+{
+    if (s->need_wakeup && af_xdp_ring_needs_wakeup(s, &s->fill)) {
+        recvfrom(s->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+
+static void af_xdp_writable(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    af_xdp_write_poll(s, false);
+    af_xdp_kick_tx(s);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+/* Return how many packets can be put on the TX ring right now.  */
+static unsigned af_xdp_tx_space(AFXDPState *s)
+{
+    af_xdp_complete_tx(s);
+    return s->n_tx_free;
+}
+
+static void af_xdp_tx_put(AFXDPState *s, uint32_t *prod,
+                          const struct iovec *iov, int iovcnt, size_t size)
+{
+    struct xdp_desc *desc = s->tx.desc;
+    uint64_t addr = s->tx_free[--s->n_tx_free];
+
+    iov_to_buf(iov, iovcnt, 0, s->umem + addr, size);
+    desc[*prod & (AF_XDP_RING_SIZE - 1)].addr = addr;
+    desc[*prod & (AF_XDP_RING_SIZE - 1)].len = size;
+    desc[*prod & (AF_XDP_RING_SIZE - 1)].options = 0;
+    (*prod)++;
+}
+
+static void af_xdp_tx_commit(AFXDPState *s, uint32_t prod)
+{
+    if (prod != *s->tx.producer) {
+        atomic_store_release(s->tx.producer, prod);
+        af_xdp_kick_tx(s);
+    }
+}
+
+static ssize_t af_xdp_receive_iov(NetClientState *nc,
+                                  const struct iovec *iov, int iovcnt)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
+    uint32_t prod;
+
+    if (size > AF_XDP_FRAME_SIZE) {
+        /* Drop.  */
+        return size;
+    }
+
+    if (!af_xdp_tx_space(s)) {
+        af_xdp_write_poll(s, true);
+        return 0;
+    }
+
+    prod = *s->tx.producer;
+    af_xdp_tx_put(s, &prod, iov, iovcnt, size);
+    af_xdp_tx_commit(s, prod);
+    return size;
+}
+
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_xdp_receive_iov(nc, &iov, 1);
+}
+
+static int af_xdp_receive_batch(NetClientState *nc,
+                                const struct iovec *packets, int count)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    int n = MIN(count, af_xdp_tx_space(s));
+    uint32_t prod = *s->tx.producer;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (packets[i].iov_len <= AF_XDP_FRAME_SIZE) {
+            af_xdp_tx_put(s, &prod, &packets[i], 1, packets[i].iov_len);
+        }
+    }
+    if (n < count) {
+        af_xdp_write_poll(s, true);
+    }
+    af_xdp_tx_commit(s, prod);
+    return n;
+}
+
+static void af_xdp_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    af_xdp_read_poll(s, true);
+}
+
+static void af_xdp_send(void *opaque)
+{
+    AFXDPState *s = opaque;
+    struct xdp_desc *desc = s->rx.desc;
+    uint64_t *fill = s->fill.desc;
+    uint32_t prod = atomic_load_acquire(s->rx.producer);
+    uint32_t cons = *s->rx.consumer;
+    uint32_t fill_prod = *s->fill.producer;
+
+    qemu_net_plug(&s->nc);
+    while (cons != prod) {
+        struct xdp_desc *d = &desc[cons++ & (AF_XDP_RING_SIZE - 1)];
+        ssize_t size;
+
+        /*
+         * The packet is either consumed or copied to the peer's queue
+         * when this returns, so the frame can go back to the kernel.
+         */
+        size = qemu_send_packet_async(&s->nc, s->umem + d->addr, d->len,
+                                      af_xdp_send_completed);
+        fill[fill_prod++ & (AF_XDP_RING_SIZE - 1)] =
+            d->addr & ~(uint64_t)(AF_XDP_FRAME_SIZE - 1);
+
+        if (size == 0) {
+            af_xdp_read_poll(s, false);
+            break;
+        }
+    }
+    atomic_store_release(s->rx.consumer, cons);
+    atomic_store_release(s->fill.producer, fill_prod);
+    af_xdp_kick_fill(s);
+    qemu_net_unplug(&s->nc);
+}
+
+static int af_xdp_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+ * Attach @prog_fd as the XDP program of @ifindex, or detach the current
+ * program if @prog_fd is -1.  Returns 0 or a negative errno.
+ */
+static int af_xdp_link_set_prog(int ifindex, int prog_fd, uint32_t flags)
+{
+    struct {
+        struct nlmsghdr nh;
+        struct ifinfomsg ifinfo;
+        char attrbuf[64];
+    } req;
+    char buf[4096];
+    struct nlmsghdr *nh;
+    struct nlattr *xdp, *nla;
+    ssize_t len;
+    int sock, ret;
+
+    sock = qemu_socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (sock < 0) {
+        return -errno;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req.nh.nlmsg_type = RTM_SETLINK;
+    req.ifinfo.ifi_family = AF_UNSPEC;
+    req.ifinfo.ifi_index = ifindex;
+
+    xdp = (struct nlattr *)((char *)&req + NLMSG_ALIGN(req.nh.nlmsg_len));
+    xdp->nla_type = NLA_F_NESTED | IFLA_XDP;
+    xdp->nla_len = NLA_HDRLEN;
+
+    nla = (struct nlattr *)((char *)xdp + xdp->nla_len);
+    nla->nla_type = IFLA_XDP_FD;
+    nla->nla_len = NLA_HDRLEN + sizeof(prog_fd);
+    memcpy((char *)nla + NLA_HDRLEN, &prog_fd, sizeof(prog_fd));
+    xdp->nla_len += nla->nla_len;
+
+    nla = (struct nlattr *)((char *)xdp + xdp->nla_len);
+    nla->nla_type = IFLA_XDP_FLAGS;
+    nla->nla_len = NLA_HDRLEN + sizeof(flags);
+    memcpy((char *)nla + NLA_HDRLEN, &flags, sizeof(flags));
+    xdp->nla_len += nla->nla_len;
+
+    req.nh.nlmsg_len += NLA_ALIGN(xdp->nla_len);
+
+    if (send(sock, &req, req.nh.nlmsg_len, 0) < 0) {
+        ret = -errno;
+        goto out;
+    }
+    len = recv(sock, buf, sizeof(buf), 0);
+    if (len < 0) {
+        ret = -errno;
+        goto out;
+    }
+
+    ret = -EPROTO;
+    for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+         nh = NLMSG_NEXT(nh, len)) {
+        if (nh->nlmsg_type == NLMSG_ERROR) {
+            struct nlmsgerr *err = NLMSG_DATA(nh);
+            ret = err->error;
+            break;
+        }
+    }
+
+out:
+    close(sock);
+    return ret;
+}
+
+static void af_xdp_prog_put(AFXDPProg *prog)
+{
+    if (--prog->refcnt) {
+        return;
+    }
+    if (prog->ifindex) {
+        af_xdp_link_set_prog(prog->ifindex, -1, prog->mode_flags);
+    }
+    if (prog->prog_fd >= 0) {
+        close(prog->prog_fd);
+    }
+    if (prog->map_fd >= 0) {
+        close(prog->map_fd);
+    }
+    g_free(prog);
+}
+
+/*
+ * Create the XSKMAP with room for queues 0 to @max_queue - 1, load the
+ * program and attach it to @ifindex.
+ */
+static AFXDPProg *af_xdp_prog_new(int ifindex, uint32_t max_queue,
+                                  const NetdevAFXDPOptions *opts,
+                                  Error **errp)
+{
+    AFXDPProg *prog = g_new0(AFXDPProg, 1);
+    union bpf_attr attr;
+    int ret;
+
+    prog->refcnt = 1;
+    prog->prog_fd = -1;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(int);
+    attr.max_entries = max_queue;
+    prog->map_fd = af_xdp_bpf(BPF_MAP_CREATE, &attr);
+    if (prog->map_fd < 0) {
+        error_setg_errno(errp, errno, "af-xdp: could not create XSKMAP");
+        goto fail;
+    }
+
+    {
+        /*
+         * return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS);
+         *
+         * The lower bits of the flags are the action taken when there is
+         * no socket for the queue in the map.
+         */
+        struct bpf_insn insns[] = {
+            {
+                .code = BPF_LDX | BPF_MEM | BPF_W,
+                .dst_reg = BPF_REG_2,
+                .src_reg = BPF_REG_1,
+                .off = offsetof(struct xdp_md, rx_queue_index),
+            }, {
+                .code = BPF_LD | BPF_DW | BPF_IMM,
+                .dst_reg = BPF_REG_1,
+                .src_reg = BPF_PSEUDO_MAP_FD,
+                .imm = prog->map_fd,
+            }, {
+                /* second half of the 64-bit immediate */
+                .code = 0,
+            }, {
+                .code = BPF_ALU64 | BPF_MOV | BPF_K,
+                .dst_reg = BPF_REG_3,
+                .imm = XDP_PASS,
+            }, {
+                .code = BPF_JMP | BPF_CALL,
+                .imm = BPF_FUNC_redirect_map,
+            }, {
+                .code = BPF_JMP | BPF_EXIT,
+            },
+        };
+
+        memset(&attr, 0, sizeof(attr));
+        attr.prog_type = BPF_PROG_TYPE_XDP;
+        attr.insns = (uintptr_t)insns;
+        attr.insn_cnt = ARRAY_SIZE(insns);
+        attr.license = (uintptr_t)"GPL";
+        prog->prog_fd = af_xdp_bpf(BPF_PROG_LOAD, &attr);
+        if (prog->prog_fd < 0) {
+            error_setg_errno(errp, errno, "af-xdp: could not load XDP program");
+            goto fail;
+        }
+    }
+
+    if (!opts->has_mode || opts->mode == AFXDP_MODE_NATIVE) {
+        prog->mode_flags = XDP_FLAGS_DRV_MODE;
+        ret = af_xdp_link_set_prog(ifindex, prog->prog_fd,
+                                   prog->mode_flags |
+                                   XDP_FLAGS_UPDATE_IF_NOEXIST);
+        if (ret < 0 && !opts->has_mode) {
+            prog->mode_flags = XDP_FLAGS_SKB_MODE;
+            ret = af_xdp_link_set_prog(ifindex, prog->prog_fd,
+                                       prog->mode_flags |
+                                       XDP_FLAGS_UPDATE_IF_NOEXIST);
+        }
+    } else {
+        prog->mode_flags = XDP_FLAGS_SKB_MODE;
+        ret = af_xdp_link_set_prog(ifindex, prog->prog_fd,
+                                   prog->mode_flags |
+                                   XDP_FLAGS_UPDATE_IF_NOEXIST);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "af-xdp: could not attach XDP program "
+                         "to interface '%s'", opts->ifname);
+        goto fail;
+    }
+    prog->ifindex = ifindex;
+    return prog;
+
+fail:
+    af_xdp_prog_put(prog);
+    return NULL;
+}
+
+static int af_xdp_ring_map(AFXDPState *s, AFXDPRing *ring,
+                           const struct xdp_ring_offset *off,
+                           size_t entry_size, off_t pgoff)
+{
+    ring->map_size = off->desc + AF_XDP_RING_SIZE * entry_size;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, s->fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        return -errno;
+    }
+    ring->producer = ring->map + off->producer;
+    ring->consumer = ring->map + off->consumer;
+#ifdef XDP_RING_NEED_WAKEUP
+    ring->flags = ring->map + off->flags;
+#endif
+    ring->desc = ring->map + off->desc;
+    return 0;
+}
+
+static void af_xdp_ring_unmap(AFXDPRing *ring)
+{
+    if (ring->map) {
+        munmap(ring->map, ring->map_size);
+        ring->map = NULL;
+    }
+}
+
+static int af_xdp_socket_init(AFXDPState *s, int ifindex, bool force_copy,
+                              Error **errp)
+{
+    struct xdp_umem_reg reg = {
+        .addr = (uintptr_t)s->umem,
+        .len = AF_XDP_UMEM_SIZE,
+        .chunk_size = AF_XDP_FRAME_SIZE,
+    };
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family = AF_XDP,
+        .sxdp_ifindex = ifindex,
+        .sxdp_queue_id = s->queue,
+    };
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    uint32_t size = AF_XDP_RING_SIZE;
+    uint16_t bind_flags = 0;
+    uint64_t *fill;
+    union bpf_attr attr;
+    int i, ret;
+
+    s->fd = qemu_socket(AF_XDP, SOCK_RAW, 0);
+    if (s->fd < 0) {
+        error_setg_errno(errp, errno, "af-xdp: could not create socket");
+        return -1;
+    }
+
+    if (setsockopt(s->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) ||
+        setsockopt(s->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) ||
+        setsockopt(s->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+                   &size, sizeof(size)) ||
+        setsockopt(s->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) ||
+        setsockopt(s->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size))) {
+        error_setg_errno(errp, errno, "af-xdp: could not set up rings");
+        return -1;
+    }
+
+    if (getsockopt(s->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen)) {
+        error_setg_errno(errp, errno, "af-xdp: could not get ring offsets");
+        return -1;
+    }
+    if (optlen != sizeof(off)) {
+        error_setg(errp, "af-xdp: kernel ring layout not supported");
+        return -1;
+    }
+
+    ret = af_xdp_ring_map(s, &s->rx, &off.rx, sizeof(struct xdp_desc),
+                          XDP_PGOFF_RX_RING);
+    if (!ret) {
+        ret = af_xdp_ring_map(s, &s->tx, &off.tx, sizeof(struct xdp_desc),
+                              XDP_PGOFF_TX_RING);
+    }
+    if (!ret) {
+        ret = af_xdp_ring_map(s, &s->fill, &off.fr, sizeof(uint64_t),
+                              XDP_UMEM_PGOFF_FILL_RING);
+    }
+    if (!ret) {
+        ret = af_xdp_ring_map(s, &s->comp, &off.cr, sizeof(uint64_t),
+                              XDP_UMEM_PGOFF_COMPLETION_RING);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "af-xdp: could not map rings");
+        return -1;
+    }
+
+    /* Give all receive frames to the kernel.  */
+    fill = s->fill.desc;
+    for (i = 0; i < AF_XDP_RING_SIZE; i++) {
+        fill[i] = (uint64_t)i * AF_XDP_FRAME_SIZE;
+    }
+    atomic_store_release(s->fill.producer, AF_XDP_RING_SIZE);
+
+    for (i = 0; i < AF_XDP_RING_SIZE; i++) {
+        s->tx_free[i] = (uint64_t)(AF_XDP_NUM_FRAMES - 1 - i) *
+                        AF_XDP_FRAME_SIZE;
+    }
+    s->n_tx_free = AF_XDP_RING_SIZE;
+
+    /*
+     * Headers with ring flags match the layout checked above only on
+     * kernels that also support XDP_USE_NEED_WAKEUP.
+     */
+#ifdef XDP_USE_NEED_WAKEUP
+    s->need_wakeup = true;
+    bind_flags = XDP_USE_NEED_WAKEUP;
+#endif
+
+    ret = -1;
+    if (!force_copy) {
+        sxdp.sxdp_flags = XDP_ZEROCOPY | bind_flags;
+        ret = bind(s->fd, (struct sockaddr *)&sxdp, sizeof(sxdp));
+    }
+    if (ret < 0) {
+        sxdp.sxdp_flags = XDP_COPY | bind_flags;
+        ret = bind(s->fd, (struct sockaddr *)&sxdp, sizeof(sxdp));
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, errno, "af-xdp: could not bind to queue %u",
+                         s->queue);
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = s->prog->map_fd;
+    attr.key = (uintptr_t)&s->queue;
+    attr.value = (uintptr_t)&s->fd;
+    attr.flags = BPF_ANY;
+    if (af_xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        error_setg_errno(errp, errno, "af-xdp: could not add socket to XSKMAP");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void af_xdp_cleanup(NetClientState *nc)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    if (s->fd >= 0) {
+        af_xdp_poll(nc, false);
+        af_xdp_ring_unmap(&s->rx);
+        af_xdp_ring_unmap(&s->tx);
+        af_xdp_ring_unmap(&s->fill);
+        af_xdp_ring_unmap(&s->comp);
+        close(s->fd);
+        s->fd = -1;
+    }
+    if (s->prog) {
+        af_xdp_prog_put(s->prog);
+        s->prog = NULL;
+    }
+    qemu_vfree(s->umem);
+    s->umem = NULL;
+}
+
+static NetClientInfo net_af_xdp_info = {
+    .type = NET_CLIENT_DRIVER_AF_XDP,
+    .size = sizeof(AFXDPState),
+    .receive = af_xdp_receive,
+    .receive_iov = af_xdp_receive_iov,
+    .receive_batch = af_xdp_receive_batch,
+    .poll = af_xdp_poll,
+    .cleanup = af_xdp_cleanup,
+};
+
+int net_init_af_xdp(const Netdev *netdev,
+                    const char *name, NetClientState *peer, Error **errp)
+{
+    const NetdevAFXDPOptions *opts = &netdev->u.af_xdp;
+    int64_t queues = opts->has_queues ? opts->queues : 1;
+    int64_t start = opts->has_start_queue ? opts->start_queue : 0;
+    NetClientState **ncs;
+    AFXDPProg *prog;
+    Error *err = NULL;
+    int ifindex;
+    int64_t i;
+
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_setg(errp, "af-xdp: queues must be between 1 and %d",
+                   MAX_QUEUE_NUM);
+        return -1;
+    }
+    if (start < 0 || start + queues > INT32_MAX) {
+        error_setg(errp, "af-xdp: invalid start-queue");
+        return -1;
+    }
+    if (peer && queues > 1) {
+        error_setg(errp, "Multiqueue af-xdp cannot be used with hubs");
+        return -1;
+    }
+
+    ifindex = if_nametoindex(opts->ifname);
+    if (!ifindex) {
+        error_setg_errno(errp, errno, "af-xdp: unknown interface '%s'",
+                         opts->ifname);
+        return -1;
+    }
+
+    prog = af_xdp_prog_new(ifindex, start + queues, opts, errp);
+    if (!prog) {
+        return -1;
+    }
+
+    ncs = g_new0(NetClientState *, queues);
+    for (i = 0; i < queues; i++) {
+        AFXDPState *s;
+
+        ncs[i] = qemu_new_net_client(&net_af_xdp_info, peer, "af-xdp", name);
+        s = DO_UPCAST(AFXDPState, nc, ncs[i]);
+        s->fd = -1;
+        s->queue = start + i;
+        s->prog = prog;
+        prog->refcnt++;
+        s->umem = qemu_memalign(qemu_real_host_page_size, AF_XDP_UMEM_SIZE);
+
+        if (af_xdp_socket_init(s, ifindex, opts->has_force_copy &&
+                               opts->force_copy, &err) < 0) {
+            goto fail;
+        }
+
+        snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+                 "ifname=%s,queue=%u", opts->ifname, s->queue);
+        af_xdp_read_poll(s, true);
+    }
+
+    af_xdp_prog_put(prog);
+    g_free(ncs);
+    return 0;
+
+fail:
+    error_propagate(errp, err);
+    /* This deletes all queues created so far, they share the name.  */
+    qemu_del_net_client(ncs[0]);
+    af_xdp_prog_put(prog);
+    g_free(ncs);
+    return -1;
+}
@@ -17,6 +17,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "net/checksum.h"
 #include "net/eth.h"
 
@@ -191,3 +192,24 @@ net_checksum_add_iov(const struct iovec *iov, const unsigned int iov_cnt,
     }
     return res;
 }
+
+void net_toeplitz_table_init(NetToeplitzTable *table, const uint8_t *key)
+{
+    int i, b, v;
+
+    for (i = 0; i < NET_TOEPLITZ_MAX_INPUT; i++) {
+        /* the 40 key bits starting at input byte i */
+        uint64_t window = ((uint64_t)ldl_be_p(key + i) << 8) | key[i + 4];
+        uint32_t bit_hash[8];
+
+        /* bit_hash[b] is the key contribution of bit b, counting from LSB */
+        for (b = 0; b < 8; b++) {
+            bit_hash[b] = window >> (b + 1);
+        }
+
+        table->t[i][0] = 0;
+        for (v = 1; v < 256; v++) {
+            table->t[i][v] = table->t[i][v & (v - 1)] ^ bit_hash[ctz32(v)];
+        }
+    }
+}
@@ -27,6 +27,8 @@
 #include "qemu/sockets.h"
 #include "net/colo.h"
 #include "sysemu/iothread.h"
+#include "qapi/visitor.h"
+#include "qemu/thread.h"
 
 #define TYPE_COLO_COMPARE "colo-compare"
 #define COLO_COMPARE(obj) \
@@ -35,8 +37,7 @@
 #define COMPARE_READ_LEN_MAX NET_BUFSIZE
 #define MAX_QUEUE_SIZE 1024
 
-#define COLO_COMPARE_FREE_PRIMARY     0x01
-#define COLO_COMPARE_FREE_SECONDARY   0x02
+#define COLO_COMPARE_MAX_THREADS 64
 
 /* TODO: Should be configurable */
 #define REGULAR_PACKET_CHECK_MS 3000
@@ -62,7 +63,32 @@
  *                    |primary |  |secondary    |primary | |secondary
  *                    |packet  |  |packet  +    |packet  | |packet  +
  *                    +--------+  +--------+    +--------+ +--------+
+ *
+ * Connections are split into shards by the hash of their key.  With
+ * compare_threads=0 there is a single shard, compared in the iothread.
+ * Otherwise each shard has its own thread, and the iothread only parses
+ * the packets and pushes them to the shard's lock-free inbox.
  */
+typedef struct CompareShard {
+    struct CompareState *s;
+
+    /*
+     * Record the connection that through the NIC
+     * Element type: Connection
+     */
+    GQueue conn_list;
+    /* Record the connection without repetition */
+    GHashTable *connection_track_table;
+
+    /* Packets from the iothread, most recent first */
+    QSLIST_HEAD(PacketInbox, Packet) pri_inbox;
+    struct PacketInbox sec_inbox;
+    bool check_old;     /* set by packet_check_timer */
+    bool stopping;
+    QemuEvent event;
+    QemuThread thread;
+} CompareShard;
+
 typedef struct CompareState {
     Object parent;
 
@@ -75,14 +101,12 @@ typedef struct CompareState {
     SocketReadState pri_rs;
     SocketReadState sec_rs;
     bool vnet_hdr;
+    uint32_t compare_threads;
 
-    /*
-     * Record the connection that through the NIC
-     * Element type: Connection
-     */
-    GQueue conn_list;
-    /* Record the connection without repetition */
-    GHashTable *connection_track_table;
+    CompareShard *shards;
+    uint32_t nr_shards;
+    /* Serializes the packets written to chr_out */
+    QemuMutex out_lock;
 
     IOThread *iothread;
     GMainContext *worker_context;
@@ -102,6 +126,10 @@ static int compare_chr_send(CompareState *s,
                             const uint8_t *buf,
                             uint32_t size,
                             uint32_t vnet_hdr_len);
+static int compare_chr_send_locked(CompareState *s,
+                                   const uint8_t *buf,
+                                   uint32_t size,
+                                   uint32_t vnet_hdr_len);
 
 static gint seq_sorter(Packet *a, Packet *b, gpointer data)
 {
@@ -116,6 +144,7 @@ static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
 {
     Packet *pkt = data;
     struct tcphdr *tcphd;
+    int payload_size;
 
     tcphd = (struct tcphdr *)pkt->transport_header;
 
@@ -124,7 +153,12 @@ static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
     *max_ack = *max_ack > pkt->tcp_ack ? *max_ack : pkt->tcp_ack;
     pkt->header_size = pkt->transport_header - (uint8_t *)pkt->data
                        + (tcphd->th_off << 2) - pkt->vnet_hdr_len;
-    pkt->payload_size = pkt->size - pkt->header_size;
+
+    /* Leave out the Ethernet padding of short frames */
+    payload_size = MIN(pkt->size - pkt->vnet_hdr_len - pkt->header_size,
+                       ntohs(pkt->ip->ip_len) - (pkt->ip->ip_hl << 2)
+                       - (tcphd->th_off << 2));
+    pkt->payload_size = MAX(payload_size, 0);
     pkt->seq_end = pkt->tcp_seq + pkt->payload_size;
     pkt->flags = tcphd->th_flags;
 }
@@ -151,38 +185,22 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
 }
 
 /*
- * Return 0 on success, if return -1 means the pkt
- * is unsupported(arp and ipv6) and will be sent later
+ * Queue a packet that passed parse_packet_early to its connection
+ * and return the connection.
  */
-static int packet_enqueue(CompareState *s, int mode, Connection **con)
+static Connection *packet_enqueue(CompareShard *shard, Packet *pkt, int mode)
 {
     ConnectionKey key;
-    Packet *pkt = NULL;
     Connection *conn;
 
-    if (mode == PRIMARY_IN) {
-        pkt = packet_new(s->pri_rs.buf,
-                         s->pri_rs.packet_len,
-                         s->pri_rs.vnet_hdr_len);
-    } else {
-        pkt = packet_new(s->sec_rs.buf,
-                         s->sec_rs.packet_len,
-                         s->sec_rs.vnet_hdr_len);
-    }
-
-    if (parse_packet_early(pkt)) {
-        packet_destroy(pkt, NULL);
-        pkt = NULL;
-        return -1;
-    }
     fill_connection_key(pkt, &key);
 
-    conn = connection_get(s->connection_track_table,
+    conn = connection_get(shard->connection_track_table,
                           &key,
-                          &s->conn_list);
+                          &shard->conn_list);
 
     if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
+        g_queue_push_tail(&shard->conn_list, conn);
         conn->processing = true;
     }
 
@@ -190,16 +208,17 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
         if (!colo_insert_packet(&conn->primary_list, pkt, &conn->pack)) {
             error_report("colo compare primary queue size too big,"
                          "drop packet");
+            packet_destroy(pkt, NULL);
         }
     } else {
         if (!colo_insert_packet(&conn->secondary_list, pkt, &conn->sack)) {
             error_report("colo compare secondary queue size too big,"
                          "drop packet");
+            packet_destroy(pkt, NULL);
         }
     }
-    *con = conn;
 
-    return 0;
+    return conn;
 }
 
 static inline bool after(uint32_t seq1, uint32_t seq2)
@@ -251,71 +270,38 @@ static int colo_compare_packet_payload(Packet *ppkt,
     return memcmp(ppkt->data + poffset, spkt->data + soffset, len);
 }
 
-/*
- * return true means that the payload is consist and
- * need to make the next comparison, false means do
- * the checkpoint
-*/
-static bool colo_mark_tcp_pkt(Packet *ppkt, Packet *spkt,
-                              int8_t *mark, uint32_t max_ack)
+static inline uint8_t *colo_tcp_payload(Packet *pkt)
 {
-    *mark = 0;
-
-    if (ppkt->tcp_seq == spkt->tcp_seq && ppkt->seq_end == spkt->seq_end) {
-        if (colo_compare_packet_payload(ppkt, spkt,
-                                        ppkt->header_size, spkt->header_size,
-                                        ppkt->payload_size)) {
-            *mark = COLO_COMPARE_FREE_SECONDARY | COLO_COMPARE_FREE_PRIMARY;
-            return true;
-        }
-    }
-    if (ppkt->tcp_seq == spkt->tcp_seq && ppkt->seq_end == spkt->seq_end) {
-        if (colo_compare_packet_payload(ppkt, spkt,
-                                        ppkt->header_size, spkt->header_size,
-                                        ppkt->payload_size)) {
-            *mark = COLO_COMPARE_FREE_SECONDARY | COLO_COMPARE_FREE_PRIMARY;
-            return true;
-        }
-    }
+    return (uint8_t *)pkt->data + pkt->vnet_hdr_len + pkt->header_size;
+}
 
-    /* one part of secondary packet payload still need to be compared */
-    if (!after(ppkt->seq_end, spkt->seq_end)) {
-        if (colo_compare_packet_payload(ppkt, spkt,
-                                        ppkt->header_size + ppkt->offset,
-                                        spkt->header_size + spkt->offset,
-                                        ppkt->payload_size - ppkt->offset)) {
-            if (!after(ppkt->tcp_ack, max_ack)) {
-                *mark = COLO_COMPARE_FREE_PRIMARY;
-                spkt->offset += ppkt->payload_size - ppkt->offset;
-                return true;
-            } else {
-                /* secondary guest hasn't ack the data, don't send
-                 * out this packet
-                 */
-                return false;
-            }
-        }
-    } else {
-        /* primary packet is longer than secondary packet, compare
-         * the same part and mark the primary packet offset
-         */
-        if (colo_compare_packet_payload(ppkt, spkt,
-                                        ppkt->header_size + ppkt->offset,
-                                        spkt->header_size + spkt->offset,
-                                        spkt->payload_size - spkt->offset)) {
-            *mark = COLO_COMPARE_FREE_SECONDARY;
-            ppkt->offset += spkt->payload_size - spkt->offset;
-            return true;
-        }
+/*
+ * Add the payload of @pkt from *@seq to @end to @hash, and advance *@seq.
+ * @pkt must start at or before *@seq and end at or after @end.
+ */
+static void colo_hash_tcp_payload(ColoHash *hash, Packet *pkt,
+                                  uint32_t *seq, uint32_t end)
+{
+    if (after(end, *seq)) {
+        colo_hash_update(hash, colo_tcp_payload(pkt) + (*seq - pkt->tcp_seq),
+                         end - *seq);
+        *seq = end;
     }
-
-    return false;
 }
 
+/*
+ * Compare the TCP byte streams of the two guests, so that different
+ * segmentation on the two sides does not matter.  Both streams are
+ * hashed from conn->compare_seq up to the end of the first primary
+ * packet, then the hashes are compared.  Secondary packets are freed as
+ * soon as they are hashed, so only the primary packets are kept around
+ * until the secondary catches up.
+ */
 static void colo_compare_tcp(CompareState *s, Connection *conn)
 {
-    Packet *ppkt = NULL, *spkt = NULL;
-    int8_t mark;
+    Packet *ppkt, *spkt;
+    uint32_t target;
+    bool sec_partial;
 
     /*
      * If ppkt and spkt have the same payload, but ppkt's ACK
@@ -330,97 +316,98 @@ static void colo_compare_tcp(CompareState *s, Connection *conn)
     */
     uint32_t min_ack = conn->pack > conn->sack ? conn->sack : conn->pack;
 
-pri:
-    if (g_queue_is_empty(&conn->primary_list)) {
-        return;
-    }
-    ppkt = g_queue_pop_head(&conn->primary_list);
-sec:
-    if (g_queue_is_empty(&conn->secondary_list)) {
-        g_queue_push_head(&conn->primary_list, ppkt);
-        return;
-    }
-    spkt = g_queue_pop_head(&conn->secondary_list);
-
-    if (ppkt->tcp_seq == ppkt->seq_end) {
-        colo_release_primary_pkt(s, ppkt);
-        ppkt = NULL;
-    }
-
-    if (ppkt && conn->compare_seq && !after(ppkt->seq_end, conn->compare_seq)) {
-        trace_colo_compare_main("pri: this packet has compared");
-        colo_release_primary_pkt(s, ppkt);
-        ppkt = NULL;
-    }
+    while ((ppkt = g_queue_peek_head(&conn->primary_list))) {
+        /* No payload, or payload that was already compared */
+        if (ppkt->tcp_seq == ppkt->seq_end ||
+            (conn->compare_seq && !after(ppkt->seq_end, conn->compare_seq))) {
+            trace_colo_compare_main("pri: this packet has compared");
+            g_queue_pop_head(&conn->primary_list);
+            colo_release_primary_pkt(s, ppkt);
+            continue;
+        }
 
-    if (spkt->tcp_seq == spkt->seq_end) {
-        packet_destroy(spkt, NULL);
-        if (!ppkt) {
-            goto pri;
-        } else {
-            goto sec;
+        if (!conn->compare_seq) {
+            conn->compare_seq = ppkt->tcp_seq;
+            conn->pri_seq = conn->sec_seq = ppkt->tcp_seq;
         }
-    } else {
-        if (conn->compare_seq && !after(spkt->seq_end, conn->compare_seq)) {
-            trace_colo_compare_main("sec: this packet has compared");
-            packet_destroy(spkt, NULL);
-            if (!ppkt) {
-                goto pri;
+        if (after(ppkt->tcp_seq, conn->pri_seq)) {
+            /* a primary packet is missing */
+            return;
+        }
+        colo_hash_tcp_payload(&conn->pri_hash, ppkt, &conn->pri_seq,
+                              ppkt->seq_end);
+        target = conn->pri_seq;
+
+        while (after(target, conn->sec_seq)) {
+            spkt = g_queue_peek_head(&conn->secondary_list);
+            if (!spkt) {
+                return;
+            }
+            if (!after(spkt->seq_end, conn->sec_seq)) {
+                trace_colo_compare_main("sec: this packet has compared");
+                g_queue_pop_head(&conn->secondary_list);
+                packet_destroy(spkt, NULL);
+                continue;
+            }
+            if (after(spkt->tcp_seq, conn->sec_seq)) {
+                /* a secondary packet is missing */
+                return;
+            }
+            trace_colo_compare_tcp_info("sec",
+                                        spkt->tcp_seq, spkt->tcp_ack,
+                                        spkt->header_size,
+                                        spkt->payload_size,
+                                        spkt->flags);
+            if (after(spkt->seq_end, target)) {
+                colo_hash_tcp_payload(&conn->sec_hash, spkt, &conn->sec_seq,
+                                      target);
             } else {
-                goto sec;
+                colo_hash_tcp_payload(&conn->sec_hash, spkt, &conn->sec_seq,
+                                      spkt->seq_end);
+                g_queue_pop_head(&conn->secondary_list);
+                packet_destroy(spkt, NULL);
             }
         }
-        if (!ppkt) {
-            g_queue_push_head(&conn->secondary_list, spkt);
-            goto pri;
-        }
-    }
 
-    if (colo_mark_tcp_pkt(ppkt, spkt, &mark, min_ack)) {
+        /* Is the secondary in the middle of a packet? */
+        spkt = g_queue_peek_head(&conn->secondary_list);
+        sec_partial = spkt && after(conn->sec_seq, spkt->tcp_seq) &&
+                      after(spkt->seq_end, conn->sec_seq);
+
         trace_colo_compare_tcp_info("pri",
                                     ppkt->tcp_seq, ppkt->tcp_ack,
                                     ppkt->header_size, ppkt->payload_size,
-                                    ppkt->offset, ppkt->flags);
-
-        trace_colo_compare_tcp_info("sec",
-                                    spkt->tcp_seq, spkt->tcp_ack,
-                                    spkt->header_size, spkt->payload_size,
-                                    spkt->offset, spkt->flags);
+                                    ppkt->flags);
 
-        if (mark == COLO_COMPARE_FREE_PRIMARY) {
-            conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
-            g_queue_push_head(&conn->secondary_list, spkt);
-            goto pri;
-        }
-        if (mark == COLO_COMPARE_FREE_SECONDARY) {
-            conn->compare_seq = spkt->seq_end;
-            packet_destroy(spkt, NULL);
-            goto sec;
-        }
-        if (mark == (COLO_COMPARE_FREE_PRIMARY | COLO_COMPARE_FREE_SECONDARY)) {
-            conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
-            packet_destroy(spkt, NULL);
-            goto pri;
+        if (!colo_hash_equal(&conn->pri_hash, &conn->sec_hash)) {
+            trace_colo_compare_main("tcp: payload of packets are different");
+            if (trace_event_get_state_backends(TRACE_COLO_COMPARE_MISCOMPARE)) {
+                qemu_hexdump((char *)ppkt->data, stderr,
+                             "colo-compare ppkt", ppkt->size);
+            }
+            /*
+             * colo_compare_inconsistent_notify();
+             * TODO: notice to checkpoint();
+             */
+            return;
         }
-    } else {
-        g_queue_push_head(&conn->primary_list, ppkt);
-        g_queue_push_head(&conn->secondary_list, spkt);
-
-        qemu_hexdump((char *)ppkt->data, stderr,
-                     "colo-compare ppkt", ppkt->size);
-        qemu_hexdump((char *)spkt->data, stderr,
-                     "colo-compare spkt", spkt->size);
 
         /*
-         * colo_compare_inconsistent_notify();
-         * TODO: notice to checkpoint();
+         * The secondary sent more data than this packet: wait until the
+         * secondary guest has acked the data that the primary has.
          */
+        if (sec_partial && after(ppkt->tcp_ack, min_ack)) {
+            return;
+        }
+
+        conn->compare_seq = target;
+        colo_hash_init(&conn->pri_hash);
+        colo_hash_init(&conn->sec_hash);
+        g_queue_pop_head(&conn->primary_list);
+        colo_release_primary_pkt(s, ppkt);
     }
 }
 
-
 /*
  * Called from the compare thread on the primary
  * for compare udp packet
@@ -574,15 +561,13 @@ static int colo_old_packet_check_one_conn(Connection *conn,
  * if we have some then we have to checkpoint to wake
  * the secondary up.
  */
-static void colo_old_packet_check(void *opaque)
+static void colo_old_packet_check(CompareShard *shard)
 {
-    CompareState *s = opaque;
-
     /*
      * If we find one old packet, stop finding job and notify
      * COLO frame do checkpoint.
      */
-    g_queue_find_custom(&s->conn_list, NULL,
+    g_queue_find_custom(&shard->conn_list, NULL,
                         (GCompareFunc)colo_old_packet_check_one_conn);
 }
 
@@ -647,6 +632,19 @@ static int compare_chr_send(CompareState *s,
                             const uint8_t *buf,
                             uint32_t size,
                             uint32_t vnet_hdr_len)
+{
+    int ret;
+
+    qemu_mutex_lock(&s->out_lock);
+    ret = compare_chr_send_locked(s, buf, size, vnet_hdr_len);
+    qemu_mutex_unlock(&s->out_lock);
+    return ret;
+}
+
+static int compare_chr_send_locked(CompareState *s,
+                                   const uint8_t *buf,
+                                   uint32_t size,
+                                   uint32_t vnet_hdr_len)
 {
     int ret = 0;
     uint32_t len = htonl(size);
@@ -729,9 +727,19 @@ static void compare_sec_chr_in(void *opaque, const uint8_t *buf, int size)
 static void check_old_packet_regular(void *opaque)
 {
     CompareState *s = opaque;
+    CompareShard *shard;
+    int i;
 
     /* if have old packet we will notify checkpoint */
-    colo_old_packet_check(s);
+    for (i = 0; i < s->nr_shards; i++) {
+        shard = &s->shards[i];
+        if (s->compare_threads) {
+            atomic_set(&shard->check_old, true);
+            qemu_event_set(&shard->event);
+        } else {
+            colo_old_packet_check(shard);
+        }
+    }
     timer_mod(s->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
                 REGULAR_PACKET_CHECK_MS);
 }
@@ -816,6 +824,37 @@ static void compare_set_outdev(Object *obj, const char *value, Error **errp)
     s->outdev = g_strdup(value);
 }
 
+static void compare_get_threads(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->compare_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_threads(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (value > COLO_COMPARE_MAX_THREADS) {
+        error_setg(&local_err, "Property '%s' must be at most %d",
+                   name, COLO_COMPARE_MAX_THREADS);
+        goto out;
+    }
+    s->compare_threads = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
 static bool compare_get_vnet_hdr(Object *obj, Error **errp)
 {
     CompareState *s = COLO_COMPARE(obj);
@@ -832,34 +871,112 @@ static void compare_set_vnet_hdr(Object *obj,
     s->vnet_hdr = value;
 }
 
-static void compare_pri_rs_finalize(SocketReadState *pri_rs)
+/* Queue @pkt to its connection, and compare the connection */
+static void colo_compare_shard_packet(CompareShard *shard, Packet *pkt,
+                                      int mode)
 {
-    CompareState *s = container_of(pri_rs, CompareState, pri_rs);
-    Connection *conn = NULL;
+    Connection *conn = packet_enqueue(shard, pkt, mode);
 
-    if (packet_enqueue(s, PRIMARY_IN, &conn)) {
-        trace_colo_compare_main("primary: unsupported packet in");
-        compare_chr_send(s,
-                         pri_rs->buf,
-                         pri_rs->packet_len,
-                         pri_rs->vnet_hdr_len);
-    } else {
+    colo_compare_connection(conn, shard->s);
+}
+
+static void colo_compare_shard_drain(CompareShard *shard,
+                                     struct PacketInbox *inbox, int mode)
+{
+    struct PacketInbox batch, ordered = QSLIST_HEAD_INITIALIZER(ordered);
+    Packet *pkt;
+
+    QSLIST_MOVE_ATOMIC(&batch, inbox);
+
+    /* The inbox is last in, first out: restore the arrival order */
+    while ((pkt = QSLIST_FIRST(&batch))) {
+        QSLIST_REMOVE_HEAD(&batch, next);
+        QSLIST_INSERT_HEAD(&ordered, pkt, next);
+    }
+    while ((pkt = QSLIST_FIRST(&ordered))) {
+        QSLIST_REMOVE_HEAD(&ordered, next);
+        colo_compare_shard_packet(shard, pkt, mode);
+    }
+}
+
+static void *colo_compare_shard_thread(void *opaque)
+{
+    CompareShard *shard = opaque;
+
+    while (!atomic_read(&shard->stopping)) {
+        qemu_event_reset(&shard->event);
+
+        colo_compare_shard_drain(shard, &shard->pri_inbox, PRIMARY_IN);
+        colo_compare_shard_drain(shard, &shard->sec_inbox, SECONDARY_IN);
+        if (atomic_xchg(&shard->check_old, false)) {
+            colo_old_packet_check(shard);
+        }
+
+        if (QSLIST_EMPTY(&shard->pri_inbox) &&
+            QSLIST_EMPTY(&shard->sec_inbox) &&
+            !atomic_read(&shard->check_old) &&
+            !atomic_read(&shard->stopping)) {
+            qemu_event_wait(&shard->event);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Called from the iothread for each packet read from primary_in or
+ * secondary_in.  Takes over the packet buffer of @rs.
+ */
+static void colo_compare_dispatch(CompareState *s, SocketReadState *rs,
+                                  int mode)
+{
+    Packet *pkt = packet_new_nocopy(rs->data, rs->packet_len,
+                                    rs->vnet_hdr_len);
+    CompareShard *shard;
+    ConnectionKey key;
+
+    rs->data = NULL;
+
+    if (parse_packet_early(pkt)) {
+        if (mode == PRIMARY_IN) {
+            trace_colo_compare_main("primary: unsupported packet in");
+            compare_chr_send(s, pkt->data, pkt->size, pkt->vnet_hdr_len);
+        } else {
+            trace_colo_compare_main("secondary: unsupported packet in");
+        }
+        packet_destroy(pkt, NULL);
+        return;
+    }
+
+    fill_connection_key(pkt, &key);
+    shard = &s->shards[connection_key_hash(&key) % s->nr_shards];
+
+    if (!s->compare_threads) {
         /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
+        colo_compare_shard_packet(shard, pkt, mode);
+        return;
+    }
+
+    if (mode == PRIMARY_IN) {
+        QSLIST_INSERT_HEAD_ATOMIC(&shard->pri_inbox, pkt, next);
+    } else {
+        QSLIST_INSERT_HEAD_ATOMIC(&shard->sec_inbox, pkt, next);
     }
+    qemu_event_set(&shard->event);
+}
+
+static void compare_pri_rs_finalize(SocketReadState *pri_rs)
+{
+    CompareState *s = container_of(pri_rs, CompareState, pri_rs);
+
+    colo_compare_dispatch(s, pri_rs, PRIMARY_IN);
 }
 
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, SECONDARY_IN, &conn)) {
-        trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
-    }
+    colo_compare_dispatch(s, sec_rs, SECONDARY_IN);
 }
 
 
@@ -895,6 +1012,7 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 {
     CompareState *s = COLO_COMPARE(uc);
     Chardev *chr;
+    int i;
 
     if (!s->pri_indev || !s->sec_indev || !s->outdev || !s->iothread) {
         error_setg(errp, "colo compare needs 'primary_in' ,"
@@ -925,18 +1043,58 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 
     net_socket_rs_init(&s->pri_rs, compare_pri_rs_finalize, s->vnet_hdr);
     net_socket_rs_init(&s->sec_rs, compare_sec_rs_finalize, s->vnet_hdr);
-
-    g_queue_init(&s->conn_list);
-
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      connection_destroy);
+    /* Packets are queued without copying them out of the read state */
+    s->pri_rs.alloc = true;
+    s->sec_rs.alloc = true;
+
+    qemu_mutex_init(&s->out_lock);
+    s->nr_shards = MAX(s->compare_threads, 1);
+    s->shards = g_new0(CompareShard, s->nr_shards);
+    for (i = 0; i < s->nr_shards; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        shard->s = s;
+        g_queue_init(&shard->conn_list);
+        shard->connection_track_table =
+            g_hash_table_new_full(connection_key_hash,
+                                  connection_key_equal,
+                                  g_free,
+                                  connection_destroy);
+        QSLIST_INIT(&shard->pri_inbox);
+        QSLIST_INIT(&shard->sec_inbox);
+        qemu_event_init(&shard->event, false);
+        if (s->compare_threads) {
+            qemu_thread_create(&shard->thread, "colo-compare",
+                               colo_compare_shard_thread, shard,
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
 
     colo_compare_iothread(s);
     return;
 }
 
+/* Send out the packets that a stopped shard did not get to */
+static void colo_flush_inbox(CompareState *s, struct PacketInbox *inbox,
+                             int mode)
+{
+    struct PacketInbox batch, ordered = QSLIST_HEAD_INITIALIZER(ordered);
+    Packet *pkt;
+
+    QSLIST_MOVE_ATOMIC(&batch, inbox);
+    while ((pkt = QSLIST_FIRST(&batch))) {
+        QSLIST_REMOVE_HEAD(&batch, next);
+        QSLIST_INSERT_HEAD(&ordered, pkt, next);
+    }
+    while ((pkt = QSLIST_FIRST(&ordered))) {
+        QSLIST_REMOVE_HEAD(&ordered, next);
+        if (mode == PRIMARY_IN) {
+            compare_chr_send(s, pkt->data, pkt->size, pkt->vnet_hdr_len);
+        }
+        packet_destroy(pkt, NULL);
+    }
+}
+
 static void colo_flush_packets(void *opaque, void *user_data)
 {
     CompareState *s = user_data;
@@ -985,30 +1143,54 @@ static void colo_compare_init(Object *obj)
     s->vnet_hdr = false;
     object_property_add_bool(obj, "vnet_hdr_support", compare_get_vnet_hdr,
                              compare_set_vnet_hdr, NULL);
+
+    s->compare_threads = 0;
+    object_property_add(obj, "compare_threads", "uint32",
+                        compare_get_threads, compare_set_threads,
+                        NULL, NULL, NULL);
 }
 
 static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
+    int i;
 
     qemu_chr_fe_deinit(&s->chr_pri_in, false);
     qemu_chr_fe_deinit(&s->chr_sec_in, false);
-    qemu_chr_fe_deinit(&s->chr_out, false);
     if (s->iothread) {
         colo_compare_timer_del(s);
     }
-    /* Release all unhandled packets after compare thead exited */
-    g_queue_foreach(&s->conn_list, colo_flush_packets, s);
 
-    g_queue_clear(&s->conn_list);
+    for (i = 0; i < s->nr_shards; i++) {
+        CompareShard *shard = &s->shards[i];
 
-    if (s->connection_track_table) {
-        g_hash_table_destroy(s->connection_track_table);
+        if (s->compare_threads) {
+            atomic_set(&shard->stopping, true);
+            qemu_event_set(&shard->event);
+            qemu_thread_join(&shard->thread);
+        }
+        qemu_event_destroy(&shard->event);
+
+        /* Release all unhandled packets after compare thead exited */
+        g_queue_foreach(&shard->conn_list, colo_flush_packets, s);
+        colo_flush_inbox(s, &shard->pri_inbox, PRIMARY_IN);
+        colo_flush_inbox(s, &shard->sec_inbox, SECONDARY_IN);
+
+        g_queue_clear(&shard->conn_list);
+        g_hash_table_destroy(shard->connection_track_table);
     }
+    g_free(s->shards);
+    if (s->nr_shards) {
+        qemu_mutex_destroy(&s->out_lock);
+    }
+    qemu_chr_fe_deinit(&s->chr_out, false);
 
     if (s->iothread) {
         object_unref(OBJECT(s->iothread));
     }
+    /* Packets that were being received */
+    g_free(s->pri_rs.data);
+    g_free(s->sec_rs.data);
     g_free(s->pri_indev);
     g_free(s->sec_indev);
     g_free(s->outdev);
@@ -13,9 +13,14 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "qemu/bswap.h"
 #include "trace.h"
 #include "net/colo.h"
 
+#define COLO_HASH_SEED  0x2545f4914f6cdd1dULL
+#define COLO_HASH_PRIME 0x9e3779b97f4a7c15ULL
+
 uint32_t connection_key_hash(const void *opaque)
 {
     const ConnectionKey *key = opaque;
@@ -45,12 +50,13 @@ int parse_packet_early(Packet *pkt)
     static const uint8_t vlan[] = {0x81, 0x00};
     uint8_t *data = pkt->data + pkt->vnet_hdr_len;
     uint16_t l3_proto;
-    ssize_t l2hdr_len = eth_get_l2_hdr_length(data);
+    ssize_t l2hdr_len;
 
     if (pkt->size < ETH_HLEN + pkt->vnet_hdr_len) {
         trace_colo_proxy_main("pkt->size < ETH_HLEN");
         return 1;
     }
+    l2hdr_len = eth_get_l2_hdr_length(data);
 
     /*
      * TODO: support vlan.
@@ -136,6 +142,11 @@ Connection *connection_new(ConnectionKey *key)
 
     conn->ip_proto = key->ip_proto;
     conn->processing = false;
+    conn->compare_seq = 0;
+    colo_hash_init(&conn->pri_hash);
+    colo_hash_init(&conn->sec_hash);
+    conn->pri_seq = 0;
+    conn->sec_seq = 0;
     conn->offset = 0;
     conn->syn_flag = 0;
     conn->pack = 0;
@@ -158,10 +169,16 @@ void connection_destroy(void *opaque)
 }
 
 Packet *packet_new(const void *data, int size, int vnet_hdr_len)
+{
+    return packet_new_nocopy(g_memdup(data, size), size, vnet_hdr_len);
+}
+
+/* Like packet_new, but take over @data, which must come from g_malloc */
+Packet *packet_new_nocopy(void *data, int size, int vnet_hdr_len)
 {
     Packet *pkt = g_slice_new(Packet);
 
-    pkt->data = g_memdup(data, size);
+    pkt->data = data;
     pkt->size = size;
     pkt->creation_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
     pkt->vnet_hdr_len = vnet_hdr_len;
@@ -170,7 +187,6 @@ Packet *packet_new(const void *data, int size, int vnet_hdr_len)
     pkt->seq_end = 0;
     pkt->header_size = 0;
     pkt->payload_size = 0;
-    pkt->offset = 0;
     pkt->flags = 0;
 
     return pkt;
@@ -184,6 +200,44 @@ void packet_destroy(void *opaque, void *user_data)
     g_slice_free(Packet, pkt);
 }
 
+void colo_hash_init(ColoHash *h)
+{
+    h->hash = COLO_HASH_SEED;
+    h->tail = 0;
+    h->tail_len = 0;
+}
+
+static inline uint64_t colo_hash_mix(uint64_t hash, uint64_t word)
+{
+    return (rol64(hash, 31) ^ word) * COLO_HASH_PRIME;
+}
+
+/*
+ * This is not a cryptographic hash, a collision only hides a difference
+ * between the two guests until the next checkpoint.
+ */
+void colo_hash_update(ColoHash *h, const uint8_t *buf, size_t len)
+{
+    /* complete the pending word first */
+    while (h->tail_len && len) {
+        h->tail |= (uint64_t)*buf++ << (h->tail_len * 8);
+        len--;
+        if (++h->tail_len == 8) {
+            h->hash = colo_hash_mix(h->hash, h->tail);
+            h->tail = 0;
+            h->tail_len = 0;
+        }
+    }
+
+    for (; len >= 8; buf += 8, len -= 8) {
+        h->hash = colo_hash_mix(h->hash, ldq_le_p(buf));
+    }
+
+    while (len--) {
+        h->tail |= (uint64_t)*buf++ << (h->tail_len++ * 8);
+    }
+}
+
 /*
  * Clear hashtable, stop this hash growing really huge
  */
@@ -17,6 +17,7 @@
 
 #include "slirp/slirp.h"
 #include "qemu/jhash.h"
+#include "qemu/queue.h"
 #include "qemu/timer.h"
 
 #define HASHTABLE_MAX_SIZE 16384
@@ -33,7 +34,9 @@
 #define IPPROTO_UDPLITE 136
 #endif
 
-typedef struct Packet {
+typedef struct Packet Packet;
+
+struct Packet {
     void *data;
     union {
         uint8_t *network_header;
@@ -51,10 +54,22 @@ typedef struct Packet {
     uint32_t seq_end;
     uint8_t header_size;  /* the header length */
     uint16_t payload_size; /* the payload length */
-    /* record the payload offset(the length that has been compared) */
-    uint16_t offset;
     uint8_t flags; /* Flags(aka Control bits) */
-} Packet;
+    /* for colo-compare to hand the packet to a compare thread */
+    QSLIST_ENTRY(Packet) next;
+};
+
+/*
+ * Hash of a byte stream that does not depend on how the stream was
+ * split into packets: two streams with the same contents have the same
+ * ColoHash state.  Bytes are mixed in 8 at a time, the last incomplete
+ * word is kept in @tail.
+ */
+typedef struct ColoHash {
+    uint64_t hash;
+    uint64_t tail;
+    unsigned int tail_len;
+} ColoHash;
 
 typedef struct ConnectionKey {
     /* (src, dst) must be grouped, in the same way than in IP header */
@@ -75,6 +90,14 @@ typedef struct Connection {
     uint8_t ip_proto;
     /* record the sequence number that has been compared */
     uint32_t compare_seq;
+    /*
+     * Hashes of the TCP payload from compare_seq to pri_seq in the
+     * primary_list and to sec_seq in the secondary_list
+     */
+    ColoHash pri_hash;
+    ColoHash sec_hash;
+    uint32_t pri_seq;
+    uint32_t sec_seq;
     /* the maximum of acknowledgement number in primary_list queue */
     uint32_t pack;
     /* the maximum of acknowledgement number in secondary_list queue */
@@ -101,6 +124,15 @@ Connection *connection_get(GHashTable *connection_track_table,
                            GQueue *conn_list);
 void connection_hashtable_reset(GHashTable *connection_track_table);
 Packet *packet_new(const void *data, int size, int vnet_hdr_len);
+Packet *packet_new_nocopy(void *data, int size, int vnet_hdr_len);
 void packet_destroy(void *opaque, void *user_data);
+void colo_hash_init(ColoHash *h);
+void colo_hash_update(ColoHash *h, const uint8_t *buf, size_t len);
+
+static inline bool colo_hash_equal(const ColoHash *a, const ColoHash *b)
+{
+    return a->hash == b->hash && a->tail == b->tail &&
+           a->tail_len == b->tail_len;
+}
 
 #endif /* QEMU_COLO_PROXY_H */
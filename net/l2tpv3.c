@@ -69,6 +69,13 @@ typedef struct NetL2TPV3State {
     uint8_t *header_buf;
     struct iovec *vec;
 
+    /*
+     * these are used for batched xmit - one header per packet
+     */
+
+    uint8_t *tx_header_buf;
+    struct mmsghdr *tx_msgvec;
+
     /*
      * these are used for receive - try to "eat" up to 32 packets at a time
      */
@@ -179,32 +186,32 @@ static void l2tpv3_poll(NetClientState *nc, bool enable)
     l2tpv3_read_poll(s, enable);
 }
 
-static void l2tpv3_form_header(NetL2TPV3State *s)
+static void l2tpv3_form_header(NetL2TPV3State *s, uint8_t *header_buf)
 {
     uint32_t *counter;
 
     if (s->udp) {
-        stl_be_p((uint32_t *) s->header_buf, L2TPV3_DATA_PACKET);
+        stl_be_p((uint32_t *) header_buf, L2TPV3_DATA_PACKET);
     }
     stl_be_p(
-            (uint32_t *) (s->header_buf + s->session_offset),
+            (uint32_t *) (header_buf + s->session_offset),
             s->tx_session
         );
     if (s->cookie) {
         if (s->cookie_is_64) {
             stq_be_p(
-                (uint64_t *)(s->header_buf + s->cookie_offset),
+                (uint64_t *)(header_buf + s->cookie_offset),
                 s->tx_cookie
             );
         } else {
             stl_be_p(
-                (uint32_t *) (s->header_buf + s->cookie_offset),
+                (uint32_t *) (header_buf + s->cookie_offset),
                 s->tx_cookie
             );
         }
     }
     if (s->has_counter) {
-        counter = (uint32_t *)(s->header_buf + s->counter_offset);
+        counter = (uint32_t *)(header_buf + s->counter_offset);
         if (s->pin_counter) {
             *counter = 0;
         } else {
@@ -229,7 +236,7 @@ static ssize_t net_l2tpv3_receive_dgram_iov(NetClientState *nc,
         );
         return -1;
     }
-    l2tpv3_form_header(s);
+    l2tpv3_form_header(s, s->header_buf);
     memcpy(s->vec + 1, iov, iovcnt * sizeof(struct iovec));
     s->vec->iov_base = s->header_buf;
     s->vec->iov_len = s->offset;
@@ -271,7 +278,7 @@ static ssize_t net_l2tpv3_receive_dgram(NetClientState *nc,
     struct msghdr message;
     ssize_t ret = 0;
 
-    l2tpv3_form_header(s);
+    l2tpv3_form_header(s, s->header_buf);
     vec = s->vec;
     vec->iov_base = s->header_buf;
     vec->iov_len = s->offset;
@@ -306,6 +313,53 @@ static ssize_t net_l2tpv3_receive_dgram(NetClientState *nc,
     return ret;
 }
 
+static int net_l2tpv3_receive_dgram_batch(NetClientState *nc,
+                    const struct iovec *packets,
+                    int count)
+{
+    NetL2TPV3State *s = DO_UPCAST(NetL2TPV3State, nc, nc);
+
+    struct mmsghdr *msgvec = s->tx_msgvec;
+    struct iovec *vec = s->vec;
+    uint8_t *header_buf;
+    int i, ret;
+
+    assert(count <= NET_QUEUE_BATCH_MAX);
+    for (i = 0; i < count; i++) {
+        header_buf = s->tx_header_buf + i * s->offset;
+        l2tpv3_form_header(s, header_buf);
+        vec[0].iov_base = header_buf;
+        vec[0].iov_len = s->offset;
+        vec[1] = packets[i];
+        msgvec[i].msg_hdr.msg_name = s->dgram_dst;
+        msgvec[i].msg_hdr.msg_namelen = s->dst_size;
+        msgvec[i].msg_hdr.msg_iov = vec;
+        msgvec[i].msg_hdr.msg_iovlen = 2;
+        msgvec[i].msg_hdr.msg_control = NULL;
+        msgvec[i].msg_hdr.msg_controllen = 0;
+        msgvec[i].msg_hdr.msg_flags = 0;
+        vec += 2;
+    }
+    do {
+        ret = sendmmsg(s->fd, msgvec, count, 0);
+    } while ((ret == -1) && (errno == EINTR));
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == ENOBUFS) {
+            /* signal upper layer that socket buffer is full */
+            l2tpv3_write_poll(s, true);
+            ret = 0;
+        } else {
+            /* drop the whole batch, like the single packet path does */
+            ret = count;
+        }
+    }
+    if (s->has_counter && !s->pin_counter) {
+        /* the packets that were not sent get their counter on resend */
+        s->counter -= count - ret;
+    }
+    return ret;
+}
+
 static int l2tpv3_verify_header(NetL2TPV3State *s, uint8_t *buf)
 {
 
@@ -512,6 +566,8 @@ static void net_l2tpv3_cleanup(NetClientState *nc)
     destroy_vector(s->msgvec, MAX_L2TPV3_MSGCNT, IOVSIZE);
     g_free(s->vec);
     g_free(s->header_buf);
+    g_free(s->tx_msgvec);
+    g_free(s->tx_header_buf);
     g_free(s->dgram_dst);
 }
 
@@ -520,6 +576,7 @@ static NetClientInfo net_l2tpv3_info = {
     .size = sizeof(NetL2TPV3State),
     .receive = net_l2tpv3_receive_dgram,
     .receive_iov = net_l2tpv3_receive_dgram_iov,
+    .receive_batch = net_l2tpv3_receive_dgram_batch,
     .poll = l2tpv3_poll,
     .cleanup = net_l2tpv3_cleanup,
 };
@@ -720,6 +777,8 @@ int net_init_l2tpv3(const Netdev *netdev,
     s->msgvec = build_l2tpv3_vector(s, MAX_L2TPV3_MSGCNT);
     s->vec = g_new(struct iovec, MAX_L2TPV3_IOVCNT);
     s->header_buf = g_malloc(s->header_size);
+    s->tx_msgvec = g_new(struct mmsghdr, NET_QUEUE_BATCH_MAX);
+    s->tx_header_buf = g_malloc(NET_QUEUE_BATCH_MAX * s->offset);
 
     qemu_set_nonblock(fd);
 
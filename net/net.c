@@ -29,6 +29,7 @@
 #include "hub.h"
 #include "net/slirp.h"
 #include "net/eth.h"
+#include "net/offload.h"
 #include "util.h"
 
 #include "monitor/monitor.h"
@@ -60,6 +61,23 @@
 static VMChangeStateEntry *net_change_state_entry;
 static QTAILQ_HEAD(, NetClientState) net_clients;
 
+/*
+ * Offloads emulated by the net layer for a backend that cannot exchange
+ * packets with a virtio net header.  When the peer uses the header, it is
+ * added to the packets the backend sends, coalescing TCP segments when the
+ * peer accepts it, and stripped from the packets it receives, cutting TSO
+ * frames into segments.  The header is in host byte order.
+ */
+struct NetOffloadState {
+    bool using_vnet_hdr;
+    bool csum;
+    bool tso4;
+    bool tso6;
+    NetGRO *gro;
+    NetPacketSent *gro_sent_cb;
+    NetGSO *gso;
+};
+
 /***********************************************************/
 /* network device redirectors */
 
@@ -255,6 +273,10 @@ static void qemu_net_client_setup(NetClientState *nc,
     QTAILQ_INSERT_TAIL(&net_clients, nc, next);
 
     nc->incoming_queue = qemu_new_net_queue(qemu_deliver_packet_iov, nc);
+    if (info->receive_batch) {
+        qemu_net_queue_set_deliver_batch(nc->incoming_queue,
+                                         qemu_deliver_packet_batch);
+    }
     nc->destructor = destructor;
     QTAILQ_INIT(&nc->filters);
 }
@@ -340,6 +362,11 @@ static void qemu_free_net_client(NetClientState *nc)
     if (nc->incoming_queue) {
         qemu_del_net_queue(nc->incoming_queue);
     }
+    if (nc->offload) {
+        net_gro_free(nc->offload->gro);
+        net_gso_free(nc->offload->gso);
+        g_free(nc->offload);
+    }
     if (nc->peer) {
         nc->peer->peer = NULL;
     }
@@ -435,9 +462,21 @@ void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
     }
 }
 
+/*
+ * Called by backends without offloads of their own.  Those that send
+ * packets in bursts should call qemu_flush_gro() at the end of each burst.
+ */
+void qemu_enable_sw_offload(NetClientState *nc)
+{
+    assert(!nc->offload);
+    nc->offload = g_new0(NetOffloadState, 1);
+    nc->offload->gro = net_gro_new();
+    nc->offload->gso = net_gso_new();
+}
+
 bool qemu_has_ufo(NetClientState *nc)
 {
-    if (!nc || !nc->info->has_ufo) {
+    if (!nc || nc->offload || !nc->info->has_ufo) {
         return false;
     }
 
@@ -446,6 +485,10 @@ bool qemu_has_ufo(NetClientState *nc)
 
 bool qemu_has_vnet_hdr(NetClientState *nc)
 {
+    if (nc && nc->offload) {
+        return true;
+    }
+
     if (!nc || !nc->info->has_vnet_hdr) {
         return false;
     }
@@ -455,6 +498,11 @@ bool qemu_has_vnet_hdr(NetClientState *nc)
 
 bool qemu_has_vnet_hdr_len(NetClientState *nc, int len)
 {
+    if (nc && nc->offload) {
+        return len == sizeof(struct virtio_net_hdr) ||
+               len == sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    }
+
     if (!nc || !nc->info->has_vnet_hdr_len) {
         return false;
     }
@@ -464,6 +512,14 @@ bool qemu_has_vnet_hdr_len(NetClientState *nc, int len)
 
 void qemu_using_vnet_hdr(NetClientState *nc, bool enable)
 {
+    if (nc && nc->offload) {
+        nc->offload->using_vnet_hdr = enable;
+        if (!nc->vnet_hdr_len) {
+            nc->vnet_hdr_len = sizeof(struct virtio_net_hdr);
+        }
+        return;
+    }
+
     if (!nc || !nc->info->using_vnet_hdr) {
         return;
     }
@@ -471,9 +527,39 @@ void qemu_using_vnet_hdr(NetClientState *nc, bool enable)
     nc->info->using_vnet_hdr(nc, enable);
 }
 
+/* The emulated offloads of @nc are used by the context that @nc sends
+ * from; serialize with it before changing them.  */
+static AioContext *qemu_offload_acquire(NetClientState *nc)
+{
+    AioContext *ctx = nc->ctx;
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    return ctx;
+}
+
+static void qemu_offload_release(AioContext *ctx)
+{
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
 void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
                           int ecn, int ufo)
 {
+    if (nc && nc->offload) {
+        AioContext *ctx = qemu_offload_acquire(nc);
+
+        qemu_flush_gro(nc);
+        nc->offload->csum = csum;
+        nc->offload->tso4 = csum && tso4;
+        nc->offload->tso6 = csum && tso6;
+        qemu_offload_release(ctx);
+        return;
+    }
+
     if (!nc || !nc->info->set_offload) {
         return;
     }
@@ -483,6 +569,15 @@ void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
 
 void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
 {
+    if (nc && nc->offload) {
+        AioContext *ctx = qemu_offload_acquire(nc);
+
+        qemu_flush_gro(nc);
+        nc->vnet_hdr_len = len;
+        qemu_offload_release(ctx);
+        return;
+    }
+
     if (!nc || !nc->info->set_vnet_hdr_len) {
         return;
     }
@@ -494,7 +589,7 @@ void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
 int qemu_set_vnet_le(NetClientState *nc, bool is_le)
 {
 #ifdef HOST_WORDS_BIGENDIAN
-    if (!nc || !nc->info->set_vnet_le) {
+    if (!nc || nc->offload || !nc->info->set_vnet_le) {
         return -ENOSYS;
     }
 
@@ -509,7 +604,7 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #ifdef HOST_WORDS_BIGENDIAN
     return 0;
 #else
-    if (!nc || !nc->info->set_vnet_be) {
+    if (!nc || nc->offload || !nc->info->set_vnet_be) {
         return -ENOSYS;
     }
 
@@ -517,6 +612,25 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+/*
+ * Move the backend's I/O handlers to @ctx, or back to the main loop if
+ * @ctx is NULL.  Packets are then sent to the peer from that context.
+ */
+int qemu_net_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    int ret;
+
+    if (!nc || !nc->info->set_aio_context) {
+        return -ENOSYS;
+    }
+
+    ret = nc->info->set_aio_context(nc, ctx);
+    if (ret == 0) {
+        nc->ctx = ctx;
+    }
+    return ret;
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -588,10 +702,18 @@ static ssize_t filter_receive(NetClientState *nc,
 
 void qemu_purge_queued_packets(NetClientState *nc)
 {
+    if (nc->offload) {
+        net_gro_reset(nc->offload->gro);
+    }
+
     if (!nc->peer) {
         return;
     }
 
+    /* A partially segmented frame may be among the purged packets */
+    if (nc->peer->offload) {
+        net_gso_reset(nc->peer->offload->gso);
+    }
     qemu_net_queue_purge(nc->peer->incoming_queue, nc);
 }
 
@@ -620,6 +742,93 @@ void qemu_flush_queued_packets(NetClientState *nc)
     qemu_flush_or_purge_queued_packets(nc, false);
 }
 
+/* Packets sent by @nc between qemu_net_plug() and qemu_net_unplug() are
+ * handed to the peer in batches, if the peer can receive them that way.
+ */
+void qemu_net_plug(NetClientState *nc)
+{
+    if (nc->peer && nc->peer->info->receive_batch) {
+        qemu_net_queue_plug(nc->peer->incoming_queue);
+    }
+}
+
+void qemu_net_unplug(NetClientState *nc)
+{
+    if (nc->peer && nc->peer->info->receive_batch) {
+        qemu_net_queue_unplug(nc->peer->incoming_queue);
+    }
+}
+
+static ssize_t qemu_sendv_packet_async_with_flags(NetClientState *sender,
+                                                  unsigned flags,
+                                                  const struct iovec *iov,
+                                                  int iovcnt,
+                                                  NetPacketSent *sent_cb);
+
+/*
+ * Send @buf with a virtio net header for the peer, after coalescing it
+ * with the following packets of the burst if possible.
+ */
+static ssize_t qemu_send_packet_offload(NetClientState *sender,
+                                        const uint8_t *buf, int size,
+                                        NetPacketSent *sent_cb)
+{
+    NetOffloadState *s = sender->offload;
+    struct virtio_net_hdr_mrg_rxbuf hdr = {};
+    struct iovec iov[2];
+    bool blocked = false;
+    ssize_t ret;
+
+    for (;;) {
+        switch (net_gro_receive(s->gro, buf, size, s->tso4, s->tso6)) {
+        case NET_GRO_MERGED:
+            s->gro_sent_cb = sent_cb;
+            return size;
+        case NET_GRO_FLUSH:
+            if (qemu_flush_gro(sender)) {
+                continue;
+            }
+            /* The coalesced frame was queued: queue @buf behind it as is,
+             * and have the backend wait for the peer.  */
+            blocked = true;
+            break;
+        case NET_GRO_NONE:
+            break;
+        }
+        break;
+    }
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sender->vnet_hdr_len;
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = size;
+    ret = qemu_sendv_packet_async_with_flags(sender,
+                                             QEMU_NET_PACKET_FLAG_NONE,
+                                             iov, 2, sent_cb);
+    return blocked ? 0 : ret;
+}
+
+/*
+ * Send the TCP segments coalesced by qemu_send_packet_async as a single
+ * packet.  Returns false if the peer could not receive it right away, in
+ * which case it is queued and the sent_cb of the segments is called later.
+ */
+bool qemu_flush_gro(NetClientState *nc)
+{
+    NetOffloadState *s = nc->offload;
+    struct iovec iov;
+    size_t size;
+
+    if (!s || !net_gro_pending(s->gro)) {
+        return true;
+    }
+
+    iov.iov_base = (void *)net_gro_finish(s->gro, nc->vnet_hdr_len, &size);
+    iov.iov_len = size;
+    return qemu_sendv_packet_async_with_flags(nc, QEMU_NET_PACKET_FLAG_NONE,
+                                              &iov, 1, s->gro_sent_cb) != 0;
+}
+
 static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
                                                  unsigned flags,
                                                  const uint8_t *buf, int size,
@@ -637,6 +846,11 @@ static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
         return size;
     }
 
+    if (sender->offload && sender->offload->using_vnet_hdr &&
+        !(flags & QEMU_NET_PACKET_FLAG_RAW)) {
+        return qemu_send_packet_offload(sender, buf, size, sent_cb);
+    }
+
     /* Let filters handle the packet first */
     ret = filter_receive(sender, NET_FILTER_DIRECTION_TX,
                          sender, flags, buf, size, sent_cb);
@@ -705,6 +919,30 @@ static ssize_t nc_sendv_compat(NetClientState *nc, const struct iovec *iov,
     return ret;
 }
 
+static ssize_t nc_receive_iov(NetClientState *nc, const struct iovec *iov,
+                              int iovcnt, unsigned flags)
+{
+    int ret;
+
+    if (nc->info->receive_iov && !(flags & QEMU_NET_PACKET_FLAG_RAW)) {
+        ret = nc->info->receive_iov(nc, iov, iovcnt);
+    } else {
+        ret = nc_sendv_compat(nc, iov, iovcnt, flags);
+    }
+
+    if (ret == 0) {
+        nc->receive_disabled = 1;
+    }
+
+    return ret;
+}
+
+static ssize_t nc_receive_segment(void *opaque, const struct iovec *iov,
+                                  int iovcnt)
+{
+    return nc_receive_iov(opaque, iov, iovcnt, QEMU_NET_PACKET_FLAG_NONE);
+}
+
 ssize_t qemu_deliver_packet_iov(NetClientState *sender,
                                 unsigned flags,
                                 const struct iovec *iov,
@@ -712,7 +950,6 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
                                 void *opaque)
 {
     NetClientState *nc = opaque;
-    int ret;
 
     if (nc->link_down) {
         return iov_size(iov, iovcnt);
@@ -722,12 +959,40 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
         return 0;
     }
 
-    if (nc->info->receive_iov && !(flags & QEMU_NET_PACKET_FLAG_RAW)) {
-        ret = nc->info->receive_iov(nc, iov, iovcnt);
-    } else {
-        ret = nc_sendv_compat(nc, iov, iovcnt, flags);
+    if (nc->offload && nc->offload->using_vnet_hdr &&
+        !(flags & QEMU_NET_PACKET_FLAG_RAW)) {
+        return net_gso_segment(nc->offload->gso, iov, iovcnt,
+                               nc->vnet_hdr_len, nc_receive_segment, nc);
+    }
+
+    return nc_receive_iov(nc, iov, iovcnt, flags);
+}
+
+int qemu_deliver_packet_batch(const struct iovec *packets, int count,
+                              void *opaque)
+{
+    NetClientState *nc = opaque;
+    int i, ret;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    if (nc->offload && nc->offload->using_vnet_hdr) {
+        for (i = 0; i < count; i++) {
+            if (qemu_deliver_packet_iov(NULL, QEMU_NET_PACKET_FLAG_NONE,
+                                        &packets[i], 1, nc) == 0) {
+                break;
+            }
+        }
+        return i;
     }
 
+    ret = nc->info->receive_batch(nc, packets, count);
     if (ret == 0) {
         nc->receive_disabled = 1;
     }
@@ -735,9 +1000,11 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
-ssize_t qemu_sendv_packet_async(NetClientState *sender,
-                                const struct iovec *iov, int iovcnt,
-                                NetPacketSent *sent_cb)
+static ssize_t qemu_sendv_packet_async_with_flags(NetClientState *sender,
+                                                  unsigned flags,
+                                                  const struct iovec *iov,
+                                                  int iovcnt,
+                                                  NetPacketSent *sent_cb)
 {
     NetQueue *queue;
     int ret;
@@ -748,24 +1015,32 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
 
     /* Let filters handle the packet first */
     ret = filter_receive_iov(sender, NET_FILTER_DIRECTION_TX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
+                             flags, iov, iovcnt, sent_cb);
     if (ret) {
         return ret;
     }
 
     ret = filter_receive_iov(sender->peer, NET_FILTER_DIRECTION_RX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
+                             flags, iov, iovcnt, sent_cb);
     if (ret) {
         return ret;
     }
 
     queue = sender->peer->incoming_queue;
 
-    return qemu_net_queue_send_iov(queue, sender,
-                                   QEMU_NET_PACKET_FLAG_NONE,
+    return qemu_net_queue_send_iov(queue, sender, flags,
                                    iov, iovcnt, sent_cb);
 }
 
+ssize_t qemu_sendv_packet_async(NetClientState *sender,
+                                const struct iovec *iov, int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_NONE,
+                                              iov, iovcnt, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -946,6 +1221,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_DRIVER_NETMAP]    = net_init_netmap,
 #endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_DRIVER_AF_XDP]    = net_init_af_xdp,
+#endif
 #ifdef CONFIG_NET_BRIDGE
         [NET_CLIENT_DRIVER_BRIDGE]    = net_init_bridge,
 #endif
@@ -1081,6 +1359,9 @@ static void show_netdevs(void)
 #ifdef CONFIG_NETMAP
         "netmap",
 #endif
+#ifdef CONFIG_AF_XDP
+        "af-xdp",
+#endif
 #ifdef CONFIG_POSIX
         "vhost-user",
 #endif
@@ -1649,6 +1930,8 @@ void net_socket_rs_init(SocketReadState *rs,
     rs->packet_len = 0;
     rs->vnet_hdr_len = 0;
     memset(rs->buf, 0, sizeof(rs->buf));
+    rs->alloc = false;
+    rs->data = NULL;
     rs->finalize = finalize;
 }
 
@@ -1710,7 +1993,12 @@ int net_fill_rstate(SocketReadState *rs, const uint8_t *buf, int size)
             if (l > size) {
                 l = size;
             }
-            if (rs->index + l <= sizeof(rs->buf)) {
+            if (rs->alloc && rs->packet_len <= sizeof(rs->buf)) {
+                if (!rs->data) {
+                    rs->data = g_malloc(rs->packet_len);
+                }
+                memcpy(rs->data + rs->index, buf, l);
+            } else if (!rs->alloc && rs->index + l <= sizeof(rs->buf)) {
                 memcpy(rs->buf + rs->index, buf, l);
             } else {
                 fprintf(stderr, "serious error: oversized packet received,"
@@ -1727,6 +2015,8 @@ int net_fill_rstate(SocketReadState *rs, const uint8_t *buf, int size)
                 rs->state = 0;
                 assert(rs->finalize);
                 rs->finalize(rs);
+                g_free(rs->data);
+                rs->data = NULL;
             }
             break;
         }
@@ -0,0 +1,535 @@
+/*
+ * Software segmentation and receive coalescing offloads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Backends that cannot exchange packets with a virtio_net_hdr (socket,
+ * or tap without IFF_VNET_HDR) can have the net layer emulate one.  On
+ * transmit, TSO frames from the guest are cut into MSS sized segments
+ * (GSO) and partial checksums are completed.  On receive, consecutive
+ * segments of one TCP stream are merged into a single large frame (GRO)
+ * that the guest can take in one go.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "net/checksum.h"
+#include "net/eth.h"
+#include "net/offload.h"
+
+/* Room for the largest virtio_net_hdr in front of the coalesced frame */
+#define NET_GRO_HDR_ROOM    sizeof(struct virtio_net_hdr_mrg_rxbuf)
+#define NET_GRO_MAX_FRAME   (ETH_HLEN + sizeof(struct vlan_header) + \
+                             sizeof(struct ip6_header) + 0xFFFF)
+
+#define NET_TCP_FLAGS_OFFSET 13
+#define NET_TCP_CSUM_OFFSET  offsetof(struct tcp_header, th_sum)
+
+#define NET_TCP_CWR 0x80
+
+/* Ethernet with a VLAN tag, and IPv4 and TCP headers with options */
+#define NET_GSO_MAX_HDR     (ETH_HLEN + sizeof(struct vlan_header) + 60 + 60)
+
+struct NetGRO {
+    uint8_t *buf;           /* header room followed by the frame */
+    size_t len;             /* frame length, 0 if nothing is pending */
+    size_t l3_off;
+    size_t l4_off;
+    size_t hdr_len;         /* Ethernet, IP and TCP headers */
+    size_t mss;
+    unsigned int segs;
+    uint32_t next_seq;
+    bool ipv6;
+    bool closed;            /* last segment was short or had PSH */
+};
+
+/* A TSO frame that the backend could only take part of */
+struct NetGSO {
+    uint8_t hdr[NET_GSO_MAX_HDR];   /* headers of the frame */
+    size_t size;                    /* size of the frame, 0 if none */
+    unsigned int sent;              /* segments already sent */
+};
+
+/* A parsed TCP/IP frame, possibly VLAN tagged; IPv6 extension headers are
+ * not supported.  */
+typedef struct NetTCPFrame {
+    bool ipv6;
+    size_t l3_off;
+    size_t l4_off;
+    size_t hdr_len;
+    size_t len;             /* excluding Ethernet padding */
+} NetTCPFrame;
+
+static uint32_t net_tcp_pseudo_sum(const uint8_t *frame, const NetTCPFrame *f)
+{
+    uint8_t *ip = (uint8_t *)frame + f->l3_off;
+    uint32_t l4_len = f->len - f->l4_off;
+    uint32_t sum;
+
+    if (f->ipv6) {
+        sum = net_checksum_add(32, ip + offsetof(struct ip6_header, ip6_src));
+    } else {
+        sum = net_checksum_add(8, ip + offsetof(struct ip_header, ip_src));
+    }
+    return sum + IP_PROTO_TCP + (l4_len >> 16) + (l4_len & 0xFFFF);
+}
+
+/* Store the full TCP checksum of @frame, whose layout is given by @f.  */
+static void net_tcp_set_csum(uint8_t *frame, const NetTCPFrame *f)
+{
+    uint32_t l4_len = f->len - f->l4_off;
+    uint8_t *csum = frame + f->l4_off + NET_TCP_CSUM_OFFSET;
+    uint32_t sum;
+
+    stw_be_p(csum, 0);
+    sum = net_tcp_pseudo_sum(frame, f);
+    sum += net_checksum_add(l4_len, frame + f->l4_off);
+    stw_be_p(csum, net_checksum_finish(sum));
+}
+
+static void net_ip_set_len(uint8_t *frame, const NetTCPFrame *f)
+{
+    uint8_t *ip = frame + f->l3_off;
+
+    if (f->ipv6) {
+        stw_be_p(ip + offsetof(struct ip6_header, ip6_ctlun.ip6_un1.ip6_un1_plen),
+                 f->len - f->l4_off);
+    } else {
+        stw_be_p(ip + offsetof(struct ip_header, ip_len), f->len - f->l3_off);
+        stw_be_p(ip + offsetof(struct ip_header, ip_sum), 0);
+        stw_be_p(ip + offsetof(struct ip_header, ip_sum),
+                 net_raw_checksum(ip, f->l4_off - f->l3_off));
+    }
+}
+
+static bool net_tcp_parse(const uint8_t *frame, size_t size, NetTCPFrame *f)
+{
+    const uint8_t *ip;
+    size_t l3_len, tcp_len;
+    uint16_t proto;
+
+    if (size < ETH_HLEN + sizeof(struct vlan_header)) {
+        return false;
+    }
+
+    f->l3_off = ETH_HLEN;
+    proto = lduw_be_p(frame + offsetof(struct eth_header, h_proto));
+    if (proto == ETH_P_VLAN) {
+        f->l3_off += sizeof(struct vlan_header);
+        proto = lduw_be_p(frame + ETH_HLEN +
+                          offsetof(struct vlan_header, h_proto));
+    }
+    ip = frame + f->l3_off;
+
+    switch (proto) {
+    case ETH_P_IP:
+        if (size < f->l3_off + sizeof(struct ip_header) ||
+            (ldub_p(ip) >> 4) != IP_HEADER_VERSION_4 ||
+            ldub_p(ip + offsetof(struct ip_header, ip_p)) != IP_PROTO_TCP ||
+            (lduw_be_p(ip + offsetof(struct ip_header, ip_off)) &
+             (IP_MF | IP_OFFMASK))) {
+            return false;
+        }
+        l3_len = lduw_be_p(ip + offsetof(struct ip_header, ip_len));
+        f->ipv6 = false;
+        f->l4_off = f->l3_off + IP_HDR_GET_LEN(ip);
+        if (f->l4_off < f->l3_off + sizeof(struct ip_header)) {
+            return false;
+        }
+        break;
+    case ETH_P_IPV6:
+        if (size < f->l3_off + sizeof(struct ip6_header) ||
+            (ldub_p(ip) >> 4) != IP_HEADER_VERSION_6 ||
+            ldub_p(ip + offsetof(struct ip6_header,
+                                 ip6_ctlun.ip6_un1.ip6_un1_nxt)) != IP_PROTO_TCP) {
+            return false;
+        }
+        l3_len = lduw_be_p(ip + offsetof(struct ip6_header,
+                                         ip6_ctlun.ip6_un1.ip6_un1_plen)) +
+                 sizeof(struct ip6_header);
+        f->ipv6 = true;
+        f->l4_off = f->l3_off + sizeof(struct ip6_header);
+        break;
+    default:
+        return false;
+    }
+
+    f->len = f->l3_off + l3_len;
+    if (f->len > size || f->len < f->l4_off + sizeof(struct tcp_header)) {
+        return false;
+    }
+    tcp_len = (ldub_p(frame + f->l4_off + NET_TCP_FLAGS_OFFSET - 1) >> 4) << 2;
+    f->hdr_len = f->l4_off + tcp_len;
+    return tcp_len >= sizeof(struct tcp_header) && f->hdr_len <= f->len;
+}
+
+/* GRO */
+
+NetGRO *net_gro_new(void)
+{
+    NetGRO *gro = g_new0(NetGRO, 1);
+
+    gro->buf = g_malloc(NET_GRO_HDR_ROOM + NET_GRO_MAX_FRAME);
+    return gro;
+}
+
+void net_gro_free(NetGRO *gro)
+{
+    if (gro) {
+        g_free(gro->buf);
+        g_free(gro);
+    }
+}
+
+bool net_gro_pending(NetGRO *gro)
+{
+    return gro->len != 0;
+}
+
+void net_gro_reset(NetGRO *gro)
+{
+    gro->len = 0;
+}
+
+static bool net_gro_csum_ok(const uint8_t *frame, const NetTCPFrame *f)
+{
+    uint32_t l4_len = f->len - f->l4_off;
+    uint32_t sum;
+
+    if (!f->ipv6 && net_raw_checksum((uint8_t *)frame + f->l3_off,
+                                     f->l4_off - f->l3_off)) {
+        return false;
+    }
+    sum = net_tcp_pseudo_sum(frame, f);
+    sum += net_checksum_add(l4_len, (uint8_t *)frame + f->l4_off);
+    return net_checksum_finish(sum) == 0;
+}
+
+/* Whether @frame continues the stream of the pending frame.  The headers
+ * must match, except for the IP length, the IPv4 ID and the checksums; the
+ * sequence number and PSH are checked by the caller.
+ */
+static bool net_gro_same_flow(NetGRO *gro, const uint8_t *frame,
+                              const NetTCPFrame *f)
+{
+    const uint8_t *held = gro->buf + NET_GRO_HDR_ROOM;
+    const uint8_t *th = frame + f->l4_off;
+    const uint8_t *held_th = held + gro->l4_off;
+
+    if (f->ipv6 != gro->ipv6 || f->l3_off != gro->l3_off ||
+        f->l4_off != gro->l4_off || f->hdr_len != gro->hdr_len) {
+        return false;
+    }
+
+    if (f->ipv6) {
+        /* Ethernet header, IPv6 flow word, next header, hop limit and
+         * addresses */
+        if (memcmp(frame, held, f->l3_off + 4) ||
+            memcmp(frame + f->l3_off + 6, held + f->l3_off + 6,
+                   sizeof(struct ip6_header) - 6)) {
+            return false;
+        }
+    } else {
+        /* Ethernet header, TOS, flags, TTL, protocol, addresses and
+         * options */
+        if (memcmp(frame, held, f->l3_off + 2) ||
+            memcmp(frame + f->l3_off + 6, held + f->l3_off + 6, 4) ||
+            memcmp(frame + f->l3_off + 12, held + f->l3_off + 12,
+                   f->l4_off - f->l3_off - 12)) {
+            return false;
+        }
+    }
+
+    /* Ports, then acknowledgment number, data offset and window */
+    if (memcmp(th, held_th, 4) ||
+        memcmp(th + offsetof(struct tcp_header, th_ack),
+               held_th + offsetof(struct tcp_header, th_ack), 4) ||
+        ldub_p(th + NET_TCP_FLAGS_OFFSET - 1) !=
+        ldub_p(held_th + NET_TCP_FLAGS_OFFSET - 1) ||
+        memcmp(th + offsetof(struct tcp_header, th_win),
+               held_th + offsetof(struct tcp_header, th_win), 2)) {
+        return false;
+    }
+
+    /* Options, e.g. timestamps */
+    return !memcmp(th + sizeof(struct tcp_header),
+                   held_th + sizeof(struct tcp_header),
+                   f->hdr_len - f->l4_off - sizeof(struct tcp_header));
+}
+
+NetGROResult net_gro_receive(NetGRO *gro, const uint8_t *frame, size_t size,
+                             bool tso4, bool tso6)
+{
+    uint8_t *held = gro->buf + NET_GRO_HDR_ROOM;
+    NetTCPFrame f;
+    size_t payload;
+    uint8_t flags;
+
+    if ((!tso4 && !tso6) || !net_tcp_parse(frame, size, &f) ||
+        !(f.ipv6 ? tso6 : tso4)) {
+        goto not_merged;
+    }
+
+    payload = f.len - f.hdr_len;
+    flags = ldub_p(frame + f.l4_off + NET_TCP_FLAGS_OFFSET);
+    if (!payload || (flags & ~TH_PUSH) != TH_ACK ||
+        !net_gro_csum_ok(frame, &f)) {
+        goto not_merged;
+    }
+
+    if (!gro->len) {
+        memcpy(held, frame, f.len);
+        gro->len = f.len;
+        gro->l3_off = f.l3_off;
+        gro->l4_off = f.l4_off;
+        gro->hdr_len = f.hdr_len;
+        gro->mss = payload;
+        gro->segs = 1;
+        gro->ipv6 = f.ipv6;
+        gro->closed = flags & TH_PUSH;
+        gro->next_seq = ldl_be_p(frame + f.l4_off +
+                                 offsetof(struct tcp_header, th_seq)) + payload;
+        return NET_GRO_MERGED;
+    }
+
+    if (gro->closed || payload > gro->mss ||
+        gro->len + payload > NET_GRO_MAX_FRAME ||
+        gro->len + payload - (gro->ipv6 ? gro->l4_off : gro->l3_off) > 0xFFFF ||
+        ldl_be_p(frame + f.l4_off + offsetof(struct tcp_header, th_seq)) !=
+        gro->next_seq ||
+        !net_gro_same_flow(gro, frame, &f)) {
+        return NET_GRO_FLUSH;
+    }
+
+    memcpy(held + gro->len, frame + f.hdr_len, payload);
+    gro->len += payload;
+    gro->next_seq += payload;
+    gro->segs++;
+    if (flags & TH_PUSH) {
+        stb_p(held + gro->l4_off + NET_TCP_FLAGS_OFFSET,
+              ldub_p(held + gro->l4_off + NET_TCP_FLAGS_OFFSET) | TH_PUSH);
+    }
+    gro->closed = payload < gro->mss || (flags & TH_PUSH);
+    return NET_GRO_MERGED;
+
+not_merged:
+    return gro->len ? NET_GRO_FLUSH : NET_GRO_NONE;
+}
+
+const uint8_t *net_gro_finish(NetGRO *gro, size_t vnet_hdr_len, size_t *size)
+{
+    uint8_t *frame = gro->buf + NET_GRO_HDR_ROOM;
+    uint8_t *start = frame - vnet_hdr_len;
+    struct virtio_net_hdr hdr = {};
+    NetTCPFrame f = {
+        .ipv6 = gro->ipv6,
+        .l3_off = gro->l3_off,
+        .l4_off = gro->l4_off,
+        .hdr_len = gro->hdr_len,
+        .len = gro->len,
+    };
+
+    assert(gro->len && vnet_hdr_len >= sizeof(hdr) &&
+           vnet_hdr_len <= NET_GRO_HDR_ROOM);
+
+    if (gro->segs > 1) {
+        uint32_t sum = net_tcp_pseudo_sum(frame, &f);
+
+        net_ip_set_len(frame, &f);
+        /* Leave the pseudo header sum for the guest, as a NIC would */
+        stw_be_p(frame + f.l4_off + NET_TCP_CSUM_OFFSET,
+                 (uint16_t)~net_checksum_finish(sum));
+
+        hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr.gso_type = f.ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6
+                              : VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr.hdr_len = f.hdr_len;
+        hdr.gso_size = gro->mss;
+        hdr.csum_start = f.l4_off;
+        hdr.csum_offset = NET_TCP_CSUM_OFFSET;
+    }
+
+    memset(start, 0, vnet_hdr_len);
+    memcpy(start, &hdr, sizeof(hdr));
+    *size = vnet_hdr_len + gro->len;
+    gro->len = 0;
+    return start;
+}
+
+/* GSO */
+
+NetGSO *net_gso_new(void)
+{
+    return g_new0(NetGSO, 1);
+}
+
+void net_gso_free(NetGSO *gso)
+{
+    g_free(gso);
+}
+
+void net_gso_reset(NetGSO *gso)
+{
+    gso->size = 0;
+    gso->sent = 0;
+}
+
+static ssize_t net_gso_tcp(NetGSO *gso, uint8_t *frame, size_t size,
+                           const struct virtio_net_hdr *hdr,
+                           NetGSOOutput *output, void *opaque)
+{
+    NetTCPFrame f;
+    uint8_t *seg;
+    size_t mss = hdr->gso_size;
+    size_t off, payload;
+    uint32_t seq;
+    uint16_t id;
+    uint8_t flags;
+    ssize_t ret = size;
+    unsigned int i, first = 0;
+
+    if (!net_tcp_parse(frame, size, &f) || !mss ||
+        f.ipv6 != ((hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) ==
+                   VIRTIO_NET_HDR_GSO_TCPV6)) {
+        /* Malformed, drop it */
+        net_gso_reset(gso);
+        return size;
+    }
+
+    assert(f.hdr_len <= sizeof(gso->hdr));
+
+    /* The backend queued the frame after taking its first segments */
+    if (gso->size == size && !memcmp(gso->hdr, frame, f.hdr_len)) {
+        first = gso->sent;
+    }
+    net_gso_reset(gso);
+
+    seg = g_malloc(f.hdr_len + mss);
+    memcpy(seg, frame, f.hdr_len);
+    seq = ldl_be_p(frame + f.l4_off + offsetof(struct tcp_header, th_seq));
+    id = lduw_be_p(frame + f.l3_off + offsetof(struct ip_header, ip_id));
+    flags = ldub_p(frame + f.l4_off + NET_TCP_FLAGS_OFFSET);
+
+    for (i = 0, off = f.hdr_len; off < f.len; i++, off += payload) {
+        NetTCPFrame s = f;
+        struct iovec iov;
+        ssize_t r;
+
+        payload = MIN(mss, f.len - off);
+        if (i < first) {
+            continue;
+        }
+        memcpy(seg + f.hdr_len, frame + off, payload);
+        s.len = f.hdr_len + payload;
+
+        if (!f.ipv6) {
+            stw_be_p(seg + f.l3_off + offsetof(struct ip_header, ip_id),
+                     id + i);
+        }
+        net_ip_set_len(seg, &s);
+
+        /* CWR only on the first segment, FIN and PSH only on the last */
+        stl_be_p(seg + f.l4_off + offsetof(struct tcp_header, th_seq),
+                 seq + (off - f.hdr_len));
+        stb_p(seg + f.l4_off + NET_TCP_FLAGS_OFFSET,
+              flags & ~(i ? NET_TCP_CWR : 0) &
+              ~(off + payload < f.len ? TH_FIN | TH_PUSH : 0));
+        net_tcp_set_csum(seg, &s);
+
+        iov.iov_base = seg;
+        iov.iov_len = s.len;
+        r = output(opaque, &iov, 1);
+        if (r == 0) {
+            /*
+             * The backend is full and will retry the whole frame once it
+             * can take more; resume from this segment then.
+             */
+            memcpy(gso->hdr, frame, f.hdr_len);
+            gso->size = size;
+            gso->sent = i;
+            ret = 0;
+            break;
+        }
+        if (r <= 0) {
+            /* An error drops the rest of the frame, like a failed send */
+            ret = r;
+            break;
+        }
+    }
+
+    g_free(seg);
+    return ret;
+}
+
+static void net_gso_csum(uint8_t *frame, size_t size,
+                         const struct virtio_net_hdr *hdr)
+{
+    uint32_t start = hdr->csum_start;
+    uint32_t offset = hdr->csum_offset;
+    uint8_t *csum;
+
+    if (start >= size || offset + 2 > size - start) {
+        return;
+    }
+
+    /* The guest stored the pseudo header sum in the checksum field */
+    csum = frame + start + offset;
+    stw_be_p(csum, net_checksum_finish(net_checksum_add(size - start,
+                                                        frame + start)));
+}
+
+ssize_t net_gso_segment(NetGSO *gso, const struct iovec *iov, int iovcnt,
+                        size_t vnet_hdr_len,
+                        NetGSOOutput *output, void *opaque)
+{
+    struct virtio_net_hdr hdr;
+    size_t total = iov_size(iov, iovcnt);
+    size_t size;
+    uint8_t *frame;
+    ssize_t ret;
+
+    if (total < vnet_hdr_len ||
+        iov_to_buf(iov, iovcnt, 0, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        return total;
+    }
+    size = total - vnet_hdr_len;
+
+    if (hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE &&
+        !(hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        struct iovec sg[NET_GSO_MAX_IOV];
+        int cnt = iov_copy(sg, ARRAY_SIZE(sg), iov, iovcnt,
+                           vnet_hdr_len, size);
+
+        if (iov_size(sg, cnt) == size) {
+            ret = output(opaque, sg, cnt);
+            return ret > 0 ? total : ret;
+        }
+    }
+
+    frame = g_malloc(size);
+    iov_to_buf(iov, iovcnt, vnet_hdr_len, frame, size);
+
+    switch (hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+    case VIRTIO_NET_HDR_GSO_NONE: {
+        struct iovec sg = { .iov_base = frame, .iov_len = size };
+
+        if (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+            net_gso_csum(frame, size, &hdr);
+        }
+        ret = output(opaque, &sg, 1);
+        break;
+    }
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+        ret = net_gso_tcp(gso, frame, size, &hdr, output, opaque);
+        break;
+    default:
+        /* UFO is never offered to the guest */
+        ret = size;
+        break;
+    }
+
+    g_free(frame);
+    return ret > 0 ? total : ret;
+}
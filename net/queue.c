@@ -23,6 +23,7 @@
 
 #include "qemu/osdep.h"
 #include "net/queue.h"
+#include "qemu/iov.h"
 #include "qemu/queue.h"
 #include "net/net.h"
 
@@ -38,6 +39,12 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * While the queue is plugged and has a batch delivery handler, packets
+ * that could be delivered right away are copied to the queue instead
+ * and reported as sent.  They are passed to the batch handler, up to
+ * NET_QUEUE_BATCH_MAX at a time, when enough of them have accumulated
+ * or when the queue is unplugged.
  */
 
 struct NetPacket {
@@ -54,6 +61,8 @@ struct NetQueue {
     uint32_t nq_maxlen;
     uint32_t nq_count;
     NetQueueDeliverFunc *deliver;
+    NetQueueDeliverBatchFunc *deliver_batch;
+    unsigned plugged;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
 
@@ -78,6 +87,12 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     return queue;
 }
 
+void qemu_net_queue_set_deliver_batch(NetQueue *queue,
+                                      NetQueueDeliverBatchFunc *deliver_batch)
+{
+    queue->deliver_batch = deliver_batch;
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
@@ -182,6 +197,62 @@ static ssize_t qemu_net_queue_deliver_iov(NetQueue *queue,
     return ret;
 }
 
+static bool qemu_net_queue_batching(NetQueue *queue)
+{
+    return queue->plugged && queue->deliver_batch;
+}
+
+/* Deliver up to NET_QUEUE_BATCH_MAX packets from the head of the queue
+ * with a single call to the batch delivery handler.  Returns the number
+ * of packets consumed, or -1 if the head of the queue cannot be batched.
+ */
+static int qemu_net_queue_deliver_batch(NetQueue *queue)
+{
+    struct iovec packets[NET_QUEUE_BATCH_MAX];
+    NetPacket *packet;
+    int count = 0;
+    int ret, i;
+
+    QTAILQ_FOREACH(packet, &queue->packets, entry) {
+        if (count == NET_QUEUE_BATCH_MAX ||
+            packet->flags != QEMU_NET_PACKET_FLAG_NONE) {
+            break;
+        }
+        packets[count].iov_base = packet->data;
+        packets[count].iov_len = packet->size;
+        count++;
+    }
+    if (count < 2) {
+        return -1;
+    }
+
+    queue->delivering = 1;
+    ret = queue->deliver_batch(packets, count, queue->opaque);
+    queue->delivering = 0;
+
+    assert(ret >= 0 && ret <= count);
+    for (i = 0; i < ret; i++) {
+        packet = QTAILQ_FIRST(&queue->packets);
+        QTAILQ_REMOVE(&queue->packets, packet, entry);
+        queue->nq_count--;
+        if (packet->sent_cb) {
+            packet->sent_cb(packet->sender, packet->size);
+        }
+        g_free(packet);
+    }
+    return ret;
+}
+
+/* Flush a plugged queue once a full batch is pending, or unconditionally
+ * if @force is true.
+ */
+static void qemu_net_queue_flush_batch(NetQueue *queue, bool force)
+{
+    if (force || queue->nq_count >= NET_QUEUE_BATCH_MAX) {
+        qemu_net_queue_flush(queue);
+    }
+}
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
@@ -196,6 +267,12 @@ ssize_t qemu_net_queue_send(NetQueue *queue,
         return 0;
     }
 
+    if (qemu_net_queue_batching(queue)) {
+        qemu_net_queue_append(queue, sender, flags, data, size, NULL);
+        qemu_net_queue_flush_batch(queue, false);
+        return size;
+    }
+
     ret = qemu_net_queue_deliver(queue, sender, flags, data, size);
     if (ret == 0) {
         qemu_net_queue_append(queue, sender, flags, data, size, sent_cb);
@@ -221,6 +298,12 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
         return 0;
     }
 
+    if (qemu_net_queue_batching(queue)) {
+        qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, NULL);
+        qemu_net_queue_flush_batch(queue, false);
+        return iov_size(iov, iovcnt);
+    }
+
     ret = qemu_net_queue_deliver_iov(queue, sender, flags, iov, iovcnt);
     if (ret == 0) {
         qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, sent_cb);
@@ -254,6 +337,15 @@ bool qemu_net_queue_flush(NetQueue *queue)
         NetPacket *packet;
         int ret;
 
+        if (queue->deliver_batch) {
+            ret = qemu_net_queue_deliver_batch(queue);
+            if (ret == 0) {
+                return false;
+            } else if (ret > 0) {
+                continue;
+            }
+        }
+
         packet = QTAILQ_FIRST(&queue->packets);
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         queue->nq_count--;
@@ -277,3 +369,16 @@ bool qemu_net_queue_flush(NetQueue *queue)
     }
     return true;
 }
+
+void qemu_net_queue_plug(NetQueue *queue)
+{
+    queue->plugged++;
+}
+
+void qemu_net_queue_unplug(NetQueue *queue)
+{
+    assert(queue->plugged > 0);
+    if (--queue->plugged == 0 && !queue->delivering) {
+        qemu_net_queue_flush_batch(queue, true);
+    }
+}
@@ -187,6 +187,10 @@ static void net_socket_send(void *opaque)
     if (ret == -1) {
         goto eoc;
     }
+
+    if (!qemu_flush_gro(&s->nc)) {
+        net_socket_read_poll(s, false);
+    }
 }
 
 static void net_socket_send_dgram(void *opaque)
@@ -204,7 +208,8 @@ static void net_socket_send_dgram(void *opaque)
         return;
     }
     if (qemu_send_packet_async(&s->nc, s->rs.buf, size,
-                               net_socket_send_completed) == 0) {
+                               net_socket_send_completed) == 0 ||
+        !qemu_flush_gro(&s->nc)) {
         net_socket_read_poll(s, false);
     }
 }
@@ -719,7 +724,7 @@ int net_init_socket(const Netdev *netdev, const char *name,
                                 errp)) {
             return -1;
         }
-        return 0;
+        goto out;
     }
 
     if (sock->has_listen) {
@@ -727,7 +732,7 @@ int net_init_socket(const Netdev *netdev, const char *name,
             < 0) {
             return -1;
         }
-        return 0;
+        goto out;
     }
 
     if (sock->has_connect) {
@@ -735,7 +740,7 @@ int net_init_socket(const Netdev *netdev, const char *name,
             < 0) {
             return -1;
         }
-        return 0;
+        goto out;
     }
 
     if (sock->has_mcast) {
@@ -745,7 +750,7 @@ int net_init_socket(const Netdev *netdev, const char *name,
                                   sock->localaddr, errp) < 0) {
             return -1;
         }
-        return 0;
+        goto out;
     }
 
     assert(sock->has_udp);
@@ -757,5 +762,11 @@ int net_init_socket(const Netdev *netdev, const char *name,
                             errp) < 0) {
         return -1;
     }
+
+out:
+    if (sock->has_gso && sock->gso) {
+        /* The new client is connected to the hub port for -net */
+        qemu_enable_sw_offload(peer ? peer->peer : qemu_find_netdev(name));
+    }
     return 0;
 }
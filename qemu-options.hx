@@ -128,9 +128,15 @@ Select CPU model (@code{-cpu help} for list and additional feature selection)
 ETEXI
 
 DEF("accel", HAS_ARG, QEMU_OPTION_accel,
-    "-accel [accel=]accelerator[,thread=single|multi]\n"
+    "-accel [accel=]accelerator[,thread=single|multi][,hot-threshold=n][,tb-cache=dir]\n"
+    "                [,perfmap=on|off][,jitdump=on|off][,reg-prefs=on|off]\n"
     "                select accelerator (kvm, xen, hax, hvf, whpx or tcg; use 'help' for a list)\n"
-    "                thread=single|multi (enable multi-threaded TCG)", QEMU_ARCH_ALL)
+    "                thread=single|multi (enable multi-threaded TCG)\n"
+    "                hot-threshold=n (retranslate TBs run n times, 0=off)\n"
+    "                tb-cache=dir (keep translated code in dir across runs)\n"
+    "                perfmap=on|off (write /tmp/perf-<pid>.map for perf)\n"
+    "                jitdump=on|off (write jit-<pid>.dump for perf)\n"
+    "                reg-prefs=on|off (honour register preferences in TCG)", QEMU_ARCH_ALL)
 STEXI
 @item -accel @var{name}[,prop=@var{value}[,...]]
 @findex -accel
@@ -144,6 +150,26 @@ Controls number of TCG threads. When the TCG is multi-threaded there will be one
 thread per vCPU therefor taking advantage of additional host cores. The default
 is to enable multi-threading where both the back-end and front-ends support it and
 no incompatible TCG features have been enabled (e.g. icount/replay).
+@item hot-threshold=@var{n}
+Enables tiered translation in TCG. Each translation block counts its
+executions, and once it has run @var{n} times it is translated again with
+additional optimization passes. The default of 0 disables the counters.
+@item tb-cache=@var{dir}
+Keeps the intermediate code of translated blocks in a file in @var{dir}, so
+that later runs of the same QEMU binary with the same CPU model can skip
+decoding guest code that has not changed. Only valid for TCG.
+@item perfmap=on|off
+Writes the address range and guest PC of every translated block to
+@file{/tmp/perf-<pid>.map}, so that @command{perf report} can attribute
+samples in translated code to the guest code it came from.
+@item jitdump=on|off
+Writes translated blocks and their host code to @file{jit-<pid>.dump} in the
+current directory, for use with @command{perf inject --jit}.
+@item reg-prefs=on|off
+Controls whether the TCG register allocator places each value in the host
+register that its later uses in the block want, such as the argument register
+of a helper call.  It is on by default; turning it off gives the greedy
+per-op allocation, to compare the size and speed of the generated code.
 @end table
 ETEXI
 
@@ -1921,7 +1947,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev tap,id=str[,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile]\n"
     "         [,br=bridge][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off]\n"
     "         [,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
-    "         [,poll-us=n]\n"
+    "         [,poll-us=n][,gso=on|off]\n"
     "                configure a host TAP network backend with ID 'str'\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
@@ -1944,6 +1970,8 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'queues=n' to specify the number of queues to be created for multiqueue TAP\n"
     "                use 'poll-us=n' to speciy the maximum number of microseconds that could be\n"
     "                spent on busy polling for vhost net\n"
+    "                use gso=on to segment and coalesce TCP packets in QEMU\n"
+    "                when IFF_VNET_HDR is not used\n"
     "-netdev bridge,id=str[,br=bridge][,helper=helper]\n"
     "                configure a host TAP network backend with ID 'str' that is\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
@@ -1985,6 +2013,8 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev socket,id=str[,fd=h][,udp=host:port][,localaddr=host:port]\n"
     "                configure a network backend to connect to another network\n"
     "                using an UDP tunnel\n"
+    "                use 'gso=on' with any of the above to segment and coalesce\n"
+    "                TCP packets in QEMU\n"
 #ifdef CONFIG_VDE
     "-netdev vde,id=str[,sock=socketpath][,port=n][,group=groupname][,mode=octalmode]\n"
     "                configure a network backend to connect to port 'n' of a vde switch\n"
@@ -1998,6 +2028,12 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m]\n"
+    "                attach to the existing network interface 'name' through AF_XDP\n"
+    "                sockets bound to its queues 'm' to 'm+n-1' (default n=1, m=0)\n"
+#endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -2018,6 +2054,9 @@ DEF("nic", HAS_ARG, QEMU_OPTION_nic,
 #ifdef CONFIG_NETMAP
     "netmap|"
 #endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp|"
+#endif
 #ifdef CONFIG_POSIX
     "vhost-user|"
 #endif
@@ -2439,6 +2478,32 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -nic vde,sock=/tmp/myswitch
 @end example
 
+@item -netdev af-xdp,id=@var{id},ifname=@var{name}[,mode=native|skb][,force-copy=on|off][,queues=@var{n}][,start-queue=@var{m}]
+
+Connect to the existing host network interface @var{name} through AF_XDP
+sockets.  An XDP program is attached to the interface that redirects the
+packets of queues @var{m} to @var{m}+@var{n}-1 to QEMU, and lets the others
+through to the host network stack.  Use @option{queues=@var{n}} with a
+multiqueue virtio-net device so that each queue pair gets its own interface
+queue.  The program runs in the driver with @option{mode=native}, or in
+the generic network stack with @option{mode=skb}; by default native mode is
+tried first.  The driver places packets directly in QEMU's buffers if it
+supports it and @option{force-copy} is not set.
+
+The interface should be configured so that the packets meant for the guest
+arrive on the selected queues, for example with a single combined queue.
+QEMU needs the CAP_NET_ADMIN and CAP_SYS_ADMIN capabilities (CAP_BPF on
+newer kernels) to attach the program.
+
+Example (a veth pair, for testing):
+@example
+ip link add veth0 type veth peer name veth1
+ip link set veth0 up
+ip link set veth1 up
+qemu-system-x86_64 -netdev af-xdp,id=n0,ifname=veth0,mode=skb \
+                   -device virtio-net-pci,netdev=n0
+@end example
+
 @item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off][,queues=n]
 
 Establish a vhost-user netdev, backed by a chardev @var{id}. The chardev should
@@ -4207,13 +4272,15 @@ Dump the network traffic on netdev @var{dev} to the file specified by
 The file format is libpcap, so it can be analyzed with tools such as tcpdump
 or Wireshark.
 
-@item -object colo-compare,id=@var{id},primary_in=@var{chardevid},secondary_in=@var{chardevid},outdev=@var{chardevid}[,vnet_hdr_support]
+@item -object colo-compare,id=@var{id},primary_in=@var{chardevid},secondary_in=@var{chardevid},outdev=@var{chardevid}[,vnet_hdr_support][,compare_threads=@var{n}]
 
 Colo-compare gets packet from primary_in@var{chardevid} and secondary_in@var{chardevid}, than compare primary packet with
 secondary packet. If the packets are same, we will output primary
 packet to outdev@var{chardevid}, else we will notify colo-frame
 do checkpoint and send primary packet to outdev@var{chardevid}.
 if it has the vnet_hdr_support flag, colo compare will send/recv packet with vnet_hdr_len.
+With compare_threads=@var{n}, connections are spread over @var{n} threads
+that compare them in parallel; by default they are compared in the iothread.
 
 we must use it with the help of filter-mirror and filter-redirector.
 
@@ -23,6 +23,7 @@
 #include "disas/disas.h"
 #include "exec/exec-all.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "exec/cpu_ldst.h"
 #include "exec/translator.h"
 
@@ -3015,6 +3016,237 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* pmuludq: the low halves of each quadword, multiplied into a quadword */
+static void gen_pmuludq_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    tcg_gen_ext32u_i64(t, a);
+    tcg_gen_ext32u_i64(d, b);
+    tcg_gen_mul_i64(d, d, t);
+    tcg_temp_free_i64(t);
+}
+
+static const GVecGen3 pmuludq_op = {
+    .fni8 = gen_pmuludq_i64,
+    .vece = MO_64,
+    .prefer_i64 = TCG_TARGET_REG_BITS == 64,
+};
+
+/* pabs: the sign mask of each element, xor'ed and subtracted */
+static void gen_pabsb_i64(TCGv_i64 d, TCGv_i64 a)
+{
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    tcg_gen_vec_sar8i_i64(t, a, 7);
+    tcg_gen_xor_i64(d, a, t);
+    tcg_gen_vec_sub8_i64(d, d, t);
+    tcg_temp_free_i64(t);
+}
+
+static void gen_pabsw_i64(TCGv_i64 d, TCGv_i64 a)
+{
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    tcg_gen_vec_sar16i_i64(t, a, 15);
+    tcg_gen_xor_i64(d, a, t);
+    tcg_gen_vec_sub16_i64(d, d, t);
+    tcg_temp_free_i64(t);
+}
+
+static void gen_pabsd_i32(TCGv_i32 d, TCGv_i32 a)
+{
+    TCGv_i32 t = tcg_temp_new_i32();
+
+    tcg_gen_sari_i32(t, a, 31);
+    tcg_gen_xor_i32(d, a, t);
+    tcg_gen_sub_i32(d, d, t);
+    tcg_temp_free_i32(t);
+}
+
+static void gen_pabs_vec(unsigned vece, TCGv_vec d, TCGv_vec a)
+{
+    TCGv_vec t = tcg_temp_new_vec_matching(d);
+
+    tcg_gen_sari_vec(vece, t, a, (8 << vece) - 1);
+    tcg_gen_xor_vec(vece, d, a, t);
+    tcg_gen_sub_vec(vece, d, d, t);
+    tcg_temp_free_vec(t);
+}
+
+static const GVecGen2 pabs_op[3] = {
+    { .fni8 = gen_pabsb_i64,
+      .fniv = gen_pabs_vec,
+      .opc = INDEX_op_sari_vec,
+      .vece = MO_8 },
+    { .fni8 = gen_pabsw_i64,
+      .fniv = gen_pabs_vec,
+      .opc = INDEX_op_sari_vec,
+      .vece = MO_16 },
+    { .fni4 = gen_pabsd_i32,
+      .fniv = gen_pabs_vec,
+      .opc = INDEX_op_sari_vec,
+      .vece = MO_32 },
+};
+
+/*
+ * Expand the MMX/SSE2 integer operations that have a direct gvec equivalent
+ * inline, so that they use host vector instructions where available instead
+ * of the per-element loops of ops_sse.h.  The bitwise SSE FP operations
+ * are expanded the same way, as they don't depend on MXCSR.  Returns false
+ * if @b must go through its sse_op_table1 helper.
+ *
+ * The remaining integer operations (min/max, pavg, pmulh, pmaddwd,
+ * psadbw, shifts by register, packs and unpacks) have no expander in
+ * tcg-op-gvec and stay on their helpers, as does SSE FP arithmetic.
+ */
+static bool gen_sse_gvec(int b, int is_xmm, int op1_offset, int op2_offset)
+{
+    uint32_t sz = is_xmm ? 16 : 8;
+
+    switch (b) {
+    case 0xfc: /* paddb */
+    case 0xfd: /* paddw */
+    case 0xfe: /* paddd */
+        tcg_gen_gvec_add(b - 0xfc, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_gvec_add(MO_64, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0xf8: /* psubb */
+    case 0xf9: /* psubw */
+    case 0xfa: /* psubd */
+    case 0xfb: /* psubq */
+        tcg_gen_gvec_sub(b - 0xf8, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0xec: /* paddsb */
+    case 0xed: /* paddsw */
+        tcg_gen_gvec_ssadd(b - 0xec, op1_offset, op1_offset, op2_offset,
+                           sz, sz);
+        break;
+    case 0xe8: /* psubsb */
+    case 0xe9: /* psubsw */
+        tcg_gen_gvec_sssub(b - 0xe8, op1_offset, op1_offset, op2_offset,
+                           sz, sz);
+        break;
+    case 0xdc: /* paddusb */
+    case 0xdd: /* paddusw */
+        tcg_gen_gvec_usadd(b - 0xdc, op1_offset, op1_offset, op2_offset,
+                           sz, sz);
+        break;
+    case 0xd8: /* psubusb */
+    case 0xd9: /* psubusw */
+        tcg_gen_gvec_ussub(b - 0xd8, op1_offset, op1_offset, op2_offset,
+                           sz, sz);
+        break;
+    case 0xd5: /* pmullw */
+        tcg_gen_gvec_mul(MO_16, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0xf4: /* pmuludq */
+        tcg_gen_gvec_3(op1_offset, op1_offset, op2_offset, sz, sz,
+                       &pmuludq_op);
+        break;
+    case 0xdb: /* pand */
+    case 0x54: /* andps, andpd */
+        tcg_gen_gvec_and(MO_64, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0xdf: /* pandn */
+    case 0x55: /* andnps, andnpd */
+        tcg_gen_gvec_andc(MO_64, op1_offset, op2_offset, op1_offset, sz, sz);
+        break;
+    case 0xeb: /* por */
+    case 0x56: /* orps, orpd */
+        tcg_gen_gvec_or(MO_64, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0xef: /* pxor */
+    case 0x57: /* xorps, xorpd */
+        tcg_gen_gvec_xor(MO_64, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0x74: /* pcmpeqb */
+    case 0x75: /* pcmpeqw */
+    case 0x76: /* pcmpeql */
+        tcg_gen_gvec_cmp(TCG_COND_EQ, b - 0x74, op1_offset, op1_offset,
+                         op2_offset, sz, sz);
+        break;
+    case 0x64: /* pcmpgtb */
+    case 0x65: /* pcmpgtw */
+    case 0x66: /* pcmpgtl */
+        tcg_gen_gvec_cmp(TCG_COND_GT, b - 0x64, op1_offset, op1_offset,
+                         op2_offset, sz, sz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Likewise for the SSSE3/SSE4 operations of the 0f 38 map, in sse_op_table6.
+ * Only pabs has an MMX form; the others are SSE only.
+ */
+static bool gen_sse_gvec_0f38(int b, int is_xmm, int op1_offset,
+                              int op2_offset)
+{
+    uint32_t sz = is_xmm ? 16 : 8;
+
+    switch (b) {
+    case 0x1c: /* pabsb */
+    case 0x1d: /* pabsw */
+    case 0x1e: /* pabsd */
+        tcg_gen_gvec_2(op1_offset, op2_offset, sz, sz, &pabs_op[b - 0x1c]);
+        break;
+    case 0x29: /* pcmpeqq */
+        tcg_gen_gvec_cmp(TCG_COND_EQ, MO_64, op1_offset, op1_offset,
+                         op2_offset, sz, sz);
+        break;
+    case 0x37: /* pcmpgtq */
+        tcg_gen_gvec_cmp(TCG_COND_GT, MO_64, op1_offset, op1_offset,
+                         op2_offset, sz, sz);
+        break;
+    case 0x40: /* pmulld */
+        tcg_gen_gvec_mul(MO_32, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Shifts by immediate of group 12-14 (0f 71-73).  Shift counts larger
+ * than the element clear it, or fill it with the sign bit for psra.
+ * Returns false for the byte shifts psrldq/pslldq.
+ */
+static bool gen_sse_shift_gvec(int b, int op, int is_xmm, int ofs, int val)
+{
+    uint32_t sz = is_xmm ? 16 : 8;
+    TCGMemOp vece = MO_16 + (b & 0xff) - 0x71;
+    int bits = 8 << vece;
+
+    switch (op) {
+    case 2: /* psrl */
+        if (val >= bits) {
+            tcg_gen_gvec_dup8i(ofs, sz, sz, 0);
+        } else {
+            tcg_gen_gvec_shri(vece, ofs, ofs, val, sz, sz);
+        }
+        break;
+    case 4: /* psra */
+        tcg_gen_gvec_sari(vece, ofs, ofs, MIN(val, bits - 1), sz, sz);
+        break;
+    case 6: /* psll */
+        if (val >= bits) {
+            tcg_gen_gvec_dup8i(ofs, sz, sz, 0);
+        } else {
+            tcg_gen_gvec_shli(vece, ofs, ofs, val, sz, sz);
+        }
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -3424,6 +3656,22 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
 	        goto unknown_op;
             }
             val = x86_ldub_code(env, s);
+            sse_fn_epp = sse_op_table2[((b - 1) & 3) * 8 +
+                                       (((modrm >> 3)) & 7)][b1];
+            if (!sse_fn_epp) {
+                goto unknown_op;
+            }
+            if (is_xmm) {
+                rm = (modrm & 7) | REX_B(s);
+                op2_offset = offsetof(CPUX86State,xmm_regs[rm]);
+            } else {
+                rm = (modrm & 7);
+                op2_offset = offsetof(CPUX86State,fpregs[rm].mmx);
+            }
+            if (gen_sse_shift_gvec(b, (modrm >> 3) & 7, is_xmm,
+                                   op2_offset, val)) {
+                break;
+            }
             if (is_xmm) {
                 tcg_gen_movi_tl(cpu_T0, val);
                 tcg_gen_st32_tl(cpu_T0, cpu_env, offsetof(CPUX86State,xmm_t0.ZMM_L(0)));
@@ -3437,18 +3685,6 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                 tcg_gen_st32_tl(cpu_T0, cpu_env, offsetof(CPUX86State,mmx_t0.MMX_L(1)));
                 op1_offset = offsetof(CPUX86State,mmx_t0);
             }
-            sse_fn_epp = sse_op_table2[((b - 1) & 3) * 8 +
-                                       (((modrm >> 3)) & 7)][b1];
-            if (!sse_fn_epp) {
-                goto unknown_op;
-            }
-            if (is_xmm) {
-                rm = (modrm & 7) | REX_B(s);
-                op2_offset = offsetof(CPUX86State,xmm_regs[rm]);
-            } else {
-                rm = (modrm & 7);
-                op2_offset = offsetof(CPUX86State,fpregs[rm].mmx);
-            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op2_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op1_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -3722,6 +3958,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                 goto unknown_op;
             }
 
+            if (gen_sse_gvec_0f38(b, b1, op1_offset, op2_offset)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -4441,6 +4680,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_gvec(b, is_xmm, op1_offset, op2_offset)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -587,8 +587,12 @@ static bool swap_commutative2(TCGArg *p1, TCGArg *p2)
     return false;
 }
 
-/* Propagate constants and copies, fold constant expressions. */
-void tcg_optimize(TCGContext *s)
+/* Propagate constants and copies, fold constant expressions.
+ * If @ebb is true, what is known about globals and local temps is kept
+ * across conditional branches, i.e. propagation works on extended basic
+ * blocks: the fall-through path of a brcond has a single predecessor.
+ */
+static void tcg_optimize_1(TCGContext *s, bool ebb)
 {
     int nb_temps, nb_globals;
     TCGOp *op, *op_next, *prev_mb = NULL;
@@ -1448,7 +1452,17 @@ void tcg_optimize(TCGContext *s)
                We trash everything if the operation is the end of a basic
                block, otherwise we only trash the output args.  "mask" is
                the non-zero bits mask for the first output arg.  */
-            if (def->flags & TCG_OPF_BB_END) {
+            if (ebb && (opc == INDEX_op_brcond_i32
+                        || opc == INDEX_op_brcond_i64
+                        || opc == INDEX_op_brcond2_i32)) {
+                /* Ordinary temps die at the end of the basic block.  */
+                for (i = nb_globals; i < nb_temps; i++) {
+                    if (test_bit(i, temps_used.l) && !s->temps[i].temp_local) {
+                        reset_ts(&s->temps[i]);
+                        clear_bit(i, temps_used.l);
+                    }
+                }
+            } else if (def->flags & TCG_OPF_BB_END) {
                 bitmap_zero(temps_used.l, nb_temps);
             } else {
         do_reset_output:
@@ -1503,3 +1517,196 @@ void tcg_optimize(TCGContext *s)
         }
     }
 }
+
+void tcg_optimize(TCGContext *s)
+{
+    tcg_optimize_1(s, false);
+}
+
+/* Values of fixed CPUArchState slots known from an earlier ld or st.  */
+#define ENV_SLOTS_MAX 16
+
+struct env_slot {
+    intptr_t ofs;
+    TCGType type;
+    TCGTemp *val;
+};
+
+static int env_slots_drop_temp(struct env_slot *slots, int n, TCGTemp *ts)
+{
+    int i;
+
+    for (i = 0; i < n; ) {
+        if (slots[i].val == ts) {
+            slots[i] = slots[--n];
+        } else {
+            i++;
+        }
+    }
+    return n;
+}
+
+/* Forget the slots overlapping the SIZE bytes at OFS.  */
+static int env_slots_clobber(struct env_slot *slots, int n,
+                             intptr_t ofs, int size)
+{
+    int i;
+
+    for (i = 0; i < n; ) {
+        int slot_size = slots[i].type == TCG_TYPE_I32 ? 4 : 8;
+
+        if (slots[i].ofs < ofs + size && ofs < slots[i].ofs + slot_size) {
+            slots[i] = slots[--n];
+        } else {
+            i++;
+        }
+    }
+    return n;
+}
+
+static int env_slots_add(struct env_slot *slots, int n,
+                         intptr_t ofs, TCGType type, TCGTemp *val)
+{
+    if (n == ENV_SLOTS_MAX) {
+        /* Evict the oldest entry.  */
+        memmove(slots, slots + 1, (n - 1) * sizeof(*slots));
+        n--;
+    }
+    slots[n].ofs = ofs;
+    slots[n].type = type;
+    slots[n].val = val;
+    return n + 1;
+}
+
+/* Forward the values stored to CPUArchState to later loads of the same
+ * slot, and drop reloads of a slot whose value is already in a temp.
+ * Only done for ld/st on cpu_env at constant offsets; any op that may
+ * write to env through other means (calls, guest memory accesses that
+ * may take the slow path, stores through other pointers) forgets
+ * everything.
+ */
+static void tcg_optimize_env(TCGContext *s)
+{
+    TCGTemp *env = tcgv_ptr_temp(cpu_env);
+    struct env_slot slots[ENV_SLOTS_MAX];
+    int nb_slots = 0;
+    TCGOp *op, *op_next;
+
+    QTAILQ_FOREACH_SAFE(op, &s->ops, link, op_next) {
+        TCGOpcode opc = op->opc;
+        const TCGOpDef *def = &tcg_op_defs[opc];
+        TCGType type;
+        int size, i;
+
+        switch (opc) {
+        case INDEX_op_ld_i32:
+            type = TCG_TYPE_I32;
+            goto do_ld;
+        case INDEX_op_ld_i64:
+            type = TCG_TYPE_I64;
+        do_ld:
+            if (arg_temp(op->args[1]) == env) {
+                TCGTemp *dst = arg_temp(op->args[0]);
+                TCGTemp *val = NULL;
+
+                for (i = 0; i < nb_slots; i++) {
+                    if (slots[i].ofs == op->args[2]
+                        && slots[i].type == type) {
+                        val = slots[i].val;
+                        break;
+                    }
+                }
+                if (val == dst) {
+                    tcg_op_remove(s, op);
+                    break;
+                }
+                nb_slots = env_slots_drop_temp(slots, nb_slots, dst);
+                if (val) {
+                    op->opc = (type == TCG_TYPE_I32
+                               ? INDEX_op_mov_i32 : INDEX_op_mov_i64);
+                    op->args[1] = temp_arg(val);
+                } else {
+                    nb_slots = env_slots_add(slots, nb_slots, op->args[2],
+                                             type, dst);
+                }
+                break;
+            }
+            goto do_default;
+
+        case INDEX_op_st_i32:
+            type = TCG_TYPE_I32;
+            size = 4;
+            goto do_st;
+        case INDEX_op_st_i64:
+            type = TCG_TYPE_I64;
+            size = 8;
+            goto do_st;
+        case INDEX_op_st8_i32:
+        case INDEX_op_st8_i64:
+            size = 1;
+            goto do_st_partial;
+        case INDEX_op_st16_i32:
+        case INDEX_op_st16_i64:
+            size = 2;
+            goto do_st_partial;
+        case INDEX_op_st32_i64:
+            size = 4;
+        do_st_partial:
+            type = TCG_TYPE_COUNT;
+        do_st:
+            if (arg_temp(op->args[1]) != env) {
+                nb_slots = 0;
+                break;
+            }
+            nb_slots = env_slots_clobber(slots, nb_slots, op->args[2], size);
+            if (type != TCG_TYPE_COUNT) {
+                nb_slots = env_slots_add(slots, nb_slots, op->args[2],
+                                         type, arg_temp(op->args[0]));
+            }
+            break;
+
+        case INDEX_op_st_vec:
+        case INDEX_op_call:
+        case INDEX_op_qemu_ld_i32:
+        case INDEX_op_qemu_ld_i64:
+        case INDEX_op_qemu_st_i32:
+        case INDEX_op_qemu_st_i64:
+        case INDEX_op_set_label:
+            nb_slots = 0;
+            break;
+
+        default:
+        do_default:
+            for (i = 0; i < def->nb_oargs; i++) {
+                nb_slots = env_slots_drop_temp(slots, nb_slots,
+                                               arg_temp(op->args[i]));
+            }
+            if (opc == INDEX_op_brcond_i32
+                || opc == INDEX_op_brcond_i64
+                || opc == INDEX_op_brcond2_i32) {
+                /* Ordinary temps die at the end of the basic block.  */
+                for (i = 0; i < nb_slots; ) {
+                    TCGTemp *ts = slots[i].val;
+
+                    if (temp_idx(ts) >= s->nb_globals && !ts->temp_local) {
+                        slots[i] = slots[--nb_slots];
+                    } else {
+                        i++;
+                    }
+                }
+            } else if (def->flags & TCG_OPF_BB_END) {
+                nb_slots = 0;
+            }
+            break;
+        }
+    }
+}
+
+/* Optimizations for the CF_HOT translation of a hot TB: spend more time
+ * on code that is known to run often.
+ */
+void tcg_optimize_hot(TCGContext *s)
+{
+    tcg_optimize_env(s);
+    tcg_optimize_1(s, true);
+}
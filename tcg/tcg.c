@@ -59,6 +59,7 @@
 #include "elf.h"
 #include "exec/log.h"
 #include "sysemu/sysemu.h"
+#include "perf.h"
 
 /* Forward declarations for functions declared in tcg-target.inc.c and
    used here. */
@@ -140,7 +141,16 @@ TCGv_env cpu_env = 0;
  * dynamically allocate from as demand dictates. Given appropriate region
  * sizing, this minimizes flushes even when some TCG threads generate a lot
  * more code than others.
+ *
+ * Each allocated region is stamped with a generation number. When no free
+ * region is left, the oldest region that no TCG thread is translating into
+ * can be evicted on its own, instead of flushing the whole buffer.
  */
+struct tcg_region_info {
+    uint64_t gen;   /* allocation generation; 0 if the region is free */
+    bool busy;      /* a TCG context is translating into the region */
+};
+
 struct tcg_region_state {
     QemuMutex lock;
 
@@ -153,14 +163,38 @@ struct tcg_region_state {
     size_t stride; /* .size + guard size */
 
     /* fields protected by the lock */
-    size_t current; /* current region index */
+    struct tcg_region_info *info; /* per-region state, region.n entries */
+    uint64_t gen; /* generation of the last allocated region */
     size_t agg_size_full; /* aggregate size of full regions */
 };
 
 static struct tcg_region_state region;
+
+/*
+ * Each region keeps its own binary search tree of the TBs whose code lives
+ * in it, so that TB insertion and removal from different vCPU threads
+ * (which translate into different regions) do not contend on a single lock.
+ */
+struct tcg_region_tree {
+    QemuMutex lock;
+    GTree *tree;
+    /* padding to avoid false sharing is computed at run-time */
+};
+
+/*
+ * This is an array of struct tcg_region_tree's, with padding.
+ * We use void * to simplify the computation of region_trees[i]; each
+ * struct is found every tree_size bytes.
+ */
+static void *region_trees;
+static size_t tree_size;
 static TCGRegSet tcg_target_available_regs[TCG_TYPE_COUNT];
 static TCGRegSet tcg_target_call_clobber_regs;
 
+/* Whether the register allocator follows the preferences computed by
+   liveness_pass_1; set before any translation.  */
+bool tcg_reg_prefs = true;
+
 #if TCG_TARGET_INSN_UNIT_SIZE == 1
 static __attribute__((unused)) inline void tcg_out8(TCGContext *s, uint8_t v)
 {
@@ -295,6 +329,181 @@ TCGLabel *gen_new_label(void)
 
 #include "tcg-target.inc.c"
 
+/* compare a pointer @ptr and a tb_tc @s */
+static int ptr_cmp_tb_tc(const void *ptr, const struct tb_tc *s)
+{
+    if (ptr >= s->ptr + s->size) {
+        return 1;
+    } else if (ptr < s->ptr) {
+        return -1;
+    }
+    return 0;
+}
+
+static gint tb_tc_cmp(gconstpointer ap, gconstpointer bp)
+{
+    const struct tb_tc *a = ap;
+    const struct tb_tc *b = bp;
+
+    /*
+     * When both sizes are set, we know this isn't a lookup.
+     * This is the most likely case: every TB must be inserted; lookups
+     * are a lot less frequent.
+     */
+    if (likely(a->size && b->size)) {
+        if (a->ptr > b->ptr) {
+            return 1;
+        } else if (a->ptr < b->ptr) {
+            return -1;
+        }
+        /* a->ptr == b->ptr should happen only on deletions */
+        g_assert(a->size == b->size);
+        return 0;
+    }
+    /*
+     * All lookups have either .size field set to 0.
+     * From the glib sources we see that @ap is always the lookup key. However
+     * the docs provide no guarantee, so we just mark this case as likely.
+     */
+    if (likely(a->size == 0)) {
+        return ptr_cmp_tb_tc(a->ptr, b);
+    }
+    return ptr_cmp_tb_tc(b->ptr, a);
+}
+
+static void tcg_region_trees_init(void)
+{
+    size_t i;
+
+    tree_size = ROUND_UP(sizeof(struct tcg_region_tree), qemu_dcache_linesize);
+    region_trees = qemu_memalign(qemu_dcache_linesize, region.n * tree_size);
+    for (i = 0; i < region.n; i++) {
+        struct tcg_region_tree *rt = region_trees + i * tree_size;
+
+        qemu_mutex_init(&rt->lock);
+        rt->tree = g_tree_new(tb_tc_cmp);
+    }
+}
+
+static size_t tc_ptr_to_region_idx(void *p)
+{
+    ptrdiff_t offset;
+
+    if (p < region.start_aligned) {
+        return 0;
+    }
+    offset = p - region.start_aligned;
+    if (offset > region.stride * (region.n - 1)) {
+        return region.n - 1;
+    }
+    return offset / region.stride;
+}
+
+static struct tcg_region_tree *tc_ptr_to_region_tree(void *p)
+{
+    return region_trees + tc_ptr_to_region_idx(p) * tree_size;
+}
+
+void tcg_tb_insert(TranslationBlock *tb)
+{
+    struct tcg_region_tree *rt = tc_ptr_to_region_tree(tb->tc.ptr);
+
+    qemu_mutex_lock(&rt->lock);
+    g_tree_insert(rt->tree, &tb->tc, tb);
+    qemu_mutex_unlock(&rt->lock);
+}
+
+void tcg_tb_remove(TranslationBlock *tb)
+{
+    struct tcg_region_tree *rt = tc_ptr_to_region_tree(tb->tc.ptr);
+
+    qemu_mutex_lock(&rt->lock);
+    g_tree_remove(rt->tree, &tb->tc);
+    qemu_mutex_unlock(&rt->lock);
+}
+
+/*
+ * Find the TB 'tb' such that
+ * tb->tc.ptr <= tc_ptr < tb->tc.ptr + tb->tc.size
+ * Return NULL if not found.
+ */
+TranslationBlock *tcg_tb_lookup(uintptr_t tc_ptr)
+{
+    struct tcg_region_tree *rt = tc_ptr_to_region_tree((void *)tc_ptr);
+    TranslationBlock *tb;
+    struct tb_tc s = { .ptr = (void *)tc_ptr };
+
+    qemu_mutex_lock(&rt->lock);
+    tb = g_tree_lookup(rt->tree, &s);
+    qemu_mutex_unlock(&rt->lock);
+    return tb;
+}
+
+static void tcg_region_tree_lock_all(void)
+{
+    size_t i;
+
+    for (i = 0; i < region.n; i++) {
+        struct tcg_region_tree *rt = region_trees + i * tree_size;
+
+        qemu_mutex_lock(&rt->lock);
+    }
+}
+
+static void tcg_region_tree_unlock_all(void)
+{
+    size_t i;
+
+    for (i = 0; i < region.n; i++) {
+        struct tcg_region_tree *rt = region_trees + i * tree_size;
+
+        qemu_mutex_unlock(&rt->lock);
+    }
+}
+
+void tcg_tb_foreach(GTraverseFunc func, gpointer user_data)
+{
+    size_t i;
+
+    tcg_region_tree_lock_all();
+    for (i = 0; i < region.n; i++) {
+        struct tcg_region_tree *rt = region_trees + i * tree_size;
+
+        g_tree_foreach(rt->tree, func, user_data);
+    }
+    tcg_region_tree_unlock_all();
+}
+
+size_t tcg_nb_tbs(void)
+{
+    size_t nb_tbs = 0;
+    size_t i;
+
+    tcg_region_tree_lock_all();
+    for (i = 0; i < region.n; i++) {
+        struct tcg_region_tree *rt = region_trees + i * tree_size;
+
+        nb_tbs += g_tree_nnodes(rt->tree);
+    }
+    tcg_region_tree_unlock_all();
+    return nb_tbs;
+}
+
+static void tcg_region_tree_reset_all(void)
+{
+    size_t i;
+
+    tcg_region_tree_lock_all();
+    for (i = 0; i < region.n; i++) {
+        struct tcg_region_tree *rt = region_trees + i * tree_size;
+
+        /* Increment the refcount first so that destroy acts as a reset */
+        g_tree_ref(rt->tree);
+        g_tree_destroy(rt->tree);
+    }
+    tcg_region_tree_unlock_all();
+}
+
 static void tcg_region_bounds(size_t curr_region, void **pstart, void **pend)
 {
     void *start, *end;
@@ -327,12 +536,19 @@ static void tcg_region_assign(TCGContext *s, size_t curr_region)
 
 static bool tcg_region_alloc__locked(TCGContext *s)
 {
-    if (region.current == region.n) {
-        return true;
+    size_t i;
+
+    for (i = 0; i < region.n; i++) {
+        struct tcg_region_info *ri = &region.info[i];
+
+        if (ri->gen == 0) {
+            ri->gen = ++region.gen;
+            ri->busy = true;
+            tcg_region_assign(s, i);
+            return false;
+        }
     }
-    tcg_region_assign(s, region.current);
-    region.current++;
-    return false;
+    return true;
 }
 
 /*
@@ -342,13 +558,15 @@ static bool tcg_region_alloc__locked(TCGContext *s)
 static bool tcg_region_alloc(TCGContext *s)
 {
     bool err;
-    /* read the region size now; alloc__locked will overwrite it on success */
+    /* read the region now; alloc__locked will overwrite it on success */
     size_t size_full = s->code_gen_buffer_size;
+    size_t full = tc_ptr_to_region_idx(s->code_gen_buffer);
 
     qemu_mutex_lock(&region.lock);
     err = tcg_region_alloc__locked(s);
     if (!err) {
         region.agg_size_full += size_full - TCG_HIGHWATER;
+        region.info[full].busy = false;
     }
     qemu_mutex_unlock(&region.lock);
     return err;
@@ -370,7 +588,8 @@ void tcg_region_reset_all(void)
     unsigned int i;
 
     qemu_mutex_lock(&region.lock);
-    region.current = 0;
+    memset(region.info, 0, region.n * sizeof(*region.info));
+    region.gen = 0;
     region.agg_size_full = 0;
 
     for (i = 0; i < n_ctxs; i++) {
@@ -380,45 +599,87 @@ void tcg_region_reset_all(void)
         g_assert(!err);
     }
     qemu_mutex_unlock(&region.lock);
+
+    tcg_region_tree_reset_all();
 }
 
-#ifdef CONFIG_USER_ONLY
-static size_t tcg_n_regions(void)
+/*
+ * Evict the oldest region that is not being translated into.
+ * @func is called on each TB of the region, and must invalidate it.
+ * Returns false if no region can be evicted.
+ *
+ * Call from a safe-work context.
+ */
+bool tcg_region_evict(GTraverseFunc func, gpointer user_data)
 {
-    return 1;
+    struct tcg_region_tree *rt;
+    struct tcg_region_info *victim = NULL;
+    void *start, *end;
+    size_t i;
+
+    qemu_mutex_lock(&region.lock);
+    for (i = 0; i < region.n; i++) {
+        struct tcg_region_info *ri = &region.info[i];
+
+        if (ri->gen && !ri->busy && (!victim || ri->gen < victim->gen)) {
+            victim = ri;
+        }
+    }
+    if (victim == NULL) {
+        qemu_mutex_unlock(&region.lock);
+        return false;
+    }
+    i = victim - region.info;
+    tcg_region_bounds(i, &start, &end);
+    region.agg_size_full -= end - start - TCG_HIGHWATER;
+    victim->gen = 0;
+    qemu_mutex_unlock(&region.lock);
+
+    rt = region_trees + i * tree_size;
+    qemu_mutex_lock(&rt->lock);
+    g_tree_foreach(rt->tree, func, user_data);
+    /* Increment the refcount first so that destroy acts as a reset */
+    g_tree_ref(rt->tree);
+    g_tree_destroy(rt->tree);
+    qemu_mutex_unlock(&rt->lock);
+    return true;
 }
-#else
+
 /*
  * It is likely that some vCPUs will translate more code than others, so we
- * first try to set more regions than max_cpus, with those regions being of
+ * first try to set more regions than TCG threads, with those regions being of
  * reasonable size. If that's not possible we make do by evenly dividing
- * the code_gen_buffer among the vCPUs.
+ * the code_gen_buffer among the threads.
+ *
+ * Having several regions per thread also lets a full buffer be reclaimed
+ * one region at a time; see tcg_region_evict().
  */
 static size_t tcg_n_regions(void)
 {
+    size_t n_threads = 1;
     size_t i;
 
-    /* Use a single region if all we have is one vCPU thread */
-    if (max_cpus == 1 || !qemu_tcg_mttcg_enabled()) {
-        return 1;
+#ifndef CONFIG_USER_ONLY
+    if (qemu_tcg_mttcg_enabled()) {
+        n_threads = max_cpus;
     }
+#endif
 
-    /* Try to have more regions than max_cpus, with each region being >= 2 MB */
+    /* Try to have more regions than threads, with each region being >= 2 MB */
     for (i = 8; i > 0; i--) {
         size_t regions_per_thread = i;
         size_t region_size;
 
         region_size = tcg_init_ctx.code_gen_buffer_size;
-        region_size /= max_cpus * regions_per_thread;
+        region_size /= n_threads * regions_per_thread;
 
         if (region_size >= 2 * 1024u * 1024) {
-            return max_cpus * regions_per_thread;
+            return n_threads * regions_per_thread;
         }
     }
-    /* If we can't, then just allocate one region per vCPU thread */
-    return max_cpus;
+    /* If we can't, then just allocate one region per thread */
+    return n_threads;
 }
-#endif
 
 /*
  * Initializes region partitioning.
@@ -431,18 +692,19 @@ static size_t tcg_n_regions(void)
  * code in parallel without synchronization.
  *
  * In softmmu the number of TCG threads is bounded by max_cpus, so we use at
- * least max_cpus regions in MTTCG. In !MTTCG we use a single region.
+ * least max_cpus regions in MTTCG. In !MTTCG there is a single TCG thread.
  * Note that the TCG options from the command-line (i.e. -accel accel=tcg,[...])
  * must have been parsed before calling this function, since it calls
  * qemu_tcg_mttcg_enabled().
  *
- * In user-mode we use a single region.  Having multiple regions in user-mode
- * is not supported, because the number of vCPU threads (recall that each thread
- * spawned by the guest corresponds to a vCPU thread) is only bounded by the
- * OS, and usually this number is huge (tens of thousands is not uncommon).
- * Thus, given this large bound on the number of vCPU threads and the fact
- * that code_gen_buffer is allocated at compile-time, we cannot guarantee
- * that the availability of at least one region per vCPU thread.
+ * In user-mode all vCPU threads share a single TCG context.  Having one
+ * context per thread is not supported, because the number of vCPU threads
+ * (recall that each thread spawned by the guest corresponds to a vCPU thread)
+ * is only bounded by the OS, and usually this number is huge (tens of
+ * thousands is not uncommon). Thus, given this large bound on the number of
+ * vCPU threads and the fact that code_gen_buffer is allocated at compile-time,
+ * we cannot guarantee that the availability of at least one region per vCPU
+ * thread.
  *
  * However, this user-mode limitation is unlikely to be a significant problem
  * in practice. Multi-threaded guests share most if not all of their translated
@@ -476,6 +738,7 @@ void tcg_region_init(void)
 
     /* init the region struct */
     qemu_mutex_init(&region.lock);
+    region.info = g_new0(struct tcg_region_info, n_regions);
     region.n = n_regions;
     region.size = region_size - page_size;
     region.stride = region_size;
@@ -496,6 +759,8 @@ void tcg_region_init(void)
         g_assert(!rc);
     }
 
+    tcg_region_trees_init();
+
     /* In user-mode we support only one ctx, so do the initial allocation now */
 #ifdef CONFIG_USER_ONLY
     {
@@ -733,9 +998,8 @@ void tcg_context_init(TCGContext *s)
 
     tcg_ctx = s;
     /*
-     * In user-mode we simply share the init context among threads, since we
-     * use a single region. See the documentation tcg_region_init() for the
-     * reasoning behind this.
+     * In user-mode we simply share the init context among threads. See the
+     * documentation tcg_region_init() for the reasoning behind this.
      * In softmmu we will have at most max_cpus TCG threads.
      */
 #ifdef CONFIG_USER_ONLY
@@ -820,6 +1084,7 @@ void tcg_prologue_init(TCGContext *s)
     s->code_gen_buffer_size = total_size;
 
     tcg_register_jit(s->code_gen_buffer, total_size);
+    perf_report_prologue(buf0, prologue_size);
 
 #ifdef DEBUG_DISAS
     if (qemu_loglevel_mask(CPU_LOG_TB_OUT_ASM)) {
@@ -868,6 +1133,7 @@ void tcg_func_start(TCGContext *s)
 
     s->nb_labels = 0;
     s->current_frame_offset = s->frame_start;
+    s->host_ptr_used = false;
 
 #ifdef CONFIG_DEBUG_TCG
     s->goto_tb_issue_mask = 0;
@@ -1697,7 +1963,21 @@ static const char * const alignment_name[(MO_AMASK >> MO_ASHIFT) + 1] = {
     [MO_ALIGN_64 >> MO_ASHIFT] = "al64+",
 };
 
-void tcg_dump_ops(TCGContext *s)
+static inline bool tcg_regset_single(TCGRegSet d)
+{
+    return (d & (d - 1)) == 0;
+}
+
+static inline TCGReg tcg_regset_first(TCGRegSet d)
+{
+    if (TCG_TARGET_NB_REGS <= 32) {
+        return ctz32(d);
+    } else {
+        return ctz64(d);
+    }
+}
+
+void tcg_dump_ops(TCGContext *s, bool have_prefs)
 {
     char buf[128];
     TCGOp *op;
@@ -1712,6 +1992,7 @@ void tcg_dump_ops(TCGContext *s)
         def = &tcg_op_defs[c];
 
         if (c == INDEX_op_insn_start) {
+            nb_oargs = 0;
             col += qemu_log("\n ----");
 
             for (i = 0; i < TARGET_INSN_START_WORDS; ++i) {
@@ -1831,12 +2112,13 @@ void tcg_dump_ops(TCGContext *s)
                 col += qemu_log("%s$0x%" TCG_PRIlx, k ? "," : "", op->args[k]);
             }
         }
-        if (op->life) {
-            unsigned life = op->life;
-
+        if (have_prefs || op->life) {
             for (; col < 48; ++col) {
                 putc(' ', qemu_logfile);
             }
+        }
+        if (op->life) {
+            unsigned life = op->life;
 
             if (life & (SYNC_ARG * 3)) {
                 qemu_log("  sync:");
@@ -1856,6 +2138,26 @@ void tcg_dump_ops(TCGContext *s)
                 }
             }
         }
+        if (have_prefs) {
+            for (i = 0; i < nb_oargs; ++i) {
+                TCGRegSet set = op->output_pref[i];
+
+                if (i == 0) {
+                    qemu_log("  pref=");
+                } else {
+                    qemu_log(",");
+                }
+                if (set == 0) {
+                    qemu_log("none");
+                } else if (set == MAKE_64BIT_MASK(0, TCG_TARGET_NB_REGS)) {
+                    qemu_log("all");
+                } else if (TCG_TARGET_NB_REGS <= 32) {
+                    qemu_log("%#x", (uint32_t)set);
+                } else {
+                    qemu_log("%#" PRIx64, (uint64_t)set);
+                }
+            }
+        }
         qemu_log("\n");
     }
 }
@@ -2029,12 +2331,321 @@ TCGOp *tcg_op_insert_after(TCGContext *s, TCGOp *old_op,
     return new_op;
 }
 
+/*
+ * Serialization of the op stream of the current TB, used by the
+ * persistent translation cache.  Pointers are replaced by indices:
+ * temps by their index in s->temps, labels by their id, helpers by
+ * their index in all_helpers[], the TB pointer of exit_tb by its
+ * exit index and pointers into the TB (see tcg_const_tb_ptr) by their
+ * offset.  The format is host- and build-specific.
+ */
+enum {
+    TCG_SER_CONST,
+    TCG_SER_TEMP,
+    TCG_SER_LABEL,
+    TCG_SER_HELPER,
+    TCG_SER_EXIT_TB,
+    TCG_SER_TB_PTR,
+};
+
+#if TCG_TARGET_REG_BITS == 32
+#define INDEX_op_movi_ptr INDEX_op_movi_i32
+#else
+#define INDEX_op_movi_ptr INDEX_op_movi_i64
+#endif
+
+/* Number of args of @opc, whose op has @callo and @calli call args */
+static int tcg_op_nb_args(TCGOpcode opc, int callo, int calli,
+                          int *nb_temp_args)
+{
+    const TCGOpDef *def = &tcg_op_defs[opc];
+
+    if (opc == INDEX_op_call) {
+        *nb_temp_args = callo + calli;
+        return *nb_temp_args + 2;
+    }
+    *nb_temp_args = def->nb_oargs + def->nb_iargs;
+    return def->nb_args;
+}
+
+typedef struct QEMU_PACKED TCGSerHeader {
+    uint16_t nb_globals;
+    uint16_t nb_temps;
+    uint16_t nb_labels;
+    uint16_t nb_ops;
+} TCGSerHeader;
+
+typedef struct QEMU_PACKED TCGSerTemp {
+    uint8_t base_type;
+    uint8_t type;
+    uint8_t temp_local;
+    uint8_t temp_allocated;
+} TCGSerTemp;
+
+typedef struct QEMU_PACKED TCGSerOp {
+    uint8_t opc;
+    uint8_t param1;
+    uint8_t param2;
+    uint8_t nb_args;
+} TCGSerOp;
+
+typedef struct QEMU_PACKED TCGSerArg {
+    uint8_t kind;
+    uint64_t val;
+} TCGSerArg;
+
+static int tcg_op_label_arg(TCGOpcode opc)
+{
+    switch (opc) {
+    case INDEX_op_set_label:
+    case INDEX_op_br:
+        return 0;
+    case INDEX_op_brcond_i32:
+    case INDEX_op_brcond_i64:
+        return 3;
+    case INDEX_op_brcond2_i32:
+        return 5;
+    default:
+        return -1;
+    }
+}
+
+bool tcg_ops_serialize(TCGContext *s, TranslationBlock *tb, GByteArray *buf)
+{
+    TCGSerHeader hdr = {
+        .nb_globals = s->nb_globals,
+        .nb_temps = s->nb_temps,
+        .nb_labels = s->nb_labels,
+    };
+    guint hdr_pos = buf->len;
+    TCGOp *op;
+    int i;
+
+    if (s->host_ptr_used) {
+        /* The value of the pointer would not survive a restart.  */
+        return false;
+    }
+
+    g_byte_array_append(buf, (const guint8 *)&hdr, sizeof(hdr));
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        TCGTemp *ts = &s->temps[i];
+        TCGSerTemp st = {
+            .base_type = ts->base_type,
+            .type = ts->type,
+            .temp_local = ts->temp_local,
+            .temp_allocated = ts->temp_allocated,
+        };
+
+        g_byte_array_append(buf, (const guint8 *)&st, sizeof(st));
+    }
+
+    QTAILQ_FOREACH(op, &s->ops, link) {
+        TCGOpcode opc = op->opc;
+        int nb_temp_args, nb_args, label_idx;
+        TCGSerOp so;
+
+        nb_args = tcg_op_nb_args(opc, TCGOP_CALLO(op), TCGOP_CALLI(op),
+                                 &nb_temp_args);
+        label_idx = tcg_op_label_arg(opc);
+
+        so.opc = opc;
+        so.param1 = op->param1;
+        so.param2 = op->param2;
+        so.nb_args = nb_args;
+        g_byte_array_append(buf, (const guint8 *)&so, sizeof(so));
+
+        for (i = 0; i < nb_args; i++) {
+            TCGArg arg = op->args[i];
+            TCGSerArg sa = { .kind = TCG_SER_CONST, .val = arg };
+
+            if (i < nb_temp_args) {
+                if (arg != TCG_CALL_DUMMY_ARG) {
+                    sa.kind = TCG_SER_TEMP;
+                    sa.val = temp_idx(arg_temp(arg));
+                }
+            } else if (i == label_idx) {
+                sa.kind = TCG_SER_LABEL;
+                sa.val = arg_label(arg)->id;
+            } else if (opc == INDEX_op_call && i == nb_temp_args) {
+                TCGHelperInfo *info =
+                    g_hash_table_lookup(helper_table, (gpointer)arg);
+
+                if (!info) {
+                    goto fail;
+                }
+                sa.kind = TCG_SER_HELPER;
+                sa.val = info - all_helpers;
+            } else if (opc == INDEX_op_exit_tb
+                       && (arg & ~TB_EXIT_MASK) == (uintptr_t)tb) {
+                sa.kind = TCG_SER_EXIT_TB;
+                sa.val = arg & TB_EXIT_MASK;
+            } else if (opc == INDEX_op_exit_tb && arg > TB_EXIT_MASK) {
+                goto fail;
+            } else if (opc == INDEX_op_movi_ptr && arg >= (uintptr_t)tb
+                       && arg - (uintptr_t)tb < sizeof(*tb)) {
+                sa.kind = TCG_SER_TB_PTR;
+                sa.val = arg - (uintptr_t)tb;
+            }
+            g_byte_array_append(buf, (const guint8 *)&sa, sizeof(sa));
+        }
+        hdr.nb_ops++;
+    }
+
+    memcpy(buf->data + hdr_pos, &hdr, sizeof(hdr));
+    return true;
+
+ fail:
+    g_byte_array_set_size(buf, hdr_pos);
+    return false;
+}
+
+/*
+ * Rebuild the op stream saved by tcg_ops_serialize() in @s, which must
+ * have just been reset with tcg_func_start().  Returns false if @data
+ * is malformed; the ops are then left in an undefined state.
+ */
+bool tcg_ops_deserialize(TCGContext *s, TranslationBlock *tb,
+                         const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = p + len;
+    TCGSerHeader hdr;
+    TCGLabel **labels;
+    int i, j;
+
+    if (len < sizeof(hdr)) {
+        return false;
+    }
+    memcpy(&hdr, p, sizeof(hdr));
+    p += sizeof(hdr);
+    if (hdr.nb_globals != s->nb_globals || hdr.nb_temps > TCG_MAX_TEMPS
+        || hdr.nb_temps < hdr.nb_globals
+        || end - p < (hdr.nb_temps - hdr.nb_globals) * sizeof(TCGSerTemp)) {
+        return false;
+    }
+
+    for (i = hdr.nb_globals; i < hdr.nb_temps; i++) {
+        TCGSerTemp st;
+        TCGTemp *ts;
+
+        memcpy(&st, p, sizeof(st));
+        p += sizeof(st);
+        if (st.base_type >= TCG_TYPE_COUNT || st.type >= TCG_TYPE_COUNT) {
+            return false;
+        }
+        ts = tcg_temp_alloc(s);
+        ts->base_type = st.base_type;
+        ts->type = st.type;
+        ts->temp_local = st.temp_local;
+        ts->temp_allocated = st.temp_allocated;
+    }
+
+    labels = tcg_malloc(sizeof(TCGLabel *) * (hdr.nb_labels + 1));
+    for (i = 0; i < hdr.nb_labels; i++) {
+        labels[i] = gen_new_label();
+    }
+
+    for (i = 0; i < hdr.nb_ops; i++) {
+        TCGSerOp so;
+        TCGOp *op;
+        int label_idx, nb_temp_args;
+
+        if (end - p < sizeof(so)) {
+            return false;
+        }
+        memcpy(&so, p, sizeof(so));
+        p += sizeof(so);
+        if (so.opc >= NB_OPS || so.nb_args > MAX_OPC_PARAM
+            || end - p < so.nb_args * sizeof(TCGSerArg)) {
+            return false;
+        }
+        /* Calls carry their arg count in param1/param2, check it too */
+        if (so.nb_args != tcg_op_nb_args(so.opc, so.param1, so.param2,
+                                         &nb_temp_args)) {
+            return false;
+        }
+
+        op = tcg_emit_op(so.opc);
+        op->param1 = so.param1;
+        op->param2 = so.param2;
+        label_idx = tcg_op_label_arg(so.opc);
+
+        for (j = 0; j < so.nb_args; j++) {
+            TCGSerArg sa;
+
+            memcpy(&sa, p, sizeof(sa));
+            p += sizeof(sa);
+            switch (sa.kind) {
+            case TCG_SER_CONST:
+                /* Anything that is dereferenced must have been relocated */
+                if (j == label_idx
+                    || (j < nb_temp_args && sa.val != TCG_CALL_DUMMY_ARG)
+                    || (so.opc == INDEX_op_call && j == nb_temp_args)
+                    || (so.opc == INDEX_op_exit_tb && sa.val > TB_EXIT_MASK)) {
+                    return false;
+                }
+                op->args[j] = sa.val;
+                break;
+            case TCG_SER_TEMP:
+                if (j >= nb_temp_args || sa.val >= hdr.nb_temps) {
+                    return false;
+                }
+                op->args[j] = temp_arg(&s->temps[sa.val]);
+                break;
+            case TCG_SER_LABEL:
+                if (j != label_idx || sa.val >= hdr.nb_labels) {
+                    return false;
+                }
+                op->args[j] = label_arg(labels[sa.val]);
+                break;
+            case TCG_SER_HELPER:
+                if (so.opc != INDEX_op_call || j != nb_temp_args
+                    || sa.val >= ARRAY_SIZE(all_helpers)) {
+                    return false;
+                }
+                op->args[j] = (uintptr_t)all_helpers[sa.val].func;
+                break;
+            case TCG_SER_EXIT_TB:
+                if (so.opc != INDEX_op_exit_tb) {
+                    return false;
+                }
+                op->args[j] = (uintptr_t)tb + (sa.val & TB_EXIT_MASK);
+                break;
+            case TCG_SER_TB_PTR:
+                if (so.opc != INDEX_op_movi_ptr || sa.val >= sizeof(*tb)) {
+                    return false;
+                }
+                op->args[j] = (uintptr_t)tb + sa.val;
+                break;
+            default:
+                return false;
+            }
+        }
+    }
+
+    return p == end;
+}
+
 #define TS_DEAD  1
 #define TS_MEM   2
 
 #define IS_DEAD_ARG(n)   (arg_life & (DEAD_ARG << (n)))
 #define NEED_SYNC_ARG(n) (arg_life & (SYNC_ARG << (n)))
 
+/* During liveness pass 1, state_ptr of each temp points to the set of
+   registers preferred by its uses later in the TB.  */
+static inline TCGRegSet *la_temp_pref(TCGTemp *ts)
+{
+    return ts->state_ptr;
+}
+
+/* A temp that is dead has no later use to express a preference.  */
+static inline void la_reset_pref(TCGTemp *ts)
+{
+    *la_temp_pref(ts)
+        = (ts->state == TS_DEAD ? 0 : tcg_target_available_regs[ts->type]);
+}
+
 /* liveness analysis: end of function: all temps are dead, and globals
    should be in memory. */
 static void tcg_la_func_end(TCGContext *s)
@@ -2045,9 +2656,11 @@ static void tcg_la_func_end(TCGContext *s)
 
     for (i = 0; i < ng; ++i) {
         s->temps[i].state = TS_DEAD | TS_MEM;
+        la_reset_pref(&s->temps[i]);
     }
     for (i = ng; i < nt; ++i) {
         s->temps[i].state = TS_DEAD;
+        la_reset_pref(&s->temps[i]);
     }
 }
 
@@ -2061,21 +2674,63 @@ static void tcg_la_bb_end(TCGContext *s)
 
     for (i = 0; i < ng; ++i) {
         s->temps[i].state = TS_DEAD | TS_MEM;
+        la_reset_pref(&s->temps[i]);
     }
     for (i = ng; i < nt; ++i) {
         s->temps[i].state = (s->temps[i].temp_local
                              ? TS_DEAD | TS_MEM
                              : TS_DEAD);
+        la_reset_pref(&s->temps[i]);
+    }
+}
+
+/* liveness analysis: a call clobbers the caller-saved registers, so
+   values that live across it would rather be in callee-saved ones.  */
+static void tcg_la_cross_call(TCGContext *s)
+{
+    TCGRegSet mask = ~tcg_target_call_clobber_regs;
+    int nt = s->nb_temps;
+    int i;
+
+    for (i = 0; i < nt; i++) {
+        TCGTemp *ts = &s->temps[i];
+
+        if (!(ts->state & TS_DEAD)) {
+            TCGRegSet *pset = la_temp_pref(ts);
+            TCGRegSet set = *pset & mask;
+
+            /* If the combination is not possible, restart.  */
+            if (set == 0) {
+                set = tcg_target_available_regs[ts->type] & mask;
+            }
+            *pset = set;
+        }
     }
 }
 
 /* Liveness analysis : update the opc_arg_life array to tell if a
    given input arguments is dead. Instructions updating dead
-   temporaries are removed. */
+   temporaries are removed.
+
+   While walking the TB backwards, also compute for each temp the set
+   of registers its later uses would like it to be in: the argument
+   registers of the helpers it is passed to, the register constraints
+   of the ops that read it, and callee-saved registers if it lives
+   across a call.  The preference of each output is recorded in
+   op->output_pref[], so that the register allocator can place values
+   where they are needed next instead of moving them there.  */
 static void liveness_pass_1(TCGContext *s)
 {
     int nb_globals = s->nb_globals;
+    int nb_temps = s->nb_temps;
     TCGOp *op, *op_prev;
+    TCGRegSet *prefs;
+    int i;
+
+    prefs = tcg_malloc(sizeof(TCGRegSet) * nb_temps);
+    for (i = 0; i < nb_temps; ++i) {
+        s->temps[i].state_ptr = prefs + i;
+    }
 
     tcg_la_func_end(s);
 
@@ -2092,6 +2747,7 @@ static void liveness_pass_1(TCGContext *s)
         case INDEX_op_call:
             {
                 int call_flags;
+                int nb_call_regs;
 
                 nb_oargs = TCGOP_CALLO(op);
                 nb_iargs = TCGOP_CALLI(op);
@@ -2112,6 +2768,8 @@ static void liveness_pass_1(TCGContext *s)
                     /* output args are dead */
                     for (i = 0; i < nb_oargs; i++) {
                         arg_ts = arg_temp(op->args[i]);
+                        /* remember the preference of the uses that follow */
+                        op->output_pref[i] = *la_temp_pref(arg_ts);
                         if (arg_ts->state & TS_DEAD) {
                             arg_life |= DEAD_ARG << i;
                         }
@@ -2119,6 +2777,7 @@ static void liveness_pass_1(TCGContext *s)
                             arg_life |= SYNC_ARG << i;
                         }
                         arg_ts->state = TS_DEAD;
+                        la_reset_pref(arg_ts);
                     }
 
                     if (!(call_flags & (TCG_CALL_NO_WRITE_GLOBALS |
@@ -2126,6 +2785,7 @@ static void liveness_pass_1(TCGContext *s)
                         /* globals should go back to memory */
                         for (i = 0; i < nb_globals; i++) {
                             s->temps[i].state = TS_DEAD | TS_MEM;
+                            la_reset_pref(&s->temps[i]);
                         }
                     } else if (!(call_flags & TCG_CALL_NO_READ_GLOBALS)) {
                         /* globals should be synced to memory */
@@ -2134,6 +2794,9 @@ static void liveness_pass_1(TCGContext *s)
                         }
                     }
 
+                    /* values still live here must survive the call */
+                    tcg_la_cross_call(s);
+
                     /* record arguments that die in this helper */
                     for (i = nb_oargs; i < nb_iargs + nb_oargs; i++) {
                         arg_ts = arg_temp(op->args[i]);
@@ -2141,13 +2804,30 @@ static void liveness_pass_1(TCGContext *s)
                             arg_life |= DEAD_ARG << i;
                         }
                     }
+
                     /* input arguments are live for preceding opcodes */
-                    for (i = nb_oargs; i < nb_iargs + nb_oargs; i++) {
-                        arg_ts = arg_temp(op->args[i]);
-                        if (arg_ts) {
+                    nb_call_regs = ARRAY_SIZE(tcg_target_call_iarg_regs);
+                    for (i = 0; i < nb_iargs; i++) {
+                        arg_ts = arg_temp(op->args[nb_oargs + i]);
+                        if (arg_ts && arg_ts->state & TS_DEAD) {
+                            /* arguments passed in registers get their
+                               argument register added below; those
+                               passed on the stack can use any */
+                            *la_temp_pref(arg_ts)
+                                = (i < nb_call_regs ? 0 :
+                                   tcg_target_available_regs[arg_ts->type]);
                             arg_ts->state &= ~TS_DEAD;
                         }
                     }
+
+                    /* prefer the register each argument is passed in */
+                    for (i = 0; i < MIN(nb_call_regs, nb_iargs); i++) {
+                        arg_ts = arg_temp(op->args[nb_oargs + i]);
+                        if (arg_ts) {
+                            tcg_regset_set_reg(*la_temp_pref(arg_ts),
+                                               tcg_target_call_iarg_regs[i]);
+                        }
+                    }
                 }
             }
             break;
@@ -2155,7 +2835,9 @@ static void liveness_pass_1(TCGContext *s)
             break;
         case INDEX_op_discard:
             /* mark the temporary as dead */
-            arg_temp(op->args[0])->state = TS_DEAD;
+            arg_ts = arg_temp(op->args[0]);
+            arg_ts->state = TS_DEAD;
+            la_reset_pref(arg_ts);
             break;
 
         case INDEX_op_add2_i32:
@@ -2257,6 +2939,8 @@ static void liveness_pass_1(TCGContext *s)
                 /* output args are dead */
                 for (i = 0; i < nb_oargs; i++) {
                     arg_ts = arg_temp(op->args[i]);
+                    /* remember the preference of the uses that follow */
+                    op->output_pref[i] = *la_temp_pref(arg_ts);
                     if (arg_ts->state & TS_DEAD) {
                         arg_life |= DEAD_ARG << i;
                     }
@@ -2264,6 +2948,7 @@ static void liveness_pass_1(TCGContext *s)
                         arg_life |= SYNC_ARG << i;
                     }
                     arg_ts->state = TS_DEAD;
+                    la_reset_pref(arg_ts);
                 }
 
                 /* if end of basic block, update */
@@ -2275,6 +2960,10 @@ static void liveness_pass_1(TCGContext *s)
                         s->temps[i].state |= TS_MEM;
                     }
                 }
+                if (def->flags & TCG_OPF_CALL_CLOBBER) {
+                    /* e.g. the softmmu slow path of qemu_ld/st */
+                    tcg_la_cross_call(s);
+                }
 
                 /* record arguments that die in this opcode */
                 for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
@@ -2285,7 +2974,51 @@ static void liveness_pass_1(TCGContext *s)
                 }
                 /* input arguments are live for preceding opcodes */
                 for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
-                    arg_temp(op->args[i])->state &= ~TS_DEAD;
+                    arg_ts = arg_temp(op->args[i]);
+                    if (arg_ts->state & TS_DEAD) {
+                        /* a value dead after this op can start anew
+                           with any register of its type */
+                        *la_temp_pref(arg_ts)
+                            = tcg_target_available_regs[arg_ts->type];
+                        arg_ts->state &= ~TS_DEAD;
+                    }
+                }
+
+                /* incorporate the register constraints of the inputs */
+                switch (opc) {
+                case INDEX_op_mov_i32:
+                case INDEX_op_mov_i64:
+                case INDEX_op_mov_vec:
+                    /* Moves have no constraints, but a source that dies
+                       here would like to be where the destination is
+                       wanted, so that the move can be suppressed.  */
+                    if (IS_DEAD_ARG(1)) {
+                        *la_temp_pref(arg_temp(op->args[1]))
+                            = op->output_pref[0];
+                    }
+                    break;
+
+                default:
+                    if (def->flags & TCG_OPF_NOT_PRESENT) {
+                        break;
+                    }
+                    for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
+                        const TCGArgConstraint *ct = &def->args_ct[i];
+                        TCGRegSet set, *pset;
+
+                        arg_ts = arg_temp(op->args[i]);
+                        pset = la_temp_pref(arg_ts);
+                        set = *pset & ct->u.regs;
+                        if (ct->ct & TCG_CT_IALIAS) {
+                            set &= op->output_pref[ct->alias_index];
+                        }
+                        /* If the combination is not possible, restart.  */
+                        if (set == 0) {
+                            set = ct->u.regs;
+                        }
+                        *pset = set;
+                    }
+                    break;
                 }
             }
             break;
@@ -2537,7 +3270,8 @@ static void temp_allocate_frame(TCGContext *s, TCGTemp *ts)
     s->current_frame_offset += sizeof(tcg_target_long);
 }
 
-static void temp_load(TCGContext *, TCGTemp *, TCGRegSet, TCGRegSet);
+static void temp_load(TCGContext *, TCGTemp *, TCGRegSet, TCGRegSet,
+                      TCGRegSet);
 
 /* Mark a temporary as free or dead.  If 'free_or_dead' is negative,
    mark it free; otherwise mark it dead.  */
@@ -2586,7 +3320,7 @@ static void temp_sync(TCGContext *s, TCGTemp *ts,
                 break;
             }
             temp_load(s, ts, tcg_target_available_regs[ts->type],
-                      allocated_regs);
+                      allocated_regs, 0);
             /* fallthrough */
 
         case TEMP_VAL_REG:
@@ -2617,31 +3351,63 @@ static void tcg_reg_free(TCGContext *s, TCGReg reg, TCGRegSet allocated_regs)
     }
 }
 
-/* Allocate a register belonging to reg1 & ~reg2 */
-static TCGReg tcg_reg_alloc(TCGContext *s, TCGRegSet desired_regs,
-                            TCGRegSet allocated_regs, bool rev)
+/* Allocate a register belonging to REQUIRED & ~ALLOCATED, trying those
+   in PREFERRED first, both among the free registers and when one has to
+   be spilled.  PREFERRED is ignored when tcg_reg_prefs is false.  */
+static TCGReg tcg_reg_alloc(TCGContext *s, TCGRegSet required_regs,
+                            TCGRegSet allocated_regs,
+                            TCGRegSet preferred_regs, bool rev)
 {
-    int i, n = ARRAY_SIZE(tcg_target_reg_alloc_order);
+    int i, j, f, n = ARRAY_SIZE(tcg_target_reg_alloc_order);
+    TCGRegSet reg_ct[2];
     const int *order;
-    TCGReg reg;
-    TCGRegSet reg_ct;
 
-    reg_ct = desired_regs & ~allocated_regs;
+    reg_ct[1] = required_regs & ~allocated_regs;
+    tcg_debug_assert(reg_ct[1] != 0);
+    reg_ct[0] = tcg_reg_prefs ? reg_ct[1] & preferred_regs : 0;
+
+    /* Skip the preferred set if it cannot be satisfied, or if the
+       preference makes no difference.  */
+    f = reg_ct[0] == 0 || reg_ct[0] == reg_ct[1];
+
     order = rev ? indirect_reg_alloc_order : tcg_target_reg_alloc_order;
 
-    /* first try free registers */
-    for(i = 0; i < n; i++) {
-        reg = order[i];
-        if (tcg_regset_test_reg(reg_ct, reg) && s->reg_to_temp[reg] == NULL)
-            return reg;
+    /* first try free registers, preferred ones first */
+    for (j = f; j < 2; j++) {
+        TCGRegSet set = reg_ct[j];
+
+        if (tcg_regset_single(set)) {
+            TCGReg reg = tcg_regset_first(set);
+            if (s->reg_to_temp[reg] == NULL) {
+                return reg;
+            }
+        } else {
+            for (i = 0; i < n; i++) {
+                TCGReg reg = order[i];
+                if (s->reg_to_temp[reg] == NULL &&
+                    tcg_regset_test_reg(set, reg)) {
+                    return reg;
+                }
+            }
+        }
     }
 
     /* XXX: do better spill choice */
-    for(i = 0; i < n; i++) {
-        reg = order[i];
-        if (tcg_regset_test_reg(reg_ct, reg)) {
+    for (j = f; j < 2; j++) {
+        TCGRegSet set = reg_ct[j];
+
+        if (tcg_regset_single(set)) {
+            TCGReg reg = tcg_regset_first(set);
             tcg_reg_free(s, reg, allocated_regs);
             return reg;
+        } else {
+            for (i = 0; i < n; i++) {
+                TCGReg reg = order[i];
+                if (tcg_regset_test_reg(set, reg)) {
+                    tcg_reg_free(s, reg, allocated_regs);
+                    return reg;
+                }
+            }
         }
     }
 
@@ -2649,9 +3415,9 @@ static TCGReg tcg_reg_alloc(TCGContext *s, TCGRegSet desired_regs,
 }
 
 /* Make sure the temporary is in a register.  If needed, allocate the register
-   from DESIRED while avoiding ALLOCATED.  */
+   from DESIRED while avoiding ALLOCATED, preferring PREFERRED.  */
 static void temp_load(TCGContext *s, TCGTemp *ts, TCGRegSet desired_regs,
-                      TCGRegSet allocated_regs)
+                      TCGRegSet allocated_regs, TCGRegSet preferred_regs)
 {
     TCGReg reg;
 
@@ -2659,12 +3425,14 @@ static void temp_load(TCGContext *s, TCGTemp *ts, TCGRegSet desired_regs,
     case TEMP_VAL_REG:
         return;
     case TEMP_VAL_CONST:
-        reg = tcg_reg_alloc(s, desired_regs, allocated_regs, ts->indirect_base);
+        reg = tcg_reg_alloc(s, desired_regs, allocated_regs,
+                            preferred_regs, ts->indirect_base);
         tcg_out_movi(s, ts->type, reg, ts->val);
         ts->mem_coherent = 0;
         break;
     case TEMP_VAL_MEM:
-        reg = tcg_reg_alloc(s, desired_regs, allocated_regs, ts->indirect_base);
+        reg = tcg_reg_alloc(s, desired_regs, allocated_regs,
+                            preferred_regs, ts->indirect_base);
         tcg_out_ld(s, ts->type, reg, ts->mem_base->reg, ts->mem_offset);
         ts->mem_coherent = 1;
         break;
@@ -2794,7 +3562,8 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOp *op)
        the SOURCE value into its own register first, that way we
        don't have to reload SOURCE the next time it is used. */
     if (ts->val_type == TEMP_VAL_MEM) {
-        temp_load(s, ts, tcg_target_available_regs[itype], allocated_regs);
+        temp_load(s, ts, tcg_target_available_regs[itype],
+                  allocated_regs, op->output_pref[0]);
     }
 
     tcg_debug_assert(ts->val_type == TEMP_VAL_REG);
@@ -2824,7 +3593,8 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOp *op)
                    input one. */
                 tcg_regset_set_reg(allocated_regs, ts->reg);
                 ots->reg = tcg_reg_alloc(s, tcg_target_available_regs[otype],
-                                         allocated_regs, ots->indirect_base);
+                                         allocated_regs, op->output_pref[0],
+                                         ots->indirect_base);
             }
             tcg_out_mov(s, otype, ots->reg, ts->reg);
         }
@@ -2843,6 +3613,7 @@ static void tcg_reg_alloc_op(TCGContext *s, const TCGOp *op)
     const TCGOpDef * const def = &tcg_op_defs[op->opc];
     TCGRegSet i_allocated_regs;
     TCGRegSet o_allocated_regs;
+    TCGRegSet i_preferred_regs, o_preferred_regs;
     int i, k, nb_iargs, nb_oargs;
     TCGReg reg;
     TCGArg arg;
@@ -2877,7 +3648,17 @@ static void tcg_reg_alloc_op(TCGContext *s, const TCGOp *op)
             goto iarg_end;
         }
 
-        temp_load(s, ts, arg_ct->u.regs, i_allocated_regs);
+        /* an input that is aliased to an output and dies here had
+           better be loaded where the output is wanted next */
+        i_preferred_regs = o_preferred_regs = 0;
+        if (arg_ct->ct & TCG_CT_IALIAS) {
+            o_preferred_regs = op->output_pref[arg_ct->alias_index];
+            if (IS_DEAD_ARG(i)) {
+                i_preferred_regs = o_preferred_regs;
+            }
+        }
+
+        temp_load(s, ts, arg_ct->u.regs, i_allocated_regs, i_preferred_regs);
 
         if (arg_ct->ct & TCG_CT_IALIAS) {
             if (ts->fixed_reg) {
@@ -2912,7 +3693,7 @@ static void tcg_reg_alloc_op(TCGContext *s, const TCGOp *op)
             /* allocate a new register matching the constraint 
                and move the temporary register into it */
             reg = tcg_reg_alloc(s, arg_ct->u.regs, i_allocated_regs,
-                                ts->indirect_base);
+                                o_preferred_regs, ts->indirect_base);
             tcg_out_mov(s, ts->type, reg, ts->reg);
         }
         new_args[i] = reg;
@@ -2957,7 +3738,7 @@ static void tcg_reg_alloc_op(TCGContext *s, const TCGOp *op)
             } else if (arg_ct->ct & TCG_CT_NEWREG) {
                 reg = tcg_reg_alloc(s, arg_ct->u.regs,
                                     i_allocated_regs | o_allocated_regs,
-                                    ts->indirect_base);
+                                    op->output_pref[i], ts->indirect_base);
             } else {
                 /* if fixed register, we try to use it */
                 reg = ts->reg;
@@ -2966,7 +3747,7 @@ static void tcg_reg_alloc_op(TCGContext *s, const TCGOp *op)
                     goto oarg_end;
                 }
                 reg = tcg_reg_alloc(s, arg_ct->u.regs, o_allocated_regs,
-                                    ts->indirect_base);
+                                    op->output_pref[i], ts->indirect_base);
             }
             tcg_regset_set_reg(o_allocated_regs, reg);
             /* if a fixed register is used, then a move will be done afterwards */
@@ -3058,7 +3839,7 @@ static void tcg_reg_alloc_call(TCGContext *s, TCGOp *op)
         if (arg != TCG_CALL_DUMMY_ARG) {
             ts = arg_temp(arg);
             temp_load(s, ts, tcg_target_available_regs[ts->type],
-                      s->reserved_regs);
+                      s->reserved_regs, 0);
             tcg_out_st(s, ts->type, ts->reg, TCG_REG_CALL_STACK, stack_offset);
         }
 #ifndef TCG_TARGET_STACK_GROWSUP
@@ -3083,7 +3864,7 @@ static void tcg_reg_alloc_call(TCGContext *s, TCGOp *op)
                 TCGRegSet arg_set = 0;
 
                 tcg_regset_set_reg(arg_set, reg);
-                temp_load(s, ts, arg_set, allocated_regs);
+                temp_load(s, ts, arg_set, allocated_regs, 0);
             }
 
             tcg_regset_set_reg(allocated_regs, reg);
@@ -3264,7 +4045,7 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
                  && qemu_log_in_addr_range(tb->pc))) {
         qemu_log_lock();
         qemu_log("OP:\n");
-        tcg_dump_ops(s);
+        tcg_dump_ops(s, false);
         qemu_log("\n");
         qemu_log_unlock();
     }
@@ -3275,7 +4056,11 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
 #endif
 
 #ifdef USE_TCG_OPTIMIZATIONS
-    tcg_optimize(s);
+    if (tb_cflags(tb) & CF_HOT) {
+        tcg_optimize_hot(s);
+    } else {
+        tcg_optimize(s);
+    }
 #endif
 
 #ifdef CONFIG_PROFILER
@@ -3291,7 +4076,7 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
                      && qemu_log_in_addr_range(tb->pc))) {
             qemu_log_lock();
             qemu_log("OP before indirect lowering:\n");
-            tcg_dump_ops(s);
+            tcg_dump_ops(s, true);
             qemu_log("\n");
             qemu_log_unlock();
         }
@@ -3312,7 +4097,7 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
                  && qemu_log_in_addr_range(tb->pc))) {
         qemu_log_lock();
         qemu_log("OP after optimization and liveness analysis:\n");
-        tcg_dump_ops(s);
+        tcg_dump_ops(s, true);
         qemu_log("\n");
         qemu_log_unlock();
     }
@@ -0,0 +1,5 @@
+/*
+ * softfloat is normally built once per target, with that target's NaN
+ * conventions.  The programs in this directory use a build of it for no
+ * target in particular, which gets the defaults of softfloat-specialize.h.
+ */
@@ -0,0 +1,255 @@
+/*
+ * Benchmark and cross-check of the softfloat host-FPU fast path
+ *
+ * Each operation is run over the same inputs twice: once with the
+ * inexact flag already raised, which lets softfloat hand normal inputs
+ * to the host FPU, and once with the flags cleared before every
+ * operation, which keeps it on the pure software path.  With -c the
+ * results and flags of both runs are compared.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "fpu/softfloat.h"
+
+enum op {
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_FMA,
+    OP_SQRT,
+};
+
+static const char * const op_names[] = {
+    [OP_ADD] = "add",
+    [OP_SUB] = "sub",
+    [OP_MUL] = "mul",
+    [OP_DIV] = "div",
+    [OP_FMA] = "fma",
+    [OP_SQRT] = "sqrt",
+};
+
+#define N_INPUTS 4096
+
+static enum op op = OP_ADD;
+static bool use_double;
+static bool check;
+static unsigned long n_ops = 50 * 1000 * 1000;
+static uint64_t inputs[3][N_INPUTS];
+
+static const char commands_string[] =
+    " -o = operation (add, sub, mul, div, fma, sqrt; default add)\n"
+    " -p = precision (single, double; default single)\n"
+    " -n = number of operations per run\n"
+    " -c = compare the results of both paths, including special inputs";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static uint64_t xorshift64star(uint64_t x)
+{
+    x ^= x >> 12; /* a */
+    x ^= x << 25; /* b */
+    x ^= x >> 27; /* c */
+    return x * UINT64_C(2685821657736338717);
+}
+
+/*
+ * Normal numbers of either sign within a few orders of magnitude of 1, so
+ * that results neither overflow nor underflow.  In check mode a quarter
+ * of the inputs are random bit patterns instead, to also cover zeroes,
+ * denormals, infinities and NaNs.
+ */
+static void set_inputs(void)
+{
+    uint64_t r = 0xdeadbeefcafef00dULL;
+    int i, j;
+
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < N_INPUTS; j++) {
+            uint64_t sign, exp, frac;
+
+            r = xorshift64star(r);
+            if (check && (r & 3) == 0) {
+                inputs[i][j] = use_double ? r : (uint32_t)(r >> 32);
+                continue;
+            }
+            sign = (op == OP_SQRT) ? 0 : (r >> 63);
+            exp = (r >> 32) & 0x1f;
+            if (use_double) {
+                frac = r & ((1ULL << 52) - 1);
+                inputs[i][j] = (sign << 63) | ((1023 - 16 + exp) << 52) | frac;
+            } else {
+                frac = r & ((1 << 23) - 1);
+                inputs[i][j] = (sign << 31) | ((127 - 16 + exp) << 23) | frac;
+            }
+        }
+    }
+}
+
+static uint64_t run_op(int i, float_status *st)
+{
+    if (use_double) {
+        float64 a = make_float64(inputs[0][i]);
+        float64 b = make_float64(inputs[1][i]);
+        float64 c = make_float64(inputs[2][i]);
+
+        switch (op) {
+        case OP_ADD:
+            return float64_val(float64_add(a, b, st));
+        case OP_SUB:
+            return float64_val(float64_sub(a, b, st));
+        case OP_MUL:
+            return float64_val(float64_mul(a, b, st));
+        case OP_DIV:
+            return float64_val(float64_div(a, b, st));
+        case OP_FMA:
+            return float64_val(float64_muladd(a, b, c, 0, st));
+        case OP_SQRT:
+            return float64_val(float64_sqrt(a, st));
+        }
+    } else {
+        float32 a = make_float32(inputs[0][i]);
+        float32 b = make_float32(inputs[1][i]);
+        float32 c = make_float32(inputs[2][i]);
+
+        switch (op) {
+        case OP_ADD:
+            return float32_val(float32_add(a, b, st));
+        case OP_SUB:
+            return float32_val(float32_sub(a, b, st));
+        case OP_MUL:
+            return float32_val(float32_mul(a, b, st));
+        case OP_DIV:
+            return float32_val(float32_div(a, b, st));
+        case OP_FMA:
+            return float32_val(float32_muladd(a, b, c, 0, st));
+        case OP_SQRT:
+            return float32_val(float32_sqrt(a, st));
+        }
+    }
+    g_assert_not_reached();
+}
+
+/* Returns the duration of the run in ns */
+static int64_t bench(uint8_t flags)
+{
+    float_status st = {};
+    uint64_t sink = 0;
+    int64_t t0;
+    unsigned long i;
+
+    t0 = get_clock();
+    for (i = 0; i < n_ops; i++) {
+        st.float_exception_flags = flags;
+        sink ^= run_op(i & (N_INPUTS - 1), &st);
+    }
+    /* keep the compiler from dropping the loop */
+    if (sink == 1) {
+        printf(" ");
+    }
+    return get_clock() - t0;
+}
+
+static int compare(void)
+{
+    int i, errors = 0;
+
+    for (i = 0; i < N_INPUTS; i++) {
+        float_status hard = { .float_exception_flags = float_flag_inexact };
+        float_status soft = {};
+        uint64_t rh = run_op(i, &hard);
+        uint64_t rs = run_op(i, &soft);
+
+        soft.float_exception_flags |= float_flag_inexact;
+        if (rh != rs ||
+            hard.float_exception_flags != soft.float_exception_flags) {
+            fprintf(stderr, "mismatch: %s(0x%" PRIx64 ", 0x%" PRIx64
+                    ", 0x%" PRIx64 "): host 0x%" PRIx64 " flags 0x%x, "
+                    "soft 0x%" PRIx64 " flags 0x%x\n", op_names[op],
+                    inputs[0][i], inputs[1][i], inputs[2][i],
+                    rh, hard.float_exception_flags,
+                    rs, soft.float_exception_flags);
+            errors++;
+        }
+    }
+    return errors;
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c, i;
+
+    for (;;) {
+        c = getopt(argc, argv, "ho:p:n:c");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'o':
+            for (i = 0; i < ARRAY_SIZE(op_names); i++) {
+                if (!strcmp(optarg, op_names[i])) {
+                    op = i;
+                    break;
+                }
+            }
+            if (i == ARRAY_SIZE(op_names)) {
+                fprintf(stderr, "unknown operation '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'p':
+            if (!strcmp(optarg, "single")) {
+                use_double = false;
+            } else if (!strcmp(optarg, "double")) {
+                use_double = true;
+            } else {
+                fprintf(stderr, "unknown precision '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'n':
+            n_ops = atol(optarg);
+            break;
+        case 'c':
+            check = true;
+            break;
+        default:
+            usage_complete(argv);
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int64_t soft_ns, hard_ns;
+
+    parse_args(argc, argv);
+    set_inputs();
+
+    if (check) {
+        int errors = compare();
+
+        printf("%s %s: %d mismatches in %d inputs\n", op_names[op],
+               use_double ? "double" : "single", errors, N_INPUTS);
+        return errors ? 1 : 0;
+    }
+
+    soft_ns = bench(0);
+    hard_ns = bench(float_flag_inexact);
+    printf("%s %s: softfloat %.2f MFlops, host FPU %.2f MFlops, "
+           "speedup %.2fx\n", op_names[op], use_double ? "double" : "single",
+           n_ops * 1e3 / soft_ns, n_ops * 1e3 / hard_ns,
+           (double)soft_ns / hard_ns);
+    return 0;
+}
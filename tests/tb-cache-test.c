@@ -0,0 +1,126 @@
+/*
+ * Test the persistent translation cache together with tiered translation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2
+ * or later. See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+
+/* Large enough that no TB becomes hot during the test */
+#define HOT_THRESHOLD 1000000
+
+static void wait_for_string(int fd, const char *expect)
+{
+    int i, nbr, pos = 0;
+    char ch;
+
+    /* Poll serial output... Wait at most 60 seconds */
+    for (i = 0; i < 6000; ++i) {
+        while ((nbr = read(fd, &ch, 1)) == 1) {
+            pos = ch == expect[pos] ? pos + 1 : 0;
+            if (expect[pos] == '\0') {
+                return;
+            }
+        }
+        g_assert(nbr >= 0);
+        g_usleep(10000);
+    }
+    g_assert_not_reached();
+}
+
+static void boot_sgabios(const char *cache_dir)
+{
+    char serialtmp[] = "/tmp/qtest-tb-cache-sXXXXXX";
+    int ser_fd;
+
+    ser_fd = mkstemp(serialtmp);
+    g_assert(ser_fd != -1);
+
+    global_qtest = qtest_startf("-accel tcg,hot-threshold=%d,tb-cache=%s "
+                                "-M isapc -cpu qemu32 -device sga "
+                                "-chardev file,id=serial0,path=%s "
+                                "-no-shutdown -serial chardev:serial0",
+                                HOT_THRESHOLD, cache_dir, serialtmp);
+    unlink(serialtmp);
+
+    wait_for_string(ser_fd, "SGABIOS");
+    qtest_quit(global_qtest);
+    close(ser_fd);
+}
+
+static off_t cache_file_size(const char *cache_dir)
+{
+    const char *name;
+    struct stat st;
+    char *path;
+    GDir *dir;
+
+    dir = g_dir_open(cache_dir, 0, NULL);
+    g_assert(dir);
+    name = g_dir_read_name(dir);
+    g_assert(name);
+    /* One file per QEMU binary and CPU model */
+    g_assert(!g_dir_read_name(dir));
+
+    path = g_build_filename(cache_dir, name, NULL);
+    g_assert(stat(path, &st) == 0);
+    g_free(path);
+    g_dir_close(dir);
+    return st.st_size;
+}
+
+static void cleanup_cache_dir(char *cache_dir)
+{
+    const char *name;
+    GDir *dir;
+
+    dir = g_dir_open(cache_dir, 0, NULL);
+    while (dir && (name = g_dir_read_name(dir))) {
+        char *path = g_build_filename(cache_dir, name, NULL);
+
+        unlink(path);
+        g_free(path);
+    }
+    if (dir) {
+        g_dir_close(dir);
+    }
+    rmdir(cache_dir);
+    g_free(cache_dir);
+}
+
+/*
+ * First-tier TBs carry an execution counter that points into the TB;
+ * they must still be stored, and be usable when loaded again.
+ */
+static void test_tiered_cache(void)
+{
+    char *cache_dir = g_strdup("/tmp/qtest-tb-cache-XXXXXX");
+    off_t first, second;
+
+    if (!mkdtemp(cache_dir)) {
+        g_error("mkdtemp: %s", g_strerror(errno));
+    }
+
+    boot_sgabios(cache_dir);
+    first = cache_file_size(cache_dir);
+    /* More than the header: translations were recorded */
+    g_assert_cmpint(first, >, 4096);
+
+    /* The second run must boot from the cached translations */
+    boot_sgabios(cache_dir);
+    second = cache_file_size(cache_dir);
+    g_assert_cmpint(second, <, first + first / 2);
+
+    cleanup_cache_dir(cache_dir);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("tb-cache/tiered", test_tiered_cache);
+
+    return g_test_run();
+}
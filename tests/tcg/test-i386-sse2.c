@@ -0,0 +1,427 @@
+/*
+ * Check the MMX/SSE integer and bitwise instructions that the translator
+ * expands with vector ops against a C reference, including saturation
+ * and out-of-range shift counts.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <cpuid.h>
+
+typedef union {
+    uint8_t b[16];
+    uint16_t w[8];
+    uint32_t d[4];
+    uint64_t q[2];
+} Vec;
+
+static const uint64_t inputs[][2] = {
+    { 0x0000000000000000ull, 0xffffffffffffffffull },
+    { 0x7f7f7fff7fffffffull, 0x8080800080000000ull },
+    { 0x0123456789abcdefull, 0xfedcba9876543210ull },
+    { 0x8000800080008000ull, 0x7fff7fff7fff7fffull },
+    { 0x456723c698694873ull, 0xdc515cff944a58ecull },
+    { 0x1f297ccd58bad7abull, 0x41f21efba9e3e146ull },
+};
+#define NB_INPUTS (sizeof(inputs) / sizeof(inputs[0]))
+
+static int failures;
+
+static int64_t sext(uint64_t v, int bits)
+{
+    if (bits == 64) {
+        return v;
+    }
+    return (int64_t)(v << (64 - bits)) >> (64 - bits);
+}
+
+static uint64_t get(const Vec *v, int bits, int i)
+{
+    switch (bits) {
+    case 8:
+        return v->b[i];
+    case 16:
+        return v->w[i];
+    case 32:
+        return v->d[i];
+    default:
+        return v->q[i];
+    }
+}
+
+static void set(Vec *v, int bits, int i, uint64_t x)
+{
+    switch (bits) {
+    case 8:
+        v->b[i] = x;
+        break;
+    case 16:
+        v->w[i] = x;
+        break;
+    case 32:
+        v->d[i] = x;
+        break;
+    default:
+        v->q[i] = x;
+        break;
+    }
+}
+
+static int64_t sat(int64_t x, int64_t lo, int64_t hi)
+{
+    return x < lo ? lo : x > hi ? hi : x;
+}
+
+enum {
+    ADD, SUB, ADDS, SUBS, ADDUS, SUBUS, MULL, MULUDQ,
+    AND, ANDN, OR, XOR, CMPEQ, CMPGT, ABS,
+};
+
+static uint64_t ref_op(int op, int bits, uint64_t a, uint64_t b)
+{
+    uint64_t mask = bits == 64 ? ~0ull : (1ull << bits) - 1;
+    int64_t smin = -(1ll << (bits - 1)), smax = (1ll << (bits - 1)) - 1;
+
+    switch (op) {
+    case ADD:
+        return a + b;
+    case SUB:
+        return a - b;
+    case ADDS:
+        return sat(sext(a, bits) + sext(b, bits), smin, smax);
+    case SUBS:
+        return sat(sext(a, bits) - sext(b, bits), smin, smax);
+    case ADDUS:
+        return sat(a + b, 0, mask);
+    case SUBUS:
+        return sat((int64_t)a - (int64_t)b, 0, mask);
+    case MULL:
+        return a * b;
+    case MULUDQ:
+        return (a & 0xffffffff) * (b & 0xffffffff);
+    case AND:
+        return a & b;
+    case ANDN:
+        return ~a & b;
+    case OR:
+        return a | b;
+    case XOR:
+        return a ^ b;
+    case CMPEQ:
+        return a == b ? mask : 0;
+    case CMPGT:
+        return sext(a, bits) > sext(b, bits) ? mask : 0;
+    case ABS:
+        return sext(b, bits) < 0 ? -b : b;
+    }
+    return 0;
+}
+
+static void check(const char *name, int size, const Vec *a, const Vec *b,
+                  const Vec *r, const Vec *e)
+{
+    if (memcmp(r, e, size)) {
+        printf("FAIL %-9s %s: a=%016llx%016llx b=%016llx%016llx\n"
+               "    got %016llx%016llx expected %016llx%016llx\n",
+               name, size == 8 ? "mmx" : "sse",
+               (unsigned long long)a->q[1], (unsigned long long)a->q[0],
+               (unsigned long long)b->q[1], (unsigned long long)b->q[0],
+               (unsigned long long)r->q[1], (unsigned long long)r->q[0],
+               (unsigned long long)e->q[1], (unsigned long long)e->q[0]);
+        failures++;
+    }
+}
+
+static void test_binop(const char *name, int op, int bits,
+                       void (*mmx)(Vec *, const Vec *),
+                       void (*sse)(Vec *, const Vec *))
+{
+    unsigned i, j;
+    int k, size;
+
+    for (i = 0; i < NB_INPUTS; i++) {
+        for (j = 0; j < NB_INPUTS; j++) {
+            for (size = 8; size <= 16; size += 8) {
+                Vec a, b, r, e;
+
+                memset(&r, 0, sizeof(r));
+                memset(&e, 0, sizeof(e));
+                a.q[0] = inputs[i][0];
+                a.q[1] = inputs[i][1];
+                b.q[0] = inputs[j][1];
+                b.q[1] = inputs[j][0];
+                for (k = 0; k < size * 8 / bits; k++) {
+                    uint64_t x = get(&a, bits, k), y = get(&b, bits, k);
+
+                    set(&e, bits, k, ref_op(op, bits, x, y));
+                }
+                r = a;
+                if (size == 8) {
+                    if (!mmx) {
+                        continue;
+                    }
+                    mmx(&r, &b);
+                } else {
+                    sse(&r, &b);
+                }
+                check(name, size, &a, &b, &r, &e);
+            }
+        }
+    }
+}
+
+#define BINOP(insn, op, bits)                                           \
+static void mmx_##insn(Vec *r, const Vec *b)                           \
+{                                                                       \
+    asm volatile("movq %0, %%mm0\n\t"                                   \
+                 #insn " %1, %%mm0\n\t"                                 \
+                 "movq %%mm0, %0\n\t"                                   \
+                 "emms"                                                 \
+                 : "+m" (r->q[0]) : "m" (b->q[0]) : "mm0");             \
+}                                                                       \
+static void sse_##insn(Vec *r, const Vec *b)                           \
+{                                                                       \
+    asm volatile("movdqu %0, %%xmm0\n\t"                                \
+                 "movdqu %1, %%xmm1\n\t"                                \
+                 #insn " %%xmm1, %%xmm0\n\t"                            \
+                 "movdqu %%xmm0, %0"                                    \
+                 : "+m" (*r) : "m" (*b) : "xmm0", "xmm1");              \
+}                                                                       \
+static void test_##insn(void)                                          \
+{                                                                       \
+    test_binop(#insn, op, bits, mmx_##insn, sse_##insn);                \
+}
+
+BINOP(paddb, ADD, 8)
+BINOP(paddw, ADD, 16)
+BINOP(paddd, ADD, 32)
+BINOP(paddq, ADD, 64)
+BINOP(psubb, SUB, 8)
+BINOP(psubw, SUB, 16)
+BINOP(psubd, SUB, 32)
+BINOP(psubq, SUB, 64)
+BINOP(paddsb, ADDS, 8)
+BINOP(paddsw, ADDS, 16)
+BINOP(psubsb, SUBS, 8)
+BINOP(psubsw, SUBS, 16)
+BINOP(paddusb, ADDUS, 8)
+BINOP(paddusw, ADDUS, 16)
+BINOP(psubusb, SUBUS, 8)
+BINOP(psubusw, SUBUS, 16)
+BINOP(pmullw, MULL, 16)
+BINOP(pmuludq, MULUDQ, 64)
+BINOP(pand, AND, 64)
+BINOP(pandn, ANDN, 64)
+BINOP(por, OR, 64)
+BINOP(pxor, XOR, 64)
+BINOP(pcmpeqb, CMPEQ, 8)
+BINOP(pcmpeqw, CMPEQ, 16)
+BINOP(pcmpeqd, CMPEQ, 32)
+BINOP(pcmpgtb, CMPGT, 8)
+BINOP(pcmpgtw, CMPGT, 16)
+BINOP(pcmpgtd, CMPGT, 32)
+
+/* SSSE3 pabs: the result only depends on the second operand */
+BINOP(pabsb, ABS, 8)
+BINOP(pabsw, ABS, 16)
+BINOP(pabsd, ABS, 32)
+
+/* Instructions without an MMX form */
+#define SSEOP(insn, op, bits)                                           \
+static void sse_##insn(Vec *r, const Vec *b)                           \
+{                                                                       \
+    asm volatile("movdqu %0, %%xmm0\n\t"                                \
+                 "movdqu %1, %%xmm1\n\t"                                \
+                 #insn " %%xmm1, %%xmm0\n\t"                            \
+                 "movdqu %%xmm0, %0"                                    \
+                 : "+m" (*r) : "m" (*b) : "xmm0", "xmm1");              \
+}                                                                       \
+static void test_##insn(void)                                          \
+{                                                                       \
+    test_binop(#insn, op, bits, NULL, sse_##insn);                      \
+}
+
+SSEOP(andps, AND, 64)
+SSEOP(andpd, AND, 64)
+SSEOP(andnps, ANDN, 64)
+SSEOP(andnpd, ANDN, 64)
+SSEOP(orps, OR, 64)
+SSEOP(orpd, OR, 64)
+SSEOP(xorps, XOR, 64)
+SSEOP(xorpd, XOR, 64)
+SSEOP(pmulld, MULL, 32)
+SSEOP(pcmpeqq, CMPEQ, 64)
+SSEOP(pcmpgtq, CMPGT, 64)
+
+enum { SRL, SRA, SLL };
+
+static uint64_t ref_shift(int op, int bits, uint64_t a, int count)
+{
+    uint64_t mask = bits == 64 ? ~0ull : (1ull << bits) - 1;
+
+    if (count >= bits) {
+        return op == SRA ? (uint64_t)(sext(a, bits) >> (bits - 1)) : 0;
+    }
+    switch (op) {
+    case SRL:
+        return a >> count;
+    case SRA:
+        return sext(a, bits) >> count;
+    default:
+        return (a << count) & mask;
+    }
+}
+
+static const int counts[] = { 0, 1, 7, 15, 16, 31, 32, 63, 64, 200 };
+#define NB_COUNTS (sizeof(counts) / sizeof(counts[0]))
+
+/* The count is an immediate: one asm statement per tested count */
+#define SHIFT_CASE(insn, reg, mov, n)                                   \
+    case n:                                                             \
+        asm volatile(mov " %0, %%" reg "0\n\t"                           \
+                     insn " $" #n ", %%" reg "0\n\t"                     \
+                     mov " %%" reg "0, %0"                              \
+                     : "+m" (*r) : : reg "0");                          \
+        break;
+
+#define SHIFT_CASES(insn, reg, mov)                                     \
+    switch (count) {                                                    \
+    SHIFT_CASE(insn, reg, mov, 0)                                       \
+    SHIFT_CASE(insn, reg, mov, 1)                                       \
+    SHIFT_CASE(insn, reg, mov, 7)                                       \
+    SHIFT_CASE(insn, reg, mov, 15)                                      \
+    SHIFT_CASE(insn, reg, mov, 16)                                      \
+    SHIFT_CASE(insn, reg, mov, 31)                                      \
+    SHIFT_CASE(insn, reg, mov, 32)                                      \
+    SHIFT_CASE(insn, reg, mov, 63)                                      \
+    SHIFT_CASE(insn, reg, mov, 64)                                      \
+    SHIFT_CASE(insn, reg, mov, 200)                                     \
+    }
+
+#define SHIFTOP(insn, op, bits)                                         \
+static void mmx_##insn(Vec *r, int count)                              \
+{                                                                       \
+    SHIFT_CASES(#insn, "mm", "movq")                                    \
+    asm volatile("emms");                                               \
+}                                                                       \
+static void sse_##insn(Vec *r, int count)                              \
+{                                                                       \
+    SHIFT_CASES(#insn, "xmm", "movdqu")                                 \
+}                                                                       \
+static void test_##insn(void)                                          \
+{                                                                       \
+    test_shift(#insn, op, bits, mmx_##insn, sse_##insn);                \
+}
+
+static void test_shift(const char *name, int op, int bits,
+                       void (*mmx)(Vec *, int), void (*sse)(Vec *, int))
+{
+    unsigned i, c;
+    int k, size;
+
+    for (i = 0; i < NB_INPUTS; i++) {
+        for (c = 0; c < NB_COUNTS; c++) {
+            for (size = 8; size <= 16; size += 8) {
+                Vec a, b, r, e;
+
+                memset(&a, 0, sizeof(a));
+                memset(&e, 0, sizeof(e));
+                a.q[0] = inputs[i][0];
+                a.q[1] = inputs[i][1];
+                memset(&b, 0, sizeof(b));
+                b.q[0] = counts[c];
+                for (k = 0; k < size * 8 / bits; k++) {
+                    set(&e, bits, k,
+                        ref_shift(op, bits, get(&a, bits, k), counts[c]));
+                }
+                r = a;
+                if (size == 8) {
+                    mmx(&r, counts[c]);
+                } else {
+                    sse(&r, counts[c]);
+                }
+                check(name, size, &a, &b, &r, &e);
+            }
+        }
+    }
+}
+
+SHIFTOP(psrlw, SRL, 16)
+SHIFTOP(psraw, SRA, 16)
+SHIFTOP(psllw, SLL, 16)
+SHIFTOP(psrld, SRL, 32)
+SHIFTOP(psrad, SRA, 32)
+SHIFTOP(pslld, SLL, 32)
+SHIFTOP(psrlq, SRL, 64)
+SHIFTOP(psllq, SLL, 64)
+
+int main(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    __cpuid(1, eax, ebx, ecx, edx);
+
+    test_paddb();
+    test_paddw();
+    test_paddd();
+    test_paddq();
+    test_psubb();
+    test_psubw();
+    test_psubd();
+    test_psubq();
+    test_paddsb();
+    test_paddsw();
+    test_psubsb();
+    test_psubsw();
+    test_paddusb();
+    test_paddusw();
+    test_psubusb();
+    test_psubusw();
+    test_pmullw();
+    test_pmuludq();
+    test_pand();
+    test_pandn();
+    test_por();
+    test_pxor();
+    test_pcmpeqb();
+    test_pcmpeqw();
+    test_pcmpeqd();
+    test_pcmpgtb();
+    test_pcmpgtw();
+    test_pcmpgtd();
+    test_andps();
+    test_andpd();
+    test_andnps();
+    test_andnpd();
+    test_orps();
+    test_orpd();
+    test_xorps();
+    test_xorpd();
+    if (ecx & bit_SSSE3) {
+        test_pabsb();
+        test_pabsw();
+        test_pabsd();
+    }
+    if (ecx & bit_SSE4_1) {
+        test_pmulld();
+        test_pcmpeqq();
+    }
+    if (ecx & bit_SSE4_2) {
+        test_pcmpgtq();
+    }
+
+    test_psrlw();
+    test_psraw();
+    test_psllw();
+    test_psrld();
+    test_psrad();
+    test_pslld();
+    test_psrlq();
+    test_psllq();
+
+    printf("%s\n", failures ? "FAIL" : "PASS");
+    return failures != 0;
+}
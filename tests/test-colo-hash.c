@@ -0,0 +1,113 @@
+/*
+ * COLO stream hash unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/colo.h"
+
+#define STREAM_LEN 1000
+
+static void fill_random(uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = g_test_rand_int();
+    }
+}
+
+/* Hash @buf in pieces of random length, including empty ones */
+static void hash_split(ColoHash *h, const uint8_t *buf, size_t len)
+{
+    size_t off = 0;
+
+    colo_hash_init(h);
+    while (off < len) {
+        size_t n = g_test_rand_int_range(0, 20);
+
+        n = MIN(n, len - off);
+        colo_hash_update(h, buf + off, n);
+        off += n;
+    }
+}
+
+static void test_colo_hash_split(void)
+{
+    uint8_t buf[STREAM_LEN];
+    ColoHash whole, split;
+    size_t len;
+    int i;
+
+    fill_random(buf, sizeof(buf));
+    for (len = 0; len <= 40; len++) {
+        colo_hash_init(&whole);
+        colo_hash_update(&whole, buf, len);
+        for (i = 0; i < 20; i++) {
+            hash_split(&split, buf, len);
+            g_assert(colo_hash_equal(&whole, &split));
+        }
+    }
+
+    colo_hash_init(&whole);
+    colo_hash_update(&whole, buf, sizeof(buf));
+    for (i = 0; i < 100; i++) {
+        hash_split(&split, buf, sizeof(buf));
+        g_assert(colo_hash_equal(&whole, &split));
+    }
+}
+
+static void test_colo_hash_differ(void)
+{
+    uint8_t buf[STREAM_LEN], other[STREAM_LEN];
+    ColoHash a, b;
+    size_t i, len;
+
+    fill_random(buf, sizeof(buf));
+
+    /* A single changed byte, whether in a full word or in the tail */
+    for (len = 1; len <= 40; len++) {
+        for (i = 0; i < len; i++) {
+            memcpy(other, buf, len);
+            other[i] ^= 1 << (i % 8);
+            colo_hash_init(&a);
+            colo_hash_update(&a, buf, len);
+            hash_split(&b, other, len);
+            g_assert(!colo_hash_equal(&a, &b));
+        }
+    }
+
+    /* A stream and the same stream followed by zeroes */
+    memset(other, 0, sizeof(other));
+    for (len = 0; len <= 16; len++) {
+        for (i = 1; i <= 9; i++) {
+            colo_hash_init(&a);
+            colo_hash_update(&a, other, len);
+            colo_hash_init(&b);
+            colo_hash_update(&b, other, len + i);
+            g_assert(!colo_hash_equal(&a, &b));
+        }
+    }
+
+    /* Swapped words */
+    memcpy(other, buf, sizeof(buf));
+    memcpy(other, buf + 8, 8);
+    memcpy(other + 8, buf, 8);
+    colo_hash_init(&a);
+    colo_hash_update(&a, buf, sizeof(buf));
+    colo_hash_init(&b);
+    colo_hash_update(&b, other, sizeof(other));
+    g_assert(!colo_hash_equal(&a, &b));
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/colo/hash/split", test_colo_hash_split);
+    g_test_add_func("/colo/hash/differ", test_colo_hash_differ);
+
+    return g_test_run();
+}
@@ -0,0 +1,368 @@
+/*
+ * Software segmentation and receive coalescing offloads unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "net/checksum.h"
+#include "net/eth.h"
+#include "net/offload.h"
+
+#define MSS         1000
+#define SEQ         0xfffffc00  /* wraps around within the tests */
+#define MAX_FRAME   (ETH_HLEN + sizeof(struct ip6_header) + \
+                     sizeof(struct tcp_header) + 4 * MSS)
+
+static size_t l4_offset(bool ipv6)
+{
+    return ETH_HLEN + (ipv6 ? sizeof(struct ip6_header)
+                            : sizeof(struct ip_header));
+}
+
+static size_t hdr_length(bool ipv6)
+{
+    return l4_offset(ipv6) + sizeof(struct tcp_header);
+}
+
+/* The payload byte at sequence number @seq */
+static uint8_t payload_byte(uint32_t seq)
+{
+    return seq * 7 + (seq >> 8);
+}
+
+static void check_payload(const uint8_t *data, uint32_t seq, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        g_assert_cmpint(data[i], ==, payload_byte(seq + i));
+    }
+}
+
+/* Compute the TCP checksum of a frame built by build_frame */
+static void set_tcp_csum(uint8_t *buf, bool ipv6, size_t len)
+{
+    size_t l4_off = l4_offset(ipv6);
+    uint8_t *ip = buf + ETH_HLEN;
+    uint8_t *th = buf + l4_off;
+    uint32_t sum;
+
+    if (ipv6) {
+        sum = net_checksum_add(32, ip + 8);
+    } else {
+        sum = net_checksum_add(8, ip + 12);
+    }
+    sum += IP_PROTO_TCP + len - l4_off;
+    stw_be_p(th + 16, 0);
+    sum += net_checksum_add(len - l4_off, th);
+    stw_be_p(th + 16, net_checksum_finish(sum));
+}
+
+/* Build a TCP segment of a single stream, with valid checksums */
+static size_t build_frame(uint8_t *buf, bool ipv6, uint32_t seq,
+                          size_t payload, uint8_t flags)
+{
+    size_t l4_off = l4_offset(ipv6);
+    size_t len = hdr_length(ipv6) + payload;
+    uint8_t *ip = buf + ETH_HLEN;
+    uint8_t *th = buf + l4_off;
+    size_t i;
+
+    memset(buf, 0, len);
+    memset(buf, 0x52, ETH_ALEN);
+    memset(buf + ETH_ALEN, 0x54, ETH_ALEN);
+    stw_be_p(buf + 12, ipv6 ? ETH_P_IPV6 : ETH_P_IP);
+
+    if (ipv6) {
+        stb_p(ip, IP_HEADER_VERSION_6 << 4);
+        stw_be_p(ip + 4, len - l4_off);
+        stb_p(ip + 6, IP_PROTO_TCP);
+        stb_p(ip + 7, 64);
+        memset(ip + 8, 0x11, 16);
+        memset(ip + 24, 0x22, 16);
+    } else {
+        stb_p(ip, (IP_HEADER_VERSION_4 << 4) | 5);
+        stw_be_p(ip + 2, len - ETH_HLEN);
+        stw_be_p(ip + 4, 0x1234);
+        stb_p(ip + 8, 64);
+        stb_p(ip + 9, IP_PROTO_TCP);
+        stl_be_p(ip + 12, 0x0a000001);
+        stl_be_p(ip + 16, 0x0a000002);
+        stw_be_p(ip + 10, net_raw_checksum(ip, sizeof(struct ip_header)));
+    }
+
+    stw_be_p(th, 40000);
+    stw_be_p(th + 2, 80);
+    stl_be_p(th + 4, seq);
+    stl_be_p(th + 8, 1);
+    stb_p(th + 12, (sizeof(struct tcp_header) / 4) << 4);
+    stb_p(th + 13, flags);
+    stw_be_p(th + 14, 0xffff);
+    for (i = 0; i < payload; i++) {
+        th[sizeof(struct tcp_header) + i] = payload_byte(seq + i);
+    }
+
+    set_tcp_csum(buf, ipv6, len);
+    return len;
+}
+
+static void check_gro_frame(const uint8_t *pkt, size_t size, bool ipv6,
+                            unsigned int segs, size_t payload)
+{
+    struct virtio_net_hdr hdr;
+    const uint8_t *frame = pkt + sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    size_t hdr_len = hdr_length(ipv6);
+
+    g_assert_cmpint(size, ==, sizeof(struct virtio_net_hdr_mrg_rxbuf) +
+                              hdr_len + payload);
+    memcpy(&hdr, pkt, sizeof(hdr));
+    if (segs == 1) {
+        g_assert_cmpint(hdr.gso_type, ==, VIRTIO_NET_HDR_GSO_NONE);
+        g_assert_cmpint(hdr.flags, ==, 0);
+    } else {
+        g_assert_cmpint(hdr.gso_type, ==, ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6
+                                               : VIRTIO_NET_HDR_GSO_TCPV4);
+        g_assert_cmpint(hdr.flags, ==, VIRTIO_NET_HDR_F_NEEDS_CSUM);
+        g_assert_cmpint(hdr.gso_size, ==, MSS);
+        g_assert_cmpint(hdr.hdr_len, ==, hdr_len);
+        g_assert_cmpint(hdr.csum_start, ==, l4_offset(ipv6));
+        g_assert_cmpint(hdr.csum_offset, ==,
+                        offsetof(struct tcp_header, th_sum));
+    }
+
+    if (ipv6) {
+        g_assert_cmpint(lduw_be_p(frame + ETH_HLEN + 4), ==,
+                        sizeof(struct tcp_header) + payload);
+    } else {
+        g_assert_cmpint(lduw_be_p(frame + ETH_HLEN + 2), ==,
+                        sizeof(struct ip_header) +
+                        sizeof(struct tcp_header) + payload);
+        g_assert_cmpint(net_raw_checksum((uint8_t *)frame + ETH_HLEN,
+                                         sizeof(struct ip_header)), ==, 0);
+    }
+    g_assert_cmphex((uint32_t)ldl_be_p(frame + l4_offset(ipv6) + 4), ==, SEQ);
+    check_payload(frame + hdr_len, SEQ, payload);
+}
+
+static void test_gro_merge(const void *opaque)
+{
+    bool ipv6 = *(const bool *)opaque;
+    NetGRO *gro = net_gro_new();
+    uint8_t buf[MAX_FRAME];
+    const uint8_t *pkt;
+    size_t len, size;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        len = build_frame(buf, ipv6, SEQ + i * MSS, MSS,
+                          TH_ACK | (i == 2 ? TH_PUSH : 0));
+        g_assert_cmpint(net_gro_receive(gro, buf, len, !ipv6, ipv6), ==,
+                        NET_GRO_MERGED);
+        g_assert(net_gro_pending(gro));
+    }
+
+    /* PSH ends the coalesced frame */
+    len = build_frame(buf, ipv6, SEQ + 3 * MSS, MSS, TH_ACK);
+    g_assert_cmpint(net_gro_receive(gro, buf, len, !ipv6, ipv6), ==,
+                    NET_GRO_FLUSH);
+
+    pkt = net_gro_finish(gro, sizeof(struct virtio_net_hdr_mrg_rxbuf), &size);
+    g_assert(!net_gro_pending(gro));
+    check_gro_frame(pkt, size, ipv6, 3, 3 * MSS);
+    g_assert(ldub_p(pkt + sizeof(struct virtio_net_hdr_mrg_rxbuf) +
+                    l4_offset(ipv6) + 13) & TH_PUSH);
+
+    net_gro_free(gro);
+}
+
+static void test_gro_flush(void)
+{
+    NetGRO *gro = net_gro_new();
+    uint8_t buf[MAX_FRAME];
+    const uint8_t *pkt;
+    size_t len, size;
+
+    /* Nothing pending: frames that cannot be coalesced go out as is */
+    len = build_frame(buf, false, SEQ, MSS, TH_ACK);
+    g_assert_cmpint(net_gro_receive(gro, buf, len, false, true), ==,
+                    NET_GRO_NONE);
+    stw_be_p(buf + 12, ETH_P_ARP);
+    g_assert_cmpint(net_gro_receive(gro, buf, len, true, true), ==,
+                    NET_GRO_NONE);
+    len = build_frame(buf, false, SEQ, MSS, TH_ACK | TH_SYN);
+    g_assert_cmpint(net_gro_receive(gro, buf, len, true, true), ==,
+                    NET_GRO_NONE);
+    len = build_frame(buf, false, SEQ, MSS, TH_ACK);
+    buf[len - 1] ^= 1;
+    g_assert_cmpint(net_gro_receive(gro, buf, len, true, true), ==,
+                    NET_GRO_NONE);
+    g_assert(!net_gro_pending(gro));
+
+    len = build_frame(buf, false, SEQ, MSS, TH_ACK);
+    g_assert_cmpint(net_gro_receive(gro, buf, len, true, true), ==,
+                    NET_GRO_MERGED);
+
+    /* Out of order */
+    len = build_frame(buf, false, SEQ + 2 * MSS, MSS, TH_ACK);
+    g_assert_cmpint(net_gro_receive(gro, buf, len, true, true), ==,
+                    NET_GRO_FLUSH);
+
+    /* Another stream */
+    len = build_frame(buf, false, SEQ + MSS, MSS, TH_ACK);
+    stw_be_p(buf + l4_offset(false) + 2, 81);
+    set_tcp_csum(buf, false, len);
+    g_assert_cmpint(net_gro_receive(gro, buf, len, true, true), ==,
+                    NET_GRO_FLUSH);
+
+    /* Not TCP while a frame is pending */
+    stw_be_p(buf + 12, ETH_P_ARP);
+    g_assert_cmpint(net_gro_receive(gro, buf, len, true, true), ==,
+                    NET_GRO_FLUSH);
+
+    /* A single segment is passed up without GSO */
+    pkt = net_gro_finish(gro, sizeof(struct virtio_net_hdr_mrg_rxbuf), &size);
+    check_gro_frame(pkt, size, false, 1, MSS);
+
+    /* After the flush, the frame that did not fit starts a new one */
+    len = build_frame(buf, false, SEQ + 2 * MSS, MSS, TH_ACK);
+    g_assert_cmpint(net_gro_receive(gro, buf, len, true, true), ==,
+                    NET_GRO_MERGED);
+    net_gro_reset(gro);
+    g_assert(!net_gro_pending(gro));
+
+    net_gro_free(gro);
+}
+
+typedef struct GSOTest {
+    bool ipv6;
+    bool ecn;
+    bool full;      /* the backend cannot take the second segment at first */
+} GSOTest;
+
+typedef struct GSOOutput {
+    NetGRO *gro;
+    bool ipv6;
+    bool full;
+    unsigned int segs;
+    bool fin;
+} GSOOutput;
+
+/* Check each segment, and coalesce them again */
+static ssize_t gso_output(void *opaque, const struct iovec *iov, int iovcnt)
+{
+    GSOOutput *out = opaque;
+    uint8_t buf[MAX_FRAME];
+    size_t size = iov_size(iov, iovcnt);
+    size_t hdr_len = hdr_length(out->ipv6);
+    uint8_t flags;
+
+    if (out->full && out->segs == 1) {
+        out->full = false;
+        return 0;
+    }
+
+    g_assert(!out->fin);
+    g_assert_cmpint(size, <=, sizeof(buf));
+    g_assert_cmpint(size, >, hdr_len);
+    g_assert_cmpint(size, <=, hdr_len + MSS);
+    iov_to_buf(iov, iovcnt, 0, buf, size);
+
+    flags = ldub_p(buf + l4_offset(out->ipv6) + 13);
+    out->fin = flags & TH_PUSH;
+    g_assert_cmpint(flags & ~TH_PUSH, ==, TH_ACK);
+    g_assert_cmpint(size == hdr_len + MSS, ==, !out->fin);
+
+    g_assert_cmpint(net_gro_receive(out->gro, buf, size,
+                                    !out->ipv6, out->ipv6), ==,
+                    NET_GRO_MERGED);
+    out->segs++;
+    return size;
+}
+
+static void test_gso_segment(const void *opaque)
+{
+    const GSOTest *t = opaque;
+    size_t payload = 2 * MSS + MSS / 2;
+    GSOOutput out = {
+        .gro = net_gro_new(), .ipv6 = t->ipv6, .full = t->full,
+    };
+    NetGSO *gso = net_gso_new();
+    struct virtio_net_hdr hdr = {
+        .flags = VIRTIO_NET_HDR_F_NEEDS_CSUM,
+        .gso_type = t->ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6
+                            : VIRTIO_NET_HDR_GSO_TCPV4,
+        .hdr_len = hdr_length(t->ipv6),
+        .gso_size = MSS,
+        .csum_start = l4_offset(t->ipv6),
+        .csum_offset = offsetof(struct tcp_header, th_sum),
+    };
+    uint8_t buf[MAX_FRAME];
+    struct iovec iov[2];
+    const uint8_t *pkt;
+    size_t size;
+
+    if (t->ecn) {
+        hdr.gso_type |= VIRTIO_NET_HDR_GSO_ECN;
+    }
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = build_frame(buf, t->ipv6, SEQ, payload,
+                                 TH_ACK | TH_PUSH);
+
+    if (t->full) {
+        /* The whole packet is retried, without the segment that went out */
+        g_assert_cmpint(net_gso_segment(gso, iov, 2, sizeof(hdr),
+                                        gso_output, &out), ==, 0);
+        g_assert_cmpint(out.segs, ==, 1);
+    }
+    g_assert_cmpint(net_gso_segment(gso, iov, 2, sizeof(hdr),
+                                    gso_output, &out), ==, iov_size(iov, 2));
+    g_assert_cmpint(out.segs, ==, 3);
+    g_assert(out.fin);
+
+    pkt = net_gro_finish(out.gro, sizeof(struct virtio_net_hdr_mrg_rxbuf),
+                         &size);
+    check_gro_frame(pkt, size, t->ipv6, 3, payload);
+
+    net_gso_free(gso);
+    net_gro_free(out.gro);
+}
+
+int main(int argc, char **argv)
+{
+    static const bool ipv4 = false, ipv6 = true;
+    static const GSOTest gso_tests[] = {
+        { .ipv6 = false, .ecn = false },
+        { .ipv6 = false, .ecn = true },
+        { .ipv6 = true, .ecn = false },
+        { .ipv6 = true, .ecn = true },
+        { .ipv6 = false, .full = true },
+        { .ipv6 = true, .full = true },
+    };
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_data_func("/net/offload/gro/merge/ipv4", &ipv4,
+                         test_gro_merge);
+    g_test_add_data_func("/net/offload/gro/merge/ipv6", &ipv6,
+                         test_gro_merge);
+    g_test_add_func("/net/offload/gro/flush", test_gro_flush);
+    g_test_add_data_func("/net/offload/gso/ipv4", &gso_tests[0],
+                         test_gso_segment);
+    g_test_add_data_func("/net/offload/gso/ipv4-ecn", &gso_tests[1],
+                         test_gso_segment);
+    g_test_add_data_func("/net/offload/gso/ipv6", &gso_tests[2],
+                         test_gso_segment);
+    g_test_add_data_func("/net/offload/gso/ipv6-ecn", &gso_tests[3],
+                         test_gso_segment);
+    g_test_add_data_func("/net/offload/gso/ipv4-full", &gso_tests[4],
+                         test_gso_segment);
+    g_test_add_data_func("/net/offload/gso/ipv6-full", &gso_tests[5],
+                         test_gso_segment);
+
+    return g_test_run();
+}
@@ -0,0 +1,165 @@
+/*
+ * Toeplitz hash unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+
+/* The key and the verification suite of the Microsoft RSS specification */
+static uint8_t rss_key[NET_TOEPLITZ_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+typedef struct ToeplitzIPv4Test {
+    uint8_t src[4], dst[4];
+    uint16_t sport, dport;
+    uint32_t ip_hash, tcp_hash;
+} ToeplitzIPv4Test;
+
+static const ToeplitzIPv4Test ipv4_tests[] = {
+    { { 66, 9, 149, 187 }, { 161, 142, 100, 80 }, 2794, 1766,
+      0x323e8fc2, 0x51ccc178 },
+    { { 199, 92, 111, 2 }, { 65, 69, 140, 83 }, 14230, 4739,
+      0xd718262a, 0xc626b0ea },
+    { { 24, 19, 198, 95 }, { 12, 22, 207, 184 }, 12898, 38024,
+      0xd2d0a5de, 0x5c2b394a },
+    { { 38, 27, 205, 30 }, { 209, 142, 163, 6 }, 48228, 2217,
+      0x82989176, 0xafc7327f },
+    { { 153, 39, 163, 191 }, { 202, 188, 127, 2 }, 44251, 1303,
+      0x5d1809c5, 0x10e828a2 },
+};
+
+typedef struct ToeplitzIPv6Test {
+    uint8_t src[16], dst[16];
+    uint16_t sport, dport;
+    uint32_t ip_hash, tcp_hash;
+} ToeplitzIPv6Test;
+
+static const ToeplitzIPv6Test ipv6_tests[] = {
+    {   /* 3ffe:2501:200:1fff::7 -> 3ffe:2501:200:3::1 */
+        { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x1f, 0xff,
+          0, 0, 0, 0, 0, 0, 0, 0x07 },
+        { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x00, 0x03,
+          0, 0, 0, 0, 0, 0, 0, 0x01 },
+        2794, 1766, 0x2cc18cd5, 0x40207d3d },
+    {   /* 3ffe:501:8::260:97ff:fe40:efab -> ff02::1 */
+        { 0x3f, 0xfe, 0x05, 0x01, 0x00, 0x08, 0x00, 0x00,
+          0x02, 0x60, 0x97, 0xff, 0xfe, 0x40, 0xef, 0xab },
+        { 0xff, 0x02, 0, 0, 0, 0, 0, 0,
+          0, 0, 0, 0, 0, 0, 0, 0x01 },
+        14230, 4739, 0x0f0c461c, 0xdde51bbf },
+    {   /* 3ffe:1900:4545:3:200:f8ff:fe21:67cf -> fe80::200:f8ff:fe21:67cf */
+        { 0x3f, 0xfe, 0x19, 0x00, 0x45, 0x45, 0x00, 0x03,
+          0x02, 0x00, 0xf8, 0xff, 0xfe, 0x21, 0x67, 0xcf },
+        { 0xfe, 0x80, 0, 0, 0, 0, 0, 0,
+          0x02, 0x00, 0xf8, 0xff, 0xfe, 0x21, 0x67, 0xcf },
+        44251, 38024, 0x4b61e985, 0x02d1feef },
+};
+
+static uint32_t toeplitz_bitwise(uint8_t *input, size_t len)
+{
+    net_toeplitz_key key;
+    uint32_t hash = 0;
+
+    net_toeplitz_key_init(&key, rss_key);
+    net_toeplitz_add(&hash, input, len, &key);
+    return hash;
+}
+
+/* Check both implementations against the expected hash of @input */
+static void check_hash(const NetToeplitzTable *table,
+                       uint8_t *input, size_t len, uint32_t expected)
+{
+    g_assert_cmphex(toeplitz_bitwise(input, len), ==, expected);
+    g_assert_cmphex(net_toeplitz_table_hash(table, input, len), ==,
+                    expected);
+}
+
+static void test_toeplitz_ipv4(void)
+{
+    NetToeplitzTable *table = g_new(NetToeplitzTable, 1);
+    uint8_t input[12];
+    int i;
+
+    net_toeplitz_table_init(table, rss_key);
+    for (i = 0; i < ARRAY_SIZE(ipv4_tests); i++) {
+        const ToeplitzIPv4Test *t = &ipv4_tests[i];
+
+        memcpy(input, t->src, 4);
+        memcpy(input + 4, t->dst, 4);
+        stw_be_p(input + 8, t->sport);
+        stw_be_p(input + 10, t->dport);
+        check_hash(table, input, 8, t->ip_hash);
+        check_hash(table, input, 12, t->tcp_hash);
+    }
+    g_free(table);
+}
+
+static void test_toeplitz_ipv6(void)
+{
+    NetToeplitzTable *table = g_new(NetToeplitzTable, 1);
+    uint8_t input[NET_TOEPLITZ_MAX_INPUT];
+    int i;
+
+    net_toeplitz_table_init(table, rss_key);
+    for (i = 0; i < ARRAY_SIZE(ipv6_tests); i++) {
+        const ToeplitzIPv6Test *t = &ipv6_tests[i];
+
+        memcpy(input, t->src, 16);
+        memcpy(input + 16, t->dst, 16);
+        stw_be_p(input + 32, t->sport);
+        stw_be_p(input + 34, t->dport);
+        check_hash(table, input, 32, t->ip_hash);
+        check_hash(table, input, 36, t->tcp_hash);
+    }
+    g_free(table);
+}
+
+/* The table must agree with the bitwise hash for every input length */
+static void test_toeplitz_table(void)
+{
+    NetToeplitzTable *table = g_new(NetToeplitzTable, 1);
+    uint8_t key[NET_TOEPLITZ_KEY_SIZE];
+    uint8_t input[NET_TOEPLITZ_MAX_INPUT];
+    size_t len;
+    int i, round;
+
+    for (round = 0; round < 16; round++) {
+        for (i = 0; i < sizeof(key); i++) {
+            key[i] = g_test_rand_int();
+        }
+        net_toeplitz_table_init(table, key);
+
+        for (len = 0; len <= sizeof(input); len++) {
+            net_toeplitz_key k;
+            uint32_t hash = 0;
+
+            for (i = 0; i < len; i++) {
+                input[i] = g_test_rand_int();
+            }
+            net_toeplitz_key_init(&k, key);
+            net_toeplitz_add(&hash, input, len, &k);
+            g_assert_cmphex(net_toeplitz_table_hash(table, input, len), ==,
+                            hash);
+        }
+    }
+    g_free(table);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/net/toeplitz/ipv4", test_toeplitz_ipv4);
+    g_test_add_func("/net/toeplitz/ipv6", test_toeplitz_ipv6);
+    g_test_add_func("/net/toeplitz/table", test_toeplitz_table);
+
+    return g_test_run();
+}
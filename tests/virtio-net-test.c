@@ -52,17 +52,15 @@ static QVirtioPCIDevice *virtio_net_pci_init(QPCIBus *bus, int slot)
     return dev;
 }
 
-static QOSState *pci_test_start(int socket)
+static QOSState *pci_test_vstart(const char *cmd, va_list ap)
 {
     QOSState *qs;
     const char *arch = qtest_get_arch();
-    const char *cmd = "-netdev socket,fd=%d,id=hs0 -device "
-                      "virtio-net-pci,netdev=hs0";
 
     if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
-        qs = qtest_pc_boot(cmd, socket);
+        qs = qtest_pc_vboot(cmd, ap);
     } else if (strcmp(arch, "ppc64") == 0) {
-        qs = qtest_spapr_boot(cmd, socket);
+        qs = qtest_spapr_vboot(cmd, ap);
     } else {
         g_printerr("virtio-net tests are only available on x86 or ppc64\n");
         exit(EXIT_FAILURE);
@@ -71,6 +69,23 @@ static QOSState *pci_test_start(int socket)
     return qs;
 }
 
+static QOSState *pci_test_startf(const char *cmd, ...)
+{
+    QOSState *qs;
+    va_list ap;
+
+    va_start(ap, cmd);
+    qs = pci_test_vstart(cmd, ap);
+    va_end(ap);
+    return qs;
+}
+
+static QOSState *pci_test_start(int socket)
+{
+    return pci_test_startf("-netdev socket,fd=%d,id=hs0 -device "
+                           "virtio-net-pci,netdev=hs0", socket);
+}
+
 static void driver_init(QVirtioDevice *dev)
 {
     uint32_t features;
@@ -241,6 +256,50 @@ static void pci_basic(gconstpointer data)
     g_free(dev);
     qtest_shutdown(qs);
 }
+
+/* Transmit with the queue pair in an IOThread.  Without MSI-X, assigning
+ * the guest notifiers unmasks them, and the completion is signalled
+ * through INTx.  */
+static void pci_iothread(void)
+{
+    QVirtioPCIDevice *dev;
+    QOSState *qs;
+    QVirtQueuePCI *tx, *rx;
+    uint64_t req_addr;
+    uint32_t free_head;
+    int i;
+
+    /* No netdev: socket has no IOThread support, the packets are dropped */
+    qs = pci_test_startf("-object iothread,id=iothread0 "
+                         "-device virtio-net-pci,len-iothreads=1,"
+                         "iothreads[0]=iothread0");
+    dev = virtio_net_pci_init(qs->pcibus, PCI_SLOT);
+
+    rx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 0);
+    tx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 1);
+
+    driver_init(&dev->vdev);
+
+    req_addr = guest_alloc(qs->alloc, 64);
+    memwrite(req_addr + VNET_HDR_SIZE, "TEST", 4);
+    for (i = 0; i < 3; i++) {
+        free_head = qvirtqueue_add(&tx->vq, req_addr, 64, false, false);
+        qvirtqueue_kick(&dev->vdev, &tx->vq, free_head);
+        qvirtio_wait_used_elem(&dev->vdev, &tx->vq, free_head, NULL,
+                               QVIRTIO_NET_TIMEOUT_US);
+    }
+    guest_free(qs->alloc, req_addr);
+
+    /* Stops the IOThread and deassigns the notifiers */
+    qvirtio_reset(&dev->vdev);
+
+    qvirtqueue_cleanup(dev->vdev.bus, &tx->vq, qs->alloc);
+    qvirtqueue_cleanup(dev->vdev.bus, &rx->vq, qs->alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev->pdev);
+    g_free(dev);
+    qtest_shutdown(qs);
+}
 #endif
 
 static void hotplug(void)
@@ -265,6 +324,7 @@ int main(int argc, char **argv)
     qtest_add_data_func("/virtio/net/pci/basic", send_recv_test, pci_basic);
     qtest_add_data_func("/virtio/net/pci/rx_stop_cont",
                         stop_cont_test, pci_basic);
+    qtest_add_func("/virtio/net/pci/iothread", pci_iothread);
 #endif
     qtest_add_func("/virtio/net/pci/hotplug", hotplug);
 
@@ -122,6 +122,7 @@ int main(int argc, char **argv)
 #include "qapi/opts-visitor.h"
 #include "qom/object_interfaces.h"
 #include "exec/semihost.h"
+#include "exec/tb-cache.h"
 #include "crypto/init.h"
 #include "sysemu/replay.h"
 #include "qapi/qapi-events-run-state.h"
@@ -336,6 +337,27 @@ static QemuOptsList qemu_accel_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Enable/disable multi-threaded TCG",
         },
+        {
+            .name = "hot-threshold",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Retranslate TBs executed this many times (0 = off)",
+        }, {
+            .name = "tb-cache",
+            .type = QEMU_OPT_STRING,
+            .help = "Directory for the persistent translation cache",
+        }, {
+            .name = "perfmap",
+            .type = QEMU_OPT_BOOL,
+            .help = "Generate a /tmp/perf-${pid}.map file for perf",
+        }, {
+            .name = "jitdump",
+            .type = QEMU_OPT_BOOL,
+            .help = "Generate a jit-${pid}.dump file for perf",
+        }, {
+            .name = "reg-prefs",
+            .type = QEMU_OPT_BOOL,
+            .help = "Allocate TCG registers where later uses want them",
+        },
         { /* end of list */ }
     },
 };
@@ -4619,6 +4641,17 @@ int main(int argc, char **argv, char **envp)
     if (cpu_model) {
         current_machine->cpu_type = parse_cpu_model(cpu_model);
     }
+
+    if (tcg_enabled() && accel_opts && qemu_opt_get(accel_opts, "tb-cache")) {
+        Error *err = NULL;
+
+        tb_cache_init(qemu_opt_get(accel_opts, "tb-cache"),
+                      cpu_model ? cpu_model : current_machine->cpu_type,
+                      &err);
+        if (err) {
+            warn_report_err(err);
+        }
+    }
     parse_numa_opts(current_machine);
 
     machine_run_board_init(current_machine);